@@ -0,0 +1,603 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ *
+ * Asynchronous client API: requests are sent at once and their responses are
+ * collected later by modbus_async_process(), so many transactions can be in
+ * flight on the same connection.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+
+#include "modbus.h"
+#include "modbus-private.h"
+#include "modbus-async.h"
+
+/* A request in flight */
+typedef struct _modbus_async_req {
+    int in_use;
+    uint16_t t_id;
+    int function;
+    int nb;
+    void *dest;
+    modbus_async_callback_t callback;
+    void *user_data;
+    /* Expiration date of the response timeout (us) */
+    int64_t deadline;
+    int req_length;
+    uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+} modbus_async_req_t;
+
+struct _modbus_async {
+    int window;
+    int nb_pending;
+    modbus_async_req_t *reqs;
+};
+
+static struct _modbus_async *_async_get(modbus_t *ctx)
+{
+    if (ctx->async == NULL) {
+        struct _modbus_async *async;
+
+        async = (struct _modbus_async *) malloc(sizeof(struct _modbus_async));
+        if (async == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        async->window = 1;
+        async->nb_pending = 0;
+        async->reqs = (modbus_async_req_t *) calloc(1, sizeof(modbus_async_req_t));
+        if (async->reqs == NULL) {
+            free(async);
+            errno = ENOMEM;
+            return NULL;
+        }
+        ctx->async = async;
+    }
+
+    return ctx->async;
+}
+
+void _modbus_async_free(modbus_t *ctx)
+{
+    if (ctx->async != NULL) {
+        free(ctx->async->reqs);
+        free(ctx->async);
+        ctx->async = NULL;
+    }
+}
+
+/* Sets the max number of requests in flight. The RTU backend has no transaction
+   ID to match the responses so it's limited to one request. */
+int modbus_async_set_window(modbus_t *ctx, int window)
+{
+    struct _modbus_async *async;
+    modbus_async_req_t *reqs;
+
+    if (ctx == NULL || window < 1 || window > MODBUS_ASYNC_MAX_WINDOW ||
+        (window > 1 && ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    async = _async_get(ctx);
+    if (async == NULL)
+        return -1;
+
+    if (async->nb_pending > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    reqs = (modbus_async_req_t *) calloc(window, sizeof(modbus_async_req_t));
+    if (reqs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    free(async->reqs);
+    async->reqs = reqs;
+    async->window = window;
+
+    return 0;
+}
+
+int modbus_async_get_window(modbus_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return (ctx->async == NULL) ? 1 : ctx->async->window;
+}
+
+int modbus_async_get_pending(modbus_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return (ctx->async == NULL) ? 0 : ctx->async->nb_pending;
+}
+
+/* Returns a free slot of the window or NULL (errno is set to EBUSY when all
+   the slots are in use) */
+static modbus_async_req_t *_async_slot(modbus_t *ctx)
+{
+    struct _modbus_async *async = _async_get(ctx);
+    int i;
+
+    if (async == NULL)
+        return NULL;
+
+    if (async->nb_pending >= async->window) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    for (i = 0; i < async->window; i++) {
+        if (!async->reqs[i].in_use)
+            return &async->reqs[i];
+    }
+
+    errno = EBUSY;
+    return NULL;
+}
+
+/* Sends the request built in the slot and registers it as in flight */
+static int _async_send(modbus_t *ctx, modbus_async_req_t *slot,
+                       int function, int nb, void *dest,
+                       modbus_async_callback_t callback, void *user_data)
+{
+    int rc;
+
+    rc = _modbus_send_msg(ctx, slot->req, slot->req_length);
+    if (rc == -1)
+        return -1;
+
+    /* The transaction ID has been set by build_request_basis (TCP only) */
+    slot->t_id = (slot->req[0] << 8) + slot->req[1];
+    slot->function = function;
+    slot->nb = nb;
+    slot->dest = dest;
+    slot->callback = callback;
+    slot->user_data = user_data;
+    slot->deadline = _modbus_now_us() +
+        (int64_t)ctx->response_timeout.tv_sec * 1000000 +
+        ctx->response_timeout.tv_usec;
+    slot->in_use = TRUE;
+    ctx->async->nb_pending++;
+
+    return 0;
+}
+
+static int _async_read(modbus_t *ctx, int function, int addr, int nb,
+                       int max_nb, void *dest,
+                       modbus_async_callback_t callback, void *user_data)
+{
+    modbus_async_req_t *slot;
+
+    if (ctx == NULL || dest == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nb > max_nb) {
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR Too many values requested (%d > %d)\n",
+                    nb, max_nb);
+        }
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    slot = _async_slot(ctx);
+    if (slot == NULL)
+        return -1;
+
+    slot->req_length = ctx->backend->build_request_basis(ctx, function, addr,
+                                                         nb, slot->req);
+
+    return _async_send(ctx, slot, function, nb, dest, callback, user_data);
+}
+
+int modbus_async_read_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest,
+                           modbus_async_callback_t callback, void *user_data)
+{
+    return _async_read(ctx, MODBUS_FC_READ_COILS, addr, nb,
+                       MODBUS_MAX_READ_BITS, dest, callback, user_data);
+}
+
+int modbus_async_read_input_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest,
+                                 modbus_async_callback_t callback, void *user_data)
+{
+    return _async_read(ctx, MODBUS_FC_READ_DISCRETE_INPUTS, addr, nb,
+                       MODBUS_MAX_READ_BITS, dest, callback, user_data);
+}
+
+int modbus_async_read_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest,
+                                modbus_async_callback_t callback, void *user_data)
+{
+    return _async_read(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb,
+                       MODBUS_MAX_READ_REGISTERS, dest, callback, user_data);
+}
+
+int modbus_async_read_input_registers(modbus_t *ctx, int addr, int nb,
+                                      uint16_t *dest,
+                                      modbus_async_callback_t callback,
+                                      void *user_data)
+{
+    return _async_read(ctx, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb,
+                       MODBUS_MAX_READ_REGISTERS, dest, callback, user_data);
+}
+
+static int _async_write_single(modbus_t *ctx, int function, int addr, int value,
+                               modbus_async_callback_t callback, void *user_data)
+{
+    modbus_async_req_t *slot;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    slot = _async_slot(ctx);
+    if (slot == NULL)
+        return -1;
+
+    slot->req_length = ctx->backend->build_request_basis(ctx, function, addr,
+                                                         value, slot->req);
+
+    return _async_send(ctx, slot, function, 1, NULL, callback, user_data);
+}
+
+int modbus_async_write_bit(modbus_t *ctx, int addr, int status,
+                           modbus_async_callback_t callback, void *user_data)
+{
+    return _async_write_single(ctx, MODBUS_FC_WRITE_SINGLE_COIL, addr,
+                               status ? 0xFF00 : 0, callback, user_data);
+}
+
+int modbus_async_write_register(modbus_t *ctx, int addr, int value,
+                                modbus_async_callback_t callback, void *user_data)
+{
+    return _async_write_single(ctx, MODBUS_FC_WRITE_SINGLE_REGISTER, addr,
+                               value, callback, user_data);
+}
+
+int modbus_async_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src,
+                            modbus_async_callback_t callback, void *user_data)
+{
+    modbus_async_req_t *slot;
+    int byte_count;
+
+    if (ctx == NULL || src == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nb > MODBUS_MAX_WRITE_BITS) {
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR Writing too many bits (%d > %d)\n",
+                    nb, MODBUS_MAX_WRITE_BITS);
+        }
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    slot = _async_slot(ctx);
+    if (slot == NULL)
+        return -1;
+
+    slot->req_length = ctx->backend->build_request_basis(
+        ctx, MODBUS_FC_WRITE_MULTIPLE_COILS, addr, nb, slot->req);
+    byte_count = (nb / 8) + ((nb % 8) ? 1 : 0);
+    slot->req[slot->req_length++] = byte_count;
+    _modbus_pack_bits(slot->req + slot->req_length, src, nb);
+    slot->req_length += byte_count;
+
+    return _async_send(ctx, slot, MODBUS_FC_WRITE_MULTIPLE_COILS, nb, NULL,
+                       callback, user_data);
+}
+
+int modbus_async_write_registers(modbus_t *ctx, int addr, int nb,
+                                 const uint16_t *src,
+                                 modbus_async_callback_t callback,
+                                 void *user_data)
+{
+    modbus_async_req_t *slot;
+
+    if (ctx == NULL || src == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nb > MODBUS_MAX_WRITE_REGISTERS) {
+        if (ctx->debug) {
+            fprintf(stderr,
+                    "ERROR Trying to write to too many registers (%d > %d)\n",
+                    nb, MODBUS_MAX_WRITE_REGISTERS);
+        }
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    slot = _async_slot(ctx);
+    if (slot == NULL)
+        return -1;
+
+    slot->req_length = ctx->backend->build_request_basis(
+        ctx, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr, nb, slot->req);
+    slot->req[slot->req_length++] = nb * 2;
+    _modbus_set_registers_be(slot->req + slot->req_length, src, nb);
+    slot->req_length += nb * 2;
+
+    return _async_send(ctx, slot, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, nb, NULL,
+                       callback, user_data);
+}
+
+/* Releases the slot then invokes the callback (which is allowed to submit a
+   new request in the freed slot) */
+static void _async_complete(modbus_t *ctx, modbus_async_req_t *slot,
+                            int rc, int error)
+{
+    modbus_async_callback_t callback = slot->callback;
+    void *user_data = slot->user_data;
+
+    slot->in_use = FALSE;
+    ctx->async->nb_pending--;
+
+    if (callback != NULL) {
+        errno = error;
+        callback(ctx, rc, user_data);
+    }
+}
+
+/* Decodes a checked confirmation in the destination of the request */
+static int _async_decode(modbus_t *ctx, modbus_async_req_t *slot,
+                         uint8_t *rsp, int rc)
+{
+    const int offset = ctx->backend->header_length;
+
+    switch (slot->function) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS: {
+        uint8_t *dest = slot->dest;
+
+        _modbus_unpack_bits(dest, rsp + offset + 2, slot->nb);
+        rc = slot->nb;
+    }
+        break;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS: {
+        uint16_t *dest = slot->dest;
+
+        _modbus_get_registers_be(dest, rsp + offset + 2, rc);
+    }
+        break;
+    default:
+        break;
+    }
+
+    return rc;
+}
+
+static modbus_async_req_t *_async_match(modbus_t *ctx, const uint8_t *rsp)
+{
+    struct _modbus_async *async = ctx->async;
+    int i;
+
+    for (i = 0; i < async->window; i++) {
+        modbus_async_req_t *slot = &async->reqs[i];
+
+        if (!slot->in_use)
+            continue;
+
+        /* Without transaction ID, the only request in flight is the one */
+        if (ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP ||
+            slot->t_id == ((rsp[0] << 8) + rsp[1])) {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+/* Completes the requests whose response timeout has expired and returns the
+   number of completed requests */
+static int _async_expire(modbus_t *ctx, int64_t now)
+{
+    struct _modbus_async *async = ctx->async;
+    int nb_expired = 0;
+    int i;
+
+    for (i = 0; i < async->window; i++) {
+        modbus_async_req_t *slot = &async->reqs[i];
+
+        if (slot->in_use && slot->deadline <= now) {
+            if (ctx->debug) {
+                fprintf(stderr, "Response timeout of transaction 0x%X\n",
+                        slot->t_id);
+            }
+            _async_complete(ctx, slot, -1, ETIMEDOUT);
+            nb_expired++;
+        }
+    }
+
+    return nb_expired;
+}
+
+static int64_t _async_next_deadline(modbus_t *ctx)
+{
+    struct _modbus_async *async = ctx->async;
+    int64_t deadline = INT64_MAX;
+    int i;
+
+    for (i = 0; i < async->window; i++) {
+        if (async->reqs[i].in_use && async->reqs[i].deadline < deadline)
+            deadline = async->reqs[i].deadline;
+    }
+
+    return deadline;
+}
+
+/* Completes all the requests in flight with the error code. The requests are
+   released before the first callback so the ones submitted by the callbacks
+   are kept in flight. */
+static void _async_fail_all(modbus_t *ctx, int error)
+{
+    struct _modbus_async *async = ctx->async;
+    modbus_async_callback_t callbacks[MODBUS_ASYNC_MAX_WINDOW];
+    void *user_data[MODBUS_ASYNC_MAX_WINDOW];
+    int nb_failed = 0;
+    int i;
+
+    for (i = 0; i < async->window; i++) {
+        modbus_async_req_t *slot = &async->reqs[i];
+
+        if (slot->in_use) {
+            callbacks[nb_failed] = slot->callback;
+            user_data[nb_failed] = slot->user_data;
+            nb_failed++;
+            slot->in_use = FALSE;
+            async->nb_pending--;
+        }
+    }
+
+    for (i = 0; i < nb_failed; i++) {
+        if (callbacks[i] != NULL) {
+            errno = error;
+            callbacks[i](ctx, -1, user_data[i]);
+        }
+    }
+}
+
+/* Reads the available confirmations and invokes the callbacks of their
+   requests. When block is set, the function waits until at least one request
+   is completed (by a response or a timeout).
+
+   The function shall return the number of completed requests. Otherwise it
+   shall return -1 and set errno, the requests in flight are then completed
+   with the same error. */
+int modbus_async_process(modbus_t *ctx, int block)
+{
+    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+    int nb_completed = 0;
+    int rc;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->async == NULL || ctx->async->nb_pending == 0)
+        return 0;
+
+    for (;;) {
+        modbus_async_req_t *slot;
+
+        rc = _modbus_receive_msg_mode(ctx, rsp, MSG_CONFIRMATION,
+                                      MODBUS_WAIT_NONE);
+        if (rc == -1) {
+            int64_t now;
+            struct timeval tv;
+            int64_t delay;
+
+            if (errno != EAGAIN) {
+                int saved_errno = errno;
+
+                _async_fail_all(ctx, saved_errno);
+                errno = saved_errno;
+                return -1;
+            }
+
+            now = _modbus_now_us();
+            nb_completed += _async_expire(ctx, now);
+            if (!block || nb_completed > 0 || ctx->async->nb_pending == 0)
+                break;
+
+            /* Wait for the next response until the first deadline */
+            delay = _async_next_deadline(ctx) - now;
+            tv.tv_sec = delay / 1000000;
+            tv.tv_usec = delay % 1000000;
+            rc = ctx->backend->select(ctx, &tv, 0);
+            if (rc == -1 && errno != ETIMEDOUT) {
+                int saved_errno = errno;
+
+                _async_fail_all(ctx, saved_errno);
+                errno = saved_errno;
+                return -1;
+            }
+            continue;
+        }
+
+        if (rc == 0) {
+            /* Message ignored (eg. for another slave in RTU) */
+            continue;
+        }
+
+        slot = _async_match(ctx, rsp);
+        if (slot == NULL) {
+            /* Late response of an expired request */
+            if (ctx->debug) {
+                fprintf(stderr, "No request in flight for the response 0x%X\n",
+                        (rsp[0] << 8) + rsp[1]);
+            }
+            continue;
+        }
+
+        rc = _modbus_check_confirmation(ctx, slot->req, rsp, rc);
+        if (rc == -1) {
+            _async_complete(ctx, slot, -1, errno);
+        } else {
+            rc = _async_decode(ctx, slot, rsp, rc);
+            _async_complete(ctx, slot, rc, 0);
+        }
+        nb_completed++;
+
+        if (ctx->async->nb_pending == 0)
+            break;
+    }
+
+    return nb_completed;
+}
+
+/* Forgets the requests in flight, their callbacks are invoked with ECANCELED.
+   The responses received later are ignored. */
+int modbus_async_cancel(modbus_t *ctx)
+{
+    int nb_pending;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->async == NULL)
+        return 0;
+
+    nb_pending = ctx->async->nb_pending;
+    _async_fail_all(ctx, ECANCELED);
+
+    return nb_pending;
+}
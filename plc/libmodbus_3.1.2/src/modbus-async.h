@@ -0,0 +1,61 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_ASYNC_H
+#define MODBUS_ASYNC_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Max number of requests in flight on a context. In TCP, the transaction ID
+ * associates each response with its request. */
+#define MODBUS_ASYNC_MAX_WINDOW  64
+
+/* Called once per submitted request. The rc argument is the value returned by
+ * the synchronous function (eg. the number of registers read) or -1, in this
+ * case errno is set when the callback is invoked. */
+typedef void (*modbus_async_callback_t)(modbus_t *ctx, int rc, void *user_data);
+
+MODBUS_API int modbus_async_set_window(modbus_t *ctx, int window);
+MODBUS_API int modbus_async_get_window(modbus_t *ctx);
+MODBUS_API int modbus_async_get_pending(modbus_t *ctx);
+
+MODBUS_API int modbus_async_read_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest,
+                                      modbus_async_callback_t callback, void *user_data);
+MODBUS_API int modbus_async_read_input_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest,
+                                            modbus_async_callback_t callback, void *user_data);
+MODBUS_API int modbus_async_read_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest,
+                                           modbus_async_callback_t callback, void *user_data);
+MODBUS_API int modbus_async_read_input_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest,
+                                                 modbus_async_callback_t callback, void *user_data);
+MODBUS_API int modbus_async_write_bit(modbus_t *ctx, int addr, int status,
+                                      modbus_async_callback_t callback, void *user_data);
+MODBUS_API int modbus_async_write_register(modbus_t *ctx, int addr, int value,
+                                           modbus_async_callback_t callback, void *user_data);
+MODBUS_API int modbus_async_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src,
+                                       modbus_async_callback_t callback, void *user_data);
+MODBUS_API int modbus_async_write_registers(modbus_t *ctx, int addr, int nb, const uint16_t *src,
+                                            modbus_async_callback_t callback, void *user_data);
+
+MODBUS_API int modbus_async_process(modbus_t *ctx, int block);
+MODBUS_API int modbus_async_cancel(modbus_t *ctx);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_ASYNC_H */
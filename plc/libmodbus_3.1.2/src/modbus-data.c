@@ -23,9 +23,11 @@
 #include "stdint.h"
 #endif
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
 
 #include "modbus.h"
+#include "modbus-private.h"
 
 #if defined(HAVE_BYTESWAP_H)
 #  include <byteswap.h>
@@ -60,6 +62,276 @@ static inline uint32_t bswap_32(uint32_t x)
 }
 #endif
 
+/*
+ * Conversion of many registers between the host order and the big-endian order
+ * of the frames. On little-endian hosts the bytes are swapped by pairs with the
+ * widest byte shuffle of the CPU (pshufb of SSSE3 or AVX2 selected at the first
+ * call, rev16 of NEON), big-endian hosts only copy the values.
+ */
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define _HOST_LITTLE_ENDIAN
+#elif defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && \
+    __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#  define _HOST_BIG_ENDIAN
+#elif defined(_WIN32)
+#  define _HOST_LITTLE_ENDIAN
+#endif
+
+#if defined(_HOST_LITTLE_ENDIAN) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#  define _SWAP16_X86
+#  include <immintrin.h>
+#elif defined(_HOST_LITTLE_ENDIAN) && defined(__ARM_NEON)
+#  define _SWAP16_NEON
+#  include <arm_neon.h>
+#endif
+
+#if defined(_HOST_LITTLE_ENDIAN)
+static void swap16_scalar(uint8_t *dest, const uint8_t *src, int nb)
+{
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        uint8_t lo = src[2 * i];
+
+        dest[2 * i] = src[2 * i + 1];
+        dest[2 * i + 1] = lo;
+    }
+}
+#endif
+
+#if defined(_SWAP16_X86)
+__attribute__((target("ssse3")))
+static void swap16_ssse3(uint8_t *dest, const uint8_t *src, int nb)
+{
+    const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                                       9, 8, 11, 10, 13, 12, 15, 14);
+    int i;
+
+    for (i = 0; i + 8 <= nb; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        _mm_storeu_si128((__m128i *)(dest + 2 * i), _mm_shuffle_epi8(v, mask));
+    }
+    swap16_scalar(dest + 2 * i, src + 2 * i, nb - i);
+}
+
+__attribute__((target("avx2")))
+static void swap16_avx2(uint8_t *dest, const uint8_t *src, int nb)
+{
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                                          9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6,
+                                          9, 8, 11, 10, 13, 12, 15, 14);
+    int i;
+
+    for (i = 0; i + 16 <= nb; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+        _mm256_storeu_si256((__m256i *)(dest + 2 * i),
+                            _mm256_shuffle_epi8(v, mask));
+    }
+    /* The SSE code of the tail would pay the transition from the dirty upper
+       halves of the AVX registers on each call */
+    _mm256_zeroupper();
+    swap16_ssse3(dest + 2 * i, src + 2 * i, nb - i);
+}
+
+static void swap16_init(uint8_t *dest, const uint8_t *src, int nb);
+
+/* Kernel of the CPU, resolved by the first call */
+static void (*swap16)(uint8_t *dest, const uint8_t *src, int nb) = swap16_init;
+
+static void swap16_init(uint8_t *dest, const uint8_t *src, int nb)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        swap16 = swap16_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        swap16 = swap16_ssse3;
+    } else {
+        swap16 = swap16_scalar;
+    }
+    swap16(dest, src, nb);
+}
+#elif defined(_SWAP16_NEON)
+static void swap16(uint8_t *dest, const uint8_t *src, int nb)
+{
+    int i;
+
+    for (i = 0; i + 8 <= nb; i += 8) {
+        vst1q_u8(dest + 2 * i, vrev16q_u8(vld1q_u8(src + 2 * i)));
+    }
+    swap16_scalar(dest + 2 * i, src + 2 * i, nb - i);
+}
+#elif defined(_HOST_LITTLE_ENDIAN)
+#  define swap16 swap16_scalar
+#endif
+
+/* Writes nb registers in big-endian order (frame) */
+void _modbus_set_registers_be(uint8_t *dest, const uint16_t *src, int nb)
+{
+#if defined(_HOST_LITTLE_ENDIAN)
+    swap16(dest, (const uint8_t *)src, nb);
+#elif defined(_HOST_BIG_ENDIAN)
+    memcpy(dest, src, nb * sizeof(uint16_t));
+#else
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        dest[2 * i] = src[i] >> 8;
+        dest[2 * i + 1] = src[i] & 0xFF;
+    }
+#endif
+}
+
+/* Reads nb registers in big-endian order (frame) */
+void _modbus_get_registers_be(uint16_t *dest, const uint8_t *src, int nb)
+{
+#if defined(_HOST_LITTLE_ENDIAN)
+    swap16((uint8_t *)dest, src, nb);
+#elif defined(_HOST_BIG_ENDIAN)
+    memcpy(dest, src, nb * sizeof(uint16_t));
+#else
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        dest[i] = (src[2 * i] << 8) | src[2 * i + 1];
+    }
+#endif
+}
+
+/*
+ * Conversion between the bits stored one per byte (0 or 1, any non-zero value
+ * is ON) and the bits packed LSB first of the frames and of the packed
+ * bitsets. Eight bits are converted per 64-bit word with a multiplication,
+ * sixteen per movemask of SSE2 when packing on x86.
+ */
+#if defined(_HOST_LITTLE_ENDIAN) && defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+/* Packs nb bits (one per byte) in (nb + 7) / 8 bytes, the unused bits of the
+   last byte are cleared */
+void _modbus_pack_bits(uint8_t *dest, const uint8_t *src, int nb)
+{
+    int i = 0;
+    int shift;
+    uint8_t one_byte;
+
+#if defined(_HOST_LITTLE_ENDIAN) && defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= nb; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+
+        dest[i >> 3] = mask & 0xFF;
+        dest[(i >> 3) + 1] = (mask >> 8) & 0xFF;
+    }
+#endif
+#if defined(_HOST_LITTLE_ENDIAN)
+    for (; i + 8 <= nb; i += 8) {
+        uint64_t x;
+
+        memcpy(&x, src + i, sizeof(uint64_t));
+        /* Non-zero bytes to 1 then gathers the bytes in the top byte */
+        x = ((((x & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | x) >> 7) &
+            0x0101010101010101ULL;
+        dest[i >> 3] = (x * 0x0102040810204080ULL) >> 56;
+    }
+#endif
+
+    one_byte = 0;
+    for (shift = 0; i < nb; i++, shift++) {
+        if (src[i])
+            one_byte |= 1 << (shift & 7);
+        if ((shift & 7) == 7) {
+            dest[i >> 3] = one_byte;
+            one_byte = 0;
+        }
+    }
+    if (nb > 0 && (nb & 7))
+        dest[nb >> 3] = one_byte;
+}
+
+/* Unpacks nb packed bits to one byte per bit (0 or 1) */
+void _modbus_unpack_bits(uint8_t *dest, const uint8_t *src, int nb)
+{
+    int i = 0;
+
+#if defined(_HOST_LITTLE_ENDIAN)
+    for (; i + 8 <= nb; i += 8) {
+        /* Bit k of the byte to the bit 7 of the byte k then to bit 0 */
+        uint64_t x = src[i >> 3] * 0x0101010101010101ULL;
+
+        x &= 0x8040201008040201ULL;
+        x = ((x + 0x7F7F7F7F7F7F7F7FULL) >> 7) & 0x0101010101010101ULL;
+        memcpy(dest + i, &x, sizeof(uint64_t));
+    }
+#endif
+
+    for (; i < nb; i++) {
+        dest[i] = (src[i >> 3] >> (i & 7)) & 1;
+    }
+}
+
+/* Copies nb bits from the index idx of a packed bitset to dest (from bit 0) */
+void _modbus_get_bits_packed(uint8_t *dest, const uint8_t *bitset, int idx,
+                             int nb)
+{
+    const uint8_t *src = bitset + (idx >> 3);
+    int shift = idx & 7;
+    int nb_bytes = (nb + 7) >> 3;
+    int i = 0;
+
+    if (shift == 0) {
+        memcpy(dest, src, nb_bytes);
+    } else {
+#if defined(_HOST_LITTLE_ENDIAN)
+        /* 64 bits per word, the 9th source byte is still in the range */
+        for (; (i + 8) * 8 <= nb; i += 8) {
+            uint64_t x;
+
+            memcpy(&x, src + i, sizeof(uint64_t));
+            x = (x >> shift) | ((uint64_t)src[i + 8] << (64 - shift));
+            memcpy(dest + i, &x, sizeof(uint64_t));
+        }
+#endif
+        for (; i < nb_bytes; i++) {
+            dest[i] = src[i] >> shift;
+            /* Only reads the next byte when its bits are requested */
+            if (i * 8 + 8 - shift < nb)
+                dest[i] |= src[i + 1] << (8 - shift);
+        }
+    }
+
+    if (nb & 7)
+        dest[nb_bytes - 1] &= (1 << (nb & 7)) - 1;
+}
+
+/* Copies nb bits of src (from bit 0) to the index idx of a packed bitset */
+void _modbus_set_bits_packed(uint8_t *bitset, int idx, int nb,
+                             const uint8_t *src)
+{
+    uint8_t *dest = bitset + (idx >> 3);
+    int shift = idx & 7;
+    int i;
+
+    if (shift == 0 && (nb & 7) == 0) {
+        memcpy(dest, src, nb >> 3);
+        return;
+    }
+
+    for (i = 0; nb > 0; i++, nb -= 8) {
+        unsigned int mask = ((1U << (nb < 8 ? nb : 8)) - 1) << shift;
+        unsigned int value = ((unsigned int)src[i] << shift) & mask;
+
+        dest[i] = (dest[i] & ~mask) | value;
+        if (mask >> 8)
+            dest[i + 1] = (dest[i + 1] & ~(mask >> 8)) | (value >> 8);
+    }
+}
+
 /* Sets many bits from a single byte value (all 8 bits of the byte value are
    set) */
 void modbus_set_bits_from_byte(uint8_t *dest, int idx, const uint8_t value)
@@ -76,15 +348,7 @@ void modbus_set_bits_from_byte(uint8_t *dest, int idx, const uint8_t value)
 void modbus_set_bits_from_bytes(uint8_t *dest, int idx, unsigned int nb_bits,
                                 const uint8_t *tab_byte)
 {
-    unsigned int i;
-    int shift = 0;
-
-    for (i = idx; i < idx + nb_bits; i++) {
-        dest[i] = tab_byte[(i - idx) / 8] & (1 << shift) ? 1 : 0;
-        /* gcc doesn't like: shift = (++shift) % 8; */
-        shift++;
-        shift %= 8;
-    }
+    _modbus_unpack_bits(dest + idx, tab_byte, nb_bits);
 }
 
 /* Gets the byte value from many bits.
@@ -92,7 +356,6 @@ void modbus_set_bits_from_bytes(uint8_t *dest, int idx, unsigned int nb_bits,
 uint8_t modbus_get_byte_from_bits(const uint8_t *src, int idx,
                                   unsigned int nb_bits)
 {
-    unsigned int i;
     uint8_t value = 0;
 
     if (nb_bits > 8) {
@@ -101,9 +364,7 @@ uint8_t modbus_get_byte_from_bits(const uint8_t *src, int idx,
         nb_bits = 8;
     }
 
-    for (i=0; i < nb_bits; i++) {
-        value |= (src[idx+i] << i);
-    }
+    _modbus_pack_bits(&value, src + idx, nb_bits);
 
     return value;
 }
@@ -152,3 +413,309 @@ void modbus_set_float_dcba(float f, uint16_t *dest)
     dest[0] = (uint16_t)i;
     dest[1] = (uint16_t)(i >> 16);
 }
+
+/*
+ * Conversion of arrays of 32-bit and 64-bit values stored in consecutive
+ * registers. The order names the bytes of the value from the most significant
+ * one (A) as they are stored in the registers, high byte first:
+ * - ABCD, the big-endian order of the specification;
+ * - DCBA, the bytes in reverse order (little-endian);
+ * - BADC, the registers in order with their bytes swapped;
+ * - CDAB, the registers in reverse order (modbus_get_float()).
+ * For 64-bit values, ABCD stands for ABCDEFGH, DCBA for HGFEDCBA, BADC for
+ * BADCFEHG and CDAB for GHEFCDAB.
+ *
+ * On little-endian hosts, each order is a permutation of the bytes of a value
+ * between the registers and the value in memory. It's its own inverse so the
+ * same permutation reads and writes the values, with the byte shuffle of the
+ * CPU (pshufb of SSSE3 or AVX2, tbl of NEON on AArch64). CDAB is a copy.
+ */
+
+/* Permutations of a block of 16 bytes (values of 4 and 8 bytes) */
+static const uint8_t _perm32[4][16] = {
+    /* MODBUS_ORDER_ABCD */
+    { 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13 },
+    /* MODBUS_ORDER_DCBA */
+    { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+    /* MODBUS_ORDER_BADC */
+    { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+    /* MODBUS_ORDER_CDAB */
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }
+};
+
+static const uint8_t _perm64[4][16] = {
+    { 6, 7, 4, 5, 2, 3, 0, 1, 14, 15, 12, 13, 10, 11, 8, 9 },
+    { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+    { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }
+};
+
+#if defined(_HOST_LITTLE_ENDIAN)
+/* The length is a multiple of the size of the values so the tail of a block
+   only reads the bytes of its values */
+static void shuffle_scalar(uint8_t *dest, const uint8_t *src, int length,
+                           const uint8_t *perm)
+{
+    int i;
+
+    for (i = 0; i < length; i++) {
+        dest[i] = src[(i & ~15) + perm[i & 15]];
+    }
+}
+#endif
+
+#if defined(_SWAP16_X86)
+__attribute__((target("ssse3")))
+static void shuffle_ssse3(uint8_t *dest, const uint8_t *src, int length,
+                          const uint8_t *perm)
+{
+    const __m128i mask = _mm_loadu_si128((const __m128i *)perm);
+    int i;
+
+    for (i = 0; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_shuffle_epi8(v, mask));
+    }
+    shuffle_scalar(dest + i, src + i, length - i, perm);
+}
+
+__attribute__((target("avx2")))
+static void shuffle_avx2(uint8_t *dest, const uint8_t *src, int length,
+                         const uint8_t *perm)
+{
+    const __m256i mask = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)perm));
+    int i;
+
+    for (i = 0; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dest + i),
+                            _mm256_shuffle_epi8(v, mask));
+    }
+    _mm256_zeroupper();
+    shuffle_ssse3(dest + i, src + i, length - i, perm);
+}
+
+static void shuffle_init(uint8_t *dest, const uint8_t *src, int length,
+                         const uint8_t *perm);
+
+/* Kernel of the CPU, resolved by the first call */
+static void (*shuffle)(uint8_t *dest, const uint8_t *src, int length,
+                       const uint8_t *perm) = shuffle_init;
+
+static void shuffle_init(uint8_t *dest, const uint8_t *src, int length,
+                         const uint8_t *perm)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        shuffle = shuffle_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        shuffle = shuffle_ssse3;
+    } else {
+        shuffle = shuffle_scalar;
+    }
+    shuffle(dest, src, length, perm);
+}
+#elif defined(_SWAP16_NEON) && defined(__aarch64__)
+static void shuffle(uint8_t *dest, const uint8_t *src, int length,
+                    const uint8_t *perm)
+{
+    const uint8x16_t mask = vld1q_u8(perm);
+    int i;
+
+    for (i = 0; i + 16 <= length; i += 16) {
+        vst1q_u8(dest + i, vqtbl1q_u8(vld1q_u8(src + i), mask));
+    }
+    shuffle_scalar(dest + i, src + i, length - i, perm);
+}
+#elif defined(_HOST_LITTLE_ENDIAN)
+#  define shuffle shuffle_scalar
+#endif
+
+#if !defined(_HOST_LITTLE_ENDIAN)
+/* Registers of a value in the order of the words then of the bytes, from the
+   most significant register */
+static uint64_t get_value(const uint16_t *src, int nb_words, int order)
+{
+    uint64_t value = 0;
+    int k;
+
+    for (k = 0; k < nb_words; k++) {
+        uint16_t word = (order == MODBUS_ORDER_ABCD ||
+                         order == MODBUS_ORDER_BADC) ?
+            src[k] : src[nb_words - 1 - k];
+
+        if (order == MODBUS_ORDER_DCBA || order == MODBUS_ORDER_BADC)
+            word = (word >> 8) | (word << 8);
+        value = (value << 16) | word;
+    }
+
+    return value;
+}
+
+static void set_value(uint16_t *dest, uint64_t value, int nb_words, int order)
+{
+    int k;
+
+    for (k = nb_words - 1; k >= 0; k--) {
+        uint16_t word = value & 0xFFFF;
+
+        if (order == MODBUS_ORDER_DCBA || order == MODBUS_ORDER_BADC)
+            word = (word >> 8) | (word << 8);
+        if (order == MODBUS_ORDER_ABCD || order == MODBUS_ORDER_BADC) {
+            dest[k] = word;
+        } else {
+            dest[nb_words - 1 - k] = word;
+        }
+        value >>= 16;
+    }
+}
+#endif
+
+/* Reads nb values of size bytes (4 or 8) from the registers */
+static int get_values(void *dest, const uint16_t *src, int nb, int size,
+                      int order)
+{
+    if (dest == NULL || src == NULL || nb < 0 ||
+        order < MODBUS_ORDER_ABCD || order > MODBUS_ORDER_CDAB) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#if defined(_HOST_LITTLE_ENDIAN)
+    if (order == MODBUS_ORDER_CDAB) {
+        memcpy(dest, src, nb * size);
+    } else {
+        shuffle((uint8_t *)dest, (const uint8_t *)src, nb * size,
+                size == 4 ? _perm32[order] : _perm64[order]);
+    }
+#else
+    {
+        int i;
+
+        for (i = 0; i < nb; i++) {
+            uint64_t value = get_value(src + i * size / 2, size / 2, order);
+            uint32_t value32 = (uint32_t)value;
+
+            memcpy((uint8_t *)dest + i * size,
+                   size == 4 ? (void *)&value32 : (void *)&value, size);
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/* Writes nb values of size bytes (4 or 8) to the registers */
+static int set_values(uint16_t *dest, const void *src, int nb, int size,
+                      int order)
+{
+    if (dest == NULL || src == NULL || nb < 0 ||
+        order < MODBUS_ORDER_ABCD || order > MODBUS_ORDER_CDAB) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#if defined(_HOST_LITTLE_ENDIAN)
+    if (order == MODBUS_ORDER_CDAB) {
+        memcpy(dest, src, nb * size);
+    } else {
+        shuffle((uint8_t *)dest, (const uint8_t *)src, nb * size,
+                size == 4 ? _perm32[order] : _perm64[order]);
+    }
+#else
+    {
+        int i;
+
+        for (i = 0; i < nb; i++) {
+            uint64_t value;
+
+            if (size == 4) {
+                uint32_t value32;
+
+                memcpy(&value32, (const uint8_t *)src + i * size, size);
+                value = value32;
+            } else {
+                memcpy(&value, (const uint8_t *)src + i * size, size);
+            }
+            set_value(dest + i * size / 2, value, size / 2, order);
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/* Get nb floats from 2 * nb registers in the order (MODBUS_ORDER_*) */
+int modbus_get_float_array(float *dest, const uint16_t *src, int nb, int order)
+{
+    return get_values(dest, src, nb, sizeof(float), order);
+}
+
+/* Set nb floats to 2 * nb registers in the order (MODBUS_ORDER_*) */
+int modbus_set_float_array(uint16_t *dest, const float *src, int nb, int order)
+{
+    return set_values(dest, src, nb, sizeof(float), order);
+}
+
+int modbus_get_int32_array(int32_t *dest, const uint16_t *src, int nb,
+                           int order)
+{
+    return get_values(dest, src, nb, sizeof(int32_t), order);
+}
+
+int modbus_set_int32_array(uint16_t *dest, const int32_t *src, int nb,
+                           int order)
+{
+    return set_values(dest, src, nb, sizeof(int32_t), order);
+}
+
+int modbus_get_uint32_array(uint32_t *dest, const uint16_t *src, int nb,
+                            int order)
+{
+    return get_values(dest, src, nb, sizeof(uint32_t), order);
+}
+
+int modbus_set_uint32_array(uint16_t *dest, const uint32_t *src, int nb,
+                            int order)
+{
+    return set_values(dest, src, nb, sizeof(uint32_t), order);
+}
+
+/* Get nb doubles from 4 * nb registers in the order (MODBUS_ORDER_*) */
+int modbus_get_double_array(double *dest, const uint16_t *src, int nb,
+                            int order)
+{
+    return get_values(dest, src, nb, sizeof(double), order);
+}
+
+/* Set nb doubles to 4 * nb registers in the order (MODBUS_ORDER_*) */
+int modbus_set_double_array(uint16_t *dest, const double *src, int nb,
+                            int order)
+{
+    return set_values(dest, src, nb, sizeof(double), order);
+}
+
+int modbus_get_int64_array(int64_t *dest, const uint16_t *src, int nb,
+                           int order)
+{
+    return get_values(dest, src, nb, sizeof(int64_t), order);
+}
+
+int modbus_set_int64_array(uint16_t *dest, const int64_t *src, int nb,
+                           int order)
+{
+    return set_values(dest, src, nb, sizeof(int64_t), order);
+}
+
+int modbus_get_uint64_array(uint64_t *dest, const uint16_t *src, int nb,
+                            int order)
+{
+    return get_values(dest, src, nb, sizeof(uint64_t), order);
+}
+
+int modbus_set_uint64_array(uint16_t *dest, const uint64_t *src, int nb,
+                            int order)
+{
+    return set_values(dest, src, nb, sizeof(uint64_t), order);
+}
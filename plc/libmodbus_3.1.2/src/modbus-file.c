@@ -0,0 +1,539 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ *
+ * File record access (read and write file record). The server replies with
+ * the data of a provider, the client packs the records in as few requests as
+ * possible and keeps up to the window of the asynchronous API in flight.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+
+#include "modbus.h"
+#include "modbus-private.h"
+#include "modbus-file.h"
+
+/* Reference type of the sub-requests */
+#define _FILE_REF_TYPE 6
+
+/* Length of the header of a sub-request (reference type, file number, record
+   number and record length) */
+#define _FILE_SUB_LENGTH 7
+
+/* Max lengths of the data of a read response and of a write request (the byte
+   count field) */
+#define _FILE_MAX_READ_DATA  0xF5
+#define _FILE_MAX_WRITE_DATA 0xFB
+
+/* Max number of sub-requests of a read request */
+#define _FILE_MAX_SUBS (_FILE_MAX_READ_DATA / _FILE_SUB_LENGTH)
+
+typedef struct {
+    uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+    int req_length;
+    int nb_subs;
+    /* Registers of each sub-request in the records of the caller */
+    uint16_t *data[_FILE_MAX_SUBS];
+    int nb[_FILE_MAX_SUBS];
+} _file_request_t;
+
+/* Position of the next register to request */
+typedef struct {
+    int index;
+    int offset;
+} _file_cursor_t;
+
+/* Checks the fields of a sub-request, the data address exception is returned
+   outside of the file */
+static int _file_check_sub(modbus_t *ctx, const uint8_t *sub)
+{
+    int file = (sub[1] << 8) + sub[2];
+    int record = (sub[3] << 8) + sub[4];
+    int nb = (sub[5] << 8) + sub[6];
+
+    if (sub[0] != _FILE_REF_TYPE || nb == 0) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal file sub-request (type %d, length %d)\n",
+                    sub[0], nb);
+        }
+        errno = EMBXILVAL;
+        return -1;
+    }
+
+    if (file == 0 || record + nb - 1 > MODBUS_MAX_FILE_RECORD) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal file record %d:%d (%d records)\n",
+                    file, record, nb);
+        }
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    return nb;
+}
+
+/* The error of a provider is returned as an exception */
+static int _file_provider_error(void)
+{
+    if (errno <= MODBUS_ENOBASE ||
+        errno >= MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX) {
+        errno = EMBXSFAIL;
+    }
+
+    return -1;
+}
+
+static int validate_read_file_record(modbus_t *ctx, const uint8_t *req,
+                                     int req_length, void *user_data)
+{
+    int byte_count = req[0];
+    int rsp_length = 0;
+    int i;
+
+    /* The byte count is checked against the data received */
+    if (byte_count != req_length - 1 || byte_count < _FILE_SUB_LENGTH ||
+        byte_count > _FILE_MAX_SUBS * _FILE_SUB_LENGTH ||
+        byte_count % _FILE_SUB_LENGTH != 0) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal byte count %d in read_file_record\n",
+                    byte_count);
+        }
+        errno = EMBXILVAL;
+        return -1;
+    }
+
+    for (i = 1; i < req_length; i += _FILE_SUB_LENGTH) {
+        int nb = _file_check_sub(ctx, req + i);
+
+        if (nb == -1)
+            return -1;
+
+        /* The response holds the length and the reference type then the
+           registers of each sub-request */
+        rsp_length += 2 + 2 * nb;
+        if (rsp_length > _FILE_MAX_READ_DATA) {
+            if (ctx->debug) {
+                fprintf(stderr, "Too many records in read_file_record\n");
+            }
+            errno = EMBXILVAL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int reply_read_file_record(modbus_t *ctx, const uint8_t *req,
+                                  int req_length, uint8_t *rsp,
+                                  modbus_mapping_t *mb_mapping,
+                                  void *user_data)
+{
+    const modbus_file_provider_t *provider = user_data;
+    int rsp_length = 1;
+    int i;
+
+    for (i = 1; i < req_length; i += _FILE_SUB_LENGTH) {
+        int file = (req[i + 1] << 8) + req[i + 2];
+        int record = (req[i + 3] << 8) + req[i + 4];
+        int nb = (req[i + 5] << 8) + req[i + 6];
+        const uint8_t *data;
+
+        if (provider->read(provider->user_data, file, record, nb, &data) == -1)
+            return _file_provider_error();
+
+        rsp[rsp_length++] = 1 + 2 * nb;
+        rsp[rsp_length++] = _FILE_REF_TYPE;
+        memcpy(rsp + rsp_length, data, 2 * nb);
+        rsp_length += 2 * nb;
+    }
+    rsp[0] = rsp_length - 1;
+
+    return rsp_length;
+}
+
+static int validate_write_file_record(modbus_t *ctx, const uint8_t *req,
+                                      int req_length, void *user_data)
+{
+    int byte_count = req[0];
+    int i;
+
+    if (byte_count != req_length - 1 ||
+        byte_count < _FILE_SUB_LENGTH + 2 ||
+        byte_count > _FILE_MAX_WRITE_DATA) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal byte count %d in write_file_record\n",
+                    byte_count);
+        }
+        errno = EMBXILVAL;
+        return -1;
+    }
+
+    /* The sub-requests must fill the data exactly, none is written
+       otherwise */
+    for (i = 1; i < req_length; ) {
+        int nb;
+
+        if (req_length - i < _FILE_SUB_LENGTH) {
+            errno = EMBXILVAL;
+            return -1;
+        }
+
+        nb = _file_check_sub(ctx, req + i);
+        if (nb == -1)
+            return -1;
+
+        i += _FILE_SUB_LENGTH + 2 * nb;
+        if (i > req_length) {
+            if (ctx->debug) {
+                fprintf(stderr,
+                        "Record length beyond the data in write_file_record\n");
+            }
+            errno = EMBXILVAL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int reply_write_file_record(modbus_t *ctx, const uint8_t *req,
+                                   int req_length, uint8_t *rsp,
+                                   modbus_mapping_t *mb_mapping,
+                                   void *user_data)
+{
+    const modbus_file_provider_t *provider = user_data;
+    int i;
+
+    for (i = 1; i < req_length; ) {
+        int file = (req[i + 1] << 8) + req[i + 2];
+        int record = (req[i + 3] << 8) + req[i + 4];
+        int nb = (req[i + 5] << 8) + req[i + 6];
+
+        if (provider->write(provider->user_data, file, record, nb,
+                            req + i + _FILE_SUB_LENGTH) == -1)
+            return _file_provider_error();
+
+        i += _FILE_SUB_LENGTH + 2 * nb;
+    }
+
+    /* The response is an echo of the request */
+    memcpy(rsp, req, req_length);
+
+    return req_length;
+}
+
+/* Registers the handlers of the file record functions in the table, NULL
+   restores the illegal function exception. Shared with the units of the
+   router. */
+int _modbus_set_file_provider(modbus_handler_t **handlers,
+                              const modbus_file_provider_t *provider)
+{
+    modbus_handler_t handler;
+    int rc;
+
+    if (provider == NULL || provider->read == NULL) {
+        rc = _modbus_set_handler(handlers, MODBUS_FC_READ_FILE_RECORD, NULL);
+    } else {
+        handler.min_length = 1;
+        handler.byte_count = TRUE;
+        handler.validate = validate_read_file_record;
+        handler.reply = reply_read_file_record;
+        handler.user_data = (void *)provider;
+        rc = _modbus_set_handler(handlers, MODBUS_FC_READ_FILE_RECORD,
+                                 &handler);
+    }
+    if (rc == -1)
+        return -1;
+
+    if (provider == NULL || provider->write == NULL) {
+        rc = _modbus_set_handler(handlers, MODBUS_FC_WRITE_FILE_RECORD, NULL);
+    } else {
+        handler.min_length = 1;
+        handler.byte_count = TRUE;
+        handler.validate = validate_write_file_record;
+        handler.reply = reply_write_file_record;
+        handler.user_data = (void *)provider;
+        rc = _modbus_set_handler(handlers, MODBUS_FC_WRITE_FILE_RECORD,
+                                 &handler);
+    }
+
+    return rc;
+}
+
+/* The provider isn't copied, it's used by modbus_reply() until it's
+   replaced */
+int modbus_set_file_provider(modbus_t *ctx,
+                             const modbus_file_provider_t *provider)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return _modbus_set_file_provider(&ctx->handlers, provider);
+}
+
+/* Builds the next request from the cursor and returns the number of registers
+   requested */
+static int _file_build(modbus_t *ctx, int function,
+                       const modbus_file_record_t *records, int nb_records,
+                       _file_cursor_t *cursor, _file_request_t *request)
+{
+    int byte_count_index;
+    /* Length of the data of the response (read) or of the request (write) */
+    int data_length = 0;
+    int nb_values = 0;
+
+    /* HACKISH, addr and count are not used */
+    request->req_length = ctx->backend->build_request_basis(
+        ctx, function, 0, 0, request->req) - 4;
+    byte_count_index = request->req_length++;
+    request->nb_subs = 0;
+
+    while (cursor->index < nb_records && request->nb_subs < _FILE_MAX_SUBS) {
+        const modbus_file_record_t *record = &records[cursor->index];
+        uint8_t *sub = request->req + request->req_length;
+        int nb = record->nb - cursor->offset;
+        int room;
+
+        if (function == MODBUS_FC_READ_FILE_RECORD) {
+            room = (_FILE_MAX_READ_DATA - data_length - 2) / 2;
+        } else {
+            room = (_FILE_MAX_WRITE_DATA - data_length - _FILE_SUB_LENGTH) / 2;
+        }
+        if (room <= 0)
+            break;
+        if (nb > room)
+            nb = room;
+
+        sub[0] = _FILE_REF_TYPE;
+        sub[1] = record->file >> 8;
+        sub[2] = record->file & 0x00FF;
+        sub[3] = (record->record + cursor->offset) >> 8;
+        sub[4] = (record->record + cursor->offset) & 0x00FF;
+        sub[5] = nb >> 8;
+        sub[6] = nb & 0x00FF;
+        request->req_length += _FILE_SUB_LENGTH;
+
+        if (function == MODBUS_FC_READ_FILE_RECORD) {
+            data_length += 2 + 2 * nb;
+        } else {
+            _modbus_set_registers_be(request->req + request->req_length,
+                                     record->data + cursor->offset, nb);
+            request->req_length += 2 * nb;
+            data_length += _FILE_SUB_LENGTH + 2 * nb;
+        }
+
+        request->data[request->nb_subs] = record->data + cursor->offset;
+        request->nb[request->nb_subs] = nb;
+        request->nb_subs++;
+        nb_values += nb;
+
+        cursor->offset += nb;
+        if (cursor->offset == record->nb) {
+            cursor->index++;
+            cursor->offset = 0;
+        }
+    }
+
+    request->req[byte_count_index] = (function == MODBUS_FC_READ_FILE_RECORD) ?
+        request->nb_subs * _FILE_SUB_LENGTH : data_length;
+
+    return nb_values;
+}
+
+/* Copies the registers of a checked confirmation in the records, the length
+   of the response has been checked against the request */
+static int _file_decode(modbus_t *ctx, int function,
+                        const _file_request_t *request, const uint8_t *rsp)
+{
+    const int offset = ctx->backend->header_length;
+    const uint8_t *sub = rsp + offset + 2;
+    int nb_values = 0;
+    int i;
+
+    if (function == MODBUS_FC_WRITE_FILE_RECORD) {
+        if (memcmp(rsp + offset, request->req + offset,
+                   request->req_length - offset) != 0) {
+            errno = EMBBADDATA;
+            _error_print(ctx, "write_file_record echo");
+            return -1;
+        }
+        for (i = 0; i < request->nb_subs; i++)
+            nb_values += request->nb[i];
+        return nb_values;
+    }
+
+    for (i = 0; i < request->nb_subs; i++) {
+        int nb = request->nb[i];
+
+        if (sub[0] != 1 + 2 * nb || sub[1] != _FILE_REF_TYPE) {
+            errno = EMBBADDATA;
+            _error_print(ctx, "read_file_record sub-response");
+            return -1;
+        }
+        _modbus_get_registers_be(request->data[i], sub + 2, nb);
+        sub += 2 + 2 * nb;
+        nb_values += nb;
+    }
+
+    return nb_values;
+}
+
+/* Receives and discards the responses of the requests still in flight after
+   an error so they aren't taken for the responses of the next requests. When
+   the stream is out of step (response lost, bad or missing), the context is
+   flushed and closed instead. The errno of the error is kept. */
+static void _file_discard(modbus_t *ctx, int nb_in_flight, int desync)
+{
+    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+    int saved_errno = errno;
+
+    while (!desync && nb_in_flight > 0) {
+        if (_modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION) == -1) {
+            desync = TRUE;
+        }
+        nb_in_flight--;
+    }
+
+    if (desync) {
+        if (ctx->debug) {
+            fprintf(stderr, "File transfer out of step, closing\n");
+        }
+        modbus_flush(ctx);
+        modbus_close(ctx);
+    }
+
+    errno = saved_errno;
+}
+
+/* Sends the requests of the records, keeps up to the window of
+   modbus_async_set_window() in flight and returns the number of registers
+   transferred. The responses are expected in the order of the requests. */
+static int _file_transfer(modbus_t *ctx, int function,
+                          const modbus_file_record_t *records, int nb_records)
+{
+    _file_request_t *requests;
+    _file_cursor_t cursor;
+    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+    int window;
+    int head = 0;
+    int nb_in_flight = 0;
+    int nb_values = 0;
+    int rc;
+    int i;
+
+    if (ctx == NULL || records == NULL || nb_records < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < nb_records; i++) {
+        if (records[i].file < 1 || records[i].file > 0xFFFF ||
+            records[i].record < 0 || records[i].nb < 1 ||
+            records[i].record + records[i].nb - 1 > MODBUS_MAX_FILE_RECORD ||
+            records[i].data == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    /* The responses of the asynchronous requests would be mixed up */
+    if (modbus_async_get_pending(ctx) > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    window = modbus_async_get_window(ctx);
+    requests = (_file_request_t *) malloc(window * sizeof(_file_request_t));
+    if (requests == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    cursor.index = 0;
+    cursor.offset = 0;
+    while (cursor.index < nb_records || nb_in_flight > 0) {
+        _file_request_t *request;
+
+        /* Fills the window */
+        while (nb_in_flight < window && cursor.index < nb_records) {
+            request = &requests[(head + nb_in_flight) % window];
+            _file_build(ctx, function, records, nb_records, &cursor, request);
+            rc = _modbus_send_msg(ctx, request->req, request->req_length);
+            if (rc == -1) {
+                _file_discard(ctx, nb_in_flight, FALSE);
+                goto error;
+            }
+            nb_in_flight++;
+        }
+
+        /* The oldest request is answered first */
+        request = &requests[head];
+        nb_in_flight--;
+        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        if (rc == -1) {
+            /* A late response would be taken for the next one */
+            _file_discard(ctx, nb_in_flight, nb_in_flight > 0);
+            goto error;
+        }
+
+        rc = _modbus_check_confirmation(ctx, request->req, rsp, rc);
+        if (rc == -1) {
+            /* Only an exception is a whole response */
+            _file_discard(ctx, nb_in_flight,
+                          errno <= MODBUS_ENOBASE || errno > EMBXGTAR);
+            goto error;
+        }
+
+        rc = _file_decode(ctx, function, request, rsp);
+        if (rc == -1) {
+            _file_discard(ctx, nb_in_flight, FALSE);
+            goto error;
+        }
+
+        nb_values += rc;
+        head = (head + 1) % window;
+    }
+
+    free(requests);
+    return nb_values;
+
+error:
+    free(requests);
+    return -1;
+}
+
+int modbus_read_file_records(modbus_t *ctx, const modbus_file_record_t *records,
+                             int nb_records)
+{
+    return _file_transfer(ctx, MODBUS_FC_READ_FILE_RECORD, records,
+                          nb_records);
+}
+
+int modbus_write_file_records(modbus_t *ctx,
+                              const modbus_file_record_t *records,
+                              int nb_records)
+{
+    return _file_transfer(ctx, MODBUS_FC_WRITE_FILE_RECORD, records,
+                          nb_records);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_FILE_H
+#define MODBUS_FILE_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Last record number of a file (the records are registers) */
+#define MODBUS_MAX_FILE_RECORD  0x270F
+
+/* Data of the files served by modbus_reply(). read() points *data to the nb
+ * registers from the record (big-endian, eg. in a mapped file) and write()
+ * stores them. They return 0 or -1 and set errno to EMBXILADD or
+ * EMBXSFAIL. */
+typedef struct {
+    int (*read)(void *user_data, int file, int record, int nb,
+                const uint8_t **data);
+    int (*write)(void *user_data, int file, int record, int nb,
+                 const uint8_t *data);
+    void *user_data;
+} modbus_file_provider_t;
+
+/* Records of the client functions, a record longer than a request is split */
+typedef struct {
+    int file;
+    int record;
+    int nb;
+    uint16_t *data;
+} modbus_file_record_t;
+
+MODBUS_API int modbus_set_file_provider(modbus_t *ctx,
+                                        const modbus_file_provider_t *provider);
+
+MODBUS_API int modbus_read_file_records(modbus_t *ctx,
+                                        const modbus_file_record_t *records,
+                                        int nb_records);
+MODBUS_API int modbus_write_file_records(modbus_t *ctx,
+                                         const modbus_file_record_t *records,
+                                         int nb_records);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_FILE_H */
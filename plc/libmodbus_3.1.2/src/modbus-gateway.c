@@ -0,0 +1,603 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ *
+ * Gateway from Modbus TCP to the RTU lines: the requests of the TCP clients
+ * are routed by their unit ID to a line, queued and sent one at a time by the
+ * RTU framer, the responses are returned with the MBAP header of the request.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+# include <unistd.h>
+# include <sys/socket.h>
+# include <sys/epoll.h>
+#endif
+
+#include "modbus.h"
+#include "modbus-private.h"
+#include "modbus-rtu-private.h"
+#include "modbus-tcp-private.h"
+#include "modbus-tcp-parser.h"
+#include "modbus-gateway.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+
+/* Max number of events handled by epoll_wait() call */
+#define _GATEWAY_MAX_EVENTS 64
+
+/* Max number of requests waiting for a line */
+#define _GATEWAY_QUEUE_LENGTH 32
+
+/* Bytes read from a client at once, the requests held by a read are parsed
+   in place */
+#define _GATEWAY_READ_LENGTH 4096
+
+/* Highest slave address of a RTU line */
+#define _GATEWAY_MAX_UNIT 247
+
+/* Source of an epoll event, the index of a client is in the low 32 bits */
+#define _GATEWAY_SERVER  ((uint64_t)1 << 32)
+#define _GATEWAY_FRAMER  ((uint64_t)2 << 32)
+#define _GATEWAY_CLIENT  ((uint64_t)3 << 32)
+
+typedef struct {
+    /* Client of the request, the generation changes when its slot is reused */
+    int client;
+    uint32_t generation;
+    /* Transaction and protocol identifiers */
+    uint8_t mbap[4];
+    /* Unit ID and PDU */
+    uint8_t adu[_MODBUS_RTU_HEADER_LENGTH + MODBUS_MAX_PDU_LENGTH];
+    int length;
+} _gateway_request_t;
+
+typedef struct {
+    modbus_gateway_t *gateway;
+    modbus_t *ctx;
+    int framer_id;
+    /* Circular queue, the request at the head is the one sent */
+    _gateway_request_t queue[_GATEWAY_QUEUE_LENGTH];
+    int head;
+    int nb_queued;
+    int in_flight;
+    int64_t deadline;
+} _gateway_line_t;
+
+typedef struct {
+    int fd;
+    uint32_t generation;
+    /* Framing of the requests, kept when the slot is reused */
+    modbus_tcp_parser_t *parser;
+} _gateway_client_t;
+
+struct _modbus_gateway {
+    int epfd;
+    int server_socket;
+    modbus_rtu_framer_t *framer;
+    _gateway_line_t **lines;
+    int nb_lines;
+    _gateway_client_t *clients;
+    int nb_clients;
+    /* Line of each unit ID or -1 */
+    int units[_GATEWAY_MAX_UNIT + 1];
+    int nb_responses;
+};
+
+static void _client_close(modbus_gateway_t *gateway, int slot)
+{
+    _gateway_client_t *client = &gateway->clients[slot];
+
+    epoll_ctl(gateway->epfd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+    client->generation++;
+    modbus_tcp_parser_reset(client->parser);
+}
+
+static void _client_send(modbus_gateway_t *gateway, int slot,
+                         uint32_t generation, const uint8_t *adu, int length)
+{
+    _gateway_client_t *client = &gateway->clients[slot];
+
+    /* The client has disconnected since its request */
+    if (client->fd == -1 || client->generation != generation)
+        return;
+
+    /* A client which doesn't read its responses is disconnected */
+    if (send(client->fd, adu, length, MSG_NOSIGNAL | MSG_DONTWAIT) != length)
+        _client_close(gateway, slot);
+}
+
+static void _reply_exception(modbus_gateway_t *gateway, int slot,
+                             uint32_t generation, const uint8_t *mbap,
+                             int unit, int function, int exception_code)
+{
+    uint8_t rsp[_MODBUS_TCP_HEADER_LENGTH + 2];
+
+    memcpy(rsp, mbap, 4);
+    rsp[4] = 0;
+    rsp[5] = 3;
+    rsp[6] = unit;
+    rsp[7] = function | 0x80;
+    rsp[8] = exception_code;
+    _client_send(gateway, slot, generation, rsp, sizeof(rsp));
+}
+
+static int64_t _line_timeout(_gateway_line_t *line)
+{
+    return (int64_t)line->ctx->response_timeout.tv_sec * 1000000 +
+        line->ctx->response_timeout.tv_usec;
+}
+
+/* Sends the request at the head of the queue if the line is available */
+static void _line_send(_gateway_line_t *line)
+{
+    modbus_gateway_t *gateway = line->gateway;
+
+    while (!line->in_flight && line->nb_queued > 0) {
+        _gateway_request_t *req = &line->queue[line->head];
+
+        if (modbus_rtu_framer_send(gateway->framer, line->framer_id,
+                                   req->adu, req->length) == 0) {
+            line->in_flight = TRUE;
+            line->deadline = _modbus_now_us() + _line_timeout(line);
+            return;
+        }
+
+        _reply_exception(gateway, req->client, req->generation, req->mbap,
+                         req->adu[0], req->adu[1],
+                         MODBUS_EXCEPTION_GATEWAY_TARGET);
+        line->head = (line->head + 1) % _GATEWAY_QUEUE_LENGTH;
+        line->nb_queued--;
+    }
+}
+
+/* Releases the request sent and sends the next one */
+static void _line_done(_gateway_line_t *line)
+{
+    line->in_flight = FALSE;
+    line->head = (line->head + 1) % _GATEWAY_QUEUE_LENGTH;
+    line->nb_queued--;
+    _line_send(line);
+}
+
+static void _framer_callback(modbus_rtu_framer_t *framer, int id,
+                             modbus_t *ctx, const uint8_t *frame, int length,
+                             void *user_data)
+{
+    _gateway_line_t *line = user_data;
+    _gateway_request_t *req = &line->queue[line->head];
+    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+    int adu_length;
+
+    if (!line->in_flight)
+        return;
+
+    /* The request hasn't been written on the line or the serial port is
+       closed */
+    if (frame == NULL && (errno == EIO || errno == ECONNRESET)) {
+        _reply_exception(line->gateway, req->client, req->generation,
+                         req->mbap, req->adu[0], req->adu[1],
+                         MODBUS_EXCEPTION_GATEWAY_TARGET);
+        _line_done(line);
+        return;
+    }
+
+    /* Rejected frames are handled by the response timeout */
+    if (frame == NULL)
+        return;
+
+    /* Late response to a previous request, the request may not even be sent
+       when the response of the previous one ends after its timeout */
+    if (_modbus_rtu_framer_pending(framer, id) ||
+        frame[0] != req->adu[0] || (frame[1] & 0x7F) != req->adu[1])
+        return;
+
+    /* Unit ID and PDU without the CRC */
+    adu_length = length - _MODBUS_RTU_CHECKSUM_LENGTH;
+    memcpy(rsp, req->mbap, 4);
+    rsp[4] = adu_length >> 8;
+    rsp[5] = adu_length & 0xFF;
+    memcpy(rsp + 6, frame, adu_length);
+    _client_send(line->gateway, req->client, req->generation, rsp,
+                 6 + adu_length);
+    line->gateway->nb_responses++;
+
+    _line_done(line);
+}
+
+static void _gateway_request(modbus_gateway_t *gateway, int slot,
+                             const uint8_t *adu, int adu_length)
+{
+    _gateway_client_t *client = &gateway->clients[slot];
+    int unit = adu[6];
+    int function = adu[7];
+    _gateway_line_t *line;
+    _gateway_request_t *req;
+
+    if (unit < 1 || unit > _GATEWAY_MAX_UNIT || gateway->units[unit] == -1) {
+        _reply_exception(gateway, slot, client->generation, adu, unit,
+                         function, MODBUS_EXCEPTION_GATEWAY_PATH);
+        return;
+    }
+
+    line = gateway->lines[gateway->units[unit]];
+    if (line->nb_queued == _GATEWAY_QUEUE_LENGTH) {
+        _reply_exception(gateway, slot, client->generation, adu, unit,
+                         function, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+        return;
+    }
+
+    req = &line->queue[(line->head + line->nb_queued) % _GATEWAY_QUEUE_LENGTH];
+    req->client = slot;
+    req->generation = client->generation;
+    memcpy(req->mbap, adu, 4);
+    req->length = adu_length - 6;
+    memcpy(req->adu, adu + 6, req->length);
+    line->nb_queued++;
+
+    _line_send(line);
+}
+
+typedef struct {
+    modbus_gateway_t *gateway;
+    int slot;
+} _gateway_read_t;
+
+static void _parser_callback(modbus_tcp_parser_t *parser,
+                             const modbus_tcp_frame_t *frame, void *user_data)
+{
+    _gateway_read_t *source = user_data;
+
+    /* The client may have been closed by a failed send */
+    if (source->gateway->clients[source->slot].fd == -1)
+        return;
+
+    /* Protocol ID other than Modbus or length out of a RTU frame, the stream
+       can't be resynchronized. The other frames are left to the slaves. */
+    if (frame->error == MODBUS_TCP_FRAME_BAD_PROTOCOL ||
+        frame->error == MODBUS_TCP_FRAME_BAD_LENGTH) {
+        _client_close(source->gateway, source->slot);
+        return;
+    }
+
+    _gateway_request(source->gateway, source->slot, frame->adu,
+                     frame->adu_length);
+}
+
+/* Receives the bytes of a client and handles its complete requests */
+static void _client_read(modbus_gateway_t *gateway, int slot)
+{
+    _gateway_client_t *client = &gateway->clients[slot];
+    uint8_t buf[_GATEWAY_READ_LENGTH];
+    _gateway_read_t source;
+    ssize_t n;
+
+    n = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        _client_close(gateway, slot);
+        return;
+    }
+
+    source.gateway = gateway;
+    source.slot = slot;
+    modbus_tcp_parser_push(client->parser, buf, n, _parser_callback, &source);
+}
+
+static void _gateway_accept(modbus_gateway_t *gateway)
+{
+    struct epoll_event ev;
+    int slot;
+    int fd;
+
+    fd = accept(gateway->server_socket, NULL, NULL);
+    if (fd == -1)
+        return;
+
+    for (slot = 0; slot < gateway->nb_clients; slot++) {
+        if (gateway->clients[slot].fd == -1)
+            break;
+    }
+
+    if (slot == gateway->nb_clients) {
+        int nb_clients = gateway->nb_clients ? gateway->nb_clients * 2 : 16;
+        _gateway_client_t *clients;
+        int i;
+
+        clients = realloc(gateway->clients,
+                          nb_clients * sizeof(_gateway_client_t));
+        if (clients == NULL) {
+            close(fd);
+            return;
+        }
+        for (i = gateway->nb_clients; i < nb_clients; i++) {
+            clients[i].fd = -1;
+            clients[i].generation = 0;
+            clients[i].parser = NULL;
+        }
+        gateway->clients = clients;
+        gateway->nb_clients = nb_clients;
+    }
+
+    if (gateway->clients[slot].parser == NULL) {
+        gateway->clients[slot].parser =
+            modbus_tcp_parser_new(MODBUS_TCP_PARSER_REQUEST);
+        if (gateway->clients[slot].parser == NULL) {
+            close(fd);
+            return;
+        }
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = _GATEWAY_CLIENT | slot;
+    if (epoll_ctl(gateway->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        close(fd);
+        return;
+    }
+    gateway->clients[slot].fd = fd;
+}
+
+/* Creates a gateway serving the clients of the listening socket, eg. returned
+   by modbus_tcp_listen() */
+modbus_gateway_t* modbus_gateway_new(int server_socket)
+{
+    modbus_gateway_t *gateway;
+    struct epoll_event ev;
+    int i;
+
+    if (server_socket < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    gateway = (modbus_gateway_t *) malloc(sizeof(modbus_gateway_t));
+    if (gateway == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(gateway, 0, sizeof(modbus_gateway_t));
+    gateway->server_socket = server_socket;
+    for (i = 0; i <= _GATEWAY_MAX_UNIT; i++) {
+        gateway->units[i] = -1;
+    }
+
+    gateway->framer = modbus_rtu_framer_new();
+    if (gateway->framer == NULL) {
+        free(gateway);
+        return NULL;
+    }
+
+    gateway->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (gateway->epfd == -1) {
+        modbus_rtu_framer_free(gateway->framer);
+        free(gateway);
+        return NULL;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = _GATEWAY_SERVER;
+    if (epoll_ctl(gateway->epfd, EPOLL_CTL_ADD, server_socket, &ev) == -1) {
+        modbus_gateway_free(gateway);
+        return NULL;
+    }
+    ev.data.u64 = _GATEWAY_FRAMER;
+    if (epoll_ctl(gateway->epfd, EPOLL_CTL_ADD,
+                  _modbus_rtu_framer_fd(gateway->framer), &ev) == -1) {
+        modbus_gateway_free(gateway);
+        return NULL;
+    }
+
+    return gateway;
+}
+
+/* Closes the connections of the clients and frees the gateway, the listening
+   socket and the contexts of the lines are left to the caller */
+void modbus_gateway_free(modbus_gateway_t *gateway)
+{
+    int i;
+
+    if (gateway == NULL)
+        return;
+
+    for (i = 0; i < gateway->nb_clients; i++) {
+        if (gateway->clients[i].fd != -1)
+            close(gateway->clients[i].fd);
+        modbus_tcp_parser_free(gateway->clients[i].parser);
+    }
+    for (i = 0; i < gateway->nb_lines; i++) {
+        free(gateway->lines[i]);
+    }
+    modbus_rtu_framer_free(gateway->framer);
+    close(gateway->epfd);
+    free(gateway->clients);
+    free(gateway->lines);
+    free(gateway);
+}
+
+/* Adds the line of a connected RTU context without slave address.
+
+   The function shall return the index of the line or -1 and set errno. */
+int modbus_gateway_add_line(modbus_gateway_t *gateway, modbus_t *ctx)
+{
+    _gateway_line_t **lines;
+    _gateway_line_t *line;
+
+    if (gateway == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    line = (_gateway_line_t *) malloc(sizeof(_gateway_line_t));
+    if (line == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(line, 0, sizeof(_gateway_line_t));
+    line->gateway = gateway;
+    line->ctx = ctx;
+
+    lines = realloc(gateway->lines,
+                    (gateway->nb_lines + 1) * sizeof(_gateway_line_t *));
+    if (lines == NULL) {
+        free(line);
+        errno = ENOMEM;
+        return -1;
+    }
+    gateway->lines = lines;
+
+    line->framer_id = modbus_rtu_framer_add(gateway->framer, ctx,
+                                            _framer_callback, line);
+    if (line->framer_id == -1) {
+        free(line);
+        return -1;
+    }
+
+    gateway->lines[gateway->nb_lines] = line;
+
+    return gateway->nb_lines++;
+}
+
+/* Routes the requests of the unit ID to the line (-1 to stop routing them) */
+int modbus_gateway_set_unit(modbus_gateway_t *gateway, int unit_id, int line)
+{
+    if (gateway == NULL || unit_id < 1 || unit_id > _GATEWAY_MAX_UNIT ||
+        line < -1 || line >= gateway->nb_lines) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    gateway->units[unit_id] = line;
+
+    return 0;
+}
+
+/* Waits for requests, responses or timeouts during timeout_ms at most (-1 to
+   wait forever) and processes them.
+
+   The function shall return the number of responses of the lines forwarded
+   to the clients or -1 and set errno. */
+int modbus_gateway_process(modbus_gateway_t *gateway, int timeout_ms)
+{
+    struct epoll_event events[_GATEWAY_MAX_EVENTS];
+    int64_t now;
+    int nb_events;
+    int i;
+
+    if (gateway == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Wakes up at the first response timeout */
+    now = _modbus_now_us();
+    for (i = 0; i < gateway->nb_lines; i++) {
+        _gateway_line_t *line = gateway->lines[i];
+
+        if (line->in_flight) {
+            int64_t wait_ms = (line->deadline - now + 999) / 1000;
+
+            if (wait_ms < 0)
+                wait_ms = 0;
+            if (timeout_ms == -1 || wait_ms < timeout_ms)
+                timeout_ms = (int)wait_ms;
+        }
+    }
+
+    nb_events = epoll_wait(gateway->epfd, events, _GATEWAY_MAX_EVENTS,
+                           timeout_ms);
+    if (nb_events == -1) {
+        if (errno != EINTR)
+            return -1;
+        nb_events = 0;
+    }
+
+    gateway->nb_responses = 0;
+
+    for (i = 0; i < nb_events; i++) {
+        uint64_t source = events[i].data.u64 & ~(uint64_t)0xFFFFFFFF;
+
+        if (source == _GATEWAY_SERVER) {
+            _gateway_accept(gateway);
+        } else if (source == _GATEWAY_FRAMER) {
+            modbus_rtu_framer_process(gateway->framer, 0);
+        } else {
+            int slot = (int)(events[i].data.u64 & 0xFFFFFFFF);
+
+            if (gateway->clients[slot].fd != -1)
+                _client_read(gateway, slot);
+        }
+    }
+
+    now = _modbus_now_us();
+    for (i = 0; i < gateway->nb_lines; i++) {
+        _gateway_line_t *line = gateway->lines[i];
+
+        if (line->in_flight && now >= line->deadline) {
+            _gateway_request_t *req = &line->queue[line->head];
+
+            _reply_exception(gateway, req->client, req->generation, req->mbap,
+                             req->adu[0], req->adu[1],
+                             MODBUS_EXCEPTION_GATEWAY_TARGET);
+            _line_done(line);
+        }
+    }
+
+    return gateway->nb_responses;
+}
+
+#else
+
+modbus_gateway_t* modbus_gateway_new(int server_socket)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void modbus_gateway_free(modbus_gateway_t *gateway)
+{
+}
+
+int modbus_gateway_add_line(modbus_gateway_t *gateway, modbus_t *ctx)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int modbus_gateway_set_unit(modbus_gateway_t *gateway, int unit_id, int line)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int modbus_gateway_process(modbus_gateway_t *gateway, int timeout_ms)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* HAVE_SYS_EPOLL_H && HAVE_SYS_TIMERFD_H */
@@ -0,0 +1,39 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_GATEWAY_H
+#define MODBUS_GATEWAY_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+typedef struct _modbus_gateway modbus_gateway_t;
+
+MODBUS_API modbus_gateway_t* modbus_gateway_new(int server_socket);
+MODBUS_API void modbus_gateway_free(modbus_gateway_t *gateway);
+
+MODBUS_API int modbus_gateway_add_line(modbus_gateway_t *gateway, modbus_t *ctx);
+MODBUS_API int modbus_gateway_set_unit(modbus_gateway_t *gateway, int unit_id,
+                                       int line);
+
+MODBUS_API int modbus_gateway_process(modbus_gateway_t *gateway, int timeout_ms);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_GATEWAY_H */
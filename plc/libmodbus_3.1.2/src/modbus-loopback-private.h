@@ -0,0 +1,53 @@
+/*
+ * Copyright © 2001-2011 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_LOOPBACK_PRIVATE_H
+#define MODBUS_LOOPBACK_PRIVATE_H
+
+/* Room for a few pipelined ADU */
+#define _MODBUS_LOOPBACK_BUFFER_SIZE 4096
+
+/* Bytes written by a context and not read yet by its peer */
+typedef struct {
+    uint8_t data[_MODBUS_LOOPBACK_BUFFER_SIZE];
+    int start;
+    int end;
+    /* Set when the writer is closed */
+    int closed;
+} _modbus_loopback_buffer_t;
+
+/* Shared by the two contexts of a pair, freed with the last one */
+typedef struct {
+    _modbus_loopback_buffer_t buffers[2];
+    int refs;
+} _modbus_loopback_link_t;
+
+typedef struct _modbus_loopback {
+    /* Transaction ID, first as in the TCP backends */
+    uint16_t t_id;
+    _modbus_loopback_link_t *link;
+    /* Buffers read and written by this context */
+    _modbus_loopback_buffer_t *rx;
+    _modbus_loopback_buffer_t *tx;
+    /* Maximum length returned by a read (0 for no limit) and state of the
+       generator of random lengths (0 for the maximum length) */
+    int fragment_length;
+    uint32_t fragment_seed;
+} modbus_loopback_t;
+
+#endif /* MODBUS_LOOPBACK_PRIVATE_H */
@@ -0,0 +1,307 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+
+#include "modbus-private.h"
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+#include "modbus-loopback.h"
+#include "modbus-loopback-private.h"
+
+/* Appends the bytes to the buffer, the unread bytes are moved to the start
+   when the end is reached */
+static int _loopback_write(_modbus_loopback_buffer_t *buffer,
+                           const uint8_t *data, int length)
+{
+    if (buffer->end + length > _MODBUS_LOOPBACK_BUFFER_SIZE) {
+        memmove(buffer->data, buffer->data + buffer->start,
+                buffer->end - buffer->start);
+        buffer->end -= buffer->start;
+        buffer->start = 0;
+        if (buffer->end + length > _MODBUS_LOOPBACK_BUFFER_SIZE) {
+            errno = ENOBUFS;
+            return -1;
+        }
+    }
+
+    memcpy(buffer->data + buffer->end, data, length);
+    buffer->end += length;
+
+    return length;
+}
+
+static ssize_t _modbus_loopback_send(modbus_t *ctx, const uint8_t *req,
+                                     int req_length)
+{
+    modbus_loopback_t *ctx_loopback = ctx->backend_data;
+
+    if (ctx_loopback->tx->closed) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return _loopback_write(ctx_loopback->tx, req, req_length);
+}
+
+/* Reads the bytes of the peer, a fragment of them when the fragmentation is
+   enabled to exercise the reassembly of the messages */
+static ssize_t _modbus_loopback_recv(modbus_t *ctx, uint8_t *rsp,
+                                     int rsp_length)
+{
+    modbus_loopback_t *ctx_loopback = ctx->backend_data;
+    _modbus_loopback_buffer_t *rx = ctx_loopback->rx;
+    int length = rx->end - rx->start;
+
+    if (length > rsp_length)
+        length = rsp_length;
+
+    if (ctx_loopback->fragment_length > 0) {
+        int fragment_length = ctx_loopback->fragment_length;
+
+        if (ctx_loopback->fragment_seed != 0) {
+            /* xorshift32 */
+            uint32_t x = ctx_loopback->fragment_seed;
+
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            ctx_loopback->fragment_seed = x;
+            fragment_length = 1 + x % fragment_length;
+        }
+        if (length > fragment_length)
+            length = fragment_length;
+    }
+
+    /* 0 when the buffer is empty, the peer is closed */
+    memcpy(rsp, rx->data + rx->start, length);
+    rx->start += length;
+    if (rx->start == rx->end) {
+        rx->start = 0;
+        rx->end = 0;
+    }
+
+    return length;
+}
+
+static int _modbus_loopback_connect(modbus_t *ctx)
+{
+    modbus_loopback_t *ctx_loopback = ctx->backend_data;
+
+    ctx_loopback->tx->closed = FALSE;
+
+    return 0;
+}
+
+/* The peer sees the end of the stream and the unread bytes are dropped */
+static void _modbus_loopback_close(modbus_t *ctx)
+{
+    modbus_loopback_t *ctx_loopback = ctx->backend_data;
+
+    ctx_loopback->tx->closed = TRUE;
+    ctx_loopback->rx->start = 0;
+    ctx_loopback->rx->end = 0;
+}
+
+static int _modbus_loopback_flush(modbus_t *ctx)
+{
+    modbus_loopback_t *ctx_loopback = ctx->backend_data;
+    _modbus_loopback_buffer_t *rx = ctx_loopback->rx;
+    int length = rx->end - rx->start;
+
+    rx->start = 0;
+    rx->end = 0;
+    if (ctx->debug && length > 0) {
+        printf("%d bytes flushed\n", length);
+    }
+
+    return length;
+}
+
+/* Nothing can be written by the peer while the caller waits in the same
+   thread so the wait is never blocking: an empty buffer is a timeout at
+   once. */
+static int _modbus_loopback_select(modbus_t *ctx, struct timeval *tv,
+                                   int length_to_read)
+{
+    modbus_loopback_t *ctx_loopback = ctx->backend_data;
+    _modbus_loopback_buffer_t *rx = ctx_loopback->rx;
+
+    if (ctx_loopback->tx->closed) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (rx->end > rx->start || rx->closed) {
+        return 1;
+    }
+
+    if (tv != NULL) {
+        tv->tv_sec = 0;
+        tv->tv_usec = 0;
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+static void _modbus_loopback_free(modbus_t *ctx)
+{
+    modbus_loopback_t *ctx_loopback = ctx->backend_data;
+    _modbus_loopback_link_t *link = ctx_loopback->link;
+
+    /* Closed for the peer */
+    ctx_loopback->tx->closed = TRUE;
+    if (--link->refs == 0) {
+        free(link);
+    }
+    free(ctx_loopback);
+    free(ctx);
+}
+
+const modbus_backend_t _modbus_loopback_backend = {
+    _MODBUS_BACKEND_TYPE_TCP,
+    _MODBUS_TCP_HEADER_LENGTH,
+    _MODBUS_TCP_CHECKSUM_LENGTH,
+    MODBUS_LOOPBACK_MAX_ADU_LENGTH,
+    _modbus_tcp_set_slave,
+    _modbus_tcp_build_request_basis,
+    _modbus_tcp_build_response_basis,
+    _modbus_tcp_prepare_response_tid,
+    _modbus_tcp_send_msg_pre,
+    _modbus_loopback_send,
+    _modbus_tcp_receive,
+    _modbus_loopback_recv,
+    _modbus_tcp_check_integrity,
+    _modbus_tcp_pre_check_confirmation,
+    _modbus_loopback_connect,
+    _modbus_loopback_close,
+    _modbus_loopback_flush,
+    _modbus_loopback_select,
+    _modbus_loopback_free
+};
+
+static modbus_t* _modbus_new_loopback(_modbus_loopback_link_t *link, int side)
+{
+    modbus_t *ctx;
+    modbus_loopback_t *ctx_loopback;
+
+    ctx = (modbus_t *) malloc(sizeof(modbus_t));
+    if (ctx == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    _modbus_init_common(ctx);
+
+    ctx->slave = MODBUS_TCP_SLAVE;
+    /* A deferred response would be waited for by spinning */
+    ctx->penalty_mode = MODBUS_PENALTY_NONE;
+
+    ctx->backend = &(_modbus_loopback_backend);
+
+    ctx->backend_data = (modbus_loopback_t *) malloc(sizeof(modbus_loopback_t));
+    if (ctx->backend_data == NULL) {
+        free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+    ctx_loopback = (modbus_loopback_t *)ctx->backend_data;
+    ctx_loopback->t_id = 0;
+    ctx_loopback->link = link;
+    ctx_loopback->rx = &link->buffers[side];
+    ctx_loopback->tx = &link->buffers[!side];
+    ctx_loopback->fragment_length = 0;
+    ctx_loopback->fragment_seed = 0;
+    link->refs++;
+
+    return ctx;
+}
+
+/* Creates a client and a server connected through buffers of the process,
+   to run the parsers and modbus_reply() without system calls.
+
+   The function shall return 0 or -1 and set errno. */
+int modbus_new_loopback_pair(modbus_t **ctx_client, modbus_t **ctx_server)
+{
+    _modbus_loopback_link_t *link;
+
+    if (ctx_client == NULL || ctx_server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    link = (_modbus_loopback_link_t *) calloc(1, sizeof(_modbus_loopback_link_t));
+    if (link == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    *ctx_client = _modbus_new_loopback(link, 0);
+    if (*ctx_client == NULL) {
+        free(link);
+        return -1;
+    }
+
+    *ctx_server = _modbus_new_loopback(link, 1);
+    if (*ctx_server == NULL) {
+        modbus_free(*ctx_client);
+        *ctx_client = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int modbus_loopback_set_fragment(modbus_t *ctx, int max_length, uint32_t seed)
+{
+    modbus_loopback_t *ctx_loopback;
+
+    if (ctx == NULL || ctx->backend != &_modbus_loopback_backend ||
+        max_length < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_loopback = ctx->backend_data;
+    ctx_loopback->fragment_length = max_length;
+    ctx_loopback->fragment_seed = seed;
+
+    return 0;
+}
+
+/* Adds bytes to read by the context as if they were sent by its peer, a
+   fuzzer gives them to the parsers without building a valid message */
+int modbus_loopback_inject(modbus_t *ctx, const uint8_t *data, int length)
+{
+    modbus_loopback_t *ctx_loopback;
+
+    if (ctx == NULL || ctx->backend != &_modbus_loopback_backend ||
+        data == NULL || length < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_loopback = ctx->backend_data;
+
+    return _loopback_write(ctx_loopback->rx, data, length);
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright © 2001-2010 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_LOOPBACK_H
+#define MODBUS_LOOPBACK_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+#define MODBUS_LOOPBACK_MAX_ADU_LENGTH  260
+
+MODBUS_API int modbus_new_loopback_pair(modbus_t **ctx_client,
+                                        modbus_t **ctx_server);
+MODBUS_API int modbus_loopback_set_fragment(modbus_t *ctx, int max_length,
+                                            uint32_t seed);
+MODBUS_API int modbus_loopback_inject(modbus_t *ctx, const uint8_t *data,
+                                      int length);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_LOOPBACK_H */
@@ -0,0 +1,459 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ *
+ * Request planner: the registers of many tags are read with as few requests as
+ * possible. Close tags are coalesced in a single block read and large tags are
+ * split in blocks of MODBUS_MAX_READ_REGISTERS.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+
+#include "modbus.h"
+#include "modbus-private.h"
+#include "modbus-plan.h"
+
+typedef struct _modbus_plan_tag {
+    int addr;
+    int nb;
+    uint16_t *dest;
+    int error;
+} modbus_plan_tag_t;
+
+typedef struct _modbus_plan_block {
+    int addr;
+    int nb;
+    /* Offset of the values in the buffer of the plan */
+    int offset;
+    int rc;
+    int error;
+} modbus_plan_block_t;
+
+struct _modbus_plan {
+    int function;
+    int max_gap;
+    modbus_plan_tag_t *tags;
+    int nb_tags;
+    int max_tags;
+    modbus_plan_block_t *blocks;
+    int nb_blocks;
+    uint16_t *buf;
+    /* The blocks must be computed again */
+    int dirty;
+};
+
+/* Range of registers used to sort the tags */
+typedef struct {
+    int start;
+    int end;
+} _plan_range_t;
+
+modbus_plan_t* modbus_plan_new(int function)
+{
+    modbus_plan_t *plan;
+
+    if (function != MODBUS_FC_READ_HOLDING_REGISTERS &&
+        function != MODBUS_FC_READ_INPUT_REGISTERS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    plan = (modbus_plan_t *) malloc(sizeof(modbus_plan_t));
+    if (plan == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(plan, 0, sizeof(modbus_plan_t));
+    plan->function = function;
+    plan->max_gap = MODBUS_PLAN_DEFAULT_MAX_GAP;
+
+    return plan;
+}
+
+void modbus_plan_free(modbus_plan_t *plan)
+{
+    if (plan == NULL)
+        return;
+
+    free(plan->tags);
+    free(plan->blocks);
+    free(plan->buf);
+    free(plan);
+}
+
+/* Adds a tag of nb registers at addr whose values are stored in dest by
+   modbus_plan_execute(). The function shall return the index of the tag or -1
+   and set errno. */
+int modbus_plan_add(modbus_plan_t *plan, int addr, int nb, uint16_t *dest)
+{
+    modbus_plan_tag_t *tag;
+
+    if (plan == NULL || dest == NULL || addr < 0 || nb < 1 ||
+        addr + nb > UINT16_MAX + 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (plan->nb_tags == plan->max_tags) {
+        int max_tags = plan->max_tags ? plan->max_tags * 2 : 16;
+        modbus_plan_tag_t *tags;
+
+        tags = realloc(plan->tags, max_tags * sizeof(modbus_plan_tag_t));
+        if (tags == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        plan->tags = tags;
+        plan->max_tags = max_tags;
+    }
+
+    tag = &plan->tags[plan->nb_tags];
+    tag->addr = addr;
+    tag->nb = nb;
+    tag->dest = dest;
+    tag->error = 0;
+    plan->dirty = TRUE;
+
+    return plan->nb_tags++;
+}
+
+/* Sets the max number of unused registers read between two tags to save a
+   request. 0 only merges adjacent or overlapping tags (for devices which
+   reject the reads of unmapped registers). A gap can't be larger than a
+   block. */
+int modbus_plan_set_max_gap(modbus_plan_t *plan, int max_gap)
+{
+    if (plan == NULL || max_gap < 0 || max_gap > MODBUS_MAX_READ_REGISTERS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    plan->max_gap = max_gap;
+    plan->dirty = TRUE;
+
+    return 0;
+}
+
+int modbus_plan_get_max_gap(modbus_plan_t *plan)
+{
+    if (plan == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return plan->max_gap;
+}
+
+static int _plan_compare_ranges(const void *a, const void *b)
+{
+    const _plan_range_t *ra = a;
+    const _plan_range_t *rb = b;
+
+    return ra->start - rb->start;
+}
+
+/* Appends the block, the blocks are allocated for the worst case */
+static void _plan_add_block(modbus_plan_t *plan, int addr, int nb, int *offset)
+{
+    modbus_plan_block_t *block = &plan->blocks[plan->nb_blocks++];
+
+    block->addr = addr;
+    block->nb = nb;
+    block->offset = *offset;
+    block->rc = 0;
+    block->error = 0;
+    *offset += nb;
+}
+
+/* Computes the block reads covering all the tags. The union of the tags is
+   covered from left to right with blocks as long as possible, a block is
+   extended over a gap between two tags when the gap isn't larger than max_gap.
+   For a given gap tolerance, this greedy covering uses the minimal number of
+   requests. */
+static int _plan_build(modbus_plan_t *plan)
+{
+    _plan_range_t *ranges;
+    int nb_ranges;
+    int max_blocks;
+    int nb_registers;
+    int block_addr = 0;
+    int block_end = 0;
+    int offset = 0;
+    int i;
+
+    free(plan->blocks);
+    free(plan->buf);
+    plan->blocks = NULL;
+    plan->buf = NULL;
+    plan->nb_blocks = 0;
+
+    if (plan->nb_tags == 0) {
+        plan->dirty = FALSE;
+        return 0;
+    }
+
+    ranges = (_plan_range_t *) malloc(plan->nb_tags * sizeof(_plan_range_t));
+    if (ranges == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < plan->nb_tags; i++) {
+        ranges[i].start = plan->tags[i].addr;
+        ranges[i].end = plan->tags[i].addr + plan->tags[i].nb;
+    }
+    qsort(ranges, plan->nb_tags, sizeof(_plan_range_t), _plan_compare_ranges);
+
+    /* Union of the overlapping or adjacent tags */
+    nb_ranges = 0;
+    max_blocks = 0;
+    nb_registers = 0;
+    for (i = 0; i < plan->nb_tags; i++) {
+        if (nb_ranges > 0 && ranges[i].start <= ranges[nb_ranges - 1].end) {
+            if (ranges[i].end > ranges[nb_ranges - 1].end)
+                ranges[nb_ranges - 1].end = ranges[i].end;
+        } else {
+            ranges[nb_ranges++] = ranges[i];
+        }
+    }
+    for (i = 0; i < nb_ranges; i++) {
+        int nb = ranges[i].end - ranges[i].start;
+
+        max_blocks += (nb + MODBUS_MAX_READ_REGISTERS - 1) /
+            MODBUS_MAX_READ_REGISTERS;
+        nb_registers += nb;
+    }
+    /* The gaps read in the blocks */
+    nb_registers += (nb_ranges - 1) * plan->max_gap;
+    if (nb_registers > max_blocks * MODBUS_MAX_READ_REGISTERS)
+        nb_registers = max_blocks * MODBUS_MAX_READ_REGISTERS;
+
+    plan->blocks = (modbus_plan_block_t *) malloc(
+        max_blocks * sizeof(modbus_plan_block_t));
+    plan->buf = (uint16_t *) malloc(nb_registers * sizeof(uint16_t));
+    if (plan->blocks == NULL || plan->buf == NULL) {
+        free(ranges);
+        free(plan->blocks);
+        free(plan->buf);
+        plan->blocks = NULL;
+        plan->buf = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (i = 0; i < nb_ranges; i++) {
+        int pos = ranges[i].start;
+
+        while (pos < ranges[i].end) {
+            int limit;
+
+            if (block_end > block_addr && pos - block_end <= plan->max_gap &&
+                pos < block_addr + MODBUS_MAX_READ_REGISTERS) {
+                /* Extends the current block over the gap */
+                limit = block_addr + MODBUS_MAX_READ_REGISTERS;
+            } else {
+                if (block_end > block_addr) {
+                    _plan_add_block(plan, block_addr, block_end - block_addr,
+                                    &offset);
+                }
+                block_addr = pos;
+                limit = pos + MODBUS_MAX_READ_REGISTERS;
+            }
+            block_end = (ranges[i].end < limit) ? ranges[i].end : limit;
+            pos = block_end;
+        }
+    }
+    _plan_add_block(plan, block_addr, block_end - block_addr, &offset);
+
+    free(ranges);
+    plan->dirty = FALSE;
+
+    return 0;
+}
+
+/* Returns the number of requests sent by modbus_plan_execute() */
+int modbus_plan_get_nb_requests(modbus_plan_t *plan)
+{
+    if (plan == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (plan->dirty && _plan_build(plan) == -1)
+        return -1;
+
+    return plan->nb_blocks;
+}
+
+static void _plan_callback(modbus_t *ctx, int rc, void *user_data)
+{
+    modbus_plan_block_t *block = user_data;
+
+    block->rc = rc;
+    block->error = (rc == -1) ? errno : 0;
+}
+
+/* Sends the requests of the blocks in flight up to the window of the context */
+static void _plan_execute_async(modbus_plan_t *plan, modbus_t *ctx)
+{
+    int i = 0;
+
+    while (i < plan->nb_blocks || modbus_async_get_pending(ctx) > 0) {
+        while (i < plan->nb_blocks) {
+            modbus_plan_block_t *block = &plan->blocks[i];
+            int rc;
+
+            if (plan->function == MODBUS_FC_READ_HOLDING_REGISTERS) {
+                rc = modbus_async_read_registers(ctx, block->addr, block->nb,
+                                                 plan->buf + block->offset,
+                                                 _plan_callback, block);
+            } else {
+                rc = modbus_async_read_input_registers(ctx, block->addr,
+                                                       block->nb,
+                                                       plan->buf + block->offset,
+                                                       _plan_callback, block);
+            }
+            if (rc == -1) {
+                if (errno == EBUSY)
+                    break;
+                block->rc = -1;
+                block->error = errno;
+            }
+            i++;
+        }
+
+        if (modbus_async_get_pending(ctx) > 0)
+            modbus_async_process(ctx, TRUE);
+    }
+}
+
+static void _plan_execute_sync(modbus_plan_t *plan, modbus_t *ctx)
+{
+    int i;
+
+    for (i = 0; i < plan->nb_blocks; i++) {
+        modbus_plan_block_t *block = &plan->blocks[i];
+
+        if (plan->function == MODBUS_FC_READ_HOLDING_REGISTERS) {
+            block->rc = modbus_read_registers(ctx, block->addr, block->nb,
+                                              plan->buf + block->offset);
+        } else {
+            block->rc = modbus_read_input_registers(ctx, block->addr, block->nb,
+                                                    plan->buf + block->offset);
+        }
+        block->error = (block->rc == -1) ? errno : 0;
+    }
+}
+
+/* Copies the values of the blocks in the tags */
+static int _plan_scatter(modbus_plan_t *plan)
+{
+    int first_error = 0;
+    int i;
+
+    for (i = 0; i < plan->nb_tags; i++) {
+        modbus_plan_tag_t *tag = &plan->tags[i];
+        int tag_end = tag->addr + tag->nb;
+        int low = 0;
+        int high = plan->nb_blocks - 1;
+        int j;
+
+        /* First block ending after the start of the tag */
+        while (low < high) {
+            int mid = (low + high) / 2;
+
+            if (plan->blocks[mid].addr + plan->blocks[mid].nb <= tag->addr)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+
+        tag->error = 0;
+        for (j = low; j < plan->nb_blocks && plan->blocks[j].addr < tag_end; j++) {
+            modbus_plan_block_t *block = &plan->blocks[j];
+            int start = (block->addr > tag->addr) ? block->addr : tag->addr;
+            int end = block->addr + block->nb;
+
+            if (end > tag_end)
+                end = tag_end;
+
+            if (block->rc == -1) {
+                if (tag->error == 0)
+                    tag->error = block->error;
+                continue;
+            }
+
+            memcpy(tag->dest + (start - tag->addr),
+                   plan->buf + block->offset + (start - block->addr),
+                   (end - start) * sizeof(uint16_t));
+        }
+
+        if (tag->error != 0 && first_error == 0)
+            first_error = tag->error;
+    }
+
+    return first_error;
+}
+
+/* Reads the registers of all the tags. The requests are pipelined when the
+   asynchronous window of the context is larger than 1.
+
+   The function shall return the number of requests sent if all the reads are
+   successful. Otherwise it shall return -1 and set errno to the first error,
+   the tags which have been read successfully are updated anyway. */
+int modbus_plan_execute(modbus_plan_t *plan, modbus_t *ctx)
+{
+    int error;
+
+    if (plan == NULL || ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (plan->dirty && _plan_build(plan) == -1)
+        return -1;
+
+    if (modbus_async_get_window(ctx) > 1) {
+        _plan_execute_async(plan, ctx);
+    } else {
+        _plan_execute_sync(plan, ctx);
+    }
+
+    error = _plan_scatter(plan);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    return plan->nb_blocks;
+}
+
+/* Returns 0 if the tag has been read by the last execution or the error
+   code */
+int modbus_plan_get_error(modbus_plan_t *plan, int tag)
+{
+    if (plan == NULL || tag < 0 || tag >= plan->nb_tags) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return plan->tags[tag].error;
+}
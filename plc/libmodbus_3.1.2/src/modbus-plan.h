@@ -0,0 +1,46 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_PLAN_H
+#define MODBUS_PLAN_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Unused registers read between two tags rather than sending one more request.
+ * The overhead of a TCP request and its response (21 bytes) is about the size
+ * of 10 registers. */
+#define MODBUS_PLAN_DEFAULT_MAX_GAP  10
+
+typedef struct _modbus_plan modbus_plan_t;
+
+MODBUS_API modbus_plan_t* modbus_plan_new(int function);
+MODBUS_API void modbus_plan_free(modbus_plan_t *plan);
+
+MODBUS_API int modbus_plan_add(modbus_plan_t *plan, int addr, int nb, uint16_t *dest);
+MODBUS_API int modbus_plan_set_max_gap(modbus_plan_t *plan, int max_gap);
+MODBUS_API int modbus_plan_get_max_gap(modbus_plan_t *plan);
+MODBUS_API int modbus_plan_get_nb_requests(modbus_plan_t *plan);
+
+MODBUS_API int modbus_plan_execute(modbus_plan_t *plan, modbus_t *ctx);
+MODBUS_API int modbus_plan_get_error(modbus_plan_t *plan, int tag);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_PLAN_H */
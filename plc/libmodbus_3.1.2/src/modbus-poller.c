@@ -0,0 +1,620 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ *
+ * Poller of many devices from a single thread: the sockets are multiplexed
+ * with epoll and the poll dates and response timeouts of all the devices are
+ * kept in a binary heap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+# include <unistd.h>
+# include <sys/socket.h>
+# include <sys/epoll.h>
+#endif
+
+#include "modbus.h"
+#include "modbus-private.h"
+#include "modbus-poller.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Max number of events handled by epoll_wait() call */
+#define _POLLER_MAX_EVENTS 256
+
+typedef struct _modbus_poller_device {
+    modbus_poller_t *poller;
+    int id;
+    modbus_t *ctx;
+    int function;
+    int addr;
+    int nb;
+    void *dest;
+    int64_t interval;
+    modbus_poller_callback_t callback;
+    void *user_data;
+    /* Socket registered in epoll or -1 */
+    int fd;
+    int connecting;
+    int in_flight;
+    int removed;
+    /* The last request has timed out, the connection is closed */
+    int timed_out;
+    /* Scheduled date of the next poll */
+    int64_t next_poll;
+    /* Key in the heap: next poll or response deadline when in flight */
+    int64_t date;
+    int heap_index;
+} modbus_poller_device_t;
+
+struct _modbus_poller {
+    int epfd;
+    modbus_poller_device_t **devices;
+    int nb_devices;
+    modbus_poller_device_t **heap;
+    int heap_size;
+    int dispatching;
+    int nb_removed;
+    int nb_completed;
+};
+
+/* Binary min-heap on the date of the devices */
+
+static void _heap_set(modbus_poller_t *poller, int i, modbus_poller_device_t *dev)
+{
+    poller->heap[i] = dev;
+    dev->heap_index = i;
+}
+
+static void _heap_up(modbus_poller_t *poller, int i)
+{
+    modbus_poller_device_t *dev = poller->heap[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (poller->heap[parent]->date <= dev->date)
+            break;
+        _heap_set(poller, i, poller->heap[parent]);
+        i = parent;
+    }
+    _heap_set(poller, i, dev);
+}
+
+static void _heap_down(modbus_poller_t *poller, int i)
+{
+    modbus_poller_device_t *dev = poller->heap[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+
+        if (child >= poller->heap_size)
+            break;
+        if (child + 1 < poller->heap_size &&
+            poller->heap[child + 1]->date < poller->heap[child]->date)
+            child++;
+        if (dev->date <= poller->heap[child]->date)
+            break;
+        _heap_set(poller, i, poller->heap[child]);
+        i = child;
+    }
+    _heap_set(poller, i, dev);
+}
+
+static void _heap_push(modbus_poller_t *poller, modbus_poller_device_t *dev)
+{
+    _heap_set(poller, poller->heap_size++, dev);
+    _heap_up(poller, dev->heap_index);
+}
+
+static void _heap_remove(modbus_poller_t *poller, modbus_poller_device_t *dev)
+{
+    int i = dev->heap_index;
+
+    if (i == -1)
+        return;
+
+    dev->heap_index = -1;
+    poller->heap_size--;
+    if (i < poller->heap_size) {
+        _heap_set(poller, i, poller->heap[poller->heap_size]);
+        _heap_up(poller, i);
+        _heap_down(poller, poller->heap[i]->heap_index);
+    }
+}
+
+static void _heap_update(modbus_poller_t *poller, modbus_poller_device_t *dev,
+                         int64_t date)
+{
+    dev->date = date;
+    if (dev->heap_index != -1) {
+        _heap_up(poller, dev->heap_index);
+        _heap_down(poller, dev->heap_index);
+    }
+}
+
+static void _device_disconnect(modbus_poller_device_t *dev)
+{
+    if (dev->fd != -1) {
+        epoll_ctl(dev->poller->epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+        dev->fd = -1;
+    }
+    dev->connecting = FALSE;
+    modbus_close(dev->ctx);
+}
+
+static void _device_free(modbus_poller_device_t *dev)
+{
+    _device_disconnect(dev);
+    modbus_free(dev->ctx);
+    free(dev);
+}
+
+/* Schedules the next poll then reports the result of the poll */
+static void _device_done(modbus_poller_device_t *dev, int rc, int error)
+{
+    modbus_poller_t *poller = dev->poller;
+    int64_t now = _modbus_now_us();
+
+    dev->in_flight = FALSE;
+    dev->next_poll += dev->interval;
+    if (dev->next_poll <= now) {
+        /* Late, the missed polls are skipped */
+        dev->next_poll = now + dev->interval;
+    }
+    _heap_update(poller, dev, dev->next_poll);
+    poller->nb_completed++;
+
+    if (dev->callback != NULL) {
+        errno = error;
+        dev->callback(poller, dev->id, dev->ctx, rc, dev->user_data);
+    }
+}
+
+static void _async_callback(modbus_t *ctx, int rc, void *user_data)
+{
+    modbus_poller_device_t *dev = (modbus_poller_device_t *)user_data;
+
+    if (rc == -1 && errno == ETIMEDOUT)
+        dev->timed_out = TRUE;
+    _device_done(dev, rc, errno);
+}
+
+static int64_t _device_timeout(modbus_poller_device_t *dev)
+{
+    return (int64_t)dev->ctx->response_timeout.tv_sec * 1000000 +
+        dev->ctx->response_timeout.tv_usec;
+}
+
+/* Starts the connection, the context is in MODBUS_WAIT_NONE mode so TCP
+   connections are established in the background (the socket becomes
+   writable). The socket of a context added connected is used as is. */
+static int _device_connect(modbus_poller_device_t *dev)
+{
+    struct epoll_event ev;
+
+    if (modbus_get_socket(dev->ctx) == -1 && modbus_connect(dev->ctx) == -1) {
+        if (errno != EINPROGRESS || modbus_get_socket(dev->ctx) == -1)
+            return -1;
+        dev->connecting = TRUE;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = dev->connecting ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = dev;
+    dev->fd = modbus_get_socket(dev->ctx);
+    if (epoll_ctl(dev->poller->epfd, EPOLL_CTL_ADD, dev->fd, &ev) == -1) {
+        int saved_errno = errno;
+
+        dev->fd = -1;
+        dev->connecting = FALSE;
+        modbus_close(dev->ctx);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _device_send(modbus_poller_device_t *dev)
+{
+    switch (dev->function) {
+    case MODBUS_FC_READ_COILS:
+        return modbus_async_read_bits(dev->ctx, dev->addr, dev->nb, dev->dest,
+                                      _async_callback, dev);
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+        return modbus_async_read_input_bits(dev->ctx, dev->addr, dev->nb,
+                                            dev->dest, _async_callback, dev);
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+        return modbus_async_read_registers(dev->ctx, dev->addr, dev->nb,
+                                           dev->dest, _async_callback, dev);
+    default:
+        return modbus_async_read_input_registers(dev->ctx, dev->addr, dev->nb,
+                                                 dev->dest, _async_callback, dev);
+    }
+}
+
+/* Reads the responses of the device, a connection error or a response timeout
+   closes the connection (the device is connected again at the next poll), a
+   silent device may have lost the connection without closing it */
+static void _device_process(modbus_poller_device_t *dev)
+{
+    if ((modbus_async_process(dev->ctx, FALSE) == -1 || dev->timed_out) &&
+        !dev->removed) {
+        _device_disconnect(dev);
+    }
+    dev->timed_out = FALSE;
+}
+
+/* Sends the read request of the connected device */
+static void _device_request(modbus_poller_device_t *dev, int64_t now)
+{
+    if (_device_send(dev) == -1) {
+        int saved_errno = errno;
+
+        _device_disconnect(dev);
+        _device_done(dev, -1, saved_errno);
+        return;
+    }
+
+    dev->in_flight = TRUE;
+    _heap_update(dev->poller, dev, now + _device_timeout(dev));
+}
+
+/* The socket of the connecting device is writable */
+static void _device_connected(modbus_poller_device_t *dev)
+{
+    struct epoll_event ev;
+    int optval = 0;
+    socklen_t optlen = sizeof(optval);
+
+    if (getsockopt(dev->fd, SOL_SOCKET, SO_ERROR, (void *)&optval,
+                   &optlen) == -1 || optval != 0) {
+        _device_disconnect(dev);
+        _device_done(dev, -1, optval ? optval : ECONNREFUSED);
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = dev;
+    if (epoll_ctl(dev->poller->epfd, EPOLL_CTL_MOD, dev->fd, &ev) == -1) {
+        int saved_errno = errno;
+
+        _device_disconnect(dev);
+        _device_done(dev, -1, saved_errno);
+        return;
+    }
+    dev->connecting = FALSE;
+
+    _device_request(dev, _modbus_now_us());
+}
+
+/* The date of the device is due */
+static void _device_poll(modbus_poller_device_t *dev, int64_t now)
+{
+    if (dev->in_flight) {
+        /* Response timeout, the request is completed by the async layer */
+        _device_process(dev);
+        if (dev->in_flight && !dev->removed) {
+            _heap_update(dev->poller, dev, now + 1000);
+        }
+        return;
+    }
+
+    if (dev->connecting) {
+        /* Connection timeout */
+        _device_disconnect(dev);
+        _device_done(dev, -1, ETIMEDOUT);
+        return;
+    }
+
+    if (dev->fd == -1) {
+        if (_device_connect(dev) == -1) {
+            _device_done(dev, -1, errno);
+            return;
+        }
+
+        if (dev->connecting) {
+            _heap_update(dev->poller, dev, now + _device_timeout(dev));
+            return;
+        }
+    }
+
+    _device_request(dev, now);
+}
+
+static void _poller_run_timers(modbus_poller_t *poller)
+{
+    int64_t now = _modbus_now_us();
+
+    while (poller->heap_size > 0 && poller->heap[0]->date <= now) {
+        _device_poll(poller->heap[0], now);
+    }
+}
+
+modbus_poller_t* modbus_poller_new(void)
+{
+    modbus_poller_t *poller;
+
+    poller = (modbus_poller_t *) malloc(sizeof(modbus_poller_t));
+    if (poller == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(poller, 0, sizeof(modbus_poller_t));
+
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epfd == -1) {
+        free(poller);
+        return NULL;
+    }
+
+    return poller;
+}
+
+void modbus_poller_free(modbus_poller_t *poller)
+{
+    int i;
+
+    if (poller == NULL)
+        return;
+
+    for (i = 0; i < poller->nb_devices; i++) {
+        if (poller->devices[i] != NULL)
+            _device_free(poller->devices[i]);
+    }
+    close(poller->epfd);
+    free(poller->devices);
+    free(poller->heap);
+    free(poller);
+}
+
+/* Adds a device polled every interval_ms with a read request (function 0x01 to
+   0x04) and takes the ownership of the context. The connection is established
+   at the first poll and after each connection error.
+
+   The function shall return the ID of the device in the poller or -1 and set
+   errno. */
+int modbus_poller_add(modbus_poller_t *poller, modbus_t *ctx,
+                      int function, int addr, int nb, void *dest,
+                      uint32_t interval_ms,
+                      modbus_poller_callback_t callback, void *user_data)
+{
+    modbus_poller_device_t *dev;
+    int id;
+
+    if (poller == NULL || ctx == NULL || dest == NULL || interval_ms == 0 ||
+        function < MODBUS_FC_READ_COILS ||
+        function > MODBUS_FC_READ_INPUT_REGISTERS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (id = 0; id < poller->nb_devices; id++) {
+        if (poller->devices[id] == NULL)
+            break;
+    }
+
+    if (id == poller->nb_devices) {
+        int nb_devices = poller->nb_devices ? poller->nb_devices * 2 : 16;
+        modbus_poller_device_t **devices;
+        modbus_poller_device_t **heap;
+
+        devices = realloc(poller->devices,
+                          nb_devices * sizeof(modbus_poller_device_t *));
+        if (devices == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        poller->devices = devices;
+
+        heap = realloc(poller->heap,
+                       nb_devices * sizeof(modbus_poller_device_t *));
+        if (heap == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        poller->heap = heap;
+
+        memset(poller->devices + poller->nb_devices, 0,
+               (nb_devices - poller->nb_devices) *
+               sizeof(modbus_poller_device_t *));
+        poller->nb_devices = nb_devices;
+    }
+
+    dev = (modbus_poller_device_t *) malloc(sizeof(modbus_poller_device_t));
+    if (dev == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    dev->poller = poller;
+    dev->id = id;
+    dev->ctx = ctx;
+    dev->function = function;
+    dev->addr = addr;
+    dev->nb = nb;
+    dev->dest = dest;
+    dev->interval = (int64_t)interval_ms * 1000;
+    dev->callback = callback;
+    dev->user_data = user_data;
+    dev->fd = -1;
+    dev->connecting = FALSE;
+    dev->in_flight = FALSE;
+    dev->removed = FALSE;
+    dev->timed_out = FALSE;
+    /* First poll as soon as possible */
+    dev->next_poll = _modbus_now_us();
+    dev->date = dev->next_poll;
+    dev->heap_index = -1;
+
+    /* The poller never waits for a connection or a response */
+    modbus_set_wait_mode(ctx, MODBUS_WAIT_NONE);
+
+    poller->devices[id] = dev;
+    _heap_push(poller, dev);
+
+    return id;
+}
+
+/* Removes the device, closes and frees its context */
+int modbus_poller_remove(modbus_poller_t *poller, int id)
+{
+    modbus_poller_device_t *dev;
+
+    if (poller == NULL || id < 0 || id >= poller->nb_devices ||
+        poller->devices[id] == NULL || poller->devices[id]->removed) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    dev = poller->devices[id];
+    _heap_remove(poller, dev);
+
+    if (poller->dispatching) {
+        /* The device may be in use by the caller of the callback */
+        dev->removed = TRUE;
+        poller->nb_removed++;
+    } else {
+        poller->devices[id] = NULL;
+        _device_free(dev);
+    }
+
+    return 0;
+}
+
+/* Waits for responses or due polls during timeout_ms at most (-1 to wait
+   forever) and processes them.
+
+   The function shall return the number of completed polls or -1 and set
+   errno. */
+int modbus_poller_process(modbus_poller_t *poller, int timeout_ms)
+{
+    struct epoll_event events[_POLLER_MAX_EVENTS];
+    int nb_events;
+    int wait_ms;
+    int i;
+
+    if (poller == NULL || poller->dispatching) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    poller->dispatching = TRUE;
+    poller->nb_completed = 0;
+
+    _poller_run_timers(poller);
+
+    if (poller->nb_completed > 0) {
+        wait_ms = 0;
+    } else {
+        wait_ms = timeout_ms;
+        if (poller->heap_size > 0) {
+            int64_t delay = poller->heap[0]->date - _modbus_now_us();
+            int delay_ms = (delay > 0) ? (int)((delay + 999) / 1000) : 0;
+
+            if (wait_ms < 0 || delay_ms < wait_ms)
+                wait_ms = delay_ms;
+        }
+    }
+
+    nb_events = epoll_wait(poller->epfd, events, _POLLER_MAX_EVENTS, wait_ms);
+    if (nb_events == -1) {
+        if (errno != EINTR) {
+            poller->dispatching = FALSE;
+            return -1;
+        }
+        nb_events = 0;
+    }
+
+    for (i = 0; i < nb_events; i++) {
+        modbus_poller_device_t *dev = events[i].data.ptr;
+
+        if (dev->removed)
+            continue;
+
+        if (dev->connecting) {
+            _device_connected(dev);
+        } else if (dev->in_flight) {
+            _device_process(dev);
+        } else {
+            /* Unsolicited data or end of connection */
+            _device_disconnect(dev);
+        }
+    }
+
+    _poller_run_timers(poller);
+
+    poller->dispatching = FALSE;
+
+    if (poller->nb_removed > 0) {
+        for (i = 0; i < poller->nb_devices; i++) {
+            modbus_poller_device_t *dev = poller->devices[i];
+
+            if (dev != NULL && dev->removed) {
+                poller->devices[i] = NULL;
+                _device_free(dev);
+            }
+        }
+        poller->nb_removed = 0;
+    }
+
+    return poller->nb_completed;
+}
+
+#else
+
+modbus_poller_t* modbus_poller_new(void)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void modbus_poller_free(modbus_poller_t *poller)
+{
+}
+
+int modbus_poller_add(modbus_poller_t *poller, modbus_t *ctx,
+                      int function, int addr, int nb, void *dest,
+                      uint32_t interval_ms,
+                      modbus_poller_callback_t callback, void *user_data)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int modbus_poller_remove(modbus_poller_t *poller, int id)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int modbus_poller_process(modbus_poller_t *poller, int timeout_ms)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
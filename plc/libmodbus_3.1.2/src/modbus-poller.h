@@ -0,0 +1,47 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_POLLER_H
+#define MODBUS_POLLER_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+typedef struct _modbus_poller modbus_poller_t;
+
+/* Called after each poll of a device with the value returned by the matching
+ * read function (number of values read or -1 with errno set) */
+typedef void (*modbus_poller_callback_t)(modbus_poller_t *poller, int id,
+                                         modbus_t *ctx, int rc, void *user_data);
+
+MODBUS_API modbus_poller_t* modbus_poller_new(void);
+MODBUS_API void modbus_poller_free(modbus_poller_t *poller);
+
+MODBUS_API int modbus_poller_add(modbus_poller_t *poller, modbus_t *ctx,
+                                 int function, int addr, int nb, void *dest,
+                                 uint32_t interval_ms,
+                                 modbus_poller_callback_t callback,
+                                 void *user_data);
+MODBUS_API int modbus_poller_remove(modbus_poller_t *poller, int id);
+
+MODBUS_API int modbus_poller_process(modbus_poller_t *poller, int timeout_ms);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_POLLER_H */
@@ -47,6 +47,11 @@ MODBUS_BEGIN_DECLS
 
 #define _MODBUS_EXCEPTION_RSP_LENGTH 5
 
+/* Exception responses deferred by the penalty of a connection at most, the
+   longest one has a MBAP header */
+#define _MODBUS_MAX_DEFERRED 8
+#define _MODBUS_DEFERRED_RSP_LENGTH 12
+
 /* Timeouts in microsecond (0.5 s) */
 #define _RESPONSE_TIMEOUT    500000
 #define _BYTE_TIMEOUT        500000
@@ -97,7 +102,7 @@ typedef struct _modbus_backend {
     int (*connect) (modbus_t *ctx);
     void (*close) (modbus_t *ctx);
     int (*flush) (modbus_t *ctx);
-    int (*select) (modbus_t *ctx, fd_set *rset, struct timeval *tv, int msg_length);
+    int (*select) (modbus_t *ctx, struct timeval *tv, int msg_length);
     void (*free) (modbus_t *ctx);
 } modbus_backend_t;
 
@@ -110,13 +115,152 @@ struct _modbus {
     int error_recovery;
     struct timeval response_timeout;
     struct timeval byte_timeout;
+    int wait_mode;
+    int penalty_mode;
+    /* Exception responses delayed by the penalty, per connection */
+    struct _modbus_deferred_conn *deferred;
+    int nb_deferred_conns;
+    int max_deferred_conns;
+    /* Number of deferred responses of all the connections */
+    int nb_deferred;
+    /* Number of flushes of the data received during a penalty (RTU) */
+    int nb_penalty_flushes;
+    /* Handlers of modbus_reply() indexed by function code (allocated on
+       demand), an entry without reply() falls back to the built-in handler */
+    modbus_handler_t *handlers;
     const modbus_backend_t *backend;
     void *backend_data;
+    /* Requests in flight of the asynchronous API (allocated on demand) */
+    struct _modbus_async *async;
+    /* Ring of the pcapng trace or NULL */
+    struct _modbus_trace_ring *trace;
+    /* Router of the requests to the units or NULL */
+    struct _modbus_router *router;
+    /* Options of the TCP sockets (allocated on demand) */
+    modbus_tcp_profile_t *tcp_profile;
+    /* Built by a modbus_init_*() function in the storage of the caller, the
+       context and the backend data aren't freed */
+    int in_storage;
 };
 
+/* Arena of a mapping (see modbus_mapping_new_ext), the flag is set in the
+   reserved bits of the mapping flags */
+#define _MODBUS_MAPPING_ARENA  (1 << 16)
+
+/* Flags of a mapping set by modbus_mapping_new_ext() and co, the other values
+   (a mapping filled by the application without zeroing flags) are taken for
+   0, the layout of libmodbus 3.1.2 */
+#define _MAPPING_FLAGS_PUBLIC \
+    (MODBUS_MAPPING_PACKED_BITS | MODBUS_MAPPING_HUGE_PAGES | \
+     MODBUS_MAPPING_SPARSE | MODBUS_MAPPING_THREAD_SAFE)
+#define _MAPPING_FLAGS(mb_mapping) \
+    ((((mb_mapping)->flags & ~_MAPPING_FLAGS_PUBLIC) == _MODBUS_MAPPING_ARENA) ? \
+     (mb_mapping)->flags : 0)
+#define _CACHE_LINE_SIZE       64
+#define _CACHE_LINE_ALIGN(size) \
+    (((size) + _CACHE_LINE_SIZE - 1) & ~(size_t)(_CACHE_LINE_SIZE - 1))
+#define _HUGE_PAGE_SIZE        (2 * 1024 * 1024)
+
+enum {
+    _ARENA_MALLOC = 0,
+    _ARENA_MMAP,
+    _ARENA_CALLER
+};
+
+/* The tables and their stripes */
+#define _ARENA_NB_SEGMENTS     8
+
+/* Values of a table protected by a stripe (MODBUS_MAPPING_THREAD_SAFE) */
+#define _STRIPE_SHIFT          6
+#define _NB_STRIPES(nb) \
+    (((size_t)(nb) + (1 << _STRIPE_SHIFT) - 1) >> _STRIPE_SHIFT)
+
+/* Sequence lock of a stripe, odd while a writer holds it. Each stripe has its
+   own cache line to not share it between the writers of two stripes. */
+typedef struct {
+    uint32_t seq;
+    uint8_t padding[_CACHE_LINE_SIZE - sizeof(uint32_t)];
+} _modbus_stripe_t;
+
+typedef struct _modbus_sparse modbus_sparse_t;
+
+typedef struct {
+    /* First to share the address of the arena */
+    modbus_mapping_t mapping;
+    size_t size;
+    int kind;
+    /* Pages of a sparse mapping (MODBUS_MAPPING_SPARSE) */
+    modbus_sparse_t *sparse;
+    /* Stripes of the tables (MODBUS_MAPPING_THREAD_SAFE) */
+    _modbus_stripe_t *stripes[4];
+} _modbus_arena_t;
+
+#define _MAPPING_SPARSE(mb_mapping) (((_modbus_arena_t *)(mb_mapping))->sparse)
+#define _MAPPING_STRIPES(mb_mapping, table) \
+    (((_modbus_arena_t *)(mb_mapping))->stripes[table])
+
+/* Size of the storage of a context followed by its backend data */
+#define _MODBUS_STORAGE_SIZE(backend_data_size) \
+    (((sizeof(modbus_t) + 15) & ~(size_t)15) + (backend_data_size))
+
 void _modbus_init_common(modbus_t *ctx);
+modbus_t *_modbus_init_storage(void *storage, size_t size,
+                               size_t backend_data_size);
 void _error_print(modbus_t *ctx, const char *context);
 int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type);
+int _modbus_receive_msg_mode(modbus_t *ctx, uint8_t *msg,
+                             msg_type_t msg_type, int wait_mode);
+int _modbus_send_msg(modbus_t *ctx, uint8_t *msg, int msg_length);
+int _modbus_check_confirmation(modbus_t *ctx, uint8_t *req,
+                               uint8_t *rsp, int rsp_length);
+uint8_t _modbus_compute_meta_length_after_function(
+    const modbus_handler_t *handlers, int function, msg_type_t msg_type);
+int _modbus_compute_data_length_after_meta(const modbus_handler_t *handlers,
+                                           const uint8_t *pdu,
+                                           msg_type_t msg_type);
+int _modbus_set_handler(modbus_handler_t **handlers, int function,
+                        const modbus_handler_t *handler);
+int _modbus_reply(modbus_t *ctx, const modbus_handler_t *handlers,
+                  const uint8_t *req, int req_length,
+                  modbus_mapping_t *mb_mapping);
+int _modbus_set_file_provider(modbus_handler_t **handlers,
+                              const modbus_file_provider_t *provider);
+int _modbus_router_reply(modbus_t *ctx, const uint8_t *req, int req_length);
+int _modbus_router_has_unit(struct _modbus_router *router, int unit_id);
+const modbus_handler_t *_modbus_router_handlers(modbus_t *ctx, int unit_id);
+void _modbus_async_free(modbus_t *ctx);
+void _modbus_trace_record(struct _modbus_trace_ring *ring, int sent,
+                          const uint8_t *msg, int msg_length);
+void _modbus_trace_detach(modbus_t *ctx);
+int64_t _modbus_now_us(void);
+void _modbus_set_registers_be(uint8_t *dest, const uint16_t *src, int nb);
+void _modbus_get_registers_be(uint16_t *dest, const uint8_t *src, int nb);
+void _modbus_pack_bits(uint8_t *dest, const uint8_t *src, int nb);
+void _modbus_unpack_bits(uint8_t *dest, const uint8_t *src, int nb);
+void _modbus_get_bits_packed(uint8_t *dest, const uint8_t *bitset, int idx,
+                             int nb);
+void _modbus_set_bits_packed(uint8_t *bitset, int idx, int nb,
+                             const uint8_t *src);
+uint16_t _modbus_crc16(const uint8_t *buffer, size_t length);
+#ifndef _WIN32
+int _modbus_poll_fd(modbus_t *ctx, int fd, short events, struct timeval *tv);
+#endif
+
+modbus_sparse_t* _modbus_sparse_new(void);
+void _modbus_sparse_free(modbus_sparse_t *sparse);
+int _modbus_sparse_add_range(modbus_sparse_t *sparse, int table, int address,
+                             int nb);
+int _modbus_sparse_check(modbus_sparse_t *sparse, int table, int address,
+                         int nb);
+void* _modbus_sparse_value(modbus_sparse_t *sparse, int table, int address);
+void _modbus_sparse_get_bits(modbus_sparse_t *sparse, int table, int address,
+                             int nb, uint8_t *dest);
+void _modbus_sparse_set_bits(modbus_sparse_t *sparse, int table, int address,
+                             int nb, const uint8_t *src);
+void _modbus_sparse_get_registers(modbus_sparse_t *sparse, int table,
+                                  int address, int nb, uint8_t *dest);
+void _modbus_sparse_set_registers(modbus_sparse_t *sparse, int table,
+                                  int address, int nb, const uint8_t *src);
 
 #ifndef HAVE_STRLCPY
 size_t strlcpy(char *dest, const char *src, size_t dest_size);
@@ -0,0 +1,248 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ *
+ * Router of the requests of a server to the units: the unit ID of a request
+ * indexes a table of the units, each one with its mapping, its handlers and
+ * optionally its lock, so a context serves many slaves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include "modbus.h"
+#include "modbus-private.h"
+#include "modbus-router.h"
+
+/* Addresses of the serial slaves, the unit MODBUS_TCP_SLAVE (0xFF) is also
+   accepted for the TCP clients */
+#define _ROUTER_MAX_UNIT 247
+
+typedef struct {
+    modbus_mapping_t *mb_mapping;
+    /* Handlers of the unit indexed by function code (allocated on demand)
+       replacing the ones of the context, NULL to use the ones of the
+       context */
+    modbus_handler_t *handlers;
+    int flags;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t mutex;
+#endif
+} _router_unit_t;
+
+struct _modbus_router {
+    /* Indexed by unit ID */
+    _router_unit_t *units[256];
+};
+
+static int _router_check_unit(int unit_id)
+{
+    return (unit_id >= 0 && unit_id <= _ROUTER_MAX_UNIT) ||
+        unit_id == MODBUS_TCP_SLAVE;
+}
+
+static void _router_free_unit(_router_unit_t *unit)
+{
+#ifdef HAVE_PTHREAD_H
+    if (unit->flags & MODBUS_ROUTER_LOCK)
+        pthread_mutex_destroy(&unit->mutex);
+#endif
+    free(unit->handlers);
+    free(unit);
+}
+
+modbus_router_t* modbus_router_new(void)
+{
+    modbus_router_t *router;
+
+    router = (modbus_router_t *) calloc(1, sizeof(modbus_router_t));
+    if (router == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return router;
+}
+
+/* Frees the router and its units, the mappings are left to the caller */
+void modbus_router_free(modbus_router_t *router)
+{
+    int i;
+
+    if (router == NULL)
+        return;
+
+    for (i = 0; i < 256; i++) {
+        if (router->units[i] != NULL)
+            _router_free_unit(router->units[i]);
+    }
+    free(router);
+}
+
+/* Routes the requests of the unit to the mapping, the units are added before
+   the router serves requests */
+int modbus_router_add_unit(modbus_router_t *router, int unit_id,
+                           modbus_mapping_t *mb_mapping, int flags)
+{
+    _router_unit_t *unit;
+
+    if (router == NULL || !_router_check_unit(unit_id) ||
+        (flags & ~MODBUS_ROUTER_LOCK)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (router->units[unit_id] != NULL) {
+        errno = EEXIST;
+        return -1;
+    }
+
+#ifndef HAVE_PTHREAD_H
+    if (flags & MODBUS_ROUTER_LOCK) {
+        errno = ENOSYS;
+        return -1;
+    }
+#endif
+
+    unit = (_router_unit_t *) malloc(sizeof(_router_unit_t));
+    if (unit == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    unit->mb_mapping = mb_mapping;
+    unit->handlers = NULL;
+    unit->flags = flags;
+#ifdef HAVE_PTHREAD_H
+    if (flags & MODBUS_ROUTER_LOCK)
+        pthread_mutex_init(&unit->mutex, NULL);
+#endif
+    router->units[unit_id] = unit;
+
+    return 0;
+}
+
+int modbus_router_remove_unit(modbus_router_t *router, int unit_id)
+{
+    if (router == NULL || !_router_check_unit(unit_id) ||
+        router->units[unit_id] == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _router_free_unit(router->units[unit_id]);
+    router->units[unit_id] = NULL;
+
+    return 0;
+}
+
+/* Registers the handler of a function code for the unit only, see
+   modbus_set_handler() */
+int modbus_router_set_handler(modbus_router_t *router, int unit_id,
+                              int function, const modbus_handler_t *handler)
+{
+    if (router == NULL || !_router_check_unit(unit_id) ||
+        router->units[unit_id] == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return _modbus_set_handler(&router->units[unit_id]->handlers, function,
+                               handler);
+}
+
+/* Serves the file records of the unit with the provider, see
+   modbus_set_file_provider() */
+int modbus_router_set_file_provider(modbus_router_t *router, int unit_id,
+                                    const modbus_file_provider_t *provider)
+{
+    if (router == NULL || !_router_check_unit(unit_id) ||
+        router->units[unit_id] == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return _modbus_set_file_provider(&router->units[unit_id]->handlers,
+                                     provider);
+}
+
+/* Serves the units of the router with the context, modbus_reply() ignores its
+   mapping. NULL detaches the router. */
+int modbus_set_router(modbus_t *ctx, modbus_router_t *router)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->router = router;
+
+    return 0;
+}
+
+int _modbus_router_has_unit(modbus_router_t *router, int unit_id)
+{
+    return router->units[unit_id] != NULL;
+}
+
+/* Handlers giving the lengths of the requests of the unit */
+const modbus_handler_t *_modbus_router_handlers(modbus_t *ctx, int unit_id)
+{
+    _router_unit_t *unit = ctx->router->units[unit_id];
+
+    return (unit != NULL && unit->handlers != NULL) ?
+        unit->handlers : ctx->handlers;
+}
+
+/* Replies with the mapping and the handlers of the unit of the request. A
+   request to an unknown unit is ignored on a serial line and rejected with
+   the gateway path exception otherwise. */
+int _modbus_router_reply(modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    _router_unit_t *unit = ctx->router->units[req[ctx->backend->header_length - 1]];
+    int rc;
+
+    if (unit == NULL) {
+        if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU)
+            return 0;
+        return modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_GATEWAY_PATH);
+    }
+
+#ifdef HAVE_PTHREAD_H
+    if (unit->flags & MODBUS_ROUTER_LOCK) {
+        pthread_mutex_lock(&unit->mutex);
+        rc = _modbus_reply(ctx, unit->handlers != NULL ?
+                           unit->handlers : ctx->handlers,
+                           req, req_length, unit->mb_mapping);
+        pthread_mutex_unlock(&unit->mutex);
+        return rc;
+    }
+#endif
+
+    rc = _modbus_reply(ctx, unit->handlers != NULL ?
+                       unit->handlers : ctx->handlers,
+                       req, req_length, unit->mb_mapping);
+
+    return rc;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_ROUTER_H
+#define MODBUS_ROUTER_H
+
+#include "modbus.h"
+#include "modbus-file.h"
+
+MODBUS_BEGIN_DECLS
+
+/* The requests of a unit are replied under a lock of the unit, for the
+ * servers sharing a router between threads */
+#define MODBUS_ROUTER_LOCK  (1 << 0)
+
+typedef struct _modbus_router modbus_router_t;
+
+MODBUS_API modbus_router_t* modbus_router_new(void);
+MODBUS_API void modbus_router_free(modbus_router_t *router);
+
+MODBUS_API int modbus_router_add_unit(modbus_router_t *router, int unit_id,
+                                      modbus_mapping_t *mb_mapping, int flags);
+MODBUS_API int modbus_router_remove_unit(modbus_router_t *router, int unit_id);
+MODBUS_API int modbus_router_set_handler(modbus_router_t *router, int unit_id,
+                                         int function,
+                                         const modbus_handler_t *handler);
+MODBUS_API int modbus_router_set_file_provider(
+    modbus_router_t *router, int unit_id,
+    const modbus_file_provider_t *provider);
+
+MODBUS_API int modbus_set_router(modbus_t *ctx, modbus_router_t *router);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_ROUTER_H */
@@ -0,0 +1,773 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ *
+ * Framer of the RTU lines: the serial ports of many lines are multiplexed with
+ * epoll and the silences of the protocol are measured by a timer (timerfd) per
+ * line rather than by byte timeouts:
+ * - a silence of 1.5 character after a byte ends the bytes of the frame, a byte
+ *   received later and before 3.5 characters rejects the frame;
+ * - a silence of 3.5 characters ends the frame and a frame is sent 3.5
+ *   characters after the end of the previous one at the earliest.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+# include <unistd.h>
+# include <poll.h>
+# include <sys/epoll.h>
+# include <sys/timerfd.h>
+#endif
+
+#include "modbus.h"
+#include "modbus-private.h"
+#include "modbus-rtu-private.h"
+#include "modbus-rtu-framer.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+
+/* Max number of events handled by epoll_wait() call */
+#define _FRAMER_MAX_EVENTS 64
+
+/* Silences of the baud rates above 19200 bauds (fixed by the specification) */
+#define _FRAMER_T15_FAST   750
+#define _FRAMER_T35_FAST  1750
+
+typedef enum {
+    /* Silence of 3.5 characters at least */
+    _LINE_IDLE,
+    /* Bytes of a frame, timer at 1.5 character after the last one */
+    _LINE_RECEIVING,
+    /* Silence of 1.5 character, timer at 3.5 characters after the last byte */
+    _LINE_END,
+    /* Rejected frame, timer at 3.5 characters after the last byte */
+    _LINE_DISCARD,
+    /* RTS switched before sending, timer at the end of the switch */
+    _LINE_RTS_ON,
+    /* Frame sent with RTS, timer at the end of the transmission */
+    _LINE_RTS_SENDING
+} _line_state_t;
+
+typedef struct _modbus_rtu_framer_line modbus_rtu_framer_line_t;
+
+/* Data of an epoll event */
+typedef struct {
+    modbus_rtu_framer_line_t *line;
+    int is_timer;
+} _framer_source_t;
+
+struct _modbus_rtu_framer_line {
+    modbus_rtu_framer_t *framer;
+    int id;
+    modbus_t *ctx;
+    modbus_rtu_framer_callback_t callback;
+    void *user_data;
+    int timer_fd;
+    _framer_source_t serial_source;
+    _framer_source_t timer_source;
+    /* Durations in microseconds */
+    int64_t char_time;
+    int64_t t15;
+    int64_t t35;
+    _line_state_t state;
+    /* Date of the last received byte */
+    int64_t last_byte;
+    /* Date from which a frame can be sent */
+    int64_t free_date;
+    /* Frame in progress and error rejecting it */
+    uint8_t rx[MODBUS_RTU_MAX_ADU_LENGTH];
+    int rx_length;
+    int rx_error;
+    /* Frame waiting for the silence of the line */
+    uint8_t tx[MODBUS_RTU_MAX_ADU_LENGTH];
+    int tx_length;
+    int removed;
+};
+
+struct _modbus_rtu_framer {
+    int epfd;
+    modbus_rtu_framer_line_t **lines;
+    int nb_lines;
+    int dispatching;
+    int nb_removed;
+    int nb_frames;
+};
+
+static void _line_arm(modbus_rtu_framer_line_t *line, int64_t date)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    /* A null date would disarm the timer */
+    if (date <= 0)
+        date = 1;
+    its.it_value.tv_sec = date / 1000000;
+    its.it_value.tv_nsec = (date % 1000000) * 1000;
+    timerfd_settime(line->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void _line_disarm(modbus_rtu_framer_line_t *line)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(line->timer_fd, 0, &its, NULL);
+}
+
+static void _line_report(modbus_rtu_framer_line_t *line, const uint8_t *frame,
+                         int length, int error)
+{
+    if (line->callback != NULL) {
+        errno = error;
+        line->callback(line->framer, line->id, line->ctx, frame, length,
+                       line->user_data);
+    }
+}
+
+/* Writes the whole frame, the serial port is non-blocking so a full output
+   buffer is waited for during the time of the frame on the line at most */
+static int _line_write(modbus_rtu_framer_line_t *line, int64_t duration)
+{
+    modbus_t *ctx = line->ctx;
+    int offset = 0;
+
+    while (offset < line->tx_length) {
+        ssize_t rc = write(ctx->s, line->tx + offset, line->tx_length - offset);
+
+        if (rc > 0) {
+            offset += rc;
+        } else if (rc == -1 && errno == EAGAIN) {
+            struct timeval tv;
+
+            tv.tv_sec = duration / 1000000;
+            tv.tv_usec = duration % 1000000;
+            if (_modbus_poll_fd(ctx, ctx->s, POLLOUT, &tv) <= 0)
+                break;
+        } else if (rc == 0 || errno != EINTR) {
+            break;
+        }
+    }
+
+    if (offset < line->tx_length) {
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR Frame of %d bytes partially sent (%d)\n",
+                    line->tx_length, offset);
+        }
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Writes the pending frame, the line is free. The frame is dropped when it
+   can't be written in full: the function shall return -1 and set errno to
+   EIO. */
+static int _line_transmit(modbus_rtu_framer_line_t *line, int64_t now)
+{
+    modbus_t *ctx = line->ctx;
+    int64_t duration = line->tx_length * line->char_time;
+    int rc;
+#if HAVE_DECL_TIOCM_RTS
+    modbus_rtu_t *ctx_rtu = ctx->backend_data;
+
+    if (ctx_rtu->rts != MODBUS_RTU_RTS_NONE && line->state == _LINE_IDLE) {
+        /* The frame is written once RTS is switched */
+        _modbus_rtu_ioctl_rts(ctx->s, ctx_rtu->rts == MODBUS_RTU_RTS_UP);
+        line->state = _LINE_RTS_ON;
+        _line_arm(line, now + _MODBUS_RTU_TIME_BETWEEN_RTS_SWITCH);
+        return 0;
+    }
+#endif
+
+    if (ctx->debug) {
+        int i;
+
+        for (i = 0; i < line->tx_length; i++)
+            printf("[%.2X]", line->tx[i]);
+        printf("\n");
+    }
+
+    rc = _line_write(line, duration);
+    line->tx_length = 0;
+
+#if HAVE_DECL_TIOCM_RTS
+    if (line->state == _LINE_RTS_ON) {
+        if (rc == -1) {
+            /* Back to reception at once */
+            _modbus_rtu_ioctl_rts(ctx->s, ctx_rtu->rts != MODBUS_RTU_RTS_UP);
+            line->state = _LINE_IDLE;
+            line->free_date = now + line->t35;
+            _line_disarm(line);
+            errno = EIO;
+            return -1;
+        }
+        line->state = _LINE_RTS_SENDING;
+        _line_arm(line, now + duration + _MODBUS_RTU_TIME_BETWEEN_RTS_SWITCH);
+        return 0;
+    }
+#endif
+
+    line->free_date = now + duration + line->t35;
+
+    return rc;
+}
+
+/* The line is silent, sends the pending frame when the line is free. Returns
+   -1 when the frame can't be written. */
+static int _line_idle(modbus_rtu_framer_line_t *line, int64_t now)
+{
+    line->state = _LINE_IDLE;
+    line->rx_length = 0;
+    line->rx_error = 0;
+
+    if (line->tx_length == 0) {
+        _line_disarm(line);
+    } else if (now >= line->free_date) {
+        return _line_transmit(line, now);
+    } else {
+        _line_arm(line, line->free_date);
+    }
+
+    return 0;
+}
+
+/* Checks the received frame after a silence of 3.5 characters */
+static void _line_frame(modbus_rtu_framer_line_t *line)
+{
+    uint16_t crc_calculated;
+    uint16_t crc_received;
+    int slave;
+
+    if (line->rx_length < _MODBUS_RTU_HEADER_LENGTH + 1 +
+        _MODBUS_RTU_CHECKSUM_LENGTH) {
+        _line_report(line, NULL, -1, EMBBADDATA);
+        return;
+    }
+
+    /* Same filter as the RTU backend */
+    slave = line->rx[0];
+    if (line->ctx->slave >= 0 && slave != line->ctx->slave &&
+        slave != MODBUS_BROADCAST_ADDRESS) {
+        if (line->ctx->debug) {
+            printf("Request for slave %d ignored (not %d)\n", slave,
+                   line->ctx->slave);
+        }
+        return;
+    }
+
+    crc_calculated = _modbus_crc16(line->rx, line->rx_length - 2);
+    crc_received = (line->rx[line->rx_length - 2] << 8) |
+        line->rx[line->rx_length - 1];
+    if (crc_calculated != crc_received) {
+        if (line->ctx->debug) {
+            fprintf(stderr, "ERROR CRC received 0x%0X != CRC calculated 0x%0X\n",
+                    crc_received, crc_calculated);
+        }
+        _line_report(line, NULL, -1, EMBBADCRC);
+        return;
+    }
+
+    line->framer->nb_frames++;
+    _line_report(line, line->rx, line->rx_length, 0);
+}
+
+static void _line_read(modbus_rtu_framer_line_t *line)
+{
+    modbus_t *ctx = line->ctx;
+    uint8_t buf[MODBUS_RTU_MAX_ADU_LENGTH];
+    int64_t now;
+    ssize_t n;
+
+    n = read(ctx->s, buf, sizeof(buf));
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    now = _modbus_now_us();
+
+    if (n <= 0) {
+        /* Device closed (hangup of a pseudo-terminal, USB adapter removed) */
+        int error = (n == 0) ? ECONNRESET : errno;
+
+        epoll_ctl(line->framer->epfd, EPOLL_CTL_DEL, ctx->s, NULL);
+        _line_disarm(line);
+        /* The pending frame would never be sent */
+        line->tx_length = 0;
+        _line_report(line, NULL, -1, error);
+        return;
+    }
+
+    if (ctx->debug) {
+        int i;
+
+        for (i = 0; i < n; i++)
+            printf("<%.2X>", buf[i]);
+    }
+
+    switch (line->state) {
+    case _LINE_IDLE:
+        line->state = _LINE_RECEIVING;
+        /* Falls through */
+    case _LINE_RECEIVING:
+        if (line->rx_length + n > MODBUS_RTU_MAX_ADU_LENGTH) {
+            line->state = _LINE_DISCARD;
+            line->rx_error = EMBBADDATA;
+            break;
+        }
+        memcpy(line->rx + line->rx_length, buf, n);
+        line->rx_length += n;
+        break;
+    case _LINE_END:
+        /* Silence of more than 1.5 character in the frame */
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR Silence of %d us in the frame\n",
+                    (int)(now - line->last_byte));
+        }
+        line->state = _LINE_DISCARD;
+        line->rx_error = EMBBADDATA;
+        break;
+    case _LINE_DISCARD:
+        break;
+    default:
+        /* Echo of the frame sent on a half-duplex line */
+        return;
+    }
+
+    line->last_byte = now;
+    _line_arm(line, now + ((line->state == _LINE_RECEIVING) ?
+                           line->t15 : line->t35));
+}
+
+static void _line_timer(modbus_rtu_framer_line_t *line)
+{
+    uint64_t expirations;
+    int64_t now;
+    int rc = 0;
+
+    /* Nothing to read when the timer has been armed again since */
+    if (read(line->timer_fd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations))
+        return;
+    now = _modbus_now_us();
+
+    switch (line->state) {
+    case _LINE_RECEIVING:
+        line->state = _LINE_END;
+        _line_arm(line, line->last_byte + line->t35);
+        break;
+    case _LINE_END:
+        if (line->ctx->debug) {
+            printf("\n");
+        }
+        _line_frame(line);
+        if (line->removed)
+            return;
+        line->free_date = line->last_byte + line->t35;
+        rc = _line_idle(line, now);
+        break;
+    case _LINE_DISCARD:
+        _line_report(line, NULL, -1, line->rx_error);
+        if (line->removed)
+            return;
+        line->free_date = line->last_byte + line->t35;
+        rc = _line_idle(line, now);
+        break;
+    case _LINE_IDLE:
+        rc = _line_idle(line, now);
+        break;
+#if HAVE_DECL_TIOCM_RTS
+    case _LINE_RTS_ON:
+        rc = _line_transmit(line, now);
+        break;
+    case _LINE_RTS_SENDING: {
+        modbus_rtu_t *ctx_rtu = line->ctx->backend_data;
+
+        _modbus_rtu_ioctl_rts(line->ctx->s, ctx_rtu->rts != MODBUS_RTU_RTS_UP);
+        line->free_date = now + line->t35;
+        rc = _line_idle(line, now);
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+
+    /* The frame sent later than its call is reported as a rejected frame */
+    if (rc == -1) {
+        _line_report(line, NULL, -1, EIO);
+    }
+}
+
+static void _line_free(modbus_rtu_framer_line_t *line)
+{
+    epoll_ctl(line->framer->epfd, EPOLL_CTL_DEL, line->ctx->s, NULL);
+    close(line->timer_fd);
+    free(line);
+}
+
+static modbus_rtu_framer_line_t *_framer_line(modbus_rtu_framer_t *framer,
+                                              int id)
+{
+    if (framer == NULL || id < 0 || id >= framer->nb_lines ||
+        framer->lines[id] == NULL || framer->lines[id]->removed) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return framer->lines[id];
+}
+
+modbus_rtu_framer_t* modbus_rtu_framer_new(void)
+{
+    modbus_rtu_framer_t *framer;
+
+    framer = (modbus_rtu_framer_t *) malloc(sizeof(modbus_rtu_framer_t));
+    if (framer == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(framer, 0, sizeof(modbus_rtu_framer_t));
+
+    framer->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (framer->epfd == -1) {
+        free(framer);
+        return NULL;
+    }
+
+    return framer;
+}
+
+/* Frees the framer, the contexts of the lines are left to the caller */
+void modbus_rtu_framer_free(modbus_rtu_framer_t *framer)
+{
+    int i;
+
+    if (framer == NULL)
+        return;
+
+    for (i = 0; i < framer->nb_lines; i++) {
+        if (framer->lines[i] != NULL)
+            _line_free(framer->lines[i]);
+    }
+    close(framer->epfd);
+    free(framer->lines);
+    free(framer);
+}
+
+/* Adds the line of a connected RTU context. The silences are computed from the
+   baud rate and the character format of the context.
+
+   The function shall return the ID of the line in the framer or -1 and set
+   errno. */
+int modbus_rtu_framer_add(modbus_rtu_framer_t *framer, modbus_t *ctx,
+                          modbus_rtu_framer_callback_t callback,
+                          void *user_data)
+{
+    modbus_rtu_framer_line_t *line;
+    modbus_rtu_t *ctx_rtu;
+    struct epoll_event ev;
+    int id;
+
+    if (framer == NULL || ctx == NULL || ctx->s == -1 ||
+        ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (id = 0; id < framer->nb_lines; id++) {
+        if (framer->lines[id] == NULL)
+            break;
+    }
+
+    if (id == framer->nb_lines) {
+        int nb_lines = framer->nb_lines ? framer->nb_lines * 2 : 8;
+        modbus_rtu_framer_line_t **lines;
+
+        lines = realloc(framer->lines,
+                        nb_lines * sizeof(modbus_rtu_framer_line_t *));
+        if (lines == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(lines + framer->nb_lines, 0,
+               (nb_lines - framer->nb_lines) *
+               sizeof(modbus_rtu_framer_line_t *));
+        framer->lines = lines;
+        framer->nb_lines = nb_lines;
+    }
+
+    line = (modbus_rtu_framer_line_t *) malloc(sizeof(modbus_rtu_framer_line_t));
+    if (line == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(line, 0, sizeof(modbus_rtu_framer_line_t));
+
+    line->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                    TFD_NONBLOCK | TFD_CLOEXEC);
+    if (line->timer_fd == -1) {
+        free(line);
+        return -1;
+    }
+
+    line->framer = framer;
+    line->id = id;
+    line->ctx = ctx;
+    line->callback = callback;
+    line->user_data = user_data;
+    line->serial_source.line = line;
+    line->serial_source.is_timer = FALSE;
+    line->timer_source.line = line;
+    line->timer_source.is_timer = TRUE;
+    line->state = _LINE_IDLE;
+
+    /* Start bit, data bits, parity bit and stop bits */
+    ctx_rtu = ctx->backend_data;
+    line->char_time = (int64_t)1000000 *
+        (1 + ctx_rtu->data_bit + (ctx_rtu->parity == 'N' ? 0 : 1) +
+         ctx_rtu->stop_bit) / ctx_rtu->baud;
+    if (ctx_rtu->baud > 19200) {
+        line->t15 = _FRAMER_T15_FAST;
+        line->t35 = _FRAMER_T35_FAST;
+    } else {
+        line->t15 = line->char_time * 3 / 2;
+        line->t35 = line->char_time * 7 / 2;
+    }
+    line->free_date = _modbus_now_us();
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &line->serial_source;
+    if (epoll_ctl(framer->epfd, EPOLL_CTL_ADD, ctx->s, &ev) == -1) {
+        close(line->timer_fd);
+        free(line);
+        return -1;
+    }
+    ev.data.ptr = &line->timer_source;
+    if (epoll_ctl(framer->epfd, EPOLL_CTL_ADD, line->timer_fd, &ev) == -1) {
+        epoll_ctl(framer->epfd, EPOLL_CTL_DEL, ctx->s, NULL);
+        close(line->timer_fd);
+        free(line);
+        return -1;
+    }
+
+    framer->lines[id] = line;
+
+    return id;
+}
+
+/* Removes the line, its context isn't closed */
+int modbus_rtu_framer_remove(modbus_rtu_framer_t *framer, int id)
+{
+    modbus_rtu_framer_line_t *line = _framer_line(framer, id);
+
+    if (line == NULL)
+        return -1;
+
+    if (framer->dispatching) {
+        /* The line may be in use by the caller of the callback */
+        line->removed = TRUE;
+        framer->nb_removed++;
+    } else {
+        framer->lines[id] = NULL;
+        _line_free(line);
+    }
+
+    return 0;
+}
+
+/* Replaces the silences of 1.5 and 3.5 characters of the line, eg. to use the
+   real character times above 19200 bauds */
+int modbus_rtu_framer_set_timing(modbus_rtu_framer_t *framer, int id,
+                                 uint32_t t15_us, uint32_t t35_us)
+{
+    modbus_rtu_framer_line_t *line = _framer_line(framer, id);
+
+    if (line == NULL)
+        return -1;
+
+    if (t15_us == 0 || t35_us <= t15_us) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    line->t15 = t15_us;
+    line->t35 = t35_us;
+
+    return 0;
+}
+
+/* Sends the message (slave and PDU) with its CRC once the line is free: at
+   once or by modbus_rtu_framer_process(), which reports a frame not written
+   in full to the callback with EIO.
+
+   The function shall return 0 if successful. Otherwise it shall return -1 and
+   set errno to EBUSY if a frame is already waiting or to EIO if the frame
+   sent at once isn't written in full. */
+int modbus_rtu_framer_send(modbus_rtu_framer_t *framer, int id,
+                           const uint8_t *msg, int msg_length)
+{
+    modbus_rtu_framer_line_t *line = _framer_line(framer, id);
+    int64_t now;
+
+    if (line == NULL)
+        return -1;
+
+    if (msg == NULL || msg_length < _MODBUS_RTU_HEADER_LENGTH + 1 ||
+        msg_length > MODBUS_RTU_MAX_ADU_LENGTH - _MODBUS_RTU_CHECKSUM_LENGTH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (line->tx_length > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    memcpy(line->tx, msg, msg_length);
+    line->tx_length = line->ctx->backend->send_msg_pre(line->tx, msg_length);
+
+    if (line->state == _LINE_IDLE) {
+        now = _modbus_now_us();
+        return _line_idle(line, now);
+    }
+
+    return 0;
+}
+
+/* Waits for bytes or silences on the lines during timeout_ms at most (-1 to
+   wait forever) and processes them.
+
+   The function shall return the number of valid frames received or -1 and
+   set errno. */
+int modbus_rtu_framer_process(modbus_rtu_framer_t *framer, int timeout_ms)
+{
+    struct epoll_event events[_FRAMER_MAX_EVENTS];
+    int nb_events;
+    int i;
+
+    if (framer == NULL || framer->dispatching) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    nb_events = epoll_wait(framer->epfd, events, _FRAMER_MAX_EVENTS,
+                           timeout_ms);
+    if (nb_events == -1) {
+        if (errno != EINTR)
+            return -1;
+        nb_events = 0;
+    }
+
+    framer->dispatching = TRUE;
+    framer->nb_frames = 0;
+
+    for (i = 0; i < nb_events; i++) {
+        _framer_source_t *source = events[i].data.ptr;
+
+        if (source->line->removed)
+            continue;
+
+        if (source->is_timer) {
+            _line_timer(source->line);
+        } else {
+            _line_read(source->line);
+        }
+    }
+
+    framer->dispatching = FALSE;
+
+    if (framer->nb_removed > 0) {
+        for (i = 0; i < framer->nb_lines; i++) {
+            modbus_rtu_framer_line_t *line = framer->lines[i];
+
+            if (line != NULL && line->removed) {
+                framer->lines[i] = NULL;
+                _line_free(line);
+            }
+        }
+        framer->nb_removed = 0;
+    }
+
+    return framer->nb_frames;
+}
+
+/* The epoll descriptor of the framer is readable when the framer has events to
+   process */
+int _modbus_rtu_framer_fd(modbus_rtu_framer_t *framer)
+{
+    return framer->epfd;
+}
+
+/* Tells if a frame is waiting for the silence of the line */
+int _modbus_rtu_framer_pending(modbus_rtu_framer_t *framer, int id)
+{
+    return framer->lines[id]->tx_length > 0;
+}
+
+#else
+
+modbus_rtu_framer_t* modbus_rtu_framer_new(void)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void modbus_rtu_framer_free(modbus_rtu_framer_t *framer)
+{
+}
+
+int modbus_rtu_framer_add(modbus_rtu_framer_t *framer, modbus_t *ctx,
+                          modbus_rtu_framer_callback_t callback,
+                          void *user_data)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int modbus_rtu_framer_remove(modbus_rtu_framer_t *framer, int id)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int modbus_rtu_framer_set_timing(modbus_rtu_framer_t *framer, int id,
+                                 uint32_t t15_us, uint32_t t35_us)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int modbus_rtu_framer_send(modbus_rtu_framer_t *framer, int id,
+                           const uint8_t *msg, int msg_length)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int modbus_rtu_framer_process(modbus_rtu_framer_t *framer, int timeout_ms)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* HAVE_SYS_EPOLL_H && HAVE_SYS_TIMERFD_H */
@@ -0,0 +1,50 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_RTU_FRAMER_H
+#define MODBUS_RTU_FRAMER_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+typedef struct _modbus_rtu_framer modbus_rtu_framer_t;
+
+/* Called with each frame received on a line (slave, PDU and CRC) or with a
+ * NULL frame, a length of -1 and errno set when a frame is rejected */
+typedef void (*modbus_rtu_framer_callback_t)(modbus_rtu_framer_t *framer, int id,
+                                             modbus_t *ctx, const uint8_t *frame,
+                                             int length, void *user_data);
+
+MODBUS_API modbus_rtu_framer_t* modbus_rtu_framer_new(void);
+MODBUS_API void modbus_rtu_framer_free(modbus_rtu_framer_t *framer);
+
+MODBUS_API int modbus_rtu_framer_add(modbus_rtu_framer_t *framer, modbus_t *ctx,
+                                     modbus_rtu_framer_callback_t callback,
+                                     void *user_data);
+MODBUS_API int modbus_rtu_framer_remove(modbus_rtu_framer_t *framer, int id);
+MODBUS_API int modbus_rtu_framer_set_timing(modbus_rtu_framer_t *framer, int id,
+                                            uint32_t t15_us, uint32_t t35_us);
+
+MODBUS_API int modbus_rtu_framer_send(modbus_rtu_framer_t *framer, int id,
+                                      const uint8_t *msg, int msg_length);
+MODBUS_API int modbus_rtu_framer_process(modbus_rtu_framer_t *framer, int timeout_ms);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_RTU_FRAMER_H */
@@ -87,4 +87,12 @@ typedef struct _modbus_rtu {
     int confirmation_to_ignore;
 } modbus_rtu_t;
 
+#if HAVE_DECL_TIOCM_RTS
+void _modbus_rtu_ioctl_rts(int fd, int on);
+#endif
+
+/* Descriptor to multiplex the lines of a framer with other sources */
+int _modbus_rtu_framer_fd(modbus_rtu_framer_t *framer);
+int _modbus_rtu_framer_pending(modbus_rtu_framer_t *framer, int id);
+
 #endif /* MODBUS_RTU_PRIVATE_H */
@@ -0,0 +1,75 @@
+/*
+ * Copyright © 2001-2011 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_SHM_PRIVATE_H
+#define MODBUS_SHM_PRIVATE_H
+
+#define _MODBUS_SHM_NAME_LENGTH 256
+
+/* Size of a ring, a power of 2 holding many ADU to pipeline requests */
+#define _MODBUS_SHM_RING_SIZE 4096
+
+#define _MODBUS_SHM_MAGIC 0x4D425331
+
+/* Lock-free ring of bytes with a single producer and a single consumer. The
+   indexes are free running and each one is only written by its side, on its
+   own cache line. They are also the futex words: the consumer sleeps on head
+   for new data and the producer on tail for some room. */
+typedef struct {
+    uint32_t head;
+    uint32_t producer_waiting;
+    uint8_t _pad_producer[56];
+    uint32_t tail;
+    uint32_t consumer_waiting;
+    uint8_t _pad_consumer[56];
+    uint8_t data[_MODBUS_SHM_RING_SIZE];
+} _modbus_shm_ring_t;
+
+/* Shared memory object created by the server */
+typedef struct {
+    /* Written last by the server once the rings are ready */
+    uint32_t magic;
+    /* PID of the server */
+    uint32_t server;
+    /* PID of the connected client or 0 */
+    uint32_t client;
+    /* Set by the server on close */
+    uint32_t closed;
+    uint8_t _pad[48];
+    /* From the client to the server */
+    _modbus_shm_ring_t request;
+    /* From the server to the client */
+    _modbus_shm_ring_t response;
+} _modbus_shm_segment_t;
+
+typedef struct _modbus_shm {
+    /* Transaction ID, first as in the TCP backends */
+    uint16_t t_id;
+    /* Name of the shared memory object, starting with '/' */
+    char name[_MODBUS_SHM_NAME_LENGTH];
+    int server;
+    _modbus_shm_segment_t *segment;
+    /* Rings read and written by this side */
+    _modbus_shm_ring_t *rx;
+    _modbus_shm_ring_t *tx;
+    /* Maximum and current time of busy polling before sleeping */
+    uint32_t spin_us;
+    uint32_t spin_budget_us;
+} modbus_shm_t;
+
+#endif /* MODBUS_SHM_PRIVATE_H */
@@ -0,0 +1,632 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <config.h>
+
+#ifdef HAVE_SHM_OPEN
+# include <unistd.h>
+# include <fcntl.h>
+# include <signal.h>
+# include <sched.h>
+# include <time.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# ifdef HAVE_LINUX_FUTEX_H
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+# endif
+#endif
+
+#include "modbus-private.h"
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+#include "modbus-shm.h"
+
+#ifdef HAVE_SHM_OPEN
+
+#include "modbus-shm-private.h"
+
+/* Default busy polling before sleeping when the peer may run on another CPU */
+#define _MODBUS_SHM_SPIN_US 50
+
+#define _SHM_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define _SHM_STORE(p, value) __atomic_store_n(p, value, __ATOMIC_RELEASE)
+/* Orders the store of a waiting flag or an index with the load of the other
+   one so a side never sleeps while the other one skips the wake up */
+#define _SHM_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static void _shm_cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* Sleeps while the futex word holds the value, until the deadline (-1 for
+   none). The futex isn't private since the processes map the segment at
+   different addresses. */
+static void _shm_sleep(uint32_t *word, uint32_t value, int64_t deadline)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+    struct timespec ts;
+    struct timespec *p_ts = NULL;
+
+    if (deadline != -1) {
+        int64_t remaining = deadline - _modbus_now_us();
+
+        if (remaining <= 0)
+            return;
+        ts.tv_sec = remaining / 1000000;
+        ts.tv_nsec = (remaining % 1000000) * 1000;
+        p_ts = &ts;
+    }
+    syscall(SYS_futex, word, FUTEX_WAIT, value, p_ts, NULL, 0);
+#else
+    /* Polls the ring */
+    struct timespec ts;
+
+    (void)word;
+    (void)value;
+    (void)deadline;
+    ts.tv_sec = 0;
+    ts.tv_nsec = 50000;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static void _shm_wake(uint32_t *word)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)word;
+#endif
+}
+
+/* Bytes to read for the consumer or room to write for the producer */
+static uint32_t _shm_ready(_modbus_shm_ring_t *ring, int producer)
+{
+    if (producer) {
+        return _MODBUS_SHM_RING_SIZE - (ring->head - _SHM_LOAD(&ring->tail));
+    } else {
+        return _SHM_LOAD(&ring->head) - ring->tail;
+    }
+}
+
+/* Adapts the time of busy polling to the last wait: about twice the usual
+   delay of the peer when it's shorter than the maximum, nothing otherwise
+   since the peer is slow or shares the CPU. */
+static void _shm_adapt_spin(modbus_shm_t *ctx_shm, int64_t waited_us)
+{
+    int64_t target = 0;
+
+    if (waited_us < ctx_shm->spin_us) {
+        target = waited_us * 2;
+        if (target > ctx_shm->spin_us)
+            target = ctx_shm->spin_us;
+    }
+    ctx_shm->spin_budget_us += (target - (int64_t)ctx_shm->spin_budget_us) / 4;
+}
+
+/* Waits until the ring holds at least length bytes to read (consumer) or
+   some room for them (producer): busy polls during the spin budget then
+   sleeps on the index of the other side.
+
+   The function shall return 0 when ready or -1 and set errno to ETIMEDOUT
+   at the deadline (-1 for none) or to ECONNRESET when the server is closed. */
+static int _shm_wait(modbus_t *ctx, _modbus_shm_ring_t *ring, int producer,
+                     uint32_t length, int64_t deadline)
+{
+    modbus_shm_t *ctx_shm = ctx->backend_data;
+    uint32_t *word = producer ? &ring->tail : &ring->head;
+    uint32_t *waiting = producer ? &ring->producer_waiting :
+        &ring->consumer_waiting;
+    int64_t start;
+    int64_t now;
+    int spins = 0;
+
+    if (_shm_ready(ring, producer) >= length)
+        return 0;
+
+    start = _modbus_now_us();
+    now = start;
+    while (_shm_ready(ring, producer) < length) {
+        if (_SHM_LOAD(&ctx_shm->segment->closed)) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (deadline != -1 && now >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (now - start >= ctx_shm->spin_budget_us) {
+            break;
+        }
+        /* Gives the CPU to the peer if they share it */
+        if (++spins % 64 == 0) {
+            sched_yield();
+        } else {
+            _shm_cpu_relax();
+        }
+        now = _modbus_now_us();
+    }
+
+    for (;;) {
+        uint32_t value = _SHM_LOAD(word);
+
+        if (_shm_ready(ring, producer) >= length)
+            break;
+
+        _SHM_STORE(waiting, 1);
+        _SHM_FENCE();
+        if (_shm_ready(ring, producer) < length &&
+            !_SHM_LOAD(&ctx_shm->segment->closed)) {
+            _shm_sleep(word, value, deadline);
+        }
+        _SHM_STORE(waiting, 0);
+
+        if (_shm_ready(ring, producer) >= length)
+            break;
+        if (_SHM_LOAD(&ctx_shm->segment->closed)) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (deadline != -1 && _modbus_now_us() >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    if (ctx_shm->spin_us > 0)
+        _shm_adapt_spin(ctx_shm, _modbus_now_us() - start);
+
+    return 0;
+}
+
+/* Wakes up the other side if it sleeps on the index just moved */
+static void _shm_notify(uint32_t *word, uint32_t *waiting)
+{
+    _SHM_FENCE();
+    if (_SHM_LOAD(waiting))
+        _shm_wake(word);
+}
+
+static ssize_t _modbus_shm_send(modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    modbus_shm_t *ctx_shm = ctx->backend_data;
+    _modbus_shm_ring_t *ring = ctx_shm->tx;
+    uint32_t offset;
+    uint32_t first;
+
+    if (ring == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (req_length > _MODBUS_SHM_RING_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    /* A full ring is waited for as a full socket buffer, up to the response
+       timeout */
+    if (_shm_wait(ctx, ring, TRUE, req_length, _modbus_now_us() +
+                  (int64_t)ctx->response_timeout.tv_sec * 1000000 +
+                  ctx->response_timeout.tv_usec) == -1) {
+        return -1;
+    }
+
+    offset = ring->head & (_MODBUS_SHM_RING_SIZE - 1);
+    first = _MODBUS_SHM_RING_SIZE - offset;
+    if (first > (uint32_t)req_length)
+        first = req_length;
+    memcpy(ring->data + offset, req, first);
+    memcpy(ring->data, req + first, req_length - first);
+
+    /* The whole ADU is published at once */
+    _SHM_STORE(&ring->head, ring->head + req_length);
+    _shm_notify(&ring->head, &ring->consumer_waiting);
+
+    return req_length;
+}
+
+static ssize_t _modbus_shm_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    modbus_shm_t *ctx_shm = ctx->backend_data;
+    _modbus_shm_ring_t *ring = ctx_shm->rx;
+    uint32_t length;
+    uint32_t offset;
+    uint32_t first;
+
+    if (ring == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    length = _shm_ready(ring, FALSE);
+    if (length == 0) {
+        /* Closed by the server */
+        return 0;
+    }
+    if (length > (uint32_t)rsp_length)
+        length = rsp_length;
+
+    offset = ring->tail & (_MODBUS_SHM_RING_SIZE - 1);
+    first = _MODBUS_SHM_RING_SIZE - offset;
+    if (first > length)
+        first = length;
+    memcpy(rsp, ring->data + offset, first);
+    memcpy(rsp + first, ring->data, length - first);
+
+    _SHM_STORE(&ring->tail, ring->tail + length);
+    _shm_notify(&ring->tail, &ring->producer_waiting);
+
+    return length;
+}
+
+static int _modbus_shm_flush(modbus_t *ctx)
+{
+    modbus_shm_t *ctx_shm = ctx->backend_data;
+    _modbus_shm_ring_t *ring = ctx_shm->rx;
+    uint32_t length;
+
+    if (ring == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    length = _shm_ready(ring, FALSE);
+    if (length > 0) {
+        _SHM_STORE(&ring->tail, ring->tail + length);
+        _shm_notify(&ring->tail, &ring->producer_waiting);
+        if (ctx->debug) {
+            printf("%d bytes flushed\n", length);
+        }
+    }
+
+    return length;
+}
+
+static int _modbus_shm_select(modbus_t *ctx, struct timeval *tv,
+                              int length_to_read)
+{
+    modbus_shm_t *ctx_shm = ctx->backend_data;
+    int64_t deadline = -1;
+    int rc;
+
+    if (ctx_shm->rx == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (tv != NULL) {
+        deadline = _modbus_now_us() + (int64_t)tv->tv_sec * 1000000 +
+            tv->tv_usec;
+    }
+
+    /* The ADU are written at once so the first byte announces the others */
+    rc = _shm_wait(ctx, ctx_shm->rx, FALSE, 1, deadline);
+
+    if (tv != NULL) {
+        int64_t remaining = deadline - _modbus_now_us();
+
+        if (rc == -1 || remaining < 0)
+            remaining = 0;
+        tv->tv_sec = remaining / 1000000;
+        tv->tv_usec = remaining % 1000000;
+    }
+
+    return (rc == -1) ? -1 : 1;
+}
+
+static void _modbus_shm_unmap(modbus_t *ctx)
+{
+    modbus_shm_t *ctx_shm = ctx->backend_data;
+
+    munmap(ctx_shm->segment, sizeof(_modbus_shm_segment_t));
+    ctx_shm->segment = NULL;
+    ctx_shm->rx = NULL;
+    ctx_shm->tx = NULL;
+}
+
+/* Attaches the client to the rings of a listening server */
+static int _modbus_shm_connect(modbus_t *ctx)
+{
+    modbus_shm_t *ctx_shm = ctx->backend_data;
+    _modbus_shm_segment_t *segment;
+    struct stat st;
+    uint32_t client = 0;
+    int fd;
+
+    if (ctx->debug) {
+        printf("Connecting to %s\n", ctx_shm->name);
+    }
+
+    fd = shm_open(ctx_shm->name, O_RDWR, 0);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            errno = ECONNREFUSED;
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 ||
+        st.st_size < (off_t)sizeof(_modbus_shm_segment_t)) {
+        close(fd);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    segment = mmap(NULL, sizeof(_modbus_shm_segment_t),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    ctx_shm->segment = segment;
+
+    if (_SHM_LOAD(&segment->magic) != _MODBUS_SHM_MAGIC ||
+        _SHM_LOAD(&segment->closed)) {
+        _modbus_shm_unmap(ctx);
+        close(fd);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    /* The rings have a single producer and a single consumer so only one
+       client, the place of a dead one is taken */
+    if (!__atomic_compare_exchange_n(&segment->client, &client, getpid(), 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        (kill(client, 0) == 0 || errno != ESRCH ||
+         !__atomic_compare_exchange_n(&segment->client, &client, getpid(), 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))) {
+        _modbus_shm_unmap(ctx);
+        close(fd);
+        errno = EBUSY;
+        return -1;
+    }
+
+    ctx_shm->rx = &segment->response;
+    ctx_shm->tx = &segment->request;
+    /* Responses left for a previous client */
+    _SHM_STORE(&ctx_shm->rx->tail, _SHM_LOAD(&ctx_shm->rx->head));
+
+    ctx->s = fd;
+
+    return 0;
+}
+
+static void _modbus_shm_close(modbus_t *ctx)
+{
+    modbus_shm_t *ctx_shm = ctx->backend_data;
+    _modbus_shm_segment_t *segment = ctx_shm->segment;
+
+    if (segment != NULL) {
+        if (ctx_shm->server) {
+            /* Wakes up the client waiting for a response or some room */
+            _SHM_STORE(&segment->closed, 1);
+            _SHM_FENCE();
+            _shm_wake(&segment->response.head);
+            _shm_wake(&segment->request.tail);
+            shm_unlink(ctx_shm->name);
+        } else {
+            _SHM_STORE(&segment->client, 0);
+        }
+        _modbus_shm_unmap(ctx);
+    }
+
+    if (ctx->s != -1) {
+        close(ctx->s);
+        ctx->s = -1;
+    }
+}
+
+static void _modbus_shm_free(modbus_t *ctx) {
+    free(ctx->backend_data);
+    free(ctx);
+}
+
+const modbus_backend_t _modbus_shm_backend = {
+    _MODBUS_BACKEND_TYPE_TCP,
+    _MODBUS_TCP_HEADER_LENGTH,
+    _MODBUS_TCP_CHECKSUM_LENGTH,
+    MODBUS_SHM_MAX_ADU_LENGTH,
+    _modbus_tcp_set_slave,
+    _modbus_tcp_build_request_basis,
+    _modbus_tcp_build_response_basis,
+    _modbus_tcp_prepare_response_tid,
+    _modbus_tcp_send_msg_pre,
+    _modbus_shm_send,
+    _modbus_tcp_receive,
+    _modbus_shm_recv,
+    _modbus_tcp_check_integrity,
+    _modbus_tcp_pre_check_confirmation,
+    _modbus_shm_connect,
+    _modbus_shm_close,
+    _modbus_shm_flush,
+    _modbus_shm_select,
+    _modbus_shm_free
+};
+
+/* Creates the shared memory object of the server and sets its descriptor as
+   the socket of the context. An object left by a dead server is replaced.
+
+   The function shall return the descriptor or -1 and set errno. */
+int modbus_shm_listen(modbus_t *ctx)
+{
+    modbus_shm_t *ctx_shm;
+    _modbus_shm_segment_t *segment;
+    int fd;
+
+    if (ctx == NULL || ctx->backend != &_modbus_shm_backend) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_shm = ctx->backend_data;
+    if (ctx_shm->segment != NULL) {
+        errno = EISCONN;
+        return -1;
+    }
+
+    fd = shm_open(ctx_shm->name, O_RDWR, 0);
+    if (fd != -1) {
+        segment = mmap(NULL, sizeof(_modbus_shm_segment_t), PROT_READ,
+                       MAP_SHARED, fd, 0);
+        close(fd);
+        if (segment != MAP_FAILED) {
+            uint32_t server = _SHM_LOAD(&segment->server);
+            int alive = !_SHM_LOAD(&segment->closed) && server != 0 &&
+                (kill(server, 0) == 0 || errno != ESRCH);
+
+            munmap(segment, sizeof(_modbus_shm_segment_t));
+            if (alive) {
+                errno = EADDRINUSE;
+                return -1;
+            }
+        }
+        shm_unlink(ctx_shm->name);
+    }
+
+    /* Only the user of the server can connect */
+    fd = shm_open(ctx_shm->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(_modbus_shm_segment_t)) == -1) {
+        close(fd);
+        shm_unlink(ctx_shm->name);
+        return -1;
+    }
+
+    segment = mmap(NULL, sizeof(_modbus_shm_segment_t),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED) {
+        close(fd);
+        shm_unlink(ctx_shm->name);
+        return -1;
+    }
+
+    /* The object is zeroed by ftruncate() */
+    segment->server = getpid();
+    _SHM_STORE(&segment->magic, _MODBUS_SHM_MAGIC);
+
+    ctx_shm->server = TRUE;
+    ctx_shm->segment = segment;
+    ctx_shm->rx = &segment->request;
+    ctx_shm->tx = &segment->response;
+    ctx->s = fd;
+
+    return fd;
+}
+
+int modbus_shm_set_spin(modbus_t *ctx, uint32_t spin_us)
+{
+    modbus_shm_t *ctx_shm;
+
+    if (ctx == NULL || ctx->backend != &_modbus_shm_backend) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_shm = ctx->backend_data;
+    ctx_shm->spin_us = spin_us;
+    ctx_shm->spin_budget_us = spin_us;
+
+    return 0;
+}
+
+modbus_t* modbus_new_shm(const char *name)
+{
+    modbus_t *ctx;
+    modbus_shm_t *ctx_shm;
+    size_t length;
+
+    if (name == NULL) {
+        fprintf(stderr, "The name is NULL\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Leading '/' added and no other one, as POSIX requires it portably */
+    if (name[0] == '/')
+        name++;
+    length = strlen(name);
+    if (length == 0 || length + 1 >= _MODBUS_SHM_NAME_LENGTH ||
+        strchr(name, '/') != NULL) {
+        fprintf(stderr, "Invalid name of shared memory object\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = (modbus_t *) malloc(sizeof(modbus_t));
+    _modbus_init_common(ctx);
+
+    /* Could be changed after to reach a remote serial Modbus device */
+    ctx->slave = MODBUS_TCP_SLAVE;
+
+    ctx->backend = &(_modbus_shm_backend);
+
+    ctx->backend_data = (modbus_shm_t *) malloc(sizeof(modbus_shm_t));
+    ctx_shm = (modbus_shm_t *)ctx->backend_data;
+    ctx_shm->t_id = 0;
+    ctx_shm->name[0] = '/';
+    memcpy(ctx_shm->name + 1, name, length + 1);
+    ctx_shm->server = FALSE;
+    ctx_shm->segment = NULL;
+    ctx_shm->rx = NULL;
+    ctx_shm->tx = NULL;
+
+    /* Spinning on a single CPU only delays the peer */
+    ctx_shm->spin_us = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ?
+        _MODBUS_SHM_SPIN_US : 0;
+    ctx_shm->spin_budget_us = ctx_shm->spin_us;
+
+    return ctx;
+}
+
+#else
+
+modbus_t* modbus_new_shm(const char *name)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int modbus_shm_listen(modbus_t *ctx)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int modbus_shm_set_spin(modbus_t *ctx, uint32_t spin_us)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ * Copyright © 2001-2010 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_SHM_H
+#define MODBUS_SHM_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+#define MODBUS_SHM_MAX_ADU_LENGTH  260
+
+MODBUS_API modbus_t* modbus_new_shm(const char *name);
+MODBUS_API int modbus_shm_listen(modbus_t *ctx);
+MODBUS_API int modbus_shm_set_spin(modbus_t *ctx, uint32_t spin_us);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_SHM_H */
@@ -0,0 +1,291 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Sparse mappings: the 65536 addresses of each table are split in pages of 256
+ * values allocated when a range of addresses is added. The page of an address
+ * is found in a directory (high byte of the address) and a bitmap of the page
+ * flags the addresses of the ranges, the other ones are illegal addresses.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "modbus.h"
+#include "modbus-private.h"
+
+#define _PAGE_SHIFT  8
+#define _PAGE_SIZE   (1 << _PAGE_SHIFT)
+#define _PAGE_MASK   (_PAGE_SIZE - 1)
+#define _NB_PAGES    (MODBUS_MAPPING_SPARSE_NB >> _PAGE_SHIFT)
+#define _NB_TABLES   4
+
+typedef struct {
+    /* Addresses of the ranges */
+    uint32_t valid[_PAGE_SIZE / 32];
+    union {
+        uint8_t bits[_PAGE_SIZE];
+        uint16_t registers[_PAGE_SIZE];
+    } values;
+} _sparse_page_t;
+
+struct _modbus_sparse {
+    /* Directories of the pages of each table (allocated on demand) */
+    _sparse_page_t **pages[_NB_TABLES];
+};
+
+modbus_sparse_t* _modbus_sparse_new(void)
+{
+    modbus_sparse_t *sparse = calloc(1, sizeof(modbus_sparse_t));
+
+    if (sparse == NULL)
+        errno = ENOMEM;
+
+    return sparse;
+}
+
+void _modbus_sparse_free(modbus_sparse_t *sparse)
+{
+    int table;
+    int i;
+
+    if (sparse == NULL)
+        return;
+
+    for (table = 0; table < _NB_TABLES; table++) {
+        if (sparse->pages[table] == NULL)
+            continue;
+        for (i = 0; i < _NB_PAGES; i++) {
+            free(sparse->pages[table][i]);
+        }
+        free(sparse->pages[table]);
+    }
+    free(sparse);
+}
+
+/* Returns the mask of the bits [bit, bit + count) of a bitmap word */
+static uint32_t _word_mask(int bit, int count)
+{
+    return (count == 32) ? 0xFFFFFFFF : (((uint32_t)1 << count) - 1) << bit;
+}
+
+/* Iterates over the parts of a range of addresses in each page: n values at
+   offset in the page page_index, pos values of the range before them */
+#define _FOR_EACH_PAGE(address, nb, page_index, offset, n, pos)         \
+    for (pos = 0;                                                        \
+         pos < nb && (page_index = (address + pos) >> _PAGE_SHIFT,       \
+                      offset = (address + pos) & _PAGE_MASK,             \
+                      n = (_PAGE_SIZE - offset < nb - pos) ?             \
+                          _PAGE_SIZE - offset : nb - pos, 1);            \
+         pos += n)
+
+int _modbus_sparse_add_range(modbus_sparse_t *sparse, int table, int address,
+                             int nb)
+{
+    _sparse_page_t **pages;
+    int page_index, offset, n, pos;
+
+    if (table < 0 || table >= _NB_TABLES || address < 0 || nb < 1 ||
+        address + nb > MODBUS_MAPPING_SPARSE_NB) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (sparse->pages[table] == NULL) {
+        sparse->pages[table] = calloc(_NB_PAGES, sizeof(_sparse_page_t *));
+        if (sparse->pages[table] == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    pages = sparse->pages[table];
+
+    /* Allocates all the pages first to not add a part of the range */
+    _FOR_EACH_PAGE(address, nb, page_index, offset, n, pos) {
+        if (pages[page_index] == NULL) {
+            pages[page_index] = calloc(1, sizeof(_sparse_page_t));
+            if (pages[page_index] == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+    }
+
+    _FOR_EACH_PAGE(address, nb, page_index, offset, n, pos) {
+        _sparse_page_t *page = pages[page_index];
+        int end = offset + n;
+
+        while (offset < end) {
+            int bit = offset & 31;
+            int count = (32 - bit < end - offset) ? 32 - bit : end - offset;
+
+            page->valid[offset >> 5] |= _word_mask(bit, count);
+            offset += count;
+        }
+    }
+
+    return 0;
+}
+
+/* Returns 0 when all the addresses are in the ranges of the table, -1
+   otherwise (without errno) */
+int _modbus_sparse_check(modbus_sparse_t *sparse, int table, int address,
+                         int nb)
+{
+    _sparse_page_t **pages = sparse->pages[table];
+    int page_index, offset, n, pos;
+
+    if (pages == NULL || address < 0 || nb < 1 ||
+        address + nb > MODBUS_MAPPING_SPARSE_NB)
+        return -1;
+
+    _FOR_EACH_PAGE(address, nb, page_index, offset, n, pos) {
+        _sparse_page_t *page = pages[page_index];
+        int end = offset + n;
+
+        if (page == NULL)
+            return -1;
+
+        while (offset < end) {
+            int bit = offset & 31;
+            int count = (32 - bit < end - offset) ? 32 - bit : end - offset;
+            uint32_t mask = _word_mask(bit, count);
+
+            if ((page->valid[offset >> 5] & mask) != mask)
+                return -1;
+            offset += count;
+        }
+    }
+
+    return 0;
+}
+
+/* Returns the address of a value (uint8_t for the bits, uint16_t for the
+   registers) or NULL if the address isn't in a range */
+void* _modbus_sparse_value(modbus_sparse_t *sparse, int table, int address)
+{
+    _sparse_page_t *page;
+
+    if (table < 0 || table >= _NB_TABLES ||
+        _modbus_sparse_check(sparse, table, address, 1) == -1)
+        return NULL;
+
+    page = sparse->pages[table][address >> _PAGE_SHIFT];
+    if (table == MODBUS_TABLE_BITS || table == MODBUS_TABLE_INPUT_BITS)
+        return &page->values.bits[address & _PAGE_MASK];
+
+    return &page->values.registers[address & _PAGE_MASK];
+}
+
+/* The following functions are called on checked ranges */
+
+/* Packs nb bits (LSB first) in dest */
+void _modbus_sparse_get_bits(modbus_sparse_t *sparse, int table, int address,
+                             int nb, uint8_t *dest)
+{
+    _sparse_page_t **pages = sparse->pages[table];
+    int page_index, offset, n, pos;
+    uint8_t packed[_PAGE_SIZE / 8];
+
+    memset(dest, 0, (nb + 7) / 8);
+    _FOR_EACH_PAGE(address, nb, page_index, offset, n, pos) {
+        _modbus_pack_bits(packed, pages[page_index]->values.bits + offset, n);
+        _modbus_set_bits_packed(dest, pos, n, packed);
+    }
+}
+
+/* Unpacks nb bits (LSB first) of src */
+void _modbus_sparse_set_bits(modbus_sparse_t *sparse, int table, int address,
+                             int nb, const uint8_t *src)
+{
+    _sparse_page_t **pages = sparse->pages[table];
+    int page_index, offset, n, pos;
+    uint8_t packed[_PAGE_SIZE / 8];
+
+    _FOR_EACH_PAGE(address, nb, page_index, offset, n, pos) {
+        _modbus_get_bits_packed(packed, src, pos, n);
+        _modbus_unpack_bits(pages[page_index]->values.bits + offset, packed, n);
+    }
+}
+
+/* Writes nb registers in big-endian order in dest */
+void _modbus_sparse_get_registers(modbus_sparse_t *sparse, int table,
+                                  int address, int nb, uint8_t *dest)
+{
+    _sparse_page_t **pages = sparse->pages[table];
+    int page_index, offset, n, pos;
+
+    _FOR_EACH_PAGE(address, nb, page_index, offset, n, pos) {
+        _modbus_set_registers_be(dest + 2 * pos,
+                                 pages[page_index]->values.registers + offset,
+                                 n);
+    }
+}
+
+/* Reads nb registers in big-endian order from src */
+void _modbus_sparse_set_registers(modbus_sparse_t *sparse, int table,
+                                  int address, int nb, const uint8_t *src)
+{
+    _sparse_page_t **pages = sparse->pages[table];
+    int page_index, offset, n, pos;
+
+    _FOR_EACH_PAGE(address, nb, page_index, offset, n, pos) {
+        _modbus_get_registers_be(pages[page_index]->values.registers + offset,
+                                 src + 2 * pos, n);
+    }
+}
+
+/* Allocates a mapping without values, the ranges of addresses are added by
+   modbus_mapping_add_range() */
+modbus_mapping_t* modbus_mapping_new_sparse(void)
+{
+    modbus_mapping_t *mb_mapping = modbus_mapping_new_ext(0, 0, 0, 0, 0);
+
+    if (mb_mapping == NULL)
+        return NULL;
+
+    _MAPPING_SPARSE(mb_mapping) = _modbus_sparse_new();
+    if (_MAPPING_SPARSE(mb_mapping) == NULL) {
+        modbus_mapping_free(mb_mapping);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    mb_mapping->flags |= MODBUS_MAPPING_SPARSE;
+    /* The full address space of each table */
+    mb_mapping->nb_bits = MODBUS_MAPPING_SPARSE_NB;
+    mb_mapping->nb_input_bits = MODBUS_MAPPING_SPARSE_NB;
+    mb_mapping->nb_registers = MODBUS_MAPPING_SPARSE_NB;
+    mb_mapping->nb_input_registers = MODBUS_MAPPING_SPARSE_NB;
+
+    return mb_mapping;
+}
+
+int modbus_mapping_add_range(modbus_mapping_t *mb_mapping, int table,
+                             int address, int nb)
+{
+    if (mb_mapping == NULL ||
+        !(_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return _modbus_sparse_add_range(_MAPPING_SPARSE(mb_mapping), table,
+                                    address, nb);
+}
@@ -0,0 +1,372 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ *
+ * Incremental parser of the Modbus TCP frames: the bytes of a stream are
+ * pushed in chunks of any size and each frame is delimited by the length of
+ * its MBAP header. A frame held by a chunk is given in place, the bytes of a
+ * frame spread over several chunks are gathered in the parser. The PDU is
+ * checked against the lengths computed by the receive functions of the
+ * contexts, without context.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+
+#include "modbus.h"
+#include "modbus-private.h"
+#include "modbus-tcp-private.h"
+#include "modbus-tcp-parser.h"
+
+/* Length field of the MBAP header: unit ID and PDU */
+#define _PARSER_MIN_LENGTH  2
+#define _PARSER_MAX_LENGTH  (1 + MODBUS_MAX_PDU_LENGTH)
+
+struct _modbus_tcp_parser {
+    msg_type_t msg_type;
+    /* Error of a MBAP header, the bytes are ignored until a reset */
+    int error;
+    /* Bytes gathered of the next frame and its length once the header is
+       complete */
+    int length;
+    int adu_length;
+    uint8_t buf[MODBUS_TCP_MAX_ADU_LENGTH];
+};
+
+/* Functions with a layout known by the parser, the other frames are only
+   delimited by their MBAP header */
+static int _parser_known_function(msg_type_t msg_type, int function)
+{
+    if (msg_type == MSG_CONFIRMATION && (function & 0x80))
+        return TRUE;
+
+    switch (function) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case MODBUS_FC_READ_EXCEPTION_STATUS:
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+    case MODBUS_FC_REPORT_SLAVE_ID:
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static int _parser_check_nb(int nb, int max_nb)
+{
+    return (nb < 1 || nb > max_nb) ? MODBUS_TCP_FRAME_BAD_QUANTITY :
+        MODBUS_TCP_FRAME_OK;
+}
+
+/* Decodes the fields of a request and returns its error */
+static int _parser_decode_request(const uint8_t *pdu, modbus_tcp_frame_t *frame)
+{
+    int rc;
+
+    switch (pdu[0]) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+        frame->addr = (pdu[1] << 8) + pdu[2];
+        frame->nb = (pdu[3] << 8) + pdu[4];
+        return _parser_check_nb(frame->nb, MODBUS_MAX_READ_BITS);
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+        frame->addr = (pdu[1] << 8) + pdu[2];
+        frame->nb = (pdu[3] << 8) + pdu[4];
+        return _parser_check_nb(frame->nb, MODBUS_MAX_READ_REGISTERS);
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+        frame->addr = (pdu[1] << 8) + pdu[2];
+        frame->nb = 1;
+        return MODBUS_TCP_FRAME_OK;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        frame->addr = (pdu[1] << 8) + pdu[2];
+        frame->nb = (pdu[3] << 8) + pdu[4];
+        frame->byte_count = pdu[5];
+        rc = _parser_check_nb(frame->nb, MODBUS_MAX_WRITE_BITS);
+        if (rc == MODBUS_TCP_FRAME_OK && frame->byte_count != (frame->nb + 7) / 8)
+            rc = MODBUS_TCP_FRAME_BAD_BYTE_COUNT;
+        return rc;
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        frame->addr = (pdu[1] << 8) + pdu[2];
+        frame->nb = (pdu[3] << 8) + pdu[4];
+        frame->byte_count = pdu[5];
+        rc = _parser_check_nb(frame->nb, MODBUS_MAX_WRITE_REGISTERS);
+        if (rc == MODBUS_TCP_FRAME_OK && frame->byte_count != frame->nb * 2)
+            rc = MODBUS_TCP_FRAME_BAD_BYTE_COUNT;
+        return rc;
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        frame->addr = (pdu[1] << 8) + pdu[2];
+        frame->nb = (pdu[3] << 8) + pdu[4];
+        frame->write_addr = (pdu[5] << 8) + pdu[6];
+        frame->write_nb = (pdu[7] << 8) + pdu[8];
+        frame->byte_count = pdu[9];
+        rc = _parser_check_nb(frame->nb, MODBUS_MAX_WR_READ_REGISTERS);
+        if (rc == MODBUS_TCP_FRAME_OK)
+            rc = _parser_check_nb(frame->write_nb, MODBUS_MAX_WR_WRITE_REGISTERS);
+        if (rc == MODBUS_TCP_FRAME_OK && frame->byte_count != frame->write_nb * 2)
+            rc = MODBUS_TCP_FRAME_BAD_BYTE_COUNT;
+        return rc;
+    default:
+        /* MODBUS_FC_READ_EXCEPTION_STATUS, MODBUS_FC_REPORT_SLAVE_ID */
+        return MODBUS_TCP_FRAME_OK;
+    }
+}
+
+/* Decodes the fields of a response and returns its error */
+static int _parser_decode_response(const uint8_t *pdu, modbus_tcp_frame_t *frame)
+{
+    if (pdu[0] & 0x80) {
+        frame->exception_code = pdu[1];
+        return MODBUS_TCP_FRAME_OK;
+    }
+
+    switch (pdu[0]) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+    case MODBUS_FC_REPORT_SLAVE_ID:
+        frame->byte_count = pdu[1];
+        return MODBUS_TCP_FRAME_OK;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        frame->byte_count = pdu[1];
+        return (frame->byte_count & 1) ? MODBUS_TCP_FRAME_BAD_BYTE_COUNT :
+            MODBUS_TCP_FRAME_OK;
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+        frame->addr = (pdu[1] << 8) + pdu[2];
+        frame->nb = 1;
+        return MODBUS_TCP_FRAME_OK;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        frame->addr = (pdu[1] << 8) + pdu[2];
+        frame->nb = (pdu[3] << 8) + pdu[4];
+        return MODBUS_TCP_FRAME_OK;
+    default:
+        /* MODBUS_FC_READ_EXCEPTION_STATUS */
+        return MODBUS_TCP_FRAME_OK;
+    }
+}
+
+static void _parser_init_frame(modbus_tcp_frame_t *frame, const uint8_t *adu,
+                               int adu_length)
+{
+    frame->adu = adu;
+    frame->adu_length = adu_length;
+    frame->transaction_id = (adu[0] << 8) + adu[1];
+    frame->unit_id = adu[6];
+    frame->function = -1;
+    frame->addr = -1;
+    frame->nb = -1;
+    frame->write_addr = -1;
+    frame->write_nb = -1;
+    frame->byte_count = -1;
+    frame->exception_code = -1;
+    frame->error = MODBUS_TCP_FRAME_OK;
+}
+
+/* Checks the MBAP header and returns the length of the frame or -1 after
+   calling back with the error */
+static int _parser_header(modbus_tcp_parser_t *parser, const uint8_t *header,
+                          modbus_tcp_parser_callback_t callback,
+                          void *user_data)
+{
+    int length = (header[4] << 8) + header[5];
+    modbus_tcp_frame_t frame;
+
+    if (header[2] != 0 || header[3] != 0) {
+        parser->error = MODBUS_TCP_FRAME_BAD_PROTOCOL;
+    } else if (length < _PARSER_MIN_LENGTH || length > _PARSER_MAX_LENGTH) {
+        parser->error = MODBUS_TCP_FRAME_BAD_LENGTH;
+    } else {
+        return 6 + length;
+    }
+
+    _parser_init_frame(&frame, header, _MODBUS_TCP_HEADER_LENGTH);
+    frame.error = parser->error;
+    errno = EMBBADDATA;
+    callback(parser, &frame, user_data);
+
+    return -1;
+}
+
+/* Decodes a complete frame, calls back and returns TRUE if it's valid */
+static int _parser_frame(modbus_tcp_parser_t *parser, const uint8_t *adu,
+                         int adu_length, modbus_tcp_parser_callback_t callback,
+                         void *user_data)
+{
+    const uint8_t *pdu = adu + _MODBUS_TCP_HEADER_LENGTH;
+    int pdu_length = adu_length - _MODBUS_TCP_HEADER_LENGTH;
+    modbus_tcp_frame_t frame;
+
+    _parser_init_frame(&frame, adu, adu_length);
+    frame.function = pdu[0];
+
+    if (_parser_known_function(parser->msg_type, frame.function)) {
+        int length = 1 + _modbus_compute_meta_length_after_function(
+            NULL, frame.function, parser->msg_type);
+
+        /* The PDU must have the length computed by the receive functions */
+        if (length > pdu_length ||
+            length + _modbus_compute_data_length_after_meta(
+                NULL, pdu, parser->msg_type) != pdu_length) {
+            frame.error = MODBUS_TCP_FRAME_LENGTH_MISMATCH;
+        } else if (parser->msg_type == MSG_INDICATION) {
+            frame.error = _parser_decode_request(pdu, &frame);
+        } else {
+            frame.error = _parser_decode_response(pdu, &frame);
+        }
+    }
+
+    if (frame.error != MODBUS_TCP_FRAME_OK)
+        errno = EMBBADDATA;
+    callback(parser, &frame, user_data);
+
+    return frame.error == MODBUS_TCP_FRAME_OK;
+}
+
+/* Allocates a parser of the requests (MODBUS_TCP_PARSER_REQUEST) or of the
+   responses (MODBUS_TCP_PARSER_RESPONSE) of a stream */
+modbus_tcp_parser_t* modbus_tcp_parser_new(int type)
+{
+    modbus_tcp_parser_t *parser;
+
+    if (type != MODBUS_TCP_PARSER_REQUEST &&
+        type != MODBUS_TCP_PARSER_RESPONSE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    parser = (modbus_tcp_parser_t *) malloc(sizeof(modbus_tcp_parser_t));
+    if (parser == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    parser->msg_type = (type == MODBUS_TCP_PARSER_REQUEST) ?
+        MSG_INDICATION : MSG_CONFIRMATION;
+    modbus_tcp_parser_reset(parser);
+
+    return parser;
+}
+
+void modbus_tcp_parser_free(modbus_tcp_parser_t *parser)
+{
+    free(parser);
+}
+
+/* Drops the bytes gathered and the error, for a new stream */
+void modbus_tcp_parser_reset(modbus_tcp_parser_t *parser)
+{
+    if (parser == NULL)
+        return;
+
+    parser->error = MODBUS_TCP_FRAME_OK;
+    parser->length = 0;
+    parser->adu_length = 0;
+}
+
+/* Parses the next bytes of the stream and calls back with each frame
+   completed, valid or not. The callback may reset the parser but not free it.
+
+   The function shall return the number of valid frames or -1 and set errno
+   (EMBBADDATA after an error of MBAP header, until a reset). */
+int modbus_tcp_parser_push(modbus_tcp_parser_t *parser,
+                           const uint8_t *data, int length,
+                           modbus_tcp_parser_callback_t callback,
+                           void *user_data)
+{
+    int nb_frames = 0;
+
+    if (parser == NULL || length < 0 || (data == NULL && length > 0) ||
+        callback == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (parser->error != MODBUS_TCP_FRAME_OK) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    while (length > 0) {
+        int n;
+
+        if (parser->length == 0 && length >= _MODBUS_TCP_HEADER_LENGTH) {
+            int adu_length = _parser_header(parser, data, callback, user_data);
+
+            if (adu_length == -1)
+                return -1;
+
+            if (adu_length <= length) {
+                /* The frame is in the data */
+                nb_frames += _parser_frame(parser, data, adu_length,
+                                           callback, user_data);
+                data += adu_length;
+                length -= adu_length;
+                continue;
+            }
+            parser->adu_length = adu_length;
+        }
+
+        /* Gathers the bytes of the header then the ones of the frame */
+        if (parser->length < _MODBUS_TCP_HEADER_LENGTH) {
+            n = _MODBUS_TCP_HEADER_LENGTH - parser->length;
+        } else {
+            n = parser->adu_length - parser->length;
+        }
+        if (n > length)
+            n = length;
+        memcpy(parser->buf + parser->length, data, n);
+        parser->length += n;
+        data += n;
+        length -= n;
+
+        if (parser->adu_length == 0 &&
+            parser->length == _MODBUS_TCP_HEADER_LENGTH) {
+            int adu_length = _parser_header(parser, parser->buf,
+                                            callback, user_data);
+
+            if (adu_length == -1)
+                return -1;
+            parser->adu_length = adu_length;
+        }
+
+        if (parser->length == parser->adu_length) {
+            nb_frames += _parser_frame(parser, parser->buf, parser->adu_length,
+                                       callback, user_data);
+            parser->length = 0;
+            parser->adu_length = 0;
+        }
+    }
+
+    return nb_frames;
+}
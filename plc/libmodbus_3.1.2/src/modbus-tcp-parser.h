@@ -0,0 +1,74 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_TCP_PARSER_H
+#define MODBUS_TCP_PARSER_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Direction of the frames of a parser */
+#define MODBUS_TCP_PARSER_REQUEST   0
+#define MODBUS_TCP_PARSER_RESPONSE  1
+
+/* Errors of the frames, the parser stops after the errors of the MBAP header
+ * (protocol and length) since the stream can't be resynchronized */
+#define MODBUS_TCP_FRAME_OK               0
+#define MODBUS_TCP_FRAME_BAD_PROTOCOL     1
+#define MODBUS_TCP_FRAME_BAD_LENGTH       2
+#define MODBUS_TCP_FRAME_LENGTH_MISMATCH  3
+#define MODBUS_TCP_FRAME_BAD_QUANTITY     4
+#define MODBUS_TCP_FRAME_BAD_BYTE_COUNT   5
+
+typedef struct _modbus_tcp_parser modbus_tcp_parser_t;
+
+/* View of a frame, the fields absent from the function are -1 */
+typedef struct {
+    /* MBAP header and PDU, in the data pushed or in the parser */
+    const uint8_t *adu;
+    int adu_length;
+    int transaction_id;
+    int unit_id;
+    int function;
+    int addr;
+    int nb;
+    /* Write part of MODBUS_FC_WRITE_AND_READ_REGISTERS */
+    int write_addr;
+    int write_nb;
+    int byte_count;
+    int exception_code;
+    int error;
+} modbus_tcp_frame_t;
+
+/* Called with each frame, the view is only valid during the call */
+typedef void (*modbus_tcp_parser_callback_t)(modbus_tcp_parser_t *parser,
+                                             const modbus_tcp_frame_t *frame,
+                                             void *user_data);
+
+MODBUS_API modbus_tcp_parser_t* modbus_tcp_parser_new(int type);
+MODBUS_API void modbus_tcp_parser_free(modbus_tcp_parser_t *parser);
+MODBUS_API void modbus_tcp_parser_reset(modbus_tcp_parser_t *parser);
+MODBUS_API int modbus_tcp_parser_push(modbus_tcp_parser_t *parser,
+                                      const uint8_t *data, int length,
+                                      modbus_tcp_parser_callback_t callback,
+                                      void *user_data);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_TCP_PARSER_H */
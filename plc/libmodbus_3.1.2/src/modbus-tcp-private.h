@@ -25,8 +25,9 @@
 
 #define _MODBUS_TCP_CHECKSUM_LENGTH    0
 
-/* In both structures, the transaction ID must be placed on first position
-   to have a quick access not dependant of the TCP backend */
+/* In these structures and the one of the UDP backend, the transaction ID must
+   be placed on first position to have a quick access not dependant of the
+   backend */
 typedef struct _modbus_tcp {
     /* Extract from MODBUS Messaging on TCP/IP Implementation Guide V1.0b
        (page 23/46):
@@ -53,4 +54,30 @@ typedef struct _modbus_tcp_pi {
     char service[_MODBUS_TCP_PI_SERVICE_LENGTH];
 } modbus_tcp_pi_t;
 
+/* Context of a connection accepted by a server, without address */
+typedef struct _modbus_tcp_server {
+    /* Transaction ID */
+    uint16_t t_id;
+} modbus_tcp_server_t;
+
+/* MBAP framing shared with the UDP and Unix backends */
+int _modbus_tcp_set_slave(modbus_t *ctx, int slave);
+int _modbus_tcp_build_request_basis(modbus_t *ctx, int function, int addr,
+                                    int nb, uint8_t *req);
+int _modbus_tcp_build_response_basis(sft_t *sft, uint8_t *rsp);
+int _modbus_tcp_prepare_response_tid(const uint8_t *req, int *req_length);
+int _modbus_tcp_send_msg_pre(uint8_t *req, int req_length);
+int _modbus_tcp_check_integrity(modbus_t *ctx, uint8_t *msg,
+                                const int msg_length);
+int _modbus_tcp_pre_check_confirmation(modbus_t *ctx, const uint8_t *req,
+                                       const uint8_t *rsp, int rsp_length);
+
+/* Stream socket operations shared with the Unix backend */
+ssize_t _modbus_tcp_send(modbus_t *ctx, const uint8_t *req, int req_length);
+int _modbus_tcp_receive(modbus_t *ctx, uint8_t *req);
+ssize_t _modbus_tcp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length);
+void _modbus_tcp_close(modbus_t *ctx);
+int _modbus_tcp_flush(modbus_t *ctx);
+int _modbus_tcp_select(modbus_t *ctx, struct timeval *tv, int length_to_read);
+
 #endif /* MODBUS_TCP_PRIVATE_H */
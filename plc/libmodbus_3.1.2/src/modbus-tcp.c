@@ -52,6 +52,7 @@
 # include <netinet/tcp.h>
 # include <arpa/inet.h>
 # include <netdb.h>
+# include <poll.h>
 #endif
 
 #if !defined(MSG_NOSIGNAL)
@@ -79,7 +80,7 @@ static int _modbus_tcp_init_win32(void)
 }
 #endif
 
-static int _modbus_set_slave(modbus_t *ctx, int slave)
+int _modbus_tcp_set_slave(modbus_t *ctx, int slave)
 {
     /* Broadcast address is 0 (MODBUS_BROADCAST_ADDRESS) */
     if (slave >= 0 && slave <= 247) {
@@ -97,9 +98,9 @@ static int _modbus_set_slave(modbus_t *ctx, int slave)
 }
 
 /* Builds a TCP request header */
-static int _modbus_tcp_build_request_basis(modbus_t *ctx, int function,
-                                           int addr, int nb,
-                                           uint8_t *req)
+int _modbus_tcp_build_request_basis(modbus_t *ctx, int function,
+                                    int addr, int nb,
+                                    uint8_t *req)
 {
     modbus_tcp_t *ctx_tcp = ctx->backend_data;
 
@@ -129,7 +130,7 @@ static int _modbus_tcp_build_request_basis(modbus_t *ctx, int function,
 }
 
 /* Builds a TCP response header */
-static int _modbus_tcp_build_response_basis(sft_t *sft, uint8_t *rsp)
+int _modbus_tcp_build_response_basis(sft_t *sft, uint8_t *rsp)
 {
     /* Extract from MODBUS Messaging on TCP/IP Implementation
        Guide V1.0b (page 23/46):
@@ -152,12 +153,12 @@ static int _modbus_tcp_build_response_basis(sft_t *sft, uint8_t *rsp)
 }
 
 
-static int _modbus_tcp_prepare_response_tid(const uint8_t *req, int *req_length)
+int _modbus_tcp_prepare_response_tid(const uint8_t *req, int *req_length)
 {
     return (req[0] << 8) + req[1];
 }
 
-static int _modbus_tcp_send_msg_pre(uint8_t *req, int req_length)
+int _modbus_tcp_send_msg_pre(uint8_t *req, int req_length)
 {
     /* Substract the header length to the message length */
     int mbap_length = req_length - 6;
@@ -168,30 +169,62 @@ static int _modbus_tcp_send_msg_pre(uint8_t *req, int req_length)
     return req_length;
 }
 
-static ssize_t _modbus_tcp_send(modbus_t *ctx, const uint8_t *req, int req_length)
+ssize_t _modbus_tcp_send(modbus_t *ctx, const uint8_t *req, int req_length)
 {
+    ssize_t rc;
+
+#ifdef TCP_QUICKACK
+    /* The quick ack mode of Linux is left after the first segments, it's
+       restored once per message sent so the next message received (the
+       response or the next request) is acknowledged without delay */
+    if (ctx->tcp_profile != NULL && ctx->tcp_profile->quickack) {
+        int yes = 1;
+        setsockopt(ctx->s, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(int));
+    }
+#endif
+
     /* MSG_NOSIGNAL
        Requests not to send SIGPIPE on errors on stream oriented
        sockets when the other end breaks the connection.  The EPIPE
        error is still returned. */
-    return send(ctx->s, (const char*)req, req_length, MSG_NOSIGNAL);
+    rc = send(ctx->s, (const char*)req, req_length, MSG_NOSIGNAL);
+
+#ifdef TCP_FASTOPEN_CONNECT
+    if (rc == -1 && ctx->tcp_profile != NULL && ctx->tcp_profile->fastopen > 0 &&
+        (errno == EINPROGRESS ||
+         (errno == EAGAIN && ctx->wait_mode == MODBUS_WAIT_BLOCK))) {
+        /* The handshake precedes the request when the SYN can't carry it
+           (EINPROGRESS) or when the connection wasn't waited for (EAGAIN) */
+        struct timeval tv = ctx->response_timeout;
+
+        rc = _modbus_poll_fd(ctx, ctx->s, POLLOUT, &tv);
+        if (rc <= 0) {
+            if (rc == 0)
+                errno = ETIMEDOUT;
+            return -1;
+        }
+        rc = send(ctx->s, (const char*)req, req_length, MSG_NOSIGNAL);
+    }
+#endif
+
+    return rc;
 }
 
-static int _modbus_tcp_receive(modbus_t *ctx, uint8_t *req) {
+int _modbus_tcp_receive(modbus_t *ctx, uint8_t *req) {
     return _modbus_receive_msg(ctx, req, MSG_INDICATION);
 }
 
-static ssize_t _modbus_tcp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length) {
+ssize_t _modbus_tcp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length) {
     return recv(ctx->s, (char *)rsp, rsp_length, 0);
 }
 
-static int _modbus_tcp_check_integrity(modbus_t *ctx, uint8_t *msg, const int msg_length)
+int _modbus_tcp_check_integrity(modbus_t *ctx, uint8_t *msg, const int msg_length)
 {
     return msg_length;
 }
 
-static int _modbus_tcp_pre_check_confirmation(modbus_t *ctx, const uint8_t *req,
-                                              const uint8_t *rsp, int rsp_length)
+int _modbus_tcp_pre_check_confirmation(modbus_t *ctx, const uint8_t *req,
+                                       const uint8_t *rsp, int rsp_length)
 {
     /* Check transaction ID */
     if (req[0] != rsp[0] || req[1] != rsp[1]) {
@@ -263,6 +296,103 @@ static int _modbus_tcp_set_ipv4_options(int s)
     return 0;
 }
 
+/* Uses of the profile of the context */
+#define _PROFILE_CONNECT 0
+#define _PROFILE_ACCEPT  1
+#define _PROFILE_LISTEN  2
+
+static int _modbus_tcp_set_option(int s, int level, int name, int value)
+{
+    return setsockopt(s, level, name, (const void *)&value, sizeof(int));
+}
+
+/* Applies the profile of the context to a socket before its connection,
+   after its acceptance or before listen() (the accepted sockets inherit the
+   buffers and the class of service) */
+static int _modbus_tcp_apply_profile(modbus_t *ctx, int s, int family, int use)
+{
+    const modbus_tcp_profile_t *profile = ctx->tcp_profile;
+
+    if (profile == NULL)
+        return 0;
+
+    if (use != _PROFILE_LISTEN) {
+        if (_modbus_tcp_set_option(s, IPPROTO_TCP, TCP_NODELAY,
+                                   profile->nodelay) == -1)
+            return -1;
+#ifdef TCP_QUICKACK
+        if (profile->quickack &&
+            _modbus_tcp_set_option(s, IPPROTO_TCP, TCP_QUICKACK, 1) == -1)
+            return -1;
+#endif
+#ifdef SO_BUSY_POLL
+        if (profile->busy_poll > 0 &&
+            _modbus_tcp_set_option(s, SOL_SOCKET, SO_BUSY_POLL,
+                                   profile->busy_poll) == -1)
+            return -1;
+#endif
+#ifdef TCP_USER_TIMEOUT
+        if (profile->user_timeout > 0 &&
+            _modbus_tcp_set_option(s, IPPROTO_TCP, TCP_USER_TIMEOUT,
+                                   profile->user_timeout) == -1)
+            return -1;
+#endif
+    }
+
+#ifdef SO_PRIORITY
+    if (profile->priority >= 0 &&
+        _modbus_tcp_set_option(s, SOL_SOCKET, SO_PRIORITY,
+                               profile->priority) == -1)
+        return -1;
+#endif
+    if (profile->dscp >= 0) {
+        /* The DSCP is the 6 high bits of the traffic class */
+#ifdef IPV6_TCLASS
+        if (family == AF_INET6) {
+            if (_modbus_tcp_set_option(s, IPPROTO_IPV6, IPV6_TCLASS,
+                                       profile->dscp << 2) == -1)
+                return -1;
+        } else
+#endif
+        if (_modbus_tcp_set_option(s, IPPROTO_IP, IP_TOS,
+                                   profile->dscp << 2) == -1) {
+            return -1;
+        }
+    }
+    if (profile->send_buffer > 0 &&
+        _modbus_tcp_set_option(s, SOL_SOCKET, SO_SNDBUF,
+                               profile->send_buffer) == -1)
+        return -1;
+    if (profile->recv_buffer > 0 &&
+        _modbus_tcp_set_option(s, SOL_SOCKET, SO_RCVBUF,
+                               profile->recv_buffer) == -1)
+        return -1;
+
+#ifdef TCP_FASTOPEN_CONNECT
+    /* connect() returns at once, the SYN is sent with the first request */
+    if (use == _PROFILE_CONNECT && profile->fastopen > 0 &&
+        _modbus_tcp_set_option(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1) == -1)
+        return -1;
+#endif
+    if (use == _PROFILE_LISTEN) {
+#ifdef TCP_FASTOPEN
+        if (profile->fastopen > 0 &&
+            _modbus_tcp_set_option(s, IPPROTO_TCP, TCP_FASTOPEN,
+                                   profile->fastopen) == -1)
+            return -1;
+#endif
+#ifdef TCP_DEFER_ACCEPT
+        /* The connection is accepted with its first request */
+        if (profile->defer_accept > 0 &&
+            _modbus_tcp_set_option(s, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                                   profile->defer_accept) == -1)
+            return -1;
+#endif
+    }
+
+    return 0;
+}
+
 static int _connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen,
                     const struct timeval *ro_tv)
 {
@@ -278,15 +408,27 @@ static int _connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen,
 #else
     if (rc == -1 && errno == EINPROGRESS) {
 #endif
-        fd_set wset;
         int optval;
         socklen_t optlen = sizeof(optval);
-        struct timeval tv = *ro_tv;
+        struct timeval tv;
+
+        if (ro_tv == NULL) {
+            /* Don't wait, the socket becomes writable once connected */
+            errno = EINPROGRESS;
+            return -1;
+        }
+        tv = *ro_tv;
 
         /* Wait to be available in writing */
+#ifdef OS_WIN32
+        fd_set wset;
+
         FD_ZERO(&wset);
         FD_SET(sockfd, &wset);
         rc = select(sockfd + 1, NULL, &wset, NULL, &tv);
+#else
+        rc = _modbus_poll_fd(NULL, sockfd, POLLOUT, &tv);
+#endif
         if (rc <= 0) {
             /* Timeout or fail */
             return -1;
@@ -304,6 +446,12 @@ static int _connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen,
     return rc;
 }
 
+/* In MODBUS_WAIT_NONE mode, the connection isn't waited for */
+static const struct timeval *_connect_timeout(modbus_t *ctx)
+{
+    return (ctx->wait_mode == MODBUS_WAIT_NONE) ? NULL : &ctx->response_timeout;
+}
+
 /* Establishes a modbus TCP connection with a Modbus server. */
 static int _modbus_tcp_connect(modbus_t *ctx)
 {
@@ -333,6 +481,9 @@ static int _modbus_tcp_connect(modbus_t *ctx)
     }
 
     rc = _modbus_tcp_set_ipv4_options(ctx->s);
+    if (rc != -1) {
+        rc = _modbus_tcp_apply_profile(ctx, ctx->s, AF_INET, _PROFILE_CONNECT);
+    }
     if (rc == -1) {
         close(ctx->s);
         ctx->s = -1;
@@ -346,8 +497,13 @@ static int _modbus_tcp_connect(modbus_t *ctx)
     addr.sin_family = AF_INET;
     addr.sin_port = htons(ctx_tcp->port);
     addr.sin_addr.s_addr = inet_addr(ctx_tcp->ip);
-    rc = _connect(ctx->s, (struct sockaddr *)&addr, sizeof(addr), &ctx->response_timeout);
+    rc = _connect(ctx->s, (struct sockaddr *)&addr, sizeof(addr),
+                  _connect_timeout(ctx));
     if (rc == -1) {
+        if (errno == EINPROGRESS && ctx->wait_mode == MODBUS_WAIT_NONE) {
+            /* Connection in progress, the socket is kept */
+            return -1;
+        }
         close(ctx->s);
         ctx->s = -1;
         return -1;
@@ -411,12 +567,25 @@ static int _modbus_tcp_pi_connect(modbus_t *ctx)
         if (ai_ptr->ai_family == AF_INET)
             _modbus_tcp_set_ipv4_options(s);
 
+        if (_modbus_tcp_apply_profile(ctx, s, ai_ptr->ai_family,
+                                      _PROFILE_CONNECT) == -1) {
+            close(s);
+            continue;
+        }
+
         if (ctx->debug) {
             printf("Connecting to [%s]:%s\n", ctx_tcp_pi->node, ctx_tcp_pi->service);
         }
 
-        rc = _connect(s, ai_ptr->ai_addr, ai_ptr->ai_addrlen, &ctx->response_timeout);
+        rc = _connect(s, ai_ptr->ai_addr, ai_ptr->ai_addrlen,
+                      _connect_timeout(ctx));
         if (rc == -1) {
+            if (errno == EINPROGRESS && ctx->wait_mode == MODBUS_WAIT_NONE) {
+                /* Only the first address is tried without waiting */
+                ctx->s = s;
+                freeaddrinfo(ai_list);
+                return -1;
+            }
             close(s);
             continue;
         }
@@ -435,7 +604,7 @@ static int _modbus_tcp_pi_connect(modbus_t *ctx)
 }
 
 /* Closes the network connection and socket in TCP mode */
-static void _modbus_tcp_close(modbus_t *ctx)
+void _modbus_tcp_close(modbus_t *ctx)
 {
     if (ctx->s != -1) {
         shutdown(ctx->s, SHUT_RDWR);
@@ -444,7 +613,7 @@ static void _modbus_tcp_close(modbus_t *ctx)
     }
 }
 
-static int _modbus_tcp_flush(modbus_t *ctx)
+int _modbus_tcp_flush(modbus_t *ctx)
 {
     int rc;
     int rc_sum = 0;
@@ -514,6 +683,11 @@ int modbus_tcp_listen(modbus_t *ctx, int nb_connection)
         return -1;
     }
 
+    if (_modbus_tcp_apply_profile(ctx, new_s, AF_INET, _PROFILE_LISTEN) == -1) {
+        close(new_s);
+        return -1;
+    }
+
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     /* If the modbus port is < to 1024, we need the setuid root. */
@@ -620,6 +794,16 @@ int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection)
             }
         }
 
+        rc = _modbus_tcp_apply_profile(ctx, s, ai_ptr->ai_family,
+                                       _PROFILE_LISTEN);
+        if (rc != 0) {
+            close(s);
+            if (ctx->debug) {
+                perror("setsockopt");
+            }
+            continue;
+        }
+
         rc = bind(s, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
         if (rc != 0) {
             close(s);
@@ -674,6 +858,12 @@ int modbus_tcp_accept(modbus_t *ctx, int *s)
         return -1;
     }
 
+    if (_modbus_tcp_apply_profile(ctx, ctx->s, AF_INET, _PROFILE_ACCEPT) == -1) {
+        close(ctx->s);
+        ctx->s = -1;
+        return -1;
+    }
+
     if (ctx->debug) {
         printf("The client connection from %s is accepted\n",
                inet_ntoa(addr.sin_addr));
@@ -702,6 +892,14 @@ int modbus_tcp_pi_accept(modbus_t *ctx, int *s)
     if (ctx->s == -1) {
         close(*s);
         *s = -1;
+        return -1;
+    }
+
+    if (_modbus_tcp_apply_profile(ctx, ctx->s, addr.ss_family,
+                                  _PROFILE_ACCEPT) == -1) {
+        close(ctx->s);
+        ctx->s = -1;
+        return -1;
     }
 
     if (ctx->debug) {
@@ -711,21 +909,32 @@ int modbus_tcp_pi_accept(modbus_t *ctx, int *s)
     return ctx->s;
 }
 
-static int _modbus_tcp_select(modbus_t *ctx, fd_set *rset, struct timeval *tv, int length_to_read)
+int _modbus_tcp_select(modbus_t *ctx, struct timeval *tv, int length_to_read)
 {
     int s_rc;
-    while ((s_rc = select(ctx->s+1, rset, NULL, NULL, tv)) == -1) {
+#ifdef OS_WIN32
+    fd_set rset;
+
+    FD_ZERO(&rset);
+    FD_SET(ctx->s, &rset);
+    while ((s_rc = select(ctx->s+1, &rset, NULL, NULL, tv)) == -1) {
         if (errno == EINTR) {
             if (ctx->debug) {
                 fprintf(stderr, "A non blocked signal was caught\n");
             }
             /* Necessary after an error */
-            FD_ZERO(rset);
-            FD_SET(ctx->s, rset);
+            FD_ZERO(&rset);
+            FD_SET(ctx->s, &rset);
         } else {
             return -1;
         }
     }
+#else
+    s_rc = _modbus_poll_fd(ctx, ctx->s, POLLIN, tv);
+    if (s_rc == -1) {
+        return -1;
+    }
+#endif
 
     if (s_rc == 0) {
         errno = ETIMEDOUT;
@@ -745,7 +954,7 @@ const modbus_backend_t _modbus_tcp_backend = {
     _MODBUS_TCP_HEADER_LENGTH,
     _MODBUS_TCP_CHECKSUM_LENGTH,
     MODBUS_TCP_MAX_ADU_LENGTH,
-    _modbus_set_slave,
+    _modbus_tcp_set_slave,
     _modbus_tcp_build_request_basis,
     _modbus_tcp_build_response_basis,
     _modbus_tcp_prepare_response_tid,
@@ -768,7 +977,7 @@ const modbus_backend_t _modbus_tcp_pi_backend = {
     _MODBUS_TCP_HEADER_LENGTH,
     _MODBUS_TCP_CHECKSUM_LENGTH,
     MODBUS_TCP_MAX_ADU_LENGTH,
-    _modbus_set_slave,
+    _modbus_tcp_set_slave,
     _modbus_tcp_build_request_basis,
     _modbus_tcp_build_response_basis,
     _modbus_tcp_prepare_response_tid,
@@ -785,13 +994,45 @@ const modbus_backend_t _modbus_tcp_pi_backend = {
     _modbus_tcp_free
 };
 
-modbus_t* modbus_new_tcp(const char *ip, int port)
+/* The address of the client isn't known to connect again */
+static int _modbus_tcp_server_connect(modbus_t *ctx)
 {
-    modbus_t *ctx;
-    modbus_tcp_t *ctx_tcp;
-    size_t dest_size;
-    size_t ret_size;
+    errno = EINVAL;
+    return -1;
+}
+
+const modbus_backend_t _modbus_tcp_server_backend = {
+    _MODBUS_BACKEND_TYPE_TCP,
+    _MODBUS_TCP_HEADER_LENGTH,
+    _MODBUS_TCP_CHECKSUM_LENGTH,
+    MODBUS_TCP_MAX_ADU_LENGTH,
+    _modbus_tcp_set_slave,
+    _modbus_tcp_build_request_basis,
+    _modbus_tcp_build_response_basis,
+    _modbus_tcp_prepare_response_tid,
+    _modbus_tcp_send_msg_pre,
+    _modbus_tcp_send,
+    _modbus_tcp_receive,
+    _modbus_tcp_recv,
+    _modbus_tcp_check_integrity,
+    _modbus_tcp_pre_check_confirmation,
+    _modbus_tcp_server_connect,
+    _modbus_tcp_close,
+    _modbus_tcp_flush,
+    _modbus_tcp_select,
+    _modbus_tcp_free
+};
+
+/* The storage sizes published in modbus-tcp.h must hold the contexts */
+typedef char _modbus_tcp_context_size_check[
+    _MODBUS_STORAGE_SIZE(sizeof(modbus_tcp_t)) <= MODBUS_TCP_CONTEXT_SIZE &&
+    _MODBUS_STORAGE_SIZE(sizeof(modbus_tcp_pi_t)) <= MODBUS_TCP_PI_CONTEXT_SIZE &&
+    _MODBUS_STORAGE_SIZE(sizeof(modbus_tcp_server_t)) <=
+    MODBUS_TCP_SERVER_CONTEXT_SIZE ? 1 : -1];
 
+/* Ignores SIGPIPE on the systems without MSG_NOSIGNAL */
+static int _modbus_tcp_ignore_sigpipe(void)
+{
 #if defined(OS_BSD)
     /* MSG_NOSIGNAL is unsupported on *BSD so we install an ignore
        handler for SIGPIPE. */
@@ -801,19 +1042,24 @@ modbus_t* modbus_new_tcp(const char *ip, int port)
     if (sigaction(SIGPIPE, &sa, NULL) < 0) {
         /* The debug flag can't be set here... */
         fprintf(stderr, "Coud not install SIGPIPE handler.\n");
-        return NULL;
+        return -1;
     }
 #endif
+    return 0;
+}
 
-    ctx = (modbus_t *) malloc(sizeof(modbus_t));
-    _modbus_init_common(ctx);
+/* Sets the backend data of a TCP context, allocated or in storage */
+static int _modbus_tcp_init(modbus_t *ctx, const char *ip, int port)
+{
+    modbus_tcp_t *ctx_tcp;
+    size_t dest_size;
+    size_t ret_size;
 
     /* Could be changed after to reach a remote serial Modbus device */
     ctx->slave = MODBUS_TCP_SLAVE;
 
     ctx->backend = &(_modbus_tcp_backend);
 
-    ctx->backend_data = (modbus_tcp_t *) malloc(sizeof(modbus_tcp_t));
     ctx_tcp = (modbus_tcp_t *)ctx->backend_data;
 
     if (ip != NULL) {
@@ -821,16 +1067,14 @@ modbus_t* modbus_new_tcp(const char *ip, int port)
         ret_size = strlcpy(ctx_tcp->ip, ip, dest_size);
         if (ret_size == 0) {
             fprintf(stderr, "The IP string is empty\n");
-            modbus_free(ctx);
             errno = EINVAL;
-            return NULL;
+            return -1;
         }
 
         if (ret_size >= dest_size) {
             fprintf(stderr, "The IP string has been truncated\n");
-            modbus_free(ctx);
             errno = EINVAL;
-            return NULL;
+            return -1;
         }
     } else {
         ctx_tcp->ip[0] = '0';
@@ -838,26 +1082,59 @@ modbus_t* modbus_new_tcp(const char *ip, int port)
     ctx_tcp->port = port;
     ctx_tcp->t_id = 0;
 
-    return ctx;
+    return 0;
 }
 
+modbus_t* modbus_new_tcp(const char *ip, int port)
+{
+    modbus_t *ctx;
 
-modbus_t* modbus_new_tcp_pi(const char *node, const char *service)
+    if (_modbus_tcp_ignore_sigpipe() == -1) {
+        return NULL;
+    }
+
+    ctx = (modbus_t *) malloc(sizeof(modbus_t));
+    _modbus_init_common(ctx);
+
+    ctx->backend_data = (modbus_tcp_t *) malloc(sizeof(modbus_tcp_t));
+
+    if (_modbus_tcp_init(ctx, ip, port) == -1) {
+        modbus_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+/* Builds the context in the storage of the caller, without allocation */
+modbus_t* modbus_init_tcp(void *storage, size_t size, const char *ip, int port)
 {
     modbus_t *ctx;
+
+    if (_modbus_tcp_ignore_sigpipe() == -1) {
+        return NULL;
+    }
+
+    ctx = _modbus_init_storage(storage, size, sizeof(modbus_tcp_t));
+    if (ctx == NULL || _modbus_tcp_init(ctx, ip, port) == -1) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static int _modbus_tcp_pi_init(modbus_t *ctx, const char *node,
+                               const char *service)
+{
     modbus_tcp_pi_t *ctx_tcp_pi;
     size_t dest_size;
     size_t ret_size;
 
-    ctx = (modbus_t *) malloc(sizeof(modbus_t));
-    _modbus_init_common(ctx);
-
     /* Could be changed after to reach a remote serial Modbus device */
     ctx->slave = MODBUS_TCP_SLAVE;
 
     ctx->backend = &(_modbus_tcp_pi_backend);
 
-    ctx->backend_data = (modbus_tcp_pi_t *) malloc(sizeof(modbus_tcp_pi_t));
     ctx_tcp_pi = (modbus_tcp_pi_t *)ctx->backend_data;
 
     if (node == NULL) {
@@ -868,16 +1145,14 @@ modbus_t* modbus_new_tcp_pi(const char *node, const char *service)
         ret_size = strlcpy(ctx_tcp_pi->node, node, dest_size);
         if (ret_size == 0) {
             fprintf(stderr, "The node string is empty\n");
-            modbus_free(ctx);
             errno = EINVAL;
-            return NULL;
+            return -1;
         }
 
         if (ret_size >= dest_size) {
             fprintf(stderr, "The node string has been truncated\n");
-            modbus_free(ctx);
             errno = EINVAL;
-            return NULL;
+            return -1;
         }
     }
 
@@ -891,19 +1166,167 @@ modbus_t* modbus_new_tcp_pi(const char *node, const char *service)
 
     if (ret_size == 0) {
         fprintf(stderr, "The service string is empty\n");
-        modbus_free(ctx);
         errno = EINVAL;
-        return NULL;
+        return -1;
     }
 
     if (ret_size >= dest_size) {
         fprintf(stderr, "The service string has been truncated\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_tcp_pi->t_id = 0;
+
+    return 0;
+}
+
+modbus_t* modbus_new_tcp_pi(const char *node, const char *service)
+{
+    modbus_t *ctx;
+
+    ctx = (modbus_t *) malloc(sizeof(modbus_t));
+    _modbus_init_common(ctx);
+
+    ctx->backend_data = (modbus_tcp_pi_t *) malloc(sizeof(modbus_tcp_pi_t));
+
+    if (_modbus_tcp_pi_init(ctx, node, service) == -1) {
         modbus_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+modbus_t* modbus_init_tcp_pi(void *storage, size_t size, const char *node,
+                             const char *service)
+{
+    modbus_t *ctx;
+
+    ctx = _modbus_init_storage(storage, size, sizeof(modbus_tcp_pi_t));
+    if (ctx == NULL || _modbus_tcp_pi_init(ctx, node, service) == -1) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+/* Builds a context serving a connection accepted by the caller. Only the
+   transaction ID is kept, the context can't connect again. */
+modbus_t* modbus_init_tcp_server(void *storage, size_t size, int s)
+{
+    modbus_t *ctx;
+    modbus_tcp_server_t *ctx_tcp_server;
+
+    if (s < 0) {
         errno = EINVAL;
         return NULL;
     }
 
-    ctx_tcp_pi->t_id = 0;
+    ctx = _modbus_init_storage(storage, size, sizeof(modbus_tcp_server_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx->slave = MODBUS_TCP_SLAVE;
+    ctx->backend = &(_modbus_tcp_server_backend);
+    ctx_tcp_server = (modbus_tcp_server_t *)ctx->backend_data;
+    ctx_tcp_server->t_id = 0;
+    ctx->s = s;
 
     return ctx;
 }
+
+void modbus_tcp_profile_init(modbus_tcp_profile_t *profile)
+{
+    profile->nodelay = TRUE;
+    profile->quickack = FALSE;
+    profile->busy_poll = 0;
+    profile->priority = -1;
+    profile->dscp = -1;
+    profile->user_timeout = 0;
+    profile->send_buffer = 0;
+    profile->recv_buffer = 0;
+    profile->fastopen = 0;
+    profile->defer_accept = 0;
+}
+
+/* Copies the profile applied to the next sockets connected, accepted or
+   listened by the context. NULL restores the options of the library. */
+int modbus_tcp_set_profile(modbus_t *ctx, const modbus_tcp_profile_t *profile)
+{
+    if (ctx == NULL || (ctx->backend != &_modbus_tcp_backend &&
+                        ctx->backend != &_modbus_tcp_pi_backend &&
+                        ctx->backend != &_modbus_tcp_server_backend)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (profile == NULL) {
+        free(ctx->tcp_profile);
+        ctx->tcp_profile = NULL;
+        return 0;
+    }
+
+    if (profile->busy_poll < 0 || profile->priority < -1 ||
+        profile->dscp < -1 || profile->dscp > 63 ||
+        profile->user_timeout < 0 || profile->send_buffer < 0 ||
+        profile->recv_buffer < 0 || profile->fastopen < 0 ||
+        profile->defer_accept < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Options not offered by the system */
+    if (0
+#ifndef TCP_QUICKACK
+        || profile->quickack
+#endif
+#ifndef SO_BUSY_POLL
+        || profile->busy_poll > 0
+#endif
+#ifndef SO_PRIORITY
+        || profile->priority >= 0
+#endif
+#ifndef TCP_USER_TIMEOUT
+        || profile->user_timeout > 0
+#endif
+#if !defined(TCP_FASTOPEN) || !defined(TCP_FASTOPEN_CONNECT)
+        || profile->fastopen > 0
+#endif
+#ifndef TCP_DEFER_ACCEPT
+        || profile->defer_accept > 0
+#endif
+        ) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (ctx->tcp_profile == NULL) {
+        ctx->tcp_profile = (modbus_tcp_profile_t *) malloc(
+            sizeof(modbus_tcp_profile_t));
+        if (ctx->tcp_profile == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    *ctx->tcp_profile = *profile;
+
+    return 0;
+}
+
+int modbus_tcp_get_profile(modbus_t *ctx, modbus_tcp_profile_t *profile)
+{
+    if (ctx == NULL || profile == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->tcp_profile == NULL) {
+        modbus_tcp_profile_init(profile);
+    } else {
+        *profile = *ctx->tcp_profile;
+    }
+
+    return 0;
+}
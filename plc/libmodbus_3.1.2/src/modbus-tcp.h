@@ -51,6 +51,36 @@ MODBUS_BEGIN_DECLS
  */
 #define MODBUS_TCP_MAX_ADU_LENGTH  260
 
+/* Sizes of the storage given to modbus_init_tcp(), modbus_init_tcp_pi() and
+   modbus_init_tcp_server(), aligned on 8 bytes */
+#define MODBUS_TCP_CONTEXT_SIZE         192
+#define MODBUS_TCP_PI_CONTEXT_SIZE     1280
+#define MODBUS_TCP_SERVER_CONTEXT_SIZE  160
+
+/* Options of the sockets of a TCP context, 0 or -1 leaves the option of the
+ * system */
+typedef struct {
+    /* TCP_NODELAY, set by default */
+    int nodelay;
+    /* TCP_QUICKACK, re-armed before each message sent (Linux) */
+    int quickack;
+    /* SO_BUSY_POLL in microseconds (Linux) */
+    int busy_poll;
+    /* SO_PRIORITY (Linux) and DSCP of the IP header, -1 to leave them */
+    int priority;
+    int dscp;
+    /* TCP_USER_TIMEOUT in milliseconds (Linux) */
+    int user_timeout;
+    /* SO_SNDBUF and SO_RCVBUF in bytes */
+    int send_buffer;
+    int recv_buffer;
+    /* TCP_FASTOPEN: length of the queue of the listening socket, the
+       connections send the first request in the SYN when not 0 (Linux) */
+    int fastopen;
+    /* TCP_DEFER_ACCEPT of the listening socket in seconds (Linux) */
+    int defer_accept;
+} modbus_tcp_profile_t;
+
 MODBUS_API modbus_t* modbus_new_tcp(const char *ip_address, int port);
 MODBUS_API int modbus_tcp_listen(modbus_t *ctx, int nb_connection);
 MODBUS_API int modbus_tcp_accept(modbus_t *ctx, int *s);
@@ -59,6 +89,18 @@ MODBUS_API modbus_t* modbus_new_tcp_pi(const char *node, const char *service);
 MODBUS_API int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection);
 MODBUS_API int modbus_tcp_pi_accept(modbus_t *ctx, int *s);
 
+MODBUS_API modbus_t* modbus_init_tcp(void *storage, size_t size,
+                                     const char *ip_address, int port);
+MODBUS_API modbus_t* modbus_init_tcp_pi(void *storage, size_t size,
+                                        const char *node, const char *service);
+MODBUS_API modbus_t* modbus_init_tcp_server(void *storage, size_t size, int s);
+
+MODBUS_API void modbus_tcp_profile_init(modbus_tcp_profile_t *profile);
+MODBUS_API int modbus_tcp_set_profile(modbus_t *ctx,
+                                      const modbus_tcp_profile_t *profile);
+MODBUS_API int modbus_tcp_get_profile(modbus_t *ctx,
+                                      modbus_tcp_profile_t *profile);
+
 MODBUS_END_DECLS
 
 #endif /* MODBUS_TCP_H */
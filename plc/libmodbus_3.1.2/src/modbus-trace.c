@@ -0,0 +1,529 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ *
+ * Wire tracing to pcapng. Each traced context copies the ADU sent and
+ * received in its own ring of records (single producer, the thread of the
+ * context, and single consumer, the writer thread of the trace) so the hot
+ * path only costs a copy and a timestamp. The writer thread wraps the ADU in
+ * synthesized IPv4 and TCP headers, one stream per context with the server
+ * on port 502, and writes them as Enhanced Packet Blocks with a nanosecond
+ * resolution. A full ring drops the record, the drops are reported by the
+ * Interface Statistics Block written on close.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+# include <time.h>
+#endif
+
+#include "modbus.h"
+#include "modbus-private.h"
+#include "modbus-trace.h"
+
+#ifdef HAVE_PTHREAD_H
+
+/* Records per context, a power of 2 */
+#define _TRACE_RING_SIZE 256
+#define _TRACE_MAX_ADU_LENGTH 260
+/* Period of the writer thread */
+#define _TRACE_PERIOD_MS 10
+
+#define _TRACE_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define _TRACE_STORE(p, value) __atomic_store_n(p, value, __ATOMIC_RELEASE)
+
+#define _PCAPNG_SHB 0x0A0D0D0A
+#define _PCAPNG_IDB 0x00000001
+#define _PCAPNG_ISB 0x00000005
+#define _PCAPNG_EPB 0x00000006
+#define _PCAPNG_LINKTYPE_RAW 101
+
+#define _TRACE_IP_HEADER_LENGTH 20
+#define _TRACE_TCP_HEADER_LENGTH 20
+
+typedef struct {
+    int64_t date_ns;
+    uint16_t length;
+    uint8_t sent;
+    uint8_t adu[_TRACE_MAX_ADU_LENGTH];
+} _trace_record_t;
+
+typedef enum {
+    _TRACE_ROLE_UNKNOWN,
+    _TRACE_ROLE_CLIENT,
+    _TRACE_ROLE_SERVER
+} _trace_role_t;
+
+struct _modbus_trace_ring {
+    /* Written by the context */
+    uint32_t head;
+    uint32_t nb_dropped;
+    uint8_t _pad_producer[56];
+    /* Written by the writer thread */
+    uint32_t tail;
+    uint8_t _pad_consumer[60];
+    /* Set when the context is detached, the writer frees the ring once
+       drained */
+    int detached;
+    /* Known from the first ADU: a client sends first, a server receives */
+    _trace_role_t role;
+    uint16_t client_port;
+    uint16_t server_port;
+    uint32_t client_seq;
+    uint32_t server_seq;
+    struct _modbus_trace_ring *next;
+    _trace_record_t records[_TRACE_RING_SIZE];
+};
+
+struct _modbus_trace {
+    FILE *file;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int running;
+    struct _modbus_trace_ring *rings;
+    uint16_t next_client_port;
+    uint16_t ip_id;
+    uint64_t nb_packets;
+    uint64_t nb_dropped;
+};
+
+static int64_t _trace_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Copies the ADU in the ring of the context, called from the send and
+   receive paths */
+void _modbus_trace_record(struct _modbus_trace_ring *ring, int sent,
+                          const uint8_t *msg, int msg_length)
+{
+    uint32_t head = ring->head;
+    _trace_record_t *record;
+
+    if (head - _TRACE_LOAD(&ring->tail) == _TRACE_RING_SIZE) {
+        __atomic_fetch_add(&ring->nb_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (msg_length > _TRACE_MAX_ADU_LENGTH)
+        msg_length = _TRACE_MAX_ADU_LENGTH;
+
+    record = &ring->records[head & (_TRACE_RING_SIZE - 1)];
+    record->date_ns = _trace_now_ns();
+    record->length = msg_length;
+    record->sent = sent;
+    memcpy(record->adu, msg, msg_length);
+    _TRACE_STORE(&ring->head, head + 1);
+}
+
+static uint16_t _trace_checksum(uint32_t sum, const uint8_t *data, int length)
+{
+    int i;
+
+    for (i = 0; i + 1 < length; i += 2)
+        sum += (data[i] << 8) | data[i + 1];
+    if (length & 1)
+        sum += data[length - 1] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return ~sum & 0xFFFF;
+}
+
+static void _trace_put_16(uint8_t *dest, uint16_t value)
+{
+    dest[0] = value >> 8;
+    dest[1] = value & 0xFF;
+}
+
+static void _trace_put_32(uint8_t *dest, uint32_t value)
+{
+    dest[0] = value >> 24;
+    dest[1] = (value >> 16) & 0xFF;
+    dest[2] = (value >> 8) & 0xFF;
+    dest[3] = value & 0xFF;
+}
+
+static void _trace_write_block(modbus_trace_t *trace, uint32_t type,
+                               const void *body, uint32_t body_length)
+{
+    static const uint8_t padding[3] = { 0, 0, 0 };
+    uint32_t padded_length = (body_length + 3) & ~3;
+    uint32_t total_length = 12 + padded_length;
+
+    fwrite(&type, 4, 1, trace->file);
+    fwrite(&total_length, 4, 1, trace->file);
+    fwrite(body, 1, body_length, trace->file);
+    fwrite(padding, 1, padded_length - body_length, trace->file);
+    fwrite(&total_length, 4, 1, trace->file);
+}
+
+/* Writes the record as an IPv4 packet of the TCP stream of the context,
+   between 127.0.0.1 (client) and 127.0.0.2 (server) */
+static void _trace_write_packet(modbus_trace_t *trace,
+                                struct _modbus_trace_ring *ring,
+                                const _trace_record_t *record)
+{
+    uint32_t epb[(20 + _TRACE_IP_HEADER_LENGTH + _TRACE_TCP_HEADER_LENGTH +
+                  _TRACE_MAX_ADU_LENGTH) / 4];
+    uint8_t *ip = (uint8_t *)epb + 20;
+    uint8_t *tcp = ip + _TRACE_IP_HEADER_LENGTH;
+    int from_client;
+    int packet_length = _TRACE_IP_HEADER_LENGTH + _TRACE_TCP_HEADER_LENGTH +
+        record->length;
+    uint64_t date = record->date_ns;
+    uint32_t sum;
+
+    if (ring->role == _TRACE_ROLE_UNKNOWN) {
+        ring->role = record->sent ? _TRACE_ROLE_CLIENT : _TRACE_ROLE_SERVER;
+    }
+    from_client = (record->sent == (ring->role == _TRACE_ROLE_CLIENT));
+
+    /* Enhanced Packet Block */
+    epb[0] = 0;
+    epb[1] = (uint32_t)(date >> 32);
+    epb[2] = (uint32_t)date;
+    epb[3] = packet_length;
+    epb[4] = packet_length;
+
+    ip[0] = 0x45;
+    ip[1] = 0;
+    _trace_put_16(ip + 2, packet_length);
+    _trace_put_16(ip + 4, trace->ip_id++);
+    /* Don't fragment */
+    _trace_put_16(ip + 6, 0x4000);
+    ip[8] = 64;
+    ip[9] = 6;
+    _trace_put_16(ip + 10, 0);
+    _trace_put_32(ip + 12, from_client ? 0x7F000001 : 0x7F000002);
+    _trace_put_32(ip + 16, from_client ? 0x7F000002 : 0x7F000001);
+    _trace_put_16(ip + 10, _trace_checksum(0, ip, _TRACE_IP_HEADER_LENGTH));
+
+    _trace_put_16(tcp, from_client ? ring->client_port : ring->server_port);
+    _trace_put_16(tcp + 2, from_client ? ring->server_port : ring->client_port);
+    _trace_put_32(tcp + 4, from_client ? ring->client_seq : ring->server_seq);
+    _trace_put_32(tcp + 8, from_client ? ring->server_seq : ring->client_seq);
+    tcp[12] = (_TRACE_TCP_HEADER_LENGTH / 4) << 4;
+    /* PSH and ACK */
+    tcp[13] = 0x18;
+    _trace_put_16(tcp + 14, 0xFFFF);
+    _trace_put_16(tcp + 16, 0);
+    _trace_put_16(tcp + 18, 0);
+    memcpy(tcp + _TRACE_TCP_HEADER_LENGTH, record->adu, record->length);
+
+    /* Pseudo header: addresses, protocol and TCP length */
+    sum = 0x7F00 + 0x0001 + 0x7F00 + 0x0002 + 6 +
+        _TRACE_TCP_HEADER_LENGTH + record->length;
+    _trace_put_16(tcp + 16, _trace_checksum(sum, tcp, _TRACE_TCP_HEADER_LENGTH +
+                                            record->length));
+
+    if (from_client) {
+        ring->client_seq += record->length;
+    } else {
+        ring->server_seq += record->length;
+    }
+
+    _trace_write_block(trace, _PCAPNG_EPB, epb, 20 + packet_length);
+    trace->nb_packets++;
+}
+
+/* Fields of the blocks in the byte order of the host, as the section */
+static uint8_t *_trace_put_host_16(uint8_t *dest, uint16_t value)
+{
+    memcpy(dest, &value, 2);
+    return dest + 2;
+}
+
+static uint8_t *_trace_put_host_32(uint8_t *dest, uint32_t value)
+{
+    memcpy(dest, &value, 4);
+    return dest + 4;
+}
+
+static void _trace_write_header(modbus_trace_t *trace)
+{
+    uint8_t shb[16];
+    uint8_t idb[20];
+    uint8_t *p;
+
+    /* Byte order magic, version 1.0 and unknown section length */
+    p = _trace_put_host_32(shb, 0x1A2B3C4D);
+    p = _trace_put_host_16(p, 1);
+    p = _trace_put_host_16(p, 0);
+    memset(p, 0xFF, 8);
+    _trace_write_block(trace, _PCAPNG_SHB, shb, sizeof(shb));
+
+    /* Raw IP without snapshot length, if_tsresol of 10^-9 and end of
+       options */
+    memset(idb, 0, sizeof(idb));
+    p = _trace_put_host_16(idb, _PCAPNG_LINKTYPE_RAW);
+    p = _trace_put_host_16(p, 0);
+    p = _trace_put_host_32(p, 0);
+    p = _trace_put_host_16(p, 9);
+    p = _trace_put_host_16(p, 1);
+    *p = 9;
+    _trace_write_block(trace, _PCAPNG_IDB, idb, sizeof(idb));
+}
+
+/* Interface Statistics Block with isb_ifrecv and isb_ifdrop */
+static void _trace_write_statistics(modbus_trace_t *trace)
+{
+    uint8_t isb[40];
+    uint64_t date = _trace_now_ns();
+    uint8_t *p;
+
+    p = _trace_put_host_32(isb, 0);
+    p = _trace_put_host_32(p, (uint32_t)(date >> 32));
+    p = _trace_put_host_32(p, (uint32_t)date);
+    p = _trace_put_host_16(p, 4);
+    p = _trace_put_host_16(p, 8);
+    memcpy(p, &trace->nb_packets, 8);
+    p += 8;
+    p = _trace_put_host_16(p, 5);
+    p = _trace_put_host_16(p, 8);
+    memcpy(p, &trace->nb_dropped, 8);
+    p += 8;
+    p = _trace_put_host_16(p, 0);
+    _trace_put_host_16(p, 0);
+    _trace_write_block(trace, _PCAPNG_ISB, isb, sizeof(isb));
+}
+
+/* Writes the records of the rings and frees the drained rings of the
+   detached contexts, with the mutex held */
+static void _trace_drain(modbus_trace_t *trace)
+{
+    struct _modbus_trace_ring **p_ring = &trace->rings;
+
+    while (*p_ring != NULL) {
+        struct _modbus_trace_ring *ring = *p_ring;
+        int detached = _TRACE_LOAD(&ring->detached);
+        uint32_t head = _TRACE_LOAD(&ring->head);
+        uint32_t tail = ring->tail;
+
+        while (tail != head) {
+            _trace_write_packet(trace, ring,
+                                &ring->records[tail & (_TRACE_RING_SIZE - 1)]);
+            tail++;
+        }
+        _TRACE_STORE(&ring->tail, tail);
+
+        if (detached) {
+            trace->nb_dropped += _TRACE_LOAD(&ring->nb_dropped);
+            *p_ring = ring->next;
+            free(ring);
+        } else {
+            p_ring = &ring->next;
+        }
+    }
+    fflush(trace->file);
+}
+
+static void *_trace_writer(void *arg)
+{
+    modbus_trace_t *trace = arg;
+
+    pthread_mutex_lock(&trace->mutex);
+    while (trace->running) {
+        struct timespec deadline;
+
+        _trace_drain(trace);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += _TRACE_PERIOD_MS * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&trace->cond, &trace->mutex, &deadline);
+    }
+    _trace_drain(trace);
+    pthread_mutex_unlock(&trace->mutex);
+
+    return NULL;
+}
+
+/* Detaches the context from its trace, the ring is freed by the writer once
+   drained */
+void _modbus_trace_detach(modbus_t *ctx)
+{
+    struct _modbus_trace_ring *ring = ctx->trace;
+
+    if (ring == NULL)
+        return;
+
+    ctx->trace = NULL;
+    _TRACE_STORE(&ring->detached, TRUE);
+}
+
+/* Creates the pcapng file and starts the writer thread.
+
+   The function shall return the trace or NULL and set errno. */
+modbus_trace_t* modbus_trace_new(const char *filename)
+{
+    modbus_trace_t *trace;
+    int rc;
+
+    if (filename == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    trace = (modbus_trace_t *) malloc(sizeof(modbus_trace_t));
+    if (trace == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    trace->file = fopen(filename, "wb");
+    if (trace->file == NULL) {
+        free(trace);
+        return NULL;
+    }
+
+    trace->rings = NULL;
+    trace->next_client_port = 49152;
+    trace->ip_id = 0;
+    trace->nb_packets = 0;
+    trace->nb_dropped = 0;
+    trace->running = TRUE;
+    _trace_write_header(trace);
+
+    pthread_mutex_init(&trace->mutex, NULL);
+    pthread_cond_init(&trace->cond, NULL);
+    rc = pthread_create(&trace->thread, NULL, _trace_writer, trace);
+    if (rc != 0) {
+        pthread_cond_destroy(&trace->cond);
+        pthread_mutex_destroy(&trace->mutex);
+        fclose(trace->file);
+        free(trace);
+        errno = rc;
+        return NULL;
+    }
+
+    return trace;
+}
+
+/* Writes the last records and the statistics then closes the file. The
+   contexts must be detached or freed before. */
+void modbus_trace_free(modbus_trace_t *trace)
+{
+    if (trace == NULL)
+        return;
+
+    pthread_mutex_lock(&trace->mutex);
+    trace->running = FALSE;
+    pthread_cond_signal(&trace->cond);
+    pthread_mutex_unlock(&trace->mutex);
+    pthread_join(trace->thread, NULL);
+
+    _trace_write_statistics(trace);
+    fclose(trace->file);
+
+    while (trace->rings != NULL) {
+        struct _modbus_trace_ring *ring = trace->rings;
+
+        trace->rings = ring->next;
+        free(ring);
+    }
+    pthread_cond_destroy(&trace->cond);
+    pthread_mutex_destroy(&trace->mutex);
+    free(trace);
+}
+
+/* Traces the ADU of the context in a new TCP stream, NULL stops the
+   tracing */
+int modbus_set_trace(modbus_t *ctx, modbus_trace_t *trace)
+{
+    struct _modbus_trace_ring *ring;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _modbus_trace_detach(ctx);
+    if (trace == NULL)
+        return 0;
+
+    ring = (struct _modbus_trace_ring *) malloc(
+        sizeof(struct _modbus_trace_ring));
+    if (ring == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ring->head = 0;
+    ring->nb_dropped = 0;
+    ring->tail = 0;
+    ring->detached = FALSE;
+    ring->role = _TRACE_ROLE_UNKNOWN;
+    ring->server_port = (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU) ?
+        MODBUS_TRACE_RTU_PORT : MODBUS_TCP_DEFAULT_PORT;
+    ring->client_seq = 1;
+    ring->server_seq = 1;
+
+    pthread_mutex_lock(&trace->mutex);
+    ring->client_port = trace->next_client_port++;
+    if (trace->next_client_port == 0)
+        trace->next_client_port = 49152;
+    ring->next = trace->rings;
+    trace->rings = ring;
+    pthread_mutex_unlock(&trace->mutex);
+
+    ctx->trace = ring;
+
+    return 0;
+}
+
+#else
+
+void _modbus_trace_record(struct _modbus_trace_ring *ring, int sent,
+                          const uint8_t *msg, int msg_length)
+{
+}
+
+void _modbus_trace_detach(modbus_t *ctx)
+{
+}
+
+modbus_trace_t* modbus_trace_new(const char *filename)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void modbus_trace_free(modbus_trace_t *trace)
+{
+}
+
+int modbus_set_trace(modbus_t *ctx, modbus_trace_t *trace)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
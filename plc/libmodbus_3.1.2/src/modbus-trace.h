@@ -0,0 +1,38 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_TRACE_H
+#define MODBUS_TRACE_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* TCP port of the server in the trace of a RTU context, the TCP backends use
+   502 */
+#define MODBUS_TRACE_RTU_PORT 5020
+
+typedef struct _modbus_trace modbus_trace_t;
+
+MODBUS_API modbus_trace_t* modbus_trace_new(const char *filename);
+MODBUS_API void modbus_trace_free(modbus_trace_t *trace);
+MODBUS_API int modbus_set_trace(modbus_t *ctx, modbus_trace_t *trace);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_TRACE_H */
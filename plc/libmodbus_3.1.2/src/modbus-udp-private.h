@@ -0,0 +1,48 @@
+/*
+ * Copyright © 2001-2011 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_UDP_PRIVATE_H
+#define MODBUS_UDP_PRIVATE_H
+
+/* Datagrams received by a recvmmsg() call and responses sent by sendmmsg() */
+#define _MODBUS_UDP_BATCH_SIZE  64
+
+typedef struct _modbus_udp_batch modbus_udp_batch_t;
+
+typedef struct _modbus_udp {
+    /* Transaction ID, first as in the TCP backends */
+    uint16_t t_id;
+    /* UDP port */
+    int port;
+    /* IP address */
+    char ip[16];
+    /* Bound by modbus_udp_bind(), the responses are sent to the peer */
+    int server;
+    /* Datagram read by recv() as the bytes of a stream */
+    uint8_t rx[MODBUS_UDP_MAX_ADU_LENGTH];
+    int rx_length;
+    int rx_offset;
+    /* Sender of the last datagram */
+    struct sockaddr_storage peer;
+    socklen_t peer_length;
+    /* Buffers of modbus_udp_process() (allocated on demand) */
+    modbus_udp_batch_t *batch;
+    int batching;
+} modbus_udp_t;
+
+#endif /* MODBUS_UDP_PRIVATE_H */
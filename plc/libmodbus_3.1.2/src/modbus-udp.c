@@ -0,0 +1,500 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+
+#ifndef _WIN32
+# include <unistd.h>
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+# include <poll.h>
+#endif
+
+#include "modbus-private.h"
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+#include "modbus-udp.h"
+
+#ifndef _WIN32
+
+#include "modbus-udp-private.h"
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef HAVE_RECVMMSG
+/* Datagrams received and sent one at a time with the same layout */
+struct _modbus_mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+# define mmsghdr _modbus_mmsghdr
+# undef HAVE_SENDMMSG
+#endif
+
+struct _modbus_udp_batch {
+    struct mmsghdr rx_msgs[_MODBUS_UDP_BATCH_SIZE];
+    struct iovec rx_iov[_MODBUS_UDP_BATCH_SIZE];
+    struct sockaddr_storage addrs[_MODBUS_UDP_BATCH_SIZE];
+    uint8_t rx[_MODBUS_UDP_BATCH_SIZE][MODBUS_UDP_MAX_ADU_LENGTH];
+    struct mmsghdr tx_msgs[_MODBUS_UDP_BATCH_SIZE];
+    struct iovec tx_iov[_MODBUS_UDP_BATCH_SIZE];
+    uint8_t tx[_MODBUS_UDP_BATCH_SIZE][MODBUS_UDP_MAX_ADU_LENGTH];
+    /* Datagram replied and number of responses */
+    int current;
+    int nb_tx;
+};
+
+static ssize_t _modbus_udp_send(modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+
+    if (ctx_udp->batching) {
+        /* Sent with the other responses of the batch */
+        modbus_udp_batch_t *batch = ctx_udp->batch;
+        int i = batch->nb_tx;
+
+        if (i == _MODBUS_UDP_BATCH_SIZE) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        memcpy(batch->tx[i], req, req_length);
+        batch->tx_iov[i].iov_base = batch->tx[i];
+        batch->tx_iov[i].iov_len = req_length;
+        batch->tx_msgs[i].msg_hdr.msg_name = &batch->addrs[batch->current];
+        batch->tx_msgs[i].msg_hdr.msg_namelen =
+            batch->rx_msgs[batch->current].msg_hdr.msg_namelen;
+        batch->tx_msgs[i].msg_hdr.msg_iov = &batch->tx_iov[i];
+        batch->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->nb_tx++;
+        return req_length;
+    }
+
+    if (ctx_udp->server) {
+        return sendto(ctx->s, req, req_length, MSG_NOSIGNAL,
+                      (struct sockaddr *)&ctx_udp->peer, ctx_udp->peer_length);
+    }
+
+    return send(ctx->s, req, req_length, MSG_NOSIGNAL);
+}
+
+static int _modbus_udp_receive(modbus_t *ctx, uint8_t *req)
+{
+    return _modbus_receive_msg(ctx, req, MSG_INDICATION);
+}
+
+/* Serves the bytes of the current datagram, a new datagram is only received
+   once the previous one has been read or flushed */
+static ssize_t _modbus_udp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+    int length;
+
+    if (ctx_udp->rx_offset == ctx_udp->rx_length) {
+        ssize_t rc;
+
+        ctx_udp->peer_length = sizeof(ctx_udp->peer);
+        rc = recvfrom(ctx->s, ctx_udp->rx, sizeof(ctx_udp->rx), 0,
+                      (struct sockaddr *)&ctx_udp->peer,
+                      &ctx_udp->peer_length);
+        if (rc <= 0)
+            return rc;
+        ctx_udp->rx_length = rc;
+        ctx_udp->rx_offset = 0;
+    }
+
+    length = ctx_udp->rx_length - ctx_udp->rx_offset;
+    if (length > rsp_length)
+        length = rsp_length;
+    memcpy(rsp, ctx_udp->rx + ctx_udp->rx_offset, length);
+    ctx_udp->rx_offset += length;
+
+    return length;
+}
+
+/* Creates the socket of a client, connected to the server to only receive
+   its datagrams */
+static int _modbus_udp_connect(modbus_t *ctx)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+    struct sockaddr_in addr;
+    int flags = SOCK_DGRAM;
+
+#ifdef SOCK_CLOEXEC
+    flags |= SOCK_CLOEXEC;
+#endif
+
+    ctx->s = socket(PF_INET, flags, 0);
+    if (ctx->s == -1) {
+        return -1;
+    }
+
+    if (ctx->debug) {
+        printf("Connecting to %s:%d (UDP)\n", ctx_udp->ip, ctx_udp->port);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(ctx_udp->port);
+    addr.sin_addr.s_addr = inet_addr(ctx_udp->ip);
+    if (connect(ctx->s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(ctx->s);
+        ctx->s = -1;
+        return -1;
+    }
+    ctx_udp->server = FALSE;
+    ctx_udp->rx_length = 0;
+    ctx_udp->rx_offset = 0;
+
+    return 0;
+}
+
+static void _modbus_udp_close(modbus_t *ctx)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+
+    if (ctx->s != -1) {
+        close(ctx->s);
+        ctx->s = -1;
+    }
+    ctx_udp->rx_length = 0;
+    ctx_udp->rx_offset = 0;
+}
+
+/* Discards the rest of the current datagram, the next ones may come from other
+   clients */
+static int _modbus_udp_flush(modbus_t *ctx)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+    int rc = ctx_udp->rx_length - ctx_udp->rx_offset;
+
+    ctx_udp->rx_length = 0;
+    ctx_udp->rx_offset = 0;
+
+    return rc;
+}
+
+static int _modbus_udp_select(modbus_t *ctx, struct timeval *tv,
+                              int length_to_read)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+    int s_rc;
+
+    if (ctx_udp->rx_offset < ctx_udp->rx_length)
+        return 1;
+
+    s_rc = _modbus_poll_fd(ctx, ctx->s, POLLIN, tv);
+    if (s_rc == -1) {
+        return -1;
+    }
+
+    if (s_rc == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    return s_rc;
+}
+
+static void _modbus_udp_free(modbus_t *ctx)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+
+    free(ctx_udp->batch);
+    free(ctx->backend_data);
+    free(ctx);
+}
+
+const modbus_backend_t _modbus_udp_backend = {
+    _MODBUS_BACKEND_TYPE_TCP,
+    _MODBUS_TCP_HEADER_LENGTH,
+    _MODBUS_TCP_CHECKSUM_LENGTH,
+    MODBUS_UDP_MAX_ADU_LENGTH,
+    _modbus_tcp_set_slave,
+    _modbus_tcp_build_request_basis,
+    _modbus_tcp_build_response_basis,
+    _modbus_tcp_prepare_response_tid,
+    _modbus_tcp_send_msg_pre,
+    _modbus_udp_send,
+    _modbus_udp_receive,
+    _modbus_udp_recv,
+    _modbus_tcp_check_integrity,
+    _modbus_tcp_pre_check_confirmation,
+    _modbus_udp_connect,
+    _modbus_udp_close,
+    _modbus_udp_flush,
+    _modbus_udp_select,
+    _modbus_udp_free
+};
+
+/* Binds the socket of a server, the socket of the context is set.
+
+   The function shall return the socket or -1 and set errno. */
+int modbus_udp_bind(modbus_t *ctx)
+{
+    modbus_udp_t *ctx_udp;
+    struct sockaddr_in addr;
+    int flags = SOCK_DGRAM;
+    int yes;
+    int s;
+
+    if (ctx == NULL || ctx->backend != &_modbus_udp_backend) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_udp = ctx->backend_data;
+
+#ifdef SOCK_CLOEXEC
+    flags |= SOCK_CLOEXEC;
+#endif
+
+    s = socket(PF_INET, flags, 0);
+    if (s == -1) {
+        return -1;
+    }
+
+    yes = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR,
+                   (char *) &yes, sizeof(yes)) == -1) {
+        close(s);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(ctx_udp->port);
+    if (ctx_udp->ip[0] == '0') {
+        /* Listen any addresses */
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    } else {
+        addr.sin_addr.s_addr = inet_addr(ctx_udp->ip);
+    }
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(s);
+        return -1;
+    }
+
+    if (ctx->s != -1) {
+        close(ctx->s);
+    }
+    ctx->s = s;
+    ctx_udp->server = TRUE;
+    ctx_udp->rx_length = 0;
+    ctx_udp->rx_offset = 0;
+
+    return s;
+}
+
+/* A datagram holds exactly one request */
+static int _udp_check_request(const uint8_t *req, int req_length)
+{
+    return req_length >= _MODBUS_TCP_HEADER_LENGTH + 1 &&
+        req_length <= MODBUS_UDP_MAX_ADU_LENGTH &&
+        req[2] == 0 && req[3] == 0 &&
+        ((req[4] << 8) | req[5]) == req_length - 6;
+}
+
+/* Receives the datagrams waiting on the socket of the server, up to
+   _MODBUS_UDP_BATCH_SIZE per call, replies to them with the mapping and sends
+   all the responses at once.
+
+   The function shall return the number of requests replied, 0 if no datagram
+   has been received within timeout_ms (-1 to wait forever), or -1 and set
+   errno. */
+int modbus_udp_process(modbus_t *ctx, modbus_mapping_t *mb_mapping,
+                       int timeout_ms)
+{
+    modbus_udp_t *ctx_udp;
+    modbus_udp_batch_t *batch;
+    struct pollfd pfd;
+    int nb_rx;
+    int nb_replied = 0;
+    int i;
+
+    if (ctx == NULL || ctx->backend != &_modbus_udp_backend || ctx->s == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_udp = ctx->backend_data;
+    if (ctx_udp->batch == NULL) {
+        ctx_udp->batch = malloc(sizeof(modbus_udp_batch_t));
+        if (ctx_udp->batch == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    batch = ctx_udp->batch;
+
+    pfd.fd = ctx->s;
+    pfd.events = POLLIN;
+    i = poll(&pfd, 1, timeout_ms);
+    if (i <= 0) {
+        return (i == -1 && errno != EINTR) ? -1 : 0;
+    }
+
+    memset(batch->rx_msgs, 0, sizeof(batch->rx_msgs));
+    for (i = 0; i < _MODBUS_UDP_BATCH_SIZE; i++) {
+        batch->rx_iov[i].iov_base = batch->rx[i];
+        batch->rx_iov[i].iov_len = MODBUS_UDP_MAX_ADU_LENGTH;
+        batch->rx_msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->rx_msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+        batch->rx_msgs[i].msg_hdr.msg_iov = &batch->rx_iov[i];
+        batch->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+#ifdef HAVE_RECVMMSG
+    nb_rx = recvmmsg(ctx->s, batch->rx_msgs, _MODBUS_UDP_BATCH_SIZE,
+                     MSG_DONTWAIT, NULL);
+#else
+    for (nb_rx = 0; nb_rx < _MODBUS_UDP_BATCH_SIZE; nb_rx++) {
+        ssize_t rc = recvmsg(ctx->s, &batch->rx_msgs[nb_rx].msg_hdr,
+                             MSG_DONTWAIT);
+
+        if (rc == -1)
+            break;
+        batch->rx_msgs[nb_rx].msg_len = rc;
+    }
+    if (nb_rx == 0)
+        nb_rx = -1;
+#endif
+    if (nb_rx == -1) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+
+    /* The responses of modbus_reply() are queued by the send function */
+    batch->nb_tx = 0;
+    ctx_udp->batching = TRUE;
+    for (i = 0; i < nb_rx; i++) {
+        int req_length = batch->rx_msgs[i].msg_len;
+
+        if (!_udp_check_request(batch->rx[i], req_length)) {
+            if (ctx->debug) {
+                fprintf(stderr, "Invalid datagram of %d bytes ignored\n",
+                        req_length);
+            }
+            continue;
+        }
+
+        if (ctx->trace != NULL) {
+            _modbus_trace_record(ctx->trace, FALSE, batch->rx[i], req_length);
+        }
+        batch->current = i;
+        if (modbus_reply(ctx, batch->rx[i], req_length, mb_mapping) != -1)
+            nb_replied++;
+    }
+    ctx_udp->batching = FALSE;
+    ctx_udp->rx_length = 0;
+    ctx_udp->rx_offset = 0;
+
+    /* A response which can't be sent is lost as any datagram */
+#ifdef HAVE_SENDMMSG
+    for (i = 0; i < batch->nb_tx; ) {
+        int rc = sendmmsg(ctx->s, batch->tx_msgs + i, batch->nb_tx - i,
+                          MSG_NOSIGNAL);
+
+        if (rc <= 0)
+            break;
+        i += rc;
+    }
+#else
+    for (i = 0; i < batch->nb_tx; i++) {
+        sendmsg(ctx->s, &batch->tx_msgs[i].msg_hdr, MSG_NOSIGNAL);
+    }
+#endif
+
+    return nb_replied;
+}
+
+modbus_t* modbus_new_udp(const char *ip, int port)
+{
+    modbus_t *ctx;
+    modbus_udp_t *ctx_udp;
+    size_t dest_size;
+    size_t ret_size;
+
+    ctx = (modbus_t *) malloc(sizeof(modbus_t));
+    _modbus_init_common(ctx);
+
+    /* Could be changed after to reach a remote serial Modbus device */
+    ctx->slave = MODBUS_TCP_SLAVE;
+    /* The deferred responses are kept per socket, not per client */
+    ctx->penalty_mode = MODBUS_PENALTY_NONE;
+
+    ctx->backend = &(_modbus_udp_backend);
+
+    ctx->backend_data = (modbus_udp_t *) malloc(sizeof(modbus_udp_t));
+    ctx_udp = (modbus_udp_t *)ctx->backend_data;
+    memset(ctx_udp, 0, sizeof(modbus_udp_t));
+
+    if (ip != NULL) {
+        dest_size = sizeof(char) * 16;
+        ret_size = strlcpy(ctx_udp->ip, ip, dest_size);
+        if (ret_size == 0) {
+            fprintf(stderr, "The IP string is empty\n");
+            modbus_free(ctx);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        if (ret_size >= dest_size) {
+            fprintf(stderr, "The IP string has been truncated\n");
+            modbus_free(ctx);
+            errno = EINVAL;
+            return NULL;
+        }
+    } else {
+        ctx_udp->ip[0] = '0';
+    }
+    ctx_udp->port = port;
+    ctx_udp->t_id = 0;
+
+    return ctx;
+}
+
+#else
+
+modbus_t* modbus_new_udp(const char *ip, int port)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int modbus_udp_bind(modbus_t *ctx)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int modbus_udp_process(modbus_t *ctx, modbus_mapping_t *mb_mapping,
+                       int timeout_ms)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,36 @@
+/*
+ * Copyright © 2001-2010 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_UDP_H
+#define MODBUS_UDP_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Same ADU as TCP (MBAP header and PDU), one per datagram */
+#define MODBUS_UDP_MAX_ADU_LENGTH  260
+
+MODBUS_API modbus_t* modbus_new_udp(const char *ip_address, int port);
+MODBUS_API int modbus_udp_bind(modbus_t *ctx);
+MODBUS_API int modbus_udp_process(modbus_t *ctx, modbus_mapping_t *mb_mapping,
+                                  int timeout_ms);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_UDP_H */
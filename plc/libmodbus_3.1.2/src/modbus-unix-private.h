@@ -0,0 +1,32 @@
+/*
+ * Copyright © 2001-2011 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MODBUS_UNIX_PRIVATE_H
+#define MODBUS_UNIX_PRIVATE_H
+
+/* Size of sun_path in struct sockaddr_un */
+#define _MODBUS_UNIX_PATH_LENGTH 108
+
+typedef struct _modbus_unix {
+    /* Transaction ID, first as in the TCP backends */
+    uint16_t t_id;
+    /* Path of the socket, in the abstract namespace if it starts with '@' */
+    char path[_MODBUS_UNIX_PATH_LENGTH];
+} modbus_unix_t;
+
+#endif /* MODBUS_UNIX_PRIVATE_H */
@@ -0,0 +1,258 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <config.h>
+
+#ifndef _WIN32
+# include <unistd.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/un.h>
+# include <stddef.h>
+#endif
+
+#include "modbus-private.h"
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+#include "modbus-unix.h"
+#include "modbus-unix-private.h"
+
+#ifndef _WIN32
+
+/* Fills the address of the socket, a leading '@' is replaced by a null byte
+   for the abstract namespace of Linux */
+static socklen_t _unix_address(modbus_unix_t *ctx_unix, struct sockaddr_un *addr)
+{
+    size_t length = strlen(ctx_unix->path);
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, ctx_unix->path, length);
+    if (ctx_unix->path[0] == '@') {
+        addr->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + length;
+    }
+
+    return sizeof(struct sockaddr_un);
+}
+
+/* Establishes a connection with a Modbus server of the same host */
+static int _modbus_unix_connect(modbus_t *ctx)
+{
+    modbus_unix_t *ctx_unix = ctx->backend_data;
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    int flags = SOCK_STREAM;
+
+#ifdef SOCK_CLOEXEC
+    flags |= SOCK_CLOEXEC;
+#endif
+
+    ctx->s = socket(AF_UNIX, flags, 0);
+    if (ctx->s == -1) {
+        return -1;
+    }
+
+    if (ctx->debug) {
+        printf("Connecting to %s\n", ctx_unix->path);
+    }
+
+    /* The connection is established at once or refused, there is no
+       handshake to wait for */
+    addrlen = _unix_address(ctx_unix, &addr);
+    if (connect(ctx->s, (struct sockaddr *)&addr, addrlen) == -1) {
+        close(ctx->s);
+        ctx->s = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void _modbus_unix_free(modbus_t *ctx) {
+    free(ctx->backend_data);
+    free(ctx);
+}
+
+const modbus_backend_t _modbus_unix_backend = {
+    _MODBUS_BACKEND_TYPE_TCP,
+    _MODBUS_TCP_HEADER_LENGTH,
+    _MODBUS_TCP_CHECKSUM_LENGTH,
+    MODBUS_UNIX_MAX_ADU_LENGTH,
+    _modbus_tcp_set_slave,
+    _modbus_tcp_build_request_basis,
+    _modbus_tcp_build_response_basis,
+    _modbus_tcp_prepare_response_tid,
+    _modbus_tcp_send_msg_pre,
+    _modbus_tcp_send,
+    _modbus_tcp_receive,
+    _modbus_tcp_recv,
+    _modbus_tcp_check_integrity,
+    _modbus_tcp_pre_check_confirmation,
+    _modbus_unix_connect,
+    _modbus_tcp_close,
+    _modbus_tcp_flush,
+    _modbus_tcp_select,
+    _modbus_unix_free
+};
+
+/* Listens for the connections of the clients of the same host. A socket file
+   left by a previous server is removed.
+
+   The function shall return the listening socket or -1 and set errno. */
+int modbus_unix_listen(modbus_t *ctx, int nb_connection)
+{
+    modbus_unix_t *ctx_unix;
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    struct stat st;
+    int flags = SOCK_STREAM;
+    int new_s;
+
+    if (ctx == NULL || ctx->backend != &_modbus_unix_backend) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_unix = ctx->backend_data;
+
+#ifdef SOCK_CLOEXEC
+    flags |= SOCK_CLOEXEC;
+#endif
+
+    new_s = socket(AF_UNIX, flags, 0);
+    if (new_s == -1) {
+        return -1;
+    }
+
+    /* Only a socket is removed, not a file given by mistake */
+    if (ctx_unix->path[0] != '@' && stat(ctx_unix->path, &st) == 0 &&
+        S_ISSOCK(st.st_mode)) {
+        unlink(ctx_unix->path);
+    }
+
+    addrlen = _unix_address(ctx_unix, &addr);
+    if (bind(new_s, (struct sockaddr *)&addr, addrlen) == -1) {
+        close(new_s);
+        return -1;
+    }
+
+    if (listen(new_s, nb_connection) == -1) {
+        close(new_s);
+        return -1;
+    }
+
+    return new_s;
+}
+
+int modbus_unix_accept(modbus_t *ctx, int *s)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef HAVE_ACCEPT4
+    ctx->s = accept4(*s, NULL, NULL, SOCK_CLOEXEC);
+#else
+    ctx->s = accept(*s, NULL, NULL);
+#endif
+    if (ctx->s == -1) {
+        close(*s);
+        *s = -1;
+        return -1;
+    }
+
+    if (ctx->debug) {
+        printf("The client connection is accepted.\n");
+    }
+
+    return ctx->s;
+}
+
+modbus_t* modbus_new_unix(const char *path)
+{
+    modbus_t *ctx;
+    modbus_unix_t *ctx_unix;
+    size_t dest_size;
+    size_t ret_size;
+
+    if (path == NULL) {
+        fprintf(stderr, "The path is NULL\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = (modbus_t *) malloc(sizeof(modbus_t));
+    _modbus_init_common(ctx);
+
+    /* Could be changed after to reach a remote serial Modbus device */
+    ctx->slave = MODBUS_TCP_SLAVE;
+
+    ctx->backend = &(_modbus_unix_backend);
+
+    ctx->backend_data = (modbus_unix_t *) malloc(sizeof(modbus_unix_t));
+    ctx_unix = (modbus_unix_t *)ctx->backend_data;
+    ctx_unix->t_id = 0;
+
+    dest_size = sizeof(char) * _MODBUS_UNIX_PATH_LENGTH;
+    ret_size = strlcpy(ctx_unix->path, path, dest_size);
+    if (ret_size == 0) {
+        fprintf(stderr, "The path is empty\n");
+        modbus_free(ctx);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (ret_size >= dest_size) {
+        fprintf(stderr, "The path has been truncated\n");
+        modbus_free(ctx);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return ctx;
+}
+
+#else
+
+modbus_t* modbus_new_unix(const char *path)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int modbus_unix_listen(modbus_t *ctx, int nb_connection)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int modbus_unix_accept(modbus_t *ctx, int *s)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* _WIN32 */
@@ -29,12 +29,20 @@
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
+#ifndef _WIN32
+#include <poll.h>
+#include <sched.h>
+#endif
 
 #include <config.h>
 
 #include "modbus.h"
 #include "modbus-private.h"
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 /* Internal use */
 #define MSG_LENGTH_UNDEFINED -1
 
@@ -120,6 +128,249 @@ static void _sleep_response_timeout(modbus_t *ctx)
 #endif
 }
 
+/* Exception response delayed by the penalty of a connection */
+struct _modbus_deferred {
+    int64_t deadline;
+    int rsp_length;
+    uint8_t rsp[_MODBUS_DEFERRED_RSP_LENGTH];
+};
+
+/* Deferred responses of a connection, a ring ordered by deadline so the
+   first one is due first */
+struct _modbus_deferred_conn {
+    int s;
+    int first;
+    int nb;
+    struct _modbus_deferred ring[_MODBUS_MAX_DEFERRED];
+};
+
+/* Finds the deferred responses of the connection */
+static int _deferred_find(modbus_t *ctx, int s)
+{
+    int i;
+
+    for (i = 0; i < ctx->nb_deferred_conns; i++) {
+        if (ctx->deferred[i].s == s)
+            return i;
+    }
+
+    return -1;
+}
+
+static void _deferred_remove(modbus_t *ctx, int i)
+{
+    ctx->nb_deferred -= ctx->deferred[i].nb;
+    ctx->nb_deferred_conns--;
+    if (i < ctx->nb_deferred_conns)
+        ctx->deferred[i] = ctx->deferred[ctx->nb_deferred_conns];
+}
+
+/* Deadline of the first deferred response of a connection */
+static int64_t _deferred_deadline(modbus_t *ctx, int i)
+{
+    return ctx->deferred[i].ring[ctx->deferred[i].first].deadline;
+}
+
+/* Drops the deferred responses of a closed connection */
+static void _deferred_drop(modbus_t *ctx, int s)
+{
+    int i = _deferred_find(ctx, s);
+
+    if (i != -1)
+        _deferred_remove(ctx, i);
+}
+
+/* Sends the first deferred response of a connection */
+static int _deferred_send(modbus_t *ctx, int i)
+{
+    struct _modbus_deferred_conn *conn = &ctx->deferred[i];
+    struct _modbus_deferred deferred = conn->ring[conn->first];
+    int conn_s = conn->s;
+    int s = ctx->s;
+    int rc;
+
+    conn->first = (conn->first + 1) % _MODBUS_MAX_DEFERRED;
+    conn->nb--;
+    ctx->nb_deferred--;
+    if (conn->nb == 0)
+        _deferred_remove(ctx, i);
+
+    ctx->s = conn_s;
+    rc = _modbus_send_msg(ctx, deferred.rsp, deferred.rsp_length);
+    if (ctx->s == conn_s)
+        ctx->s = s;
+
+    return rc;
+}
+
+/* Queues a deferred response on the current connection. The function shall
+   return -1 and set errno to ENOBUFS when the connection already holds
+   _MODBUS_MAX_DEFERRED responses. */
+static int _deferred_add(modbus_t *ctx, const uint8_t *rsp, int rsp_length)
+{
+    struct _modbus_deferred_conn *conn;
+    struct _modbus_deferred *deferred;
+    int64_t deadline = _modbus_now_us() +
+        (int64_t)ctx->response_timeout.tv_sec * 1000000 +
+        ctx->response_timeout.tv_usec;
+    int i = _deferred_find(ctx, ctx->s);
+
+    /* Room for the checksum added by the backend */
+    if (rsp_length + 2 > _MODBUS_DEFERRED_RSP_LENGTH) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (i == -1) {
+        if (ctx->nb_deferred_conns == ctx->max_deferred_conns) {
+            int max_conns = ctx->max_deferred_conns ?
+                ctx->max_deferred_conns * 2 : 1;
+
+            conn = realloc(ctx->deferred,
+                           max_conns * sizeof(struct _modbus_deferred_conn));
+            if (conn == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            ctx->deferred = conn;
+            ctx->max_deferred_conns = max_conns;
+        }
+        i = ctx->nb_deferred_conns++;
+        ctx->deferred[i].s = ctx->s;
+        ctx->deferred[i].first = 0;
+        ctx->deferred[i].nb = 0;
+    }
+
+    conn = &ctx->deferred[i];
+    if (conn->nb == _MODBUS_MAX_DEFERRED) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    /* A shorter response timeout doesn't overtake the previous responses */
+    if (conn->nb > 0) {
+        int last = (conn->first + conn->nb - 1) % _MODBUS_MAX_DEFERRED;
+
+        if (deadline < conn->ring[last].deadline)
+            deadline = conn->ring[last].deadline;
+    }
+
+    deferred = &conn->ring[(conn->first + conn->nb) % _MODBUS_MAX_DEFERRED];
+    deferred->deadline = deadline;
+    deferred->rsp_length = rsp_length;
+    memcpy(deferred->rsp, rsp, rsp_length);
+    conn->nb++;
+    ctx->nb_deferred++;
+
+    return 0;
+}
+
+/* Applies the penalty of a request with an illegal number of values. The
+   input is flushed, in case the request has been truncated, and the exception
+   response is only sent after the response timeout to slow down the client:
+   - MODBUS_PENALTY_DEFER, the response is deferred and sent by the next
+     modbus_receive() on the connection or by modbus_send_deferred(), the
+     server goes on serving the other requests in the meantime. The input of
+     TCP is only flushed when the request doesn't match the length of its
+     MBAP header, the requests pipelined behind a framed one are served. The
+     function returns 0 as nothing has been sent yet;
+   - MODBUS_PENALTY_SLEEP, the server sleeps before sending the response;
+   - MODBUS_PENALTY_NONE, the response is sent at once. */
+static int _reply_penalty(modbus_t *ctx, const uint8_t *req, int req_length,
+                          uint8_t *rsp, int rsp_length)
+{
+    int mbap_length;
+
+    if (ctx->penalty_mode != MODBUS_PENALTY_DEFER) {
+        if (ctx->penalty_mode == MODBUS_PENALTY_SLEEP)
+            _sleep_response_timeout(ctx);
+        modbus_flush(ctx);
+        return _modbus_send_msg(ctx, rsp, rsp_length);
+    }
+
+    /* The unit identifier and the PDU follow the length of the MBAP header */
+    mbap_length = (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_TCP) ?
+        (req[4] << 8) + req[5] : -1;
+    if (req_length != ctx->backend->header_length - 1 + mbap_length)
+        modbus_flush(ctx);
+
+    /* A connection may have many deferred responses, one per illegal
+       request received during the penalty of the previous ones (TCP). Beyond
+       _MODBUS_MAX_DEFERRED, the server sleeps as in MODBUS_PENALTY_SLEEP
+       mode. */
+    if (_deferred_add(ctx, rsp, rsp_length) == -1) {
+        if (errno != ENOBUFS)
+            return -1;
+        _sleep_response_timeout(ctx);
+        return _modbus_send_msg(ctx, rsp, rsp_length);
+    }
+
+    if (ctx->debug) {
+        printf("Response deferred by %ld.%06ld s\n",
+               (long)ctx->response_timeout.tv_sec,
+               (long)ctx->response_timeout.tv_usec);
+    }
+
+    return 0;
+}
+
+/* Sends the due deferred responses of the current connection before
+   receiving an indication.
+
+   On TCP, the responses carry the transaction ID of their request so the
+   indications received during the penalty are served at once, the pending
+   responses are sent later. A serial master can't match the responses to
+   its requests, so on RTU the function waits for the end of the penalty and
+   the data received in the meantime are flushed (the master has timed out).
+
+   The function shall return 0 when the indication can be received or -1 on
+   error. The flushes are counted for modbus_get_penalty_flushes(). */
+static int _wait_deferred(modbus_t *ctx, int wait_mode)
+{
+    int i;
+
+    while ((i = _deferred_find(ctx, ctx->s)) != -1) {
+        struct timeval tv;
+        int64_t remaining = _deferred_deadline(ctx, i) - _modbus_now_us();
+        int rc;
+
+        if (remaining <= 0) {
+            if (_deferred_send(ctx, i) == -1)
+                return -1;
+            continue;
+        }
+
+        if (wait_mode == MODBUS_WAIT_NONE) {
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
+        } else {
+            tv.tv_sec = remaining / 1000000;
+            tv.tv_usec = remaining % 1000000;
+        }
+
+        rc = ctx->backend->select(ctx, &tv, 0);
+        if (rc == -1) {
+            if (errno != ETIMEDOUT)
+                return -1;
+            if (wait_mode == MODBUS_WAIT_NONE) {
+                errno = EAGAIN;
+                return -1;
+            }
+            continue;
+        }
+
+        if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_TCP) {
+            /* The indication is received, the response stays deferred */
+            return 0;
+        }
+
+        ctx->backend->flush(ctx);
+        ctx->nb_penalty_flushes++;
+    }
+
+    return 0;
+}
+
 int modbus_flush(modbus_t *ctx)
 {
     int rc;
@@ -167,6 +418,23 @@ static unsigned int compute_response_length_from_request(modbus_t *ctx, uint8_t
     case MODBUS_FC_MASK_WRITE_REGISTER:
         length = 7;
         break;
+    case MODBUS_FC_READ_FILE_RECORD: {
+        /* Header + length and reference type + 2 * nb values of each
+           sub-request (7 bytes) */
+        int byte_count = req[offset + 1];
+        int i;
+
+        length = 2;
+        for (i = 0; i + 7 <= byte_count; i += 7) {
+            length += 2 + 2 * ((req[offset + 2 + i + 5] << 8) |
+                               req[offset + 2 + i + 6]);
+        }
+    }
+        break;
+    case MODBUS_FC_WRITE_FILE_RECORD:
+        /* Echo of the request */
+        length = 2 + req[offset + 1];
+        break;
     default:
         length = 5;
     }
@@ -175,7 +443,7 @@ static unsigned int compute_response_length_from_request(modbus_t *ctx, uint8_t
 }
 
 /* Sends a request/response */
-static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
+int _modbus_send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
 {
     int rc;
     int i;
@@ -216,6 +484,10 @@ static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
         return -1;
     }
 
+    if (rc > 0 && ctx->trace != NULL) {
+        _modbus_trace_record(ctx->trace, TRUE, msg, msg_length);
+    }
+
     return rc;
 }
 
@@ -249,7 +521,7 @@ int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length)
         req_length += raw_req_length - 2;
     }
 
-    return send_msg(ctx, req, req_length);
+    return _modbus_send_msg(ctx, req, req_length);
 }
 
 /*
@@ -258,14 +530,18 @@ int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length)
  *  ---------- Confirmation  Response ----------
  */
 
-/* Computes the length to read after the function received */
-static uint8_t compute_meta_length_after_function(int function,
-                                                  msg_type_t msg_type)
+/* Computes the length to read after the function received, the handlers
+   registered with modbus_set_handler() or NULL. Shared with the TCP parser. */
+uint8_t _modbus_compute_meta_length_after_function(
+    const modbus_handler_t *handlers, int function, msg_type_t msg_type)
 {
     int length;
 
     if (msg_type == MSG_INDICATION) {
-        if (function <= MODBUS_FC_WRITE_SINGLE_REGISTER) {
+        if (handlers != NULL && handlers[function].reply != NULL) {
+            /* Registered with modbus_set_handler() */
+            length = handlers[function].min_length;
+        } else if (function <= MODBUS_FC_WRITE_SINGLE_REGISTER) {
             length = 4;
         } else if (function == MODBUS_FC_WRITE_MULTIPLE_COILS ||
                    function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS) {
@@ -298,21 +574,29 @@ static uint8_t compute_meta_length_after_function(int function,
     return length;
 }
 
-/* Computes the length to read after the meta information (address, count, etc) */
-static int compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg,
-                                          msg_type_t msg_type)
+/* Computes the length to read after the meta information (address, count,
+   etc) of the PDU, without the checksum. Shared with the TCP parser. */
+int _modbus_compute_data_length_after_meta(const modbus_handler_t *handlers,
+                                           const uint8_t *pdu,
+                                           msg_type_t msg_type)
 {
-    int function = msg[ctx->backend->header_length];
+    int function = pdu[0];
     int length;
 
     if (msg_type == MSG_INDICATION) {
+        if (handlers != NULL && handlers[function].reply != NULL) {
+            const modbus_handler_t *handler = &handlers[function];
+
+            return handler->byte_count ? pdu[handler->min_length] : 0;
+        }
+
         switch (function) {
         case MODBUS_FC_WRITE_MULTIPLE_COILS:
         case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
-            length = msg[ctx->backend->header_length + 5];
+            length = pdu[5];
             break;
         case MODBUS_FC_WRITE_AND_READ_REGISTERS:
-            length = msg[ctx->backend->header_length + 9];
+            length = pdu[9];
             break;
         default:
             length = 0;
@@ -321,18 +605,110 @@ static int compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg,
         /* MSG_CONFIRMATION */
         if (function <= MODBUS_FC_READ_INPUT_REGISTERS ||
             function == MODBUS_FC_REPORT_SLAVE_ID ||
+            function == MODBUS_FC_READ_FILE_RECORD ||
+            function == MODBUS_FC_WRITE_FILE_RECORD ||
             function == MODBUS_FC_WRITE_AND_READ_REGISTERS) {
-            length = msg[ctx->backend->header_length + 1];
+            length = pdu[1];
         } else {
             length = 0;
         }
     }
 
-    length += ctx->backend->checksum_length;
-
     return length;
 }
 
+/* Returns a monotonic date in microseconds to compute the deadlines */
+int64_t _modbus_now_us(void)
+{
+#ifdef _WIN32
+    return (int64_t)GetTickCount() * 1000;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+#ifndef _WIN32
+/* Waits until the file descriptor is ready for the requested poll() events.
+
+   Unlike select(), poll() isn't limited to descriptors below FD_SETSIZE so
+   servers can handle as many connections as the process is allowed to open.
+   A NULL tv blocks until the descriptor is ready and a zero tv only checks the
+   current state. As select() does on Linux, tv is updated on return to hold
+   the remaining time, a signal restarts the wait for that remaining time.
+
+   The function shall return a positive value when the descriptor is ready, 0
+   on timeout and -1 on error with errno set. */
+int _modbus_poll_fd(modbus_t *ctx, int fd, short events, struct timeval *tv)
+{
+    struct pollfd pfd;
+    struct timespec start, now;
+    long timeout_ms;
+    long elapsed_us;
+    long remaining_us = 0;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = events;
+
+    if (tv != NULL) {
+        remaining_us = tv->tv_sec * 1000000L + tv->tv_usec;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    for (;;) {
+        if (tv == NULL) {
+            timeout_ms = -1;
+        } else {
+            /* Round up so a short timeout doesn't turn into a busy loop */
+            timeout_ms = (remaining_us + 999) / 1000;
+        }
+
+        pfd.revents = 0;
+        rc = poll(&pfd, 1, (int)timeout_ms);
+        if (rc != -1 || errno != EINTR)
+            break;
+
+        if (ctx != NULL && ctx->debug) {
+            fprintf(stderr, "A non blocked signal was caught\n");
+        }
+
+        if (tv != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed_us = (now.tv_sec - start.tv_sec) * 1000000L +
+                (now.tv_nsec - start.tv_nsec) / 1000;
+            start = now;
+            remaining_us -= elapsed_us;
+            if (remaining_us < 0)
+                remaining_us = 0;
+        }
+    }
+
+    if (tv != NULL) {
+        if (rc == 0) {
+            remaining_us = 0;
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining_us -= (now.tv_sec - start.tv_sec) * 1000000L +
+                (now.tv_nsec - start.tv_nsec) / 1000;
+            if (remaining_us < 0)
+                remaining_us = 0;
+        }
+        tv->tv_sec = remaining_us / 1000000L;
+        tv->tv_usec = remaining_us % 1000000L;
+    }
+
+    if (rc > 0 && (pfd.revents & POLLNVAL)) {
+        /* Same error as select() on a closed descriptor */
+        errno = EBADF;
+        return -1;
+    }
+
+    return rc;
+}
+#endif
 
 /* Waits a response from a modbus server or a request from a modbus client.
    This function blocks if there is no replies (3 timeouts).
@@ -344,19 +720,25 @@ static int compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg,
    - EMBBADDATA
    - EMBUNKEXC
    - ETIMEDOUT
+   - EAGAIN (nothing received in MODBUS_WAIT_NONE mode)
    - read() or recv() error codes
 */
-
-int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
+int _modbus_receive_msg_mode(modbus_t *ctx, uint8_t *msg,
+                             msg_type_t msg_type, int wait_mode)
 {
     int rc;
-    fd_set rset;
     struct timeval tv;
     struct timeval *p_tv;
     int length_to_read;
     int msg_length = 0;
+    const modbus_handler_t *handlers = ctx->handlers;
     _step_t step;
 
+    if (msg_type == MSG_INDICATION && ctx->nb_deferred > 0) {
+        if (_wait_deferred(ctx, wait_mode) == -1)
+            return -1;
+    }
+
     if (ctx->debug) {
         if (msg_type == MSG_INDICATION) {
             printf("Waiting for a indication...\n");
@@ -365,10 +747,6 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         }
     }
 
-    /* Add a file descriptor to the set */
-    FD_ZERO(&rset);
-    FD_SET(ctx->s, &rset);
-
     /* We need to analyse the message step by step.  At the first step, we want
      * to reach the function code because all packets contain this
      * information. */
@@ -385,9 +763,23 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         p_tv = &tv;
     }
 
+    if (wait_mode == MODBUS_WAIT_NONE) {
+        /* Only check if a message is pending, the caller is notified with
+         * EAGAIN when there is nothing to read yet */
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+        p_tv = &tv;
+    }
+
     while (length_to_read != 0) {
-        rc = ctx->backend->select(ctx, &rset, p_tv, length_to_read);
+        rc = ctx->backend->select(ctx, p_tv, length_to_read);
         if (rc == -1) {
+            if (msg_length == 0 && errno == ETIMEDOUT &&
+                wait_mode == MODBUS_WAIT_NONE) {
+                errno = EAGAIN;
+                return -1;
+            }
+
             _error_print(ctx, "select");
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) {
                 int saved_errno = errno;
@@ -440,16 +832,22 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
             switch (step) {
             case _STEP_FUNCTION:
                 /* Function code position */
-                length_to_read = compute_meta_length_after_function(
-                    msg[ctx->backend->header_length],
-                    msg_type);
+                /* The lengths of the custom function codes depend on the
+                   handlers of the unit when the context has a router */
+                handlers = (ctx->router != NULL && msg_type == MSG_INDICATION) ?
+                    _modbus_router_handlers(ctx,
+                                            msg[ctx->backend->header_length - 1]) :
+                    ctx->handlers;
+                length_to_read = _modbus_compute_meta_length_after_function(
+                    handlers, msg[ctx->backend->header_length], msg_type);
                 if (length_to_read != 0) {
                     step = _STEP_META;
                     break;
                 } /* else switches straight to the next step */
             case _STEP_META:
-                length_to_read = compute_data_length_after_meta(
-                    ctx, msg, msg_type);
+                length_to_read = _modbus_compute_data_length_after_meta(
+                    handlers, msg + ctx->backend->header_length,
+                    msg_type) + ctx->backend->checksum_length;
                 if ((msg_length + length_to_read) > (int)ctx->backend->max_adu_length) {
                     errno = EMBBADDATA;
                     _error_print(ctx, "too many data");
@@ -470,6 +868,16 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
             tv.tv_sec = ctx->byte_timeout.tv_sec;
             tv.tv_usec = ctx->byte_timeout.tv_usec;
             p_tv = &tv;
+        } else if (length_to_read > 0 && msg_length == rc &&
+                   wait_mode == MODBUS_WAIT_NONE) {
+            /* The message has started so the remaining bytes are waited for
+               as in blocking mode */
+            if (msg_type == MSG_INDICATION) {
+                p_tv = NULL;
+            } else {
+                tv.tv_sec = ctx->response_timeout.tv_sec;
+                tv.tv_usec = ctx->response_timeout.tv_usec;
+            }
         }
         /* else timeout isn't set again, the full response must be read before
            expiration of response timeout (for CONFIRMATION only) */
@@ -478,18 +886,43 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
     if (ctx->debug)
         printf("\n");
 
-    return ctx->backend->check_integrity(ctx, msg, msg_length);
+    rc = ctx->backend->check_integrity(ctx, msg, msg_length);
+    if (rc > 0 && ctx->trace != NULL) {
+        _modbus_trace_record(ctx->trace, FALSE, msg, msg_length);
+    }
+
+    return rc;
+}
+
+int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
+{
+    /* The confirmations read by the client functions are always waited for,
+       the wait mode only applies to the explicit receive functions */
+    return _modbus_receive_msg_mode(ctx, msg, msg_type,
+                                    msg_type == MSG_INDICATION ?
+                                    ctx->wait_mode : MODBUS_WAIT_BLOCK);
 }
 
 /* Receive the request from a modbus master */
 int modbus_receive(modbus_t *ctx, uint8_t *req)
 {
+    int rc;
+
     if (ctx == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    return ctx->backend->receive(ctx, req);
+    rc = ctx->backend->receive(ctx, req);
+    if (rc == -1 && errno != EAGAIN && ctx->nb_deferred > 0) {
+        /* The caller is about to close the connection */
+        int saved_errno = errno;
+
+        _deferred_drop(ctx, ctx->s);
+        errno = saved_errno;
+    }
+
+    return rc;
 }
 
 /* Receives the confirmation.
@@ -507,11 +940,12 @@ int modbus_receive_confirmation(modbus_t *ctx, uint8_t *rsp)
         return -1;
     }
 
-    return _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+    return _modbus_receive_msg_mode(ctx, rsp, MSG_CONFIRMATION,
+                                    ctx->wait_mode);
 }
 
-static int check_confirmation(modbus_t *ctx, uint8_t *req,
-                              uint8_t *rsp, int rsp_length)
+int _modbus_check_confirmation(modbus_t *ctx, uint8_t *req,
+                               uint8_t *rsp, int rsp_length)
 {
     int rc;
     int rsp_length_computed;
@@ -641,32 +1075,6 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req,
     return rc;
 }
 
-static int response_io_status(int address, int nb,
-                              uint8_t *tab_io_status,
-                              uint8_t *rsp, int offset)
-{
-    int shift = 0;
-    /* Instead of byte (not allowed in Win32) */
-    int one_byte = 0;
-    int i;
-
-    for (i = address; i < address+nb; i++) {
-        one_byte |= tab_io_status[i] << shift;
-        if (shift == 7) {
-            /* Byte is full */
-            rsp[offset++] = one_byte;
-            one_byte = shift = 0;
-        } else {
-            shift++;
-        }
-    }
-
-    if (shift != 0)
-        rsp[offset++] = one_byte;
-
-    return offset;
-}
-
 /* Build the exception response */
 static int response_exception(modbus_t *ctx, sft_t *sft,
                               int exception_code, uint8_t *rsp)
@@ -682,391 +1090,811 @@ static int response_exception(modbus_t *ctx, sft_t *sft,
     return rsp_length;
 }
 
-/* Send a response to the received request.
-   Analyses the request and constructs a response.
+/*
+ * Built-in handlers of modbus_reply(), the request data and the response data
+ * start after the function code (address at req[0], quantity at req[2]).
+ */
 
-   If an error occurs, this function construct the response
-   accordingly.
-*/
-int modbus_reply(modbus_t *ctx, const uint8_t *req,
-                 int req_length, modbus_mapping_t *mb_mapping)
+static int validate_nb(modbus_t *ctx, const uint8_t *req, int max,
+                       const char *name)
 {
-    int offset = ctx->backend->header_length;
-    int slave = req[offset - 1];
-    int function = req[offset];
-    uint16_t address = (req[offset + 1] << 8) + req[offset + 2];
-    uint8_t rsp[MAX_MESSAGE_LENGTH];
-    int rsp_length = 0;
-    sft_t sft;
+    int nb = (req[2] << 8) + req[3];
 
-    if (ctx == NULL) {
-        errno = EINVAL;
+    if (nb < 1 || max < nb) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal nb of values %d in %s (max %d)\n",
+                    nb, name, max);
+        }
+        errno = EMBXILVAL;
         return -1;
     }
 
-    sft.slave = slave;
-    sft.function = function;
-    sft.t_id = ctx->backend->prepare_response_tid(req, &req_length);
+    return 0;
+}
 
-    /* Data are flushed on illegal number of values errors. */
-    switch (function) {
-    case MODBUS_FC_READ_COILS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
+static int validate_read_bits(modbus_t *ctx, const uint8_t *req,
+                              int req_length, void *user_data)
+{
+    return validate_nb(ctx, req, MODBUS_MAX_READ_BITS, "read_bits");
+}
 
-        if (nb < 1 || MODBUS_MAX_READ_BITS < nb) {
-            if (ctx->debug) {
-                fprintf(stderr,
-                        "Illegal nb of values %d in read_bits (max %d)\n",
-                        nb, MODBUS_MAX_READ_BITS);
-            }
-            _sleep_response_timeout(ctx);
-            modbus_flush(ctx);
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
-        } else if ((address + nb) > mb_mapping->nb_bits) {
-            if (ctx->debug) {
-                fprintf(stderr, "Illegal data address 0x%0X in read_bits\n",
-                        address + nb);
-            }
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
-        } else {
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            rsp[rsp_length++] = (nb / 8) + ((nb % 8) ? 1 : 0);
-            rsp_length = response_io_status(address, nb,
-                                            mb_mapping->tab_bits,
-                                            rsp, rsp_length);
-        }
-    }
-        break;
-    case MODBUS_FC_READ_DISCRETE_INPUTS: {
-        /* Similar to coil status (but too many arguments to use a
-         * function) */
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
+static int validate_read_input_bits(modbus_t *ctx, const uint8_t *req,
+                                    int req_length, void *user_data)
+{
+    return validate_nb(ctx, req, MODBUS_MAX_READ_BITS, "read_input_bits");
+}
 
-        if (nb < 1 || MODBUS_MAX_READ_BITS < nb) {
-            if (ctx->debug) {
-                fprintf(stderr,
-                        "Illegal nb of values %d in read_input_bits (max %d)\n",
-                        nb, MODBUS_MAX_READ_BITS);
-            }
-            _sleep_response_timeout(ctx);
-            modbus_flush(ctx);
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
-        } else if ((address + nb) > mb_mapping->nb_input_bits) {
-            if (ctx->debug) {
-                fprintf(stderr, "Illegal data address 0x%0X in read_input_bits\n",
-                        address + nb);
-            }
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
-        } else {
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            rsp[rsp_length++] = (nb / 8) + ((nb % 8) ? 1 : 0);
-            rsp_length = response_io_status(address, nb,
-                                            mb_mapping->tab_input_bits,
-                                            rsp, rsp_length);
-        }
-    }
-        break;
-    case MODBUS_FC_READ_HOLDING_REGISTERS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
+static int validate_read_registers(modbus_t *ctx, const uint8_t *req,
+                                   int req_length, void *user_data)
+{
+    return validate_nb(ctx, req, MODBUS_MAX_READ_REGISTERS,
+                       "read_holding_registers");
+}
 
-        if (nb < 1 || MODBUS_MAX_READ_REGISTERS < nb) {
-            if (ctx->debug) {
-                fprintf(stderr,
-                        "Illegal nb of values %d in read_holding_registers (max %d)\n",
-                        nb, MODBUS_MAX_READ_REGISTERS);
-            }
-            _sleep_response_timeout(ctx);
-            modbus_flush(ctx);
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
-        } else if ((address + nb) > mb_mapping->nb_registers) {
-            if (ctx->debug) {
-                fprintf(stderr, "Illegal data address 0x%0X in read_registers\n",
-                        address + nb);
-            }
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
-        } else {
-            int i;
+static int validate_read_input_registers(modbus_t *ctx, const uint8_t *req,
+                                         int req_length, void *user_data)
+{
+    return validate_nb(ctx, req, MODBUS_MAX_READ_REGISTERS,
+                       "read_input_registers");
+}
 
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            rsp[rsp_length++] = nb << 1;
-            for (i = address; i < address + nb; i++) {
-                rsp[rsp_length++] = mb_mapping->tab_registers[i] >> 8;
-                rsp[rsp_length++] = mb_mapping->tab_registers[i] & 0xFF;
-            }
-        }
-    }
-        break;
-    case MODBUS_FC_READ_INPUT_REGISTERS: {
-        /* Similar to holding registers (but too many arguments to use a
-         * function) */
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
+/* May be the indication has been truncated on reading because of invalid
+ * address (eg. nb is 0 but the request contains values to write) so the
+ * penalty flushes the input. */
+static int validate_write_bits(modbus_t *ctx, const uint8_t *req,
+                               int req_length, void *user_data)
+{
+    return validate_nb(ctx, req, MODBUS_MAX_WRITE_BITS, "write_bits");
+}
 
-        if (nb < 1 || MODBUS_MAX_READ_REGISTERS < nb) {
-            if (ctx->debug) {
-                fprintf(stderr,
-                        "Illegal number of values %d in read_input_registers (max %d)\n",
-                        nb, MODBUS_MAX_READ_REGISTERS);
-            }
-            _sleep_response_timeout(ctx);
-            modbus_flush(ctx);
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
-        } else if ((address + nb) > mb_mapping->nb_input_registers) {
-            if (ctx->debug) {
-                fprintf(stderr, "Illegal data address 0x%0X in read_input_registers\n",
-                        address + nb);
-            }
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
-        } else {
-            int i;
+static int validate_write_registers(modbus_t *ctx, const uint8_t *req,
+                                    int req_length, void *user_data)
+{
+    return validate_nb(ctx, req, MODBUS_MAX_WRITE_REGISTERS,
+                       "write_registers");
+}
 
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            rsp[rsp_length++] = nb << 1;
-            for (i = address; i < address + nb; i++) {
-                rsp[rsp_length++] = mb_mapping->tab_input_registers[i] >> 8;
-                rsp[rsp_length++] = mb_mapping->tab_input_registers[i] & 0xFF;
-            }
+static int validate_write_and_read_registers(modbus_t *ctx, const uint8_t *req,
+                                             int req_length, void *user_data)
+{
+    int nb = (req[2] << 8) + req[3];
+    int nb_write = (req[6] << 8) + req[7];
+    int nb_write_bytes = req[8];
+
+    if (nb_write < 1 || MODBUS_MAX_WR_WRITE_REGISTERS < nb_write ||
+        nb < 1 || MODBUS_MAX_WR_READ_REGISTERS < nb ||
+        nb_write_bytes != nb_write * 2) {
+        if (ctx->debug) {
+            fprintf(stderr,
+                    "Illegal nb of values (W%d, R%d) in write_and_read_registers (max W%d, R%d)\n",
+                    nb_write, nb,
+                    MODBUS_MAX_WR_WRITE_REGISTERS, MODBUS_MAX_WR_READ_REGISTERS);
         }
+        errno = EMBXILVAL;
+        return -1;
     }
-        break;
-    case MODBUS_FC_WRITE_SINGLE_COIL:
-        if (address >= mb_mapping->nb_bits) {
-            if (ctx->debug) {
-                fprintf(stderr,
-                        "Illegal data address 0x%0X in write_bit\n",
-                        address);
-            }
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
-        } else {
-            int data = (req[offset + 3] << 8) + req[offset + 4];
 
-            if (data == 0xFF00 || data == 0x0) {
-                mb_mapping->tab_bits[address] = (data) ? ON : OFF;
-                memcpy(rsp, req, req_length);
-                rsp_length = req_length;
-            } else {
-                if (ctx->debug) {
-                    fprintf(stderr,
-                            "Illegal data value 0x%0X in write_bit request at address %0X\n",
-                            data, address);
-                }
-                rsp_length = response_exception(
-                    ctx, &sft,
-                    MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
-            }
+    return 0;
+}
+
+/*
+ * Thread-safe mappings (MODBUS_MAPPING_THREAD_SAFE): the values of each table
+ * are split in stripes of 64 values protected by a sequence lock. A writer
+ * locks the stripes of its values in the order of the addresses (so the
+ * writes of many values and the read-modify-writes are atomic) and a reader
+ * copies the values without writing anything shared, then retries if a writer
+ * has held one of the stripes meanwhile.
+ */
+#ifdef _MSC_VER
+# define _SEQ_LOAD(seq) (*(volatile uint32_t *)(seq))
+# define _SEQ_TRY_LOCK(seq, value) \
+    (InterlockedCompareExchange((volatile LONG *)(seq), (value) + 1, \
+                                (value)) == (LONG)(value))
+# define _SEQ_STORE(seq, value) \
+    do { MemoryBarrier(); *(volatile uint32_t *)(seq) = (value); } while (0)
+# define _SEQ_ACQUIRE_FENCE() MemoryBarrier()
+# define _SEQ_RELEASE_FENCE() MemoryBarrier()
+#else
+# define _SEQ_LOAD(seq) __atomic_load_n(seq, __ATOMIC_ACQUIRE)
+# define _SEQ_TRY_LOCK(seq, value) \
+    __extension__ ({ uint32_t _expected = (value); \
+        __atomic_compare_exchange_n(seq, &_expected, _expected + 1, 0, \
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED); })
+# define _SEQ_STORE(seq, value) __atomic_store_n(seq, value, __ATOMIC_RELEASE)
+# define _SEQ_ACQUIRE_FENCE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+# define _SEQ_RELEASE_FENCE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+/* Gives the CPU to the writer holding a stripe after some spins */
+static void _stripe_wait(int *spins)
+{
+    if (++(*spins) % 64 == 0) {
+#ifdef _WIN32
+        Sleep(0);
+#else
+        sched_yield();
+#endif
+    }
+}
+
+/* Locks the stripes of the nb values from address for a writer */
+static void _mapping_lock(modbus_mapping_t *mb_mapping, int table,
+                          int address, int nb)
+{
+    _modbus_stripe_t *stripe;
+    _modbus_stripe_t *last;
+    int spins = 0;
+
+    if (!(_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_THREAD_SAFE) || nb < 1)
+        return;
+
+    stripe = _MAPPING_STRIPES(mb_mapping, table) + (address >> _STRIPE_SHIFT);
+    last = _MAPPING_STRIPES(mb_mapping, table) +
+        ((address + nb - 1) >> _STRIPE_SHIFT);
+    for (; stripe <= last; stripe++) {
+        for (;;) {
+            uint32_t seq = _SEQ_LOAD(&stripe->seq);
+
+            if (!(seq & 1) && _SEQ_TRY_LOCK(&stripe->seq, seq))
+                break;
+            _stripe_wait(&spins);
         }
-        break;
-    case MODBUS_FC_WRITE_SINGLE_REGISTER:
-        if (address >= mb_mapping->nb_registers) {
-            if (ctx->debug) {
-                fprintf(stderr, "Illegal data address 0x%0X in write_register\n",
-                        address);
-            }
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
-        } else {
-            int data = (req[offset + 3] << 8) + req[offset + 4];
+    }
+    /* The odd sequences are visible before the values */
+    _SEQ_RELEASE_FENCE();
+}
+
+static void _mapping_unlock(modbus_mapping_t *mb_mapping, int table,
+                            int address, int nb)
+{
+    _modbus_stripe_t *stripe;
+    _modbus_stripe_t *last;
 
-            mb_mapping->tab_registers[address] = data;
-            memcpy(rsp, req, req_length);
-            rsp_length = req_length;
+    if (!(_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_THREAD_SAFE) || nb < 1)
+        return;
+
+    stripe = _MAPPING_STRIPES(mb_mapping, table) + (address >> _STRIPE_SHIFT);
+    last = _MAPPING_STRIPES(mb_mapping, table) +
+        ((address + nb - 1) >> _STRIPE_SHIFT);
+    for (; stripe <= last; stripe++) {
+        _SEQ_STORE(&stripe->seq, stripe->seq + 1);
+    }
+}
+
+/* Returns the sum of the sequences of the stripes once no writer holds them.
+   The sequences only increase so the sum changes if a writer holds one of
+   them after. */
+static uint32_t _mapping_read_begin(modbus_mapping_t *mb_mapping, int table,
+                                    int address, int nb)
+{
+    _modbus_stripe_t *first;
+    _modbus_stripe_t *last;
+    int spins = 0;
+
+    if (!(_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_THREAD_SAFE) || nb < 1)
+        return 0;
+
+    first = _MAPPING_STRIPES(mb_mapping, table) + (address >> _STRIPE_SHIFT);
+    last = _MAPPING_STRIPES(mb_mapping, table) +
+        ((address + nb - 1) >> _STRIPE_SHIFT);
+    for (;;) {
+        _modbus_stripe_t *stripe;
+        uint32_t sum = 0;
+        uint32_t locked = 0;
+
+        for (stripe = first; stripe <= last; stripe++) {
+            uint32_t seq = _SEQ_LOAD(&stripe->seq);
+
+            locked |= seq & 1;
+            sum += seq;
         }
+        if (!locked)
+            return sum;
+        _stripe_wait(&spins);
+    }
+}
+
+/* Returns TRUE if the values read since _mapping_read_begin() may be torn */
+static int _mapping_read_retry(modbus_mapping_t *mb_mapping, int table,
+                               int address, int nb, uint32_t sum)
+{
+    _modbus_stripe_t *stripe;
+    _modbus_stripe_t *last;
+
+    if (!(_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_THREAD_SAFE) || nb < 1)
+        return FALSE;
+
+    /* The values are read before the sequences */
+    _SEQ_ACQUIRE_FENCE();
+    stripe = _MAPPING_STRIPES(mb_mapping, table) + (address >> _STRIPE_SHIFT);
+    last = _MAPPING_STRIPES(mb_mapping, table) +
+        ((address + nb - 1) >> _STRIPE_SHIFT);
+    for (; stripe <= last; stripe++) {
+        sum -= _SEQ_LOAD(&stripe->seq);
+    }
+
+    return sum != 0;
+}
+
+/* Returns 0 if the nb addresses from address are in the table of the mapping
+   (in the ranges of a sparse mapping), -1 otherwise */
+static int _mapping_check(modbus_mapping_t *mb_mapping, int table,
+                          int address, int nb)
+{
+    int nb_table;
+
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE)
+        return _modbus_sparse_check(_MAPPING_SPARSE(mb_mapping), table,
+                                    address, nb);
+
+    switch (table) {
+    case MODBUS_TABLE_BITS:
+        nb_table = mb_mapping->nb_bits;
+        break;
+    case MODBUS_TABLE_INPUT_BITS:
+        nb_table = mb_mapping->nb_input_bits;
         break;
-    case MODBUS_FC_WRITE_MULTIPLE_COILS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
+    case MODBUS_TABLE_REGISTERS:
+        nb_table = mb_mapping->nb_registers;
+        break;
+    default:
+        nb_table = mb_mapping->nb_input_registers;
+        break;
+    }
 
-        if (nb < 1 || MODBUS_MAX_WRITE_BITS < nb) {
-            if (ctx->debug) {
-                fprintf(stderr,
-                        "Illegal number of values %d in write_bits (max %d)\n",
-                        nb, MODBUS_MAX_WRITE_BITS);
-            }
-            /* May be the indication has been truncated on reading because of
-             * invalid address (eg. nb is 0 but the request contains values to
-             * write) so it's necessary to flush. */
-            _sleep_response_timeout(ctx);
-            modbus_flush(ctx);
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
-        } else if ((address + nb) > mb_mapping->nb_bits) {
-            if (ctx->debug) {
-                fprintf(stderr, "Illegal data address 0x%0X in write_bits\n",
-                        address + nb);
-            }
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
-        } else {
-            /* 6 = byte count */
-            modbus_set_bits_from_bytes(mb_mapping->tab_bits, address, nb, &req[offset + 6]);
+    return (address + nb) > nb_table ? -1 : 0;
+}
+
+static int reply_bits(modbus_t *ctx, const uint8_t *req, uint8_t *rsp,
+                      modbus_mapping_t *mb_mapping, int table,
+                      uint8_t *tab_bits, const char *name)
+{
+    int address = (req[0] << 8) + req[1];
+    int nb = (req[2] << 8) + req[3];
+    uint32_t seq;
 
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            /* 4 to copy the bit address (2) and the quantity of bits */
-            memcpy(rsp + rsp_length, req + rsp_length, 4);
-            rsp_length += 4;
+    if (_mapping_check(mb_mapping, table, address, nb) == -1) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data address 0x%0X in %s\n",
+                    address + nb, name);
         }
+        errno = EMBXILADD;
+        return -1;
     }
-        break;
-    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        if (nb < 1 || MODBUS_MAX_WRITE_REGISTERS < nb) {
-            if (ctx->debug) {
-                fprintf(stderr,
-                        "Illegal number of values %d in write_registers (max %d)\n",
-                        nb, MODBUS_MAX_WRITE_REGISTERS);
+
+    rsp[0] = (nb / 8) + ((nb % 8) ? 1 : 0);
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE) {
+        _modbus_sparse_get_bits(_MAPPING_SPARSE(mb_mapping), table, address,
+                                nb, rsp + 1);
+    } else {
+        do {
+            seq = _mapping_read_begin(mb_mapping, table, address, nb);
+            if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_PACKED_BITS) {
+                _modbus_get_bits_packed(rsp + 1, tab_bits, address, nb);
+            } else {
+                _modbus_pack_bits(rsp + 1, tab_bits + address, nb);
             }
-            /* May be the indication has been truncated on reading because of
-             * invalid address (eg. nb is 0 but the request contains values to
-             * write) so it's necessary to flush. */
-            _sleep_response_timeout(ctx);
-            modbus_flush(ctx);
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
-        } else if ((address + nb) > mb_mapping->nb_registers) {
-            if (ctx->debug) {
-                fprintf(stderr, "Illegal data address 0x%0X in write_registers\n",
-                        address + nb);
+        } while (_mapping_read_retry(mb_mapping, table, address, nb, seq));
+    }
+
+    return 1 + rsp[0];
+}
+
+static int reply_registers(modbus_t *ctx, const uint8_t *req, uint8_t *rsp,
+                           modbus_mapping_t *mb_mapping, int table,
+                           uint16_t *tab_registers, const char *name)
+{
+    int address = (req[0] << 8) + req[1];
+    int nb = (req[2] << 8) + req[3];
+    uint32_t seq;
+
+    if (_mapping_check(mb_mapping, table, address, nb) == -1) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data address 0x%0X in %s\n",
+                    address + nb, name);
+        }
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    rsp[0] = nb << 1;
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE) {
+        _modbus_sparse_get_registers(_MAPPING_SPARSE(mb_mapping), table,
+                                     address, nb, rsp + 1);
+    } else {
+        do {
+            seq = _mapping_read_begin(mb_mapping, table, address, nb);
+            _modbus_set_registers_be(rsp + 1, tab_registers + address, nb);
+        } while (_mapping_read_retry(mb_mapping, table, address, nb, seq));
+    }
+
+    return 1 + (nb << 1);
+}
+
+static int reply_read_bits(modbus_t *ctx, const uint8_t *req, int req_length,
+                           uint8_t *rsp, modbus_mapping_t *mb_mapping,
+                           void *user_data)
+{
+    return reply_bits(ctx, req, rsp, mb_mapping, MODBUS_TABLE_BITS,
+                      mb_mapping->tab_bits, "read_bits");
+}
+
+static int reply_read_input_bits(modbus_t *ctx, const uint8_t *req,
+                                 int req_length, uint8_t *rsp,
+                                 modbus_mapping_t *mb_mapping, void *user_data)
+{
+    return reply_bits(ctx, req, rsp, mb_mapping, MODBUS_TABLE_INPUT_BITS,
+                      mb_mapping->tab_input_bits, "read_input_bits");
+}
+
+static int reply_read_registers(modbus_t *ctx, const uint8_t *req,
+                                int req_length, uint8_t *rsp,
+                                modbus_mapping_t *mb_mapping, void *user_data)
+{
+    return reply_registers(ctx, req, rsp, mb_mapping, MODBUS_TABLE_REGISTERS,
+                           mb_mapping->tab_registers, "read_registers");
+}
+
+static int reply_read_input_registers(modbus_t *ctx, const uint8_t *req,
+                                      int req_length, uint8_t *rsp,
+                                      modbus_mapping_t *mb_mapping,
+                                      void *user_data)
+{
+    return reply_registers(ctx, req, rsp, mb_mapping,
+                           MODBUS_TABLE_INPUT_REGISTERS,
+                           mb_mapping->tab_input_registers,
+                           "read_input_registers");
+}
+
+static int reply_write_bit(modbus_t *ctx, const uint8_t *req, int req_length,
+                           uint8_t *rsp, modbus_mapping_t *mb_mapping,
+                           void *user_data)
+{
+    int address = (req[0] << 8) + req[1];
+    int data = (req[2] << 8) + req[3];
+
+    if (_mapping_check(mb_mapping, MODBUS_TABLE_BITS, address, 1) == -1) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data address 0x%0X in write_bit\n",
+                    address);
+        }
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    if (data != 0xFF00 && data != 0x0) {
+        if (ctx->debug) {
+            fprintf(stderr,
+                    "Illegal data value 0x%0X in write_bit request at address %0X\n",
+                    data, address);
+        }
+        errno = EMBXILVAL;
+        return -1;
+    }
+
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE) {
+        *(uint8_t *)_modbus_sparse_value(_MAPPING_SPARSE(mb_mapping),
+                                         MODBUS_TABLE_BITS, address) =
+            (data) ? ON : OFF;
+    } else {
+        _mapping_lock(mb_mapping, MODBUS_TABLE_BITS, address, 1);
+        if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_PACKED_BITS) {
+            if (data) {
+                MODBUS_SET_BIT(mb_mapping->tab_bits, address);
+            } else {
+                MODBUS_CLEAR_BIT(mb_mapping->tab_bits, address);
             }
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
         } else {
-            int i, j;
-            for (i = address, j = 6; i < address + nb; i++, j += 2) {
-                /* 6 and 7 = first value */
-                mb_mapping->tab_registers[i] =
-                    (req[offset + j] << 8) + req[offset + j + 1];
-            }
+            mb_mapping->tab_bits[address] = (data) ? ON : OFF;
+        }
+        _mapping_unlock(mb_mapping, MODBUS_TABLE_BITS, address, 1);
+    }
+    memcpy(rsp, req, req_length);
+
+    return req_length;
+}
+
+static int reply_write_register(modbus_t *ctx, const uint8_t *req,
+                                int req_length, uint8_t *rsp,
+                                modbus_mapping_t *mb_mapping, void *user_data)
+{
+    int address = (req[0] << 8) + req[1];
 
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            /* 4 to copy the address (2) and the no. of registers */
-            memcpy(rsp + rsp_length, req + rsp_length, 4);
-            rsp_length += 4;
+    if (_mapping_check(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1) == -1) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data address 0x%0X in write_register\n",
+                    address);
         }
+        errno = EMBXILADD;
+        return -1;
     }
-        break;
-    case MODBUS_FC_REPORT_SLAVE_ID: {
-        int str_len;
-        int byte_count_pos;
-
-        rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-        /* Skip byte count for now */
-        byte_count_pos = rsp_length++;
-        rsp[rsp_length++] = _REPORT_SLAVE_ID;
-        /* Run indicator status to ON */
-        rsp[rsp_length++] = 0xFF;
-        /* LMB + length of LIBMODBUS_VERSION_STRING */
-        str_len = 3 + strlen(LIBMODBUS_VERSION_STRING);
-        memcpy(rsp + rsp_length, "LMB" LIBMODBUS_VERSION_STRING, str_len);
-        rsp_length += str_len;
-        rsp[byte_count_pos] = rsp_length - byte_count_pos - 1;
+
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE) {
+        _modbus_sparse_set_registers(_MAPPING_SPARSE(mb_mapping),
+                                     MODBUS_TABLE_REGISTERS, address, 1,
+                                     &req[2]);
+    } else {
+        _mapping_lock(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1);
+        mb_mapping->tab_registers[address] = (req[2] << 8) + req[3];
+        _mapping_unlock(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1);
     }
-        break;
-    case MODBUS_FC_READ_EXCEPTION_STATUS:
+    memcpy(rsp, req, req_length);
+
+    return req_length;
+}
+
+static int reply_read_exception_status(modbus_t *ctx, const uint8_t *req,
+                                       int req_length, uint8_t *rsp,
+                                       modbus_mapping_t *mb_mapping,
+                                       void *user_data)
+{
+    if (ctx->debug) {
+        fprintf(stderr, "FIXME Not implemented\n");
+    }
+    errno = ENOPROTOOPT;
+    return -1;
+}
+
+static int reply_write_bits(modbus_t *ctx, const uint8_t *req, int req_length,
+                            uint8_t *rsp, modbus_mapping_t *mb_mapping,
+                            void *user_data)
+{
+    int address = (req[0] << 8) + req[1];
+    int nb = (req[2] << 8) + req[3];
+
+    if (_mapping_check(mb_mapping, MODBUS_TABLE_BITS, address, nb) == -1) {
         if (ctx->debug) {
-            fprintf(stderr, "FIXME Not implemented\n");
+            fprintf(stderr, "Illegal data address 0x%0X in write_bits\n",
+                    address + nb);
         }
-        errno = ENOPROTOOPT;
+        errno = EMBXILADD;
         return -1;
-        break;
-    case MODBUS_FC_MASK_WRITE_REGISTER:
-        if (address >= mb_mapping->nb_registers) {
-            if (ctx->debug) {
-                fprintf(stderr, "Illegal data address 0x%0X in write_register\n",
-                        address);
-            }
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+    }
+
+    /* 5 = first byte after the byte count */
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE) {
+        _modbus_sparse_set_bits(_MAPPING_SPARSE(mb_mapping), MODBUS_TABLE_BITS,
+                                address, nb, &req[5]);
+    } else {
+        _mapping_lock(mb_mapping, MODBUS_TABLE_BITS, address, nb);
+        if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_PACKED_BITS) {
+            _modbus_set_bits_packed(mb_mapping->tab_bits, address, nb, &req[5]);
         } else {
-            uint16_t data = mb_mapping->tab_registers[address];
-            uint16_t and = (req[offset + 3] << 8) + req[offset + 4];
-            uint16_t or = (req[offset + 5] << 8) + req[offset + 6];
+            _modbus_unpack_bits(mb_mapping->tab_bits + address, &req[5], nb);
+        }
+        _mapping_unlock(mb_mapping, MODBUS_TABLE_BITS, address, nb);
+    }
+
+    /* 4 to copy the bit address (2) and the quantity of bits */
+    memcpy(rsp, req, 4);
+
+    return 4;
+}
+
+static int reply_write_registers(modbus_t *ctx, const uint8_t *req,
+                                 int req_length, uint8_t *rsp,
+                                 modbus_mapping_t *mb_mapping, void *user_data)
+{
+    int address = (req[0] << 8) + req[1];
+    int nb = (req[2] << 8) + req[3];
+
+    if (_mapping_check(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb) == -1) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data address 0x%0X in write_registers\n",
+                    address + nb);
+        }
+        errno = EMBXILADD;
+        return -1;
+    }
 
-            data = (data & and) | (or & (~and));
-            mb_mapping->tab_registers[address] = data;
-            memcpy(rsp, req, req_length);
-            rsp_length = req_length;
+    /* 5 and 6 = first value */
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE) {
+        _modbus_sparse_set_registers(_MAPPING_SPARSE(mb_mapping),
+                                     MODBUS_TABLE_REGISTERS, address, nb,
+                                     &req[5]);
+    } else {
+        _mapping_lock(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb);
+        _modbus_get_registers_be(mb_mapping->tab_registers + address, &req[5],
+                                 nb);
+        _mapping_unlock(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb);
+    }
+
+    /* 4 to copy the address (2) and the no. of registers */
+    memcpy(rsp, req, 4);
+
+    return 4;
+}
+
+static int reply_report_slave_id(modbus_t *ctx, const uint8_t *req,
+                                 int req_length, uint8_t *rsp,
+                                 modbus_mapping_t *mb_mapping, void *user_data)
+{
+    /* Byte count in rsp[0] */
+    int rsp_length = 1;
+    int str_len;
+
+    rsp[rsp_length++] = _REPORT_SLAVE_ID;
+    /* Run indicator status to ON */
+    rsp[rsp_length++] = 0xFF;
+    /* LMB + length of LIBMODBUS_VERSION_STRING */
+    str_len = 3 + strlen(LIBMODBUS_VERSION_STRING);
+    memcpy(rsp + rsp_length, "LMB" LIBMODBUS_VERSION_STRING, str_len);
+    rsp_length += str_len;
+    rsp[0] = rsp_length - 1;
+
+    return rsp_length;
+}
+
+static int reply_mask_write_register(modbus_t *ctx, const uint8_t *req,
+                                     int req_length, uint8_t *rsp,
+                                     modbus_mapping_t *mb_mapping,
+                                     void *user_data)
+{
+    int address = (req[0] << 8) + req[1];
+    uint16_t *tab_data;
+    uint16_t data;
+    uint16_t and;
+    uint16_t or;
+
+    if (_mapping_check(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1) == -1) {
+        if (ctx->debug) {
+            fprintf(stderr, "Illegal data address 0x%0X in write_register\n",
+                    address);
         }
-        break;
-    case MODBUS_FC_WRITE_AND_READ_REGISTERS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        uint16_t address_write = (req[offset + 5] << 8) + req[offset + 6];
-        int nb_write = (req[offset + 7] << 8) + req[offset + 8];
-        int nb_write_bytes = req[offset + 9];
-
-        if (nb_write < 1 || MODBUS_MAX_WR_WRITE_REGISTERS < nb_write ||
-            nb < 1 || MODBUS_MAX_WR_READ_REGISTERS < nb ||
-            nb_write_bytes != nb_write * 2) {
-            if (ctx->debug) {
-                fprintf(stderr,
-                        "Illegal nb of values (W%d, R%d) in write_and_read_registers (max W%d, R%d)\n",
-                        nb_write, nb,
-                        MODBUS_MAX_WR_WRITE_REGISTERS, MODBUS_MAX_WR_READ_REGISTERS);
-            }
-            _sleep_response_timeout(ctx);
-            modbus_flush(ctx);
-            rsp_length = response_exception(
-                ctx, &sft,
-                MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
-        } else if ((address + nb) > mb_mapping->nb_registers ||
-                   (address_write + nb_write) > mb_mapping->nb_registers) {
-            if (ctx->debug) {
-                fprintf(stderr,
-                        "Illegal data read address 0x%0X or write address 0x%0X write_and_read_registers\n",
-                        address + nb, address_write + nb_write);
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE) {
+        tab_data = _modbus_sparse_value(_MAPPING_SPARSE(mb_mapping),
+                                        MODBUS_TABLE_REGISTERS, address);
+    } else {
+        tab_data = mb_mapping->tab_registers + address;
+    }
+    and = (req[2] << 8) + req[3];
+    or = (req[4] << 8) + req[5];
+
+    _mapping_lock(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1);
+    data = *tab_data;
+    data = (data & and) | (or & (~and));
+    *tab_data = data;
+    _mapping_unlock(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1);
+    memcpy(rsp, req, req_length);
+
+    return req_length;
+}
+
+static int reply_write_and_read_registers(modbus_t *ctx, const uint8_t *req,
+                                          int req_length, uint8_t *rsp,
+                                          modbus_mapping_t *mb_mapping,
+                                          void *user_data)
+{
+    int address = (req[0] << 8) + req[1];
+    int nb = (req[2] << 8) + req[3];
+    int address_write = (req[4] << 8) + req[5];
+    int nb_write = (req[6] << 8) + req[7];
+
+    if (_mapping_check(mb_mapping, MODBUS_TABLE_REGISTERS,
+                       address, nb) == -1 ||
+        _mapping_check(mb_mapping, MODBUS_TABLE_REGISTERS,
+                       address_write, nb_write) == -1) {
+        if (ctx->debug) {
+            fprintf(stderr,
+                    "Illegal data read address 0x%0X or write address 0x%0X write_and_read_registers\n",
+                    address + nb, address_write + nb_write);
+        }
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    /* Write first.
+       9 and 10 are the offset of the first values to write */
+    rsp[0] = nb << 1;
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE) {
+        _modbus_sparse_set_registers(_MAPPING_SPARSE(mb_mapping),
+                                     MODBUS_TABLE_REGISTERS, address_write,
+                                     nb_write, &req[9]);
+        _modbus_sparse_get_registers(_MAPPING_SPARSE(mb_mapping),
+                                     MODBUS_TABLE_REGISTERS, address, nb,
+                                     rsp + 1);
+    } else {
+        /* The stripes of both ranges (and between them) are locked to not
+           read the values of another write */
+        int first = (address < address_write) ? address : address_write;
+        int end = (address + nb > address_write + nb_write) ?
+            address + nb : address_write + nb_write;
+
+        _mapping_lock(mb_mapping, MODBUS_TABLE_REGISTERS, first, end - first);
+        _modbus_get_registers_be(mb_mapping->tab_registers + address_write,
+                                 &req[9], nb_write);
+        /* and read the data for the response */
+        _modbus_set_registers_be(rsp + 1, mb_mapping->tab_registers + address,
+                                 nb);
+        _mapping_unlock(mb_mapping, MODBUS_TABLE_REGISTERS, first, end - first);
+    }
+
+    return 1 + (nb << 1);
+}
+
+/* Built-in handlers indexed by function code (min_length, byte_count,
+   validate, reply, user_data) */
+static const modbus_handler_t _builtin_handlers[] = {
+    /* 0x00 */ { 0, 0, NULL, NULL, NULL },
+    /* 0x01 */ { 4, 0, validate_read_bits, reply_read_bits, NULL },
+    /* 0x02 */ { 4, 0, validate_read_input_bits, reply_read_input_bits, NULL },
+    /* 0x03 */ { 4, 0, validate_read_registers, reply_read_registers, NULL },
+    /* 0x04 */ { 4, 0, validate_read_input_registers,
+                 reply_read_input_registers, NULL },
+    /* 0x05 */ { 4, 0, NULL, reply_write_bit, NULL },
+    /* 0x06 */ { 4, 0, NULL, reply_write_register, NULL },
+    /* 0x07 */ { 0, 0, NULL, reply_read_exception_status, NULL },
+    /* 0x08 */ { 0, 0, NULL, NULL, NULL },
+    /* 0x09 */ { 0, 0, NULL, NULL, NULL },
+    /* 0x0A */ { 0, 0, NULL, NULL, NULL },
+    /* 0x0B */ { 0, 0, NULL, NULL, NULL },
+    /* 0x0C */ { 0, 0, NULL, NULL, NULL },
+    /* 0x0D */ { 0, 0, NULL, NULL, NULL },
+    /* 0x0E */ { 0, 0, NULL, NULL, NULL },
+    /* 0x0F */ { 5, 1, validate_write_bits, reply_write_bits, NULL },
+    /* 0x10 */ { 5, 1, validate_write_registers, reply_write_registers, NULL },
+    /* 0x11 */ { 0, 0, NULL, reply_report_slave_id, NULL },
+    /* 0x12 */ { 0, 0, NULL, NULL, NULL },
+    /* 0x13 */ { 0, 0, NULL, NULL, NULL },
+    /* 0x14 */ { 0, 0, NULL, NULL, NULL },
+    /* 0x15 */ { 0, 0, NULL, NULL, NULL },
+    /* 0x16 */ { 6, 0, NULL, reply_mask_write_register, NULL },
+    /* 0x17 */ { 9, 1, validate_write_and_read_registers,
+                 reply_write_and_read_registers, NULL }
+};
+
+#define _NB_BUILTIN_HANDLERS \
+    (int)(sizeof(_builtin_handlers) / sizeof(_builtin_handlers[0]))
+
+/* Sends the exception response matching errno (EMBXILVAL, etc) with the
+   penalty of the request when given (NULL otherwise), other errors are
+   returned without response */
+static int _reply_exception(modbus_t *ctx, sft_t *sft, uint8_t *rsp,
+                            const uint8_t *req, int req_length)
+{
+    int exception_code = errno - MODBUS_ENOBASE;
+    int rsp_length;
+
+    if (exception_code < MODBUS_EXCEPTION_ILLEGAL_FUNCTION ||
+        exception_code >= MODBUS_EXCEPTION_MAX)
+        return -1;
+
+    rsp_length = response_exception(ctx, sft, exception_code, rsp);
+    if (req != NULL)
+        return _reply_penalty(ctx, req, req_length, rsp, rsp_length);
+
+    return _modbus_send_msg(ctx, rsp, rsp_length);
+}
+
+/* Sends the response data returned by a handler or the exception */
+static int _reply_send(modbus_t *ctx, sft_t *sft, uint8_t *rsp,
+                       int rsp_length, int rc)
+{
+    if (rc == -1)
+        return _reply_exception(ctx, sft, rsp, NULL, 0);
+
+    return _modbus_send_msg(ctx, rsp, rsp_length + rc);
+}
+
+/* Send a response to the received request.
+   Analyses the request and constructs a response.
+
+   The request is dispatched to the handler of its function code, registered
+   with modbus_set_handler() or built in. If an error occurs, this function
+   construct the response accordingly.
+*/
+int modbus_reply(modbus_t *ctx, const uint8_t *req,
+                 int req_length, modbus_mapping_t *mb_mapping)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The router gives the mapping and the handlers of the unit */
+    if (ctx->router != NULL)
+        return _modbus_router_reply(ctx, req, req_length);
+
+    return _modbus_reply(ctx, ctx->handlers, req, req_length, mb_mapping);
+}
+
+/* Replies with the handlers given instead of the ones of the context (see
+   modbus_reply) */
+int _modbus_reply(modbus_t *ctx, const modbus_handler_t *handlers,
+                  const uint8_t *req, int req_length,
+                  modbus_mapping_t *mb_mapping)
+{
+    int offset;
+    int function;
+    const modbus_handler_t *handler;
+    const uint8_t *data;
+    int data_length;
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    int rsp_length;
+    int rc;
+    sft_t sft;
+
+    offset = ctx->backend->header_length;
+    function = req[offset];
+    sft.slave = req[offset - 1];
+    sft.function = function;
+    sft.t_id = ctx->backend->prepare_response_tid(req, &req_length);
+
+    /* Data of the request after the function code */
+    data = req + offset + 1;
+    data_length = req_length - offset - 1;
+    rsp_length = ctx->backend->build_response_basis(&sft, rsp);
+
+    /* Data are flushed on illegal number of values errors (validation) and
+       the response is delayed by a penalty (see _reply_penalty). */
+    if (handlers == NULL || handlers[function].reply == NULL) {
+        /* Fast path of the most used function codes, the built-in handlers
+           are called directly */
+        switch (function) {
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+            if (data_length < 4) {
+                errno = EMBXILVAL;
+                return _reply_exception(ctx, &sft, rsp, req, req_length);
             }
-            rsp_length = response_exception(ctx, &sft,
-                                            MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
-        } else {
-            int i, j;
-            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            rsp[rsp_length++] = nb << 1;
-
-            /* Write first.
-               10 and 11 are the offset of the first values to write */
-            for (i = address_write, j = 10; i < address_write + nb_write; i++, j += 2) {
-                mb_mapping->tab_registers[i] =
-                    (req[offset + j] << 8) + req[offset + j + 1];
+            if (validate_read_registers(ctx, data, data_length, NULL) == -1)
+                return _reply_exception(ctx, &sft, rsp, req, req_length);
+            rc = reply_read_registers(ctx, data, data_length,
+                                      rsp + rsp_length, mb_mapping, NULL);
+            return _reply_send(ctx, &sft, rsp, rsp_length, rc);
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+            if (data_length < 4) {
+                errno = EMBXILVAL;
+                return _reply_exception(ctx, &sft, rsp, req, req_length);
             }
-
-            /* and read the data for the response */
-            for (i = address; i < address + nb; i++) {
-                rsp[rsp_length++] = mb_mapping->tab_registers[i] >> 8;
-                rsp[rsp_length++] = mb_mapping->tab_registers[i] & 0xFF;
+            rc = reply_write_register(ctx, data, data_length,
+                                      rsp + rsp_length, mb_mapping, NULL);
+            return _reply_send(ctx, &sft, rsp, rsp_length, rc);
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            if (data_length < 5) {
+                errno = EMBXILVAL;
+                return _reply_exception(ctx, &sft, rsp, req, req_length);
             }
+            if (validate_write_registers(ctx, data, data_length, NULL) == -1)
+                return _reply_exception(ctx, &sft, rsp, req, req_length);
+            rc = reply_write_registers(ctx, data, data_length,
+                                       rsp + rsp_length, mb_mapping, NULL);
+            return _reply_send(ctx, &sft, rsp, rsp_length, rc);
+        default:
+            break;
         }
+
+        handler = (function < _NB_BUILTIN_HANDLERS) ?
+            &_builtin_handlers[function] : NULL;
+    } else {
+        handler = &handlers[function];
     }
-        break;
 
-    default:
-        rsp_length = response_exception(ctx, &sft,
-                                        MODBUS_EXCEPTION_ILLEGAL_FUNCTION,
-                                        rsp);
-        break;
+    if (handler == NULL || handler->reply == NULL) {
+        errno = EMBXILFUN;
+        return _reply_exception(ctx, &sft, rsp, NULL, 0);
+    }
+
+    if (data_length < handler->min_length) {
+        if (ctx->debug) {
+            fprintf(stderr, "Request too short for function 0x%0X (%d < %d)\n",
+                    function, data_length, handler->min_length);
+        }
+        errno = EMBXILVAL;
+        return _reply_exception(ctx, &sft, rsp, req, req_length);
     }
 
-    return send_msg(ctx, rsp, rsp_length);
+    if (handler->validate != NULL &&
+        handler->validate(ctx, data, data_length, handler->user_data) == -1)
+        return _reply_exception(ctx, &sft, rsp, req, req_length);
+
+    rc = handler->reply(ctx, data, data_length, rsp + rsp_length, mb_mapping,
+                        handler->user_data);
+
+    return _reply_send(ctx, &sft, rsp, rsp_length, rc);
 }
 
 int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
@@ -1093,13 +1921,65 @@ int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
     /* Positive exception code */
     if (exception_code < MODBUS_EXCEPTION_MAX) {
         rsp[rsp_length++] = exception_code;
-        return send_msg(ctx, rsp, rsp_length);
+        return _modbus_send_msg(ctx, rsp, rsp_length);
     } else {
         errno = EINVAL;
         return -1;
     }
 }
 
+/* Registers the handler of a function code in modbus_reply(), the handler
+   is copied. A NULL handler restores the built-in one (or the illegal function
+   exception). */
+int modbus_set_handler(modbus_t *ctx, int function,
+                       const modbus_handler_t *handler)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return _modbus_set_handler(&ctx->handlers, function, handler);
+}
+
+/* Copies the handler in the table, allocated on the first handler. Shared with
+   the units of the router. */
+int _modbus_set_handler(modbus_handler_t **handlers, int function,
+                        const modbus_handler_t *handler)
+{
+    if (function < 1 || function >= 0x80) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (handler == NULL) {
+        if (*handlers != NULL)
+            memset(&(*handlers)[function], 0, sizeof(modbus_handler_t));
+        return 0;
+    }
+
+    /* The fixed part and the byte count must fit in the PDU */
+    if (handler->reply == NULL || handler->min_length < 0 ||
+        handler->min_length >= MODBUS_MAX_PDU_LENGTH ||
+        (handler->byte_count && handler->min_length == 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (*handlers == NULL) {
+        /* The function code of a request indexes the table so 256 entries */
+        *handlers = calloc(256, sizeof(modbus_handler_t));
+        if (*handlers == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    (*handlers)[function] = *handler;
+
+    return 0;
+}
+
 /* Reads IO status */
 static int read_io_status(modbus_t *ctx, int function,
                           int addr, int nb, uint8_t *dest)
@@ -1112,33 +1992,20 @@ static int read_io_status(modbus_t *ctx, int function,
 
     req_length = ctx->backend->build_request_basis(ctx, function, addr, nb, req);
 
-    rc = send_msg(ctx, req, req_length);
+    rc = _modbus_send_msg(ctx, req, req_length);
     if (rc > 0) {
-        int i, temp, bit;
-        int pos = 0;
         int offset;
-        int offset_end;
 
         rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = _modbus_check_confirmation(ctx, req, rsp, rc);
         if (rc == -1)
             return -1;
 
         offset = ctx->backend->header_length + 2;
-        offset_end = offset + rc;
-        for (i = offset; i < offset_end; i++) {
-            /* Shift reg hi_byte to temp */
-            temp = rsp[i];
-
-            for (bit = 0x01; (bit & 0xff) && (pos < nb);) {
-                dest[pos++] = (temp & bit) ? TRUE : FALSE;
-                bit = bit << 1;
-            }
-
-        }
+        _modbus_unpack_bits(dest, rsp + offset, (nb < rc * 8) ? nb : rc * 8);
     }
 
     return rc;
@@ -1223,26 +2090,21 @@ static int read_registers(modbus_t *ctx, int function, int addr, int nb,
 
     req_length = ctx->backend->build_request_basis(ctx, function, addr, nb, req);
 
-    rc = send_msg(ctx, req, req_length);
+    rc = _modbus_send_msg(ctx, req, req_length);
     if (rc > 0) {
         int offset;
-        int i;
 
         rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = _modbus_check_confirmation(ctx, req, rsp, rc);
         if (rc == -1)
             return -1;
 
         offset = ctx->backend->header_length;
 
-        for (i = 0; i < rc; i++) {
-            /* shift reg hi_byte to temp OR with lo_byte */
-            dest[i] = (rsp[offset + 2 + (i << 1)] << 8) |
-                rsp[offset + 3 + (i << 1)];
-        }
+        _modbus_get_registers_be(dest, rsp + offset + 2, rc);
     }
 
     return rc;
@@ -1314,7 +2176,7 @@ static int write_single(modbus_t *ctx, int function, int addr, int value)
 
     req_length = ctx->backend->build_request_basis(ctx, function, addr, value, req);
 
-    rc = send_msg(ctx, req, req_length);
+    rc = _modbus_send_msg(ctx, req, req_length);
     if (rc > 0) {
         /* Used by write_bit and write_register */
         uint8_t rsp[MAX_MESSAGE_LENGTH];
@@ -1323,7 +2185,7 @@ static int write_single(modbus_t *ctx, int function, int addr, int value)
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = _modbus_check_confirmation(ctx, req, rsp, rc);
     }
 
     return rc;
@@ -1356,11 +2218,8 @@ int modbus_write_register(modbus_t *ctx, int addr, int value)
 int modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src)
 {
     int rc;
-    int i;
     int byte_count;
     int req_length;
-    int bit_check = 0;
-    int pos = 0;
     uint8_t req[MAX_MESSAGE_LENGTH];
 
     if (ctx == NULL) {
@@ -1383,24 +2242,10 @@ int modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src)
     byte_count = (nb / 8) + ((nb % 8) ? 1 : 0);
     req[req_length++] = byte_count;
 
-    for (i = 0; i < byte_count; i++) {
-        int bit;
-
-        bit = 0x01;
-        req[req_length] = 0;
-
-        while ((bit & 0xFF) && (bit_check++ < nb)) {
-            if (src[pos++])
-                req[req_length] |= bit;
-            else
-                req[req_length] &=~ bit;
-
-            bit = bit << 1;
-        }
-        req_length++;
-    }
+    _modbus_pack_bits(req + req_length, src, nb);
+    req_length += byte_count;
 
-    rc = send_msg(ctx, req, req_length);
+    rc = _modbus_send_msg(ctx, req, req_length);
     if (rc > 0) {
         uint8_t rsp[MAX_MESSAGE_LENGTH];
 
@@ -1408,7 +2253,7 @@ int modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src)
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = _modbus_check_confirmation(ctx, req, rsp, rc);
     }
 
 
@@ -1419,7 +2264,6 @@ int modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src)
 int modbus_write_registers(modbus_t *ctx, int addr, int nb, const uint16_t *src)
 {
     int rc;
-    int i;
     int req_length;
     int byte_count;
     uint8_t req[MAX_MESSAGE_LENGTH];
@@ -1445,12 +2289,10 @@ int modbus_write_registers(modbus_t *ctx, int addr, int nb, const uint16_t *src)
     byte_count = nb * 2;
     req[req_length++] = byte_count;
 
-    for (i = 0; i < nb; i++) {
-        req[req_length++] = src[i] >> 8;
-        req[req_length++] = src[i] & 0x00FF;
-    }
+    _modbus_set_registers_be(req + req_length, src, nb);
+    req_length += byte_count;
 
-    rc = send_msg(ctx, req, req_length);
+    rc = _modbus_send_msg(ctx, req, req_length);
     if (rc > 0) {
         uint8_t rsp[MAX_MESSAGE_LENGTH];
 
@@ -1458,7 +2300,7 @@ int modbus_write_registers(modbus_t *ctx, int addr, int nb, const uint16_t *src)
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = _modbus_check_confirmation(ctx, req, rsp, rc);
     }
 
     return rc;
@@ -1482,7 +2324,7 @@ int modbus_mask_write_register(modbus_t *ctx, int addr, uint16_t and_mask, uint1
     req[req_length++] = or_mask >> 8;
     req[req_length++] = or_mask & 0x00ff;
 
-    rc = send_msg(ctx, req, req_length);
+    rc = _modbus_send_msg(ctx, req, req_length);
     if (rc > 0) {
         /* Used by write_bit and write_register */
         uint8_t rsp[MAX_MESSAGE_LENGTH];
@@ -1491,7 +2333,7 @@ int modbus_mask_write_register(modbus_t *ctx, int addr, uint16_t and_mask, uint1
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = _modbus_check_confirmation(ctx, req, rsp, rc);
     }
 
     return rc;
@@ -1508,7 +2350,6 @@ int modbus_write_and_read_registers(modbus_t *ctx,
 {
     int rc;
     int req_length;
-    int i;
     int byte_count;
     uint8_t req[MAX_MESSAGE_LENGTH];
     uint8_t rsp[MAX_MESSAGE_LENGTH];
@@ -1548,12 +2389,10 @@ int modbus_write_and_read_registers(modbus_t *ctx,
     byte_count = write_nb * 2;
     req[req_length++] = byte_count;
 
-    for (i = 0; i < write_nb; i++) {
-        req[req_length++] = src[i] >> 8;
-        req[req_length++] = src[i] & 0x00FF;
-    }
+    _modbus_set_registers_be(req + req_length, src, write_nb);
+    req_length += byte_count;
 
-    rc = send_msg(ctx, req, req_length);
+    rc = _modbus_send_msg(ctx, req, req_length);
     if (rc > 0) {
         int offset;
 
@@ -1561,16 +2400,12 @@ int modbus_write_and_read_registers(modbus_t *ctx,
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = _modbus_check_confirmation(ctx, req, rsp, rc);
         if (rc == -1)
             return -1;
 
         offset = ctx->backend->header_length;
-        for (i = 0; i < rc; i++) {
-            /* shift reg hi_byte to temp OR with lo_byte */
-            dest[i] = (rsp[offset + 2 + (i << 1)] << 8) |
-                rsp[offset + 3 + (i << 1)];
-        }
+        _modbus_get_registers_be(dest, rsp + offset + 2, rc);
     }
 
     return rc;
@@ -1595,7 +2430,7 @@ int modbus_report_slave_id(modbus_t *ctx, int max_dest, uint8_t *dest)
     /* HACKISH, addr and count are not used */
     req_length -= 4;
 
-    rc = send_msg(ctx, req, req_length);
+    rc = _modbus_send_msg(ctx, req, req_length);
     if (rc > 0) {
         int i;
         int offset;
@@ -1605,7 +2440,7 @@ int modbus_report_slave_id(modbus_t *ctx, int max_dest, uint8_t *dest)
         if (rc == -1)
             return -1;
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+        rc = _modbus_check_confirmation(ctx, req, rsp, rc);
         if (rc == -1)
             return -1;
 
@@ -1627,14 +2462,52 @@ void _modbus_init_common(modbus_t *ctx)
     ctx->slave = -1;
     ctx->s = -1;
 
-    ctx->debug = FALSE;
-    ctx->error_recovery = MODBUS_ERROR_RECOVERY_NONE;
+    ctx->debug = FALSE;
+    ctx->error_recovery = MODBUS_ERROR_RECOVERY_NONE;
+
+    ctx->response_timeout.tv_sec = 0;
+    ctx->response_timeout.tv_usec = _RESPONSE_TIMEOUT;
+
+    ctx->byte_timeout.tv_sec = 0;
+    ctx->byte_timeout.tv_usec = _BYTE_TIMEOUT;
+
+    ctx->wait_mode = MODBUS_WAIT_BLOCK;
+    ctx->penalty_mode = MODBUS_PENALTY_DEFER;
+    ctx->deferred = NULL;
+    ctx->nb_deferred_conns = 0;
+    ctx->max_deferred_conns = 0;
+    ctx->nb_deferred = 0;
+    ctx->nb_penalty_flushes = 0;
+    ctx->handlers = NULL;
+    ctx->async = NULL;
+    ctx->trace = NULL;
+    ctx->router = NULL;
+    ctx->tcp_profile = NULL;
+    ctx->in_storage = FALSE;
+}
+
+/* Initializes a context at the start of the storage of the caller, its
+   backend data follows on a 16 bytes boundary. The storage must be aligned
+   on 8 bytes as the memory of malloc().
+
+   The function shall return the context or NULL and set errno. */
+modbus_t *_modbus_init_storage(void *storage, size_t size,
+                               size_t backend_data_size)
+{
+    modbus_t *ctx = storage;
+
+    if (storage == NULL || ((uintptr_t)storage & 7) != 0 ||
+        size < _MODBUS_STORAGE_SIZE(backend_data_size)) {
+        errno = EINVAL;
+        return NULL;
+    }
 
-    ctx->response_timeout.tv_sec = 0;
-    ctx->response_timeout.tv_usec = _RESPONSE_TIMEOUT;
+    _modbus_init_common(ctx);
+    ctx->in_storage = TRUE;
+    ctx->backend_data = (uint8_t *)storage +
+        _MODBUS_STORAGE_SIZE(backend_data_size) - backend_data_size;
 
-    ctx->byte_timeout.tv_sec = 0;
-    ctx->byte_timeout.tv_usec = _BYTE_TIMEOUT;
+    return ctx;
 }
 
 /* Define the slave number */
@@ -1734,6 +2607,129 @@ int modbus_set_byte_timeout(modbus_t *ctx, uint32_t to_sec, uint32_t to_usec)
     return 0;
 }
 
+int modbus_get_wait_mode(modbus_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ctx->wait_mode;
+}
+
+/* With MODBUS_WAIT_NONE, the receive functions don't wait for the beginning of
+   a message, they return at once with EAGAIN when nothing has been received.
+   It allows to drive many contexts from a single event loop. */
+int modbus_set_wait_mode(modbus_t *ctx, int mode)
+{
+    if (ctx == NULL ||
+        (mode != MODBUS_WAIT_BLOCK && mode != MODBUS_WAIT_NONE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->wait_mode = mode;
+    return 0;
+}
+
+int modbus_get_exception_penalty(modbus_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ctx->penalty_mode;
+}
+
+/* Sets how modbus_reply() delays the exception response to a request with an
+   illegal number of values */
+int modbus_set_exception_penalty(modbus_t *ctx, int mode)
+{
+    if (ctx == NULL ||
+        (mode != MODBUS_PENALTY_DEFER && mode != MODBUS_PENALTY_SLEEP &&
+         mode != MODBUS_PENALTY_NONE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->penalty_mode = mode;
+    return 0;
+}
+
+/* Sends the deferred responses whose penalty has expired, whatever their
+   connection. The function shall return the number of responses sent or -1
+   and set errno (the failed response is dropped). */
+int modbus_send_deferred(modbus_t *ctx)
+{
+    int64_t now;
+    int nb_sent = 0;
+    int i = 0;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    now = _modbus_now_us();
+    while (i < ctx->nb_deferred_conns) {
+        if (_deferred_deadline(ctx, i) <= now) {
+            /* The connection is replaced by the last one once empty */
+            if (_deferred_send(ctx, i) == -1)
+                return -1;
+            nb_sent++;
+        } else {
+            i++;
+        }
+    }
+
+    return nb_sent;
+}
+
+/* Stores the delay until the next deferred response is due. The function
+   shall return the number of deferred responses (the delay is only set when
+   there is at least one). */
+int modbus_get_deferred_timeout(modbus_t *ctx, uint32_t *to_sec,
+                                uint32_t *to_usec)
+{
+    int64_t delay = INT64_MAX;
+    int64_t now;
+    int i;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->nb_deferred == 0)
+        return 0;
+
+    now = _modbus_now_us();
+    for (i = 0; i < ctx->nb_deferred_conns; i++) {
+        if (_deferred_deadline(ctx, i) - now < delay)
+            delay = _deferred_deadline(ctx, i) - now;
+    }
+    if (delay < 0)
+        delay = 0;
+
+    *to_sec = delay / 1000000;
+    *to_usec = delay % 1000000;
+
+    return ctx->nb_deferred;
+}
+
+/* Returns the number of times the data received on a serial line during a
+   penalty have been flushed */
+int modbus_get_penalty_flushes(modbus_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ctx->nb_penalty_flushes;
+}
+
 int modbus_get_header_length(modbus_t *ctx)
 {
     if (ctx == NULL) {
@@ -1759,6 +2755,7 @@ void modbus_close(modbus_t *ctx)
     if (ctx == NULL)
         return;
 
+    _deferred_drop(ctx, ctx->s);
     ctx->backend->close(ctx);
 }
 
@@ -1767,7 +2764,13 @@ void modbus_free(modbus_t *ctx)
     if (ctx == NULL)
         return;
 
-    ctx->backend->free(ctx);
+    _modbus_trace_detach(ctx);
+    free(ctx->deferred);
+    free(ctx->handlers);
+    free(ctx->tcp_profile);
+    _modbus_async_free(ctx);
+    if (!ctx->in_storage)
+        ctx->backend->free(ctx);
 }
 
 int modbus_set_debug(modbus_t *ctx, int flag)
@@ -1781,6 +2784,217 @@ int modbus_set_debug(modbus_t *ctx, int flag)
     return 0;
 }
 
+/*
+ * The mapping and its four tables are allocated in one arena, the tables start
+ * on cache lines:
+ * | _modbus_arena_t | tab_bits | tab_input_bits | tab_registers | tab_input_registers |
+ * followed by the stripes of the four tables for MODBUS_MAPPING_THREAD_SAFE.
+ */
+
+/* Returns the size of the arena and the offsets of the tables */
+static size_t _arena_layout(int nb_bits, int nb_input_bits,
+                            int nb_registers, int nb_input_registers,
+                            int flags, size_t offsets[_ARENA_NB_SEGMENTS])
+{
+    size_t sizes[_ARENA_NB_SEGMENTS];
+    size_t size;
+    int i;
+
+    if (flags & MODBUS_MAPPING_PACKED_BITS) {
+        sizes[0] = ((size_t)nb_bits + 7) / 8;
+        sizes[1] = ((size_t)nb_input_bits + 7) / 8;
+    } else {
+        sizes[0] = nb_bits;
+        sizes[1] = nb_input_bits;
+    }
+    sizes[2] = (size_t)nb_registers * sizeof(uint16_t);
+    sizes[3] = (size_t)nb_input_registers * sizeof(uint16_t);
+
+    if (flags & MODBUS_MAPPING_THREAD_SAFE) {
+        sizes[4] = _NB_STRIPES(nb_bits) * sizeof(_modbus_stripe_t);
+        sizes[5] = _NB_STRIPES(nb_input_bits) * sizeof(_modbus_stripe_t);
+        sizes[6] = _NB_STRIPES(nb_registers) * sizeof(_modbus_stripe_t);
+        sizes[7] = _NB_STRIPES(nb_input_registers) * sizeof(_modbus_stripe_t);
+    } else {
+        sizes[4] = sizes[5] = sizes[6] = sizes[7] = 0;
+    }
+
+    size = _CACHE_LINE_ALIGN(sizeof(_modbus_arena_t));
+    for (i = 0; i < _ARENA_NB_SEGMENTS; i++) {
+        offsets[i] = size;
+        size += _CACHE_LINE_ALIGN(sizes[i]);
+    }
+
+    return size;
+}
+
+/* Sets the pointers of the mapping to the tables of the zeroed arena */
+static modbus_mapping_t* _arena_init(_modbus_arena_t *arena, size_t size,
+                                     int kind, int nb_bits, int nb_input_bits,
+                                     int nb_registers, int nb_input_registers,
+                                     int flags,
+                                     const size_t offsets[_ARENA_NB_SEGMENTS])
+{
+    modbus_mapping_t *mb_mapping = &arena->mapping;
+    uint8_t *base = (uint8_t *)arena;
+    int i;
+
+    arena->size = size;
+    arena->kind = kind;
+    arena->sparse = NULL;
+    for (i = 0; i < 4; i++) {
+        arena->stripes[i] = (flags & MODBUS_MAPPING_THREAD_SAFE) ?
+            (_modbus_stripe_t *)(base + offsets[4 + i]) : NULL;
+    }
+
+    mb_mapping->flags = flags | _MODBUS_MAPPING_ARENA;
+    /* 0X */
+    mb_mapping->nb_bits = nb_bits;
+    mb_mapping->tab_bits = nb_bits ? base + offsets[0] : NULL;
+    /* 1X */
+    mb_mapping->nb_input_bits = nb_input_bits;
+    mb_mapping->tab_input_bits = nb_input_bits ? base + offsets[1] : NULL;
+    /* 4X */
+    mb_mapping->nb_registers = nb_registers;
+    mb_mapping->tab_registers =
+        nb_registers ? (uint16_t *)(base + offsets[2]) : NULL;
+    /* 3X */
+    mb_mapping->nb_input_registers = nb_input_registers;
+    mb_mapping->tab_input_registers =
+        nb_input_registers ? (uint16_t *)(base + offsets[3]) : NULL;
+
+    return mb_mapping;
+}
+
+/* Returns the size of the memory to pass to modbus_mapping_init(), including
+   the alignment of an unaligned address */
+size_t modbus_mapping_get_size(int nb_bits, int nb_input_bits,
+                               int nb_registers, int nb_input_registers,
+                               int flags)
+{
+    size_t offsets[_ARENA_NB_SEGMENTS];
+
+    if (nb_bits < 0 || nb_input_bits < 0 ||
+        nb_registers < 0 || nb_input_registers < 0) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    return _arena_layout(nb_bits, nb_input_bits, nb_registers,
+                         nb_input_registers, flags, offsets) +
+        _CACHE_LINE_SIZE - 1;
+}
+
+/* Allocates the mapping and its tables in one arena, on huge pages when
+   MODBUS_MAPPING_HUGE_PAGES is set (if available) and with the bits packed in
+   bitsets when MODBUS_MAPPING_PACKED_BITS is set.
+
+   The function shall return the new allocated structure if successful.
+   Otherwise it shall return NULL and set errno to EINVAL or ENOMEM. */
+modbus_mapping_t* modbus_mapping_new_ext(int nb_bits, int nb_input_bits,
+                                         int nb_registers,
+                                         int nb_input_registers, int flags)
+{
+    size_t offsets[_ARENA_NB_SEGMENTS];
+    size_t size;
+    void *arena = NULL;
+    int kind = _ARENA_MALLOC;
+
+    if (nb_bits < 0 || nb_input_bits < 0 ||
+        nb_registers < 0 || nb_input_registers < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    flags &= MODBUS_MAPPING_PACKED_BITS | MODBUS_MAPPING_HUGE_PAGES |
+        MODBUS_MAPPING_THREAD_SAFE;
+    size = _arena_layout(nb_bits, nb_input_bits, nb_registers,
+                         nb_input_registers, flags, offsets);
+
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+    if (flags & MODBUS_MAPPING_HUGE_PAGES) {
+# ifdef MAP_HUGETLB
+        /* The length of the huge pages mappings is a multiple of their size */
+        size_t huge_size = (size + _HUGE_PAGE_SIZE - 1) &
+            ~(size_t)(_HUGE_PAGE_SIZE - 1);
+
+        arena = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena != MAP_FAILED) {
+            size = huge_size;
+        } else
+# endif
+        {
+            /* No reserved huge pages, transparent ones are requested */
+            arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+# ifdef MADV_HUGEPAGE
+            if (arena != MAP_FAILED)
+                madvise(arena, size, MADV_HUGEPAGE);
+# endif
+        }
+        if (arena == MAP_FAILED) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        /* Anonymous mappings are zeroed */
+        kind = _ARENA_MMAP;
+    }
+#endif
+
+    if (kind == _ARENA_MALLOC) {
+#ifdef _WIN32
+        arena = _aligned_malloc(size, _CACHE_LINE_SIZE);
+#else
+        if (posix_memalign(&arena, _CACHE_LINE_SIZE, size) != 0)
+            arena = NULL;
+#endif
+        if (arena == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        memset(arena, 0, size);
+    }
+
+    return _arena_init(arena, size, kind, nb_bits, nb_input_bits,
+                       nb_registers, nb_input_registers, flags, offsets);
+}
+
+/* Places the mapping and its tables in the memory of the caller (of
+   modbus_mapping_get_size() bytes). The memory is zeroed and is not freed by
+   modbus_mapping_free(). */
+modbus_mapping_t* modbus_mapping_init(void *mem, size_t mem_size,
+                                      int nb_bits, int nb_input_bits,
+                                      int nb_registers, int nb_input_registers,
+                                      int flags)
+{
+    size_t offsets[_ARENA_NB_SEGMENTS];
+    size_t size;
+    uintptr_t addr = (uintptr_t)mem;
+    size_t padding;
+
+    if (mem == NULL || nb_bits < 0 || nb_input_bits < 0 ||
+        nb_registers < 0 || nb_input_registers < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    flags &= MODBUS_MAPPING_PACKED_BITS | MODBUS_MAPPING_THREAD_SAFE;
+    size = _arena_layout(nb_bits, nb_input_bits, nb_registers,
+                         nb_input_registers, flags, offsets);
+    padding = _CACHE_LINE_ALIGN(addr) - addr;
+    if (mem_size < padding + size) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    memset((uint8_t *)mem + padding, 0, size);
+
+    return _arena_init((_modbus_arena_t *)((uint8_t *)mem + padding), size,
+                       _ARENA_CALLER, nb_bits, nb_input_bits, nb_registers,
+                       nb_input_registers, flags, offsets);
+}
+
 /* Allocates 4 arrays to store bits, input bits, registers and inputs
    registers. The pointers are stored in modbus_mapping structure.
 
@@ -1789,92 +3003,256 @@ int modbus_set_debug(modbus_t *ctx, int flag)
 modbus_mapping_t* modbus_mapping_new(int nb_bits, int nb_input_bits,
                                      int nb_registers, int nb_input_registers)
 {
-    modbus_mapping_t *mb_mapping;
+    return modbus_mapping_new_ext(nb_bits, nb_input_bits, nb_registers,
+                                  nb_input_registers, 0);
+}
 
-    mb_mapping = (modbus_mapping_t *)malloc(sizeof(modbus_mapping_t));
-    if (mb_mapping == NULL) {
+/* Same as modbus_mapping_new() but the bits are packed in bitsets, 8 bits per
+   byte (see MODBUS_GET_BIT) */
+modbus_mapping_t* modbus_mapping_new_packed(int nb_bits, int nb_input_bits,
+                                            int nb_registers,
+                                            int nb_input_registers)
+{
+    return modbus_mapping_new_ext(nb_bits, nb_input_bits, nb_registers,
+                                  nb_input_registers,
+                                  MODBUS_MAPPING_PACKED_BITS);
+}
+
+/* Returns the address of a bit (ON/OFF) of the mapping or NULL if the address
+   isn't in the table (in a range of a sparse mapping) or if the bits are
+   packed */
+uint8_t* modbus_mapping_get_bit_ptr(modbus_mapping_t *mb_mapping, int table,
+                                    int address)
+{
+    uint8_t *tab_bits;
+
+    if (mb_mapping == NULL || address < 0 ||
+        (table != MODBUS_TABLE_BITS && table != MODBUS_TABLE_INPUT_BITS) ||
+        (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_PACKED_BITS) ||
+        _mapping_check(mb_mapping, table, address, 1) == -1) {
+        errno = EINVAL;
         return NULL;
     }
 
-    /* 0X */
-    mb_mapping->nb_bits = nb_bits;
-    if (nb_bits == 0) {
-        mb_mapping->tab_bits = NULL;
-    } else {
-        /* Negative number raises a POSIX error */
-        mb_mapping->tab_bits =
-            (uint8_t *) malloc(nb_bits * sizeof(uint8_t));
-        if (mb_mapping->tab_bits == NULL) {
-            free(mb_mapping);
-            return NULL;
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE)
+        return _modbus_sparse_value(_MAPPING_SPARSE(mb_mapping), table,
+                                    address);
+
+    tab_bits = (table == MODBUS_TABLE_BITS) ?
+        mb_mapping->tab_bits : mb_mapping->tab_input_bits;
+    return tab_bits + address;
+}
+
+/* Returns the address of a register of the mapping or NULL if the address
+   isn't in the table (in a range of a sparse mapping) */
+uint16_t* modbus_mapping_get_register_ptr(modbus_mapping_t *mb_mapping,
+                                          int table, int address)
+{
+    uint16_t *tab_registers;
+
+    if (mb_mapping == NULL || address < 0 ||
+        (table != MODBUS_TABLE_REGISTERS &&
+         table != MODBUS_TABLE_INPUT_REGISTERS) ||
+        _mapping_check(mb_mapping, table, address, 1) == -1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE)
+        return _modbus_sparse_value(_MAPPING_SPARSE(mb_mapping), table,
+                                    address);
+
+    tab_registers = (table == MODBUS_TABLE_REGISTERS) ?
+        mb_mapping->tab_registers : mb_mapping->tab_input_registers;
+    return tab_registers + address;
+}
+
+/* Checks the table and the range of values of the mapping accessed by the
+   application */
+static int _mapping_check_access(modbus_mapping_t *mb_mapping, int table,
+                                 int is_bits, int address, int nb)
+{
+    if (mb_mapping == NULL || address < 0 || nb < 1 ||
+        (is_bits && table != MODBUS_TABLE_BITS &&
+         table != MODBUS_TABLE_INPUT_BITS) ||
+        (!is_bits && table != MODBUS_TABLE_REGISTERS &&
+         table != MODBUS_TABLE_INPUT_REGISTERS) ||
+        _mapping_check(mb_mapping, table, address, nb) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Reads nb bits (ON/OFF) of the mapping, atomically for a thread-safe
+   mapping */
+int modbus_mapping_read_bits(modbus_mapping_t *mb_mapping, int table,
+                             int address, int nb, uint8_t *dest)
+{
+    uint8_t *tab_bits;
+    uint32_t seq;
+    int i;
+
+    if (_mapping_check_access(mb_mapping, table, TRUE, address, nb) == -1)
+        return -1;
+
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE) {
+        for (i = 0; i < nb; i++) {
+            dest[i] = *(uint8_t *)_modbus_sparse_value(
+                _MAPPING_SPARSE(mb_mapping), table, address + i);
         }
-        memset(mb_mapping->tab_bits, 0, nb_bits * sizeof(uint8_t));
+        return nb;
     }
 
-    /* 1X */
-    mb_mapping->nb_input_bits = nb_input_bits;
-    if (nb_input_bits == 0) {
-        mb_mapping->tab_input_bits = NULL;
-    } else {
-        mb_mapping->tab_input_bits =
-            (uint8_t *) malloc(nb_input_bits * sizeof(uint8_t));
-        if (mb_mapping->tab_input_bits == NULL) {
-            free(mb_mapping->tab_bits);
-            free(mb_mapping);
-            return NULL;
+    tab_bits = (table == MODBUS_TABLE_BITS) ?
+        mb_mapping->tab_bits : mb_mapping->tab_input_bits;
+    do {
+        seq = _mapping_read_begin(mb_mapping, table, address, nb);
+        if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_PACKED_BITS) {
+            for (i = 0; i < nb; i++) {
+                dest[i] = MODBUS_GET_BIT(tab_bits, address + i);
+            }
+        } else {
+            memcpy(dest, tab_bits + address, nb);
+        }
+    } while (_mapping_read_retry(mb_mapping, table, address, nb, seq));
+
+    return nb;
+}
+
+/* Writes nb bits (zero or not) of the mapping, atomically for a thread-safe
+   mapping */
+int modbus_mapping_write_bits(modbus_mapping_t *mb_mapping, int table,
+                              int address, int nb, const uint8_t *src)
+{
+    uint8_t *tab_bits;
+    int i;
+
+    if (_mapping_check_access(mb_mapping, table, TRUE, address, nb) == -1)
+        return -1;
+
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE) {
+        for (i = 0; i < nb; i++) {
+            *(uint8_t *)_modbus_sparse_value(_MAPPING_SPARSE(mb_mapping), table,
+                                             address + i) = src[i] ? ON : OFF;
         }
-        memset(mb_mapping->tab_input_bits, 0, nb_input_bits * sizeof(uint8_t));
+        return nb;
     }
 
-    /* 4X */
-    mb_mapping->nb_registers = nb_registers;
-    if (nb_registers == 0) {
-        mb_mapping->tab_registers = NULL;
-    } else {
-        mb_mapping->tab_registers =
-            (uint16_t *) malloc(nb_registers * sizeof(uint16_t));
-        if (mb_mapping->tab_registers == NULL) {
-            free(mb_mapping->tab_input_bits);
-            free(mb_mapping->tab_bits);
-            free(mb_mapping);
-            return NULL;
+    tab_bits = (table == MODBUS_TABLE_BITS) ?
+        mb_mapping->tab_bits : mb_mapping->tab_input_bits;
+    _mapping_lock(mb_mapping, table, address, nb);
+    for (i = 0; i < nb; i++) {
+        if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_PACKED_BITS) {
+            if (src[i]) {
+                MODBUS_SET_BIT(tab_bits, address + i);
+            } else {
+                MODBUS_CLEAR_BIT(tab_bits, address + i);
+            }
+        } else {
+            tab_bits[address + i] = src[i] ? ON : OFF;
         }
-        memset(mb_mapping->tab_registers, 0, nb_registers * sizeof(uint16_t));
     }
+    _mapping_unlock(mb_mapping, table, address, nb);
 
-    /* 3X */
-    mb_mapping->nb_input_registers = nb_input_registers;
-    if (nb_input_registers == 0) {
-        mb_mapping->tab_input_registers = NULL;
-    } else {
-        mb_mapping->tab_input_registers =
-            (uint16_t *) malloc(nb_input_registers * sizeof(uint16_t));
-        if (mb_mapping->tab_input_registers == NULL) {
-            free(mb_mapping->tab_registers);
-            free(mb_mapping->tab_input_bits);
-            free(mb_mapping->tab_bits);
-            free(mb_mapping);
-            return NULL;
+    return nb;
+}
+
+/* Reads nb registers of the mapping, atomically for a thread-safe mapping */
+int modbus_mapping_read_registers(modbus_mapping_t *mb_mapping, int table,
+                                  int address, int nb, uint16_t *dest)
+{
+    uint16_t *tab_registers;
+    uint32_t seq;
+    int i;
+
+    if (_mapping_check_access(mb_mapping, table, FALSE, address, nb) == -1)
+        return -1;
+
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE) {
+        for (i = 0; i < nb; i++) {
+            dest[i] = *(uint16_t *)_modbus_sparse_value(
+                _MAPPING_SPARSE(mb_mapping), table, address + i);
         }
-        memset(mb_mapping->tab_input_registers, 0,
-               nb_input_registers * sizeof(uint16_t));
+        return nb;
     }
 
-    return mb_mapping;
+    tab_registers = (table == MODBUS_TABLE_REGISTERS) ?
+        mb_mapping->tab_registers : mb_mapping->tab_input_registers;
+    do {
+        seq = _mapping_read_begin(mb_mapping, table, address, nb);
+        memcpy(dest, tab_registers + address, nb * sizeof(uint16_t));
+    } while (_mapping_read_retry(mb_mapping, table, address, nb, seq));
+
+    return nb;
+}
+
+/* Writes nb registers of the mapping, atomically for a thread-safe mapping */
+int modbus_mapping_write_registers(modbus_mapping_t *mb_mapping, int table,
+                                   int address, int nb, const uint16_t *src)
+{
+    uint16_t *tab_registers;
+    int i;
+
+    if (_mapping_check_access(mb_mapping, table, FALSE, address, nb) == -1)
+        return -1;
+
+    if (_MAPPING_FLAGS(mb_mapping) & MODBUS_MAPPING_SPARSE) {
+        for (i = 0; i < nb; i++) {
+            *(uint16_t *)_modbus_sparse_value(_MAPPING_SPARSE(mb_mapping),
+                                              table, address + i) = src[i];
+        }
+        return nb;
+    }
+
+    tab_registers = (table == MODBUS_TABLE_REGISTERS) ?
+        mb_mapping->tab_registers : mb_mapping->tab_input_registers;
+    _mapping_lock(mb_mapping, table, address, nb);
+    memcpy(tab_registers + address, src, nb * sizeof(uint16_t));
+    _mapping_unlock(mb_mapping, table, address, nb);
+
+    return nb;
 }
 
-/* Frees the 4 arrays */
+/* Frees the arena of the mapping (or the 4 arrays of a mapping built by the
+   application) */
 void modbus_mapping_free(modbus_mapping_t *mb_mapping)
 {
+    _modbus_arena_t *arena;
+
     if (mb_mapping == NULL) {
         return;
     }
 
-    free(mb_mapping->tab_input_registers);
-    free(mb_mapping->tab_registers);
-    free(mb_mapping->tab_input_bits);
-    free(mb_mapping->tab_bits);
-    free(mb_mapping);
+    if (!(_MAPPING_FLAGS(mb_mapping) & _MODBUS_MAPPING_ARENA)) {
+        free(mb_mapping->tab_input_registers);
+        free(mb_mapping->tab_registers);
+        free(mb_mapping->tab_input_bits);
+        free(mb_mapping->tab_bits);
+        free(mb_mapping);
+        return;
+    }
+
+    arena = (_modbus_arena_t *)mb_mapping;
+    _modbus_sparse_free(arena->sparse);
+    switch (arena->kind) {
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+    case _ARENA_MMAP:
+        munmap(arena, arena->size);
+        break;
+#endif
+    case _ARENA_MALLOC:
+#ifdef _WIN32
+        _aligned_free(arena);
+#else
+        free(arena);
+#endif
+        break;
+    default:
+        /* Memory of the caller */
+        break;
+    }
 }
 
 #ifndef HAVE_STRLCPY
@@ -29,6 +29,7 @@
 #else
 #include "stdint.h"
 #endif
+#include <stddef.h>
 
 #include "modbus-version.h"
 
@@ -80,6 +81,8 @@ MODBUS_BEGIN_DECLS
 #define MODBUS_FC_WRITE_MULTIPLE_COILS      0x0F
 #define MODBUS_FC_WRITE_MULTIPLE_REGISTERS  0x10
 #define MODBUS_FC_REPORT_SLAVE_ID           0x11
+#define MODBUS_FC_READ_FILE_RECORD          0x14
+#define MODBUS_FC_WRITE_FILE_RECORD         0x15
 #define MODBUS_FC_MASK_WRITE_REGISTER       0x16
 #define MODBUS_FC_WRITE_AND_READ_REGISTERS  0x17
 
@@ -170,8 +173,66 @@ typedef struct {
     uint8_t *tab_input_bits;
     uint16_t *tab_input_registers;
     uint16_t *tab_registers;
+    int flags;
 } modbus_mapping_t;
 
+/* Flags of the mappings, set by the modbus_mapping_new*() functions. A mapping
+ * filled by the application must zero flags (the values which aren't set by
+ * libmodbus are taken for 0). The bits from 16 are reserved:
+ * - the bits of tab_bits and tab_input_bits are packed in bitsets (8 bits per
+ *   byte, LSB first), see MODBUS_GET_BIT(),
+ * - the mapping is allocated on huge pages (modbus_mapping_new_ext),
+ * - the values are stored in pages of the ranges of addresses added to the
+ *   mapping, the tables are NULL (modbus_mapping_new_sparse),
+ * - modbus_reply() and the modbus_mapping_read/write functions can be called
+ *   on the mapping from many threads (modbus_mapping_new_ext). */
+#define MODBUS_MAPPING_PACKED_BITS  (1 << 0)
+#define MODBUS_MAPPING_HUGE_PAGES   (1 << 1)
+#define MODBUS_MAPPING_SPARSE       (1 << 2)
+#define MODBUS_MAPPING_THREAD_SAFE  (1 << 3)
+
+/* Number of addresses of each table of a sparse mapping */
+#define MODBUS_MAPPING_SPARSE_NB    0x10000
+
+/* Tables of a mapping */
+#define MODBUS_TABLE_BITS               0
+#define MODBUS_TABLE_INPUT_BITS         1
+#define MODBUS_TABLE_REGISTERS          2
+#define MODBUS_TABLE_INPUT_REGISTERS    3
+
+/* Handler of a function code in modbus_reply(). The request data (req) and the
+ * response data (rsp) start after the function code. validate() checks the
+ * request before reply() is called, it returns 0 or -1 with errno set to an
+ * exception (EMBXILVAL, etc) sent with the penalty of modbus_reply().
+ * reply() returns the length of the response data or -1 with errno set to an
+ * exception to send or to any other error to send nothing. */
+typedef int (*modbus_validate_t)(modbus_t *ctx, const uint8_t *req,
+                                 int req_length, void *user_data);
+typedef int (*modbus_reply_t)(modbus_t *ctx, const uint8_t *req, int req_length,
+                              uint8_t *rsp, modbus_mapping_t *mb_mapping,
+                              void *user_data);
+
+typedef struct {
+    /* Fixed length of the request data, the last byte is the count of the
+       following bytes when byte_count is set */
+    int min_length;
+    int byte_count;
+    modbus_validate_t validate;
+    modbus_reply_t reply;
+    void *user_data;
+} modbus_handler_t;
+
+/* Wait modes of modbus_receive() and modbus_receive_confirmation() */
+#define MODBUS_WAIT_BLOCK  0
+#define MODBUS_WAIT_NONE   1
+
+/* Penalty applied by modbus_reply() to the requests with an illegal number of
+ * values: the exception response is deferred (without blocking the server),
+ * sent after a sleep or sent at once */
+#define MODBUS_PENALTY_DEFER  0
+#define MODBUS_PENALTY_SLEEP  1
+#define MODBUS_PENALTY_NONE   2
+
 typedef enum
 {
     MODBUS_ERROR_RECOVERY_NONE          = 0,
@@ -190,6 +251,15 @@ MODBUS_API int modbus_set_response_timeout(modbus_t *ctx, uint32_t to_sec, uint3
 MODBUS_API int modbus_get_byte_timeout(modbus_t *ctx, uint32_t *to_sec, uint32_t *to_usec);
 MODBUS_API int modbus_set_byte_timeout(modbus_t *ctx, uint32_t to_sec, uint32_t to_usec);
 
+MODBUS_API int modbus_get_wait_mode(modbus_t *ctx);
+MODBUS_API int modbus_set_wait_mode(modbus_t *ctx, int mode);
+
+MODBUS_API int modbus_get_exception_penalty(modbus_t *ctx);
+MODBUS_API int modbus_set_exception_penalty(modbus_t *ctx, int mode);
+MODBUS_API int modbus_send_deferred(modbus_t *ctx);
+MODBUS_API int modbus_get_deferred_timeout(modbus_t *ctx, uint32_t *to_sec, uint32_t *to_usec);
+MODBUS_API int modbus_get_penalty_flushes(modbus_t *ctx);
+
 MODBUS_API int modbus_get_header_length(modbus_t *ctx);
 
 MODBUS_API int modbus_connect(modbus_t *ctx);
@@ -218,6 +288,34 @@ MODBUS_API int modbus_report_slave_id(modbus_t *ctx, int max_dest, uint8_t *dest
 
 MODBUS_API modbus_mapping_t* modbus_mapping_new(int nb_bits, int nb_input_bits,
                                             int nb_registers, int nb_input_registers);
+MODBUS_API modbus_mapping_t* modbus_mapping_new_packed(int nb_bits, int nb_input_bits,
+                                                   int nb_registers, int nb_input_registers);
+MODBUS_API modbus_mapping_t* modbus_mapping_new_ext(int nb_bits, int nb_input_bits,
+                                                int nb_registers, int nb_input_registers,
+                                                int flags);
+MODBUS_API size_t modbus_mapping_get_size(int nb_bits, int nb_input_bits,
+                                          int nb_registers, int nb_input_registers,
+                                          int flags);
+MODBUS_API modbus_mapping_t* modbus_mapping_init(void *mem, size_t mem_size,
+                                                 int nb_bits, int nb_input_bits,
+                                                 int nb_registers, int nb_input_registers,
+                                                 int flags);
+MODBUS_API modbus_mapping_t* modbus_mapping_new_sparse(void);
+MODBUS_API int modbus_mapping_add_range(modbus_mapping_t *mb_mapping, int table,
+                                        int address, int nb);
+MODBUS_API uint8_t* modbus_mapping_get_bit_ptr(modbus_mapping_t *mb_mapping,
+                                               int table, int address);
+MODBUS_API uint16_t* modbus_mapping_get_register_ptr(modbus_mapping_t *mb_mapping,
+                                                     int table, int address);
+MODBUS_API int modbus_mapping_read_bits(modbus_mapping_t *mb_mapping, int table,
+                                        int address, int nb, uint8_t *dest);
+MODBUS_API int modbus_mapping_write_bits(modbus_mapping_t *mb_mapping, int table,
+                                         int address, int nb, const uint8_t *src);
+MODBUS_API int modbus_mapping_read_registers(modbus_mapping_t *mb_mapping, int table,
+                                             int address, int nb, uint16_t *dest);
+MODBUS_API int modbus_mapping_write_registers(modbus_mapping_t *mb_mapping, int table,
+                                              int address, int nb,
+                                              const uint16_t *src);
 MODBUS_API void modbus_mapping_free(modbus_mapping_t *mb_mapping);
 
 MODBUS_API int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length);
@@ -230,6 +328,8 @@ MODBUS_API int modbus_reply(modbus_t *ctx, const uint8_t *req,
                             int req_length, modbus_mapping_t *mb_mapping);
 MODBUS_API int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
                                       unsigned int exception_code);
+MODBUS_API int modbus_set_handler(modbus_t *ctx, int function,
+                                  const modbus_handler_t *handler);
 
 /**
  * UTILS FUNCTIONS
@@ -245,6 +345,11 @@ MODBUS_API int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
         tab_int8[(index) + 1] = (value) & 0xFF; \
     } while (0)
 
+/* Bits of the packed bitsets (MODBUS_MAPPING_PACKED_BITS) */
+#define MODBUS_GET_BIT(tab_bits, index) (((tab_bits)[(index) >> 3] >> ((index) & 7)) & 1)
+#define MODBUS_SET_BIT(tab_bits, index) ((tab_bits)[(index) >> 3] |= 1 << ((index) & 7))
+#define MODBUS_CLEAR_BIT(tab_bits, index) ((tab_bits)[(index) >> 3] &= ~(1 << ((index) & 7)))
+
 MODBUS_API void modbus_set_bits_from_byte(uint8_t *dest, int idx, const uint8_t value);
 MODBUS_API void modbus_set_bits_from_bytes(uint8_t *dest, int idx, unsigned int nb_bits,
                                        const uint8_t *tab_byte);
@@ -254,8 +359,41 @@ MODBUS_API float modbus_get_float_dcba(const uint16_t *src);
 MODBUS_API void modbus_set_float(float f, uint16_t *dest);
 MODBUS_API void modbus_set_float_dcba(float f, uint16_t *dest);
 
+/* Orders of the bytes of the 32-bit and 64-bit values in the registers, from
+ * the most significant byte (A) */
+#define MODBUS_ORDER_ABCD  0
+#define MODBUS_ORDER_DCBA  1
+#define MODBUS_ORDER_BADC  2
+#define MODBUS_ORDER_CDAB  3
+
+MODBUS_API int modbus_get_float_array(float *dest, const uint16_t *src, int nb, int order);
+MODBUS_API int modbus_set_float_array(uint16_t *dest, const float *src, int nb, int order);
+MODBUS_API int modbus_get_int32_array(int32_t *dest, const uint16_t *src, int nb, int order);
+MODBUS_API int modbus_set_int32_array(uint16_t *dest, const int32_t *src, int nb, int order);
+MODBUS_API int modbus_get_uint32_array(uint32_t *dest, const uint16_t *src, int nb, int order);
+MODBUS_API int modbus_set_uint32_array(uint16_t *dest, const uint32_t *src, int nb, int order);
+MODBUS_API int modbus_get_double_array(double *dest, const uint16_t *src, int nb, int order);
+MODBUS_API int modbus_set_double_array(uint16_t *dest, const double *src, int nb, int order);
+MODBUS_API int modbus_get_int64_array(int64_t *dest, const uint16_t *src, int nb, int order);
+MODBUS_API int modbus_set_int64_array(uint16_t *dest, const int64_t *src, int nb, int order);
+MODBUS_API int modbus_get_uint64_array(uint64_t *dest, const uint16_t *src, int nb, int order);
+MODBUS_API int modbus_set_uint64_array(uint16_t *dest, const uint64_t *src, int nb, int order);
+
 #include "modbus-tcp.h"
+#include "modbus-tcp-parser.h"
 #include "modbus-rtu.h"
+#include "modbus-udp.h"
+#include "modbus-unix.h"
+#include "modbus-shm.h"
+#include "modbus-loopback.h"
+#include "modbus-async.h"
+#include "modbus-plan.h"
+#include "modbus-poller.h"
+#include "modbus-rtu-framer.h"
+#include "modbus-gateway.h"
+#include "modbus-trace.h"
+#include "modbus-file.h"
+#include "modbus-router.h"
 
 MODBUS_END_DECLS
 
@@ -0,0 +1,100 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Measures the creation and the release of the contexts of the connections
+   of a server: allocated by modbus_new_tcp_pi() and modbus_new_tcp() or
+   built by modbus_init_tcp_server() in the slots of a pool. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include <modbus.h>
+
+#define NB_CONNECTIONS 10000
+
+enum {
+    NEW_TCP_PI,
+    NEW_TCP,
+    INIT_TCP_SERVER
+};
+
+static modbus_t *contexts[NB_CONNECTIONS];
+/* Slots of MODBUS_TCP_SERVER_CONTEXT_SIZE bytes */
+static uint64_t pool[NB_CONNECTIONS][MODBUS_TCP_SERVER_CONTEXT_SIZE / 8];
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run(int mode, int duration)
+{
+    static const char *names[] = {
+        "modbus_new_tcp_pi", "modbus_new_tcp", "modbus_init_tcp_server"
+    };
+    long nb_contexts = 0;
+    int64_t start = now_ns();
+    int64_t elapsed;
+    int i;
+
+    do {
+        /* As many connections opened then closed */
+        for (i = 0; i < NB_CONNECTIONS; i++) {
+            switch (mode) {
+            case NEW_TCP_PI:
+                contexts[i] = modbus_new_tcp_pi("::0", "1502");
+                break;
+            case NEW_TCP:
+                contexts[i] = modbus_new_tcp("0.0.0.0", 1502);
+                break;
+            default:
+                contexts[i] = modbus_init_tcp_server(pool[i], sizeof(pool[i]),
+                                                     i);
+                break;
+            }
+        }
+        for (i = 0; i < NB_CONNECTIONS; i++) {
+            modbus_free(contexts[i]);
+        }
+        nb_contexts += NB_CONNECTIONS;
+        elapsed = now_ns() - start;
+    } while (elapsed < (int64_t)duration * 1000000000);
+
+    printf("%-23s %11.0f %8.1f\n", names[mode],
+           nb_contexts * 1000000000.0 / elapsed, (double)elapsed / nb_contexts);
+}
+
+int main(int argc, char *argv[])
+{
+    int duration = 1;
+
+    if (argc > 1) {
+        duration = atoi(argv[1]);
+    }
+    if (duration <= 0) {
+        printf("Usage:\n  %s [seconds] - Create and free the contexts of %d"
+               " connections\n\n", argv[0], NB_CONNECTIONS);
+        exit(1);
+    }
+
+    printf("Context storage (bytes): TCP %d, TCP PI %d, server %d\n\n",
+           MODBUS_TCP_CONTEXT_SIZE, MODBUS_TCP_PI_CONTEXT_SIZE,
+           MODBUS_TCP_SERVER_CONTEXT_SIZE);
+    printf("Function                 Contexts/s  ns/ctx\n");
+    run(NEW_TCP_PI, duration);
+    run(NEW_TCP, duration);
+    run(INIT_TCP_SERVER, duration);
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Measures the CRC of the RTU frames of the library against the byte at a time
+   table lookup it replaces, from a frame to a capture of many frames. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Internal function of the library */
+uint16_t _modbus_crc16(const uint8_t *buffer, size_t length);
+
+#define MAX_LENGTH (1024 * 1024)
+
+static uint16_t table_crc[256];
+
+static void table_init(void)
+{
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        uint16_t crc = i;
+
+        for (j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+        table_crc[i] = crc;
+    }
+}
+
+/* Byte at a time, first byte to send in the high byte as the library */
+static uint16_t crc16_bytewise(const uint8_t *buffer, size_t length)
+{
+    uint16_t crc = 0xFFFF;
+
+    while (length--) {
+        crc = (crc >> 8) ^ table_crc[(crc ^ *buffer++) & 0xFF];
+    }
+
+    return (uint16_t)((crc << 8) | (crc >> 8));
+}
+
+/* Cycles on x86, nanoseconds elsewhere */
+static uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double measure(uint16_t (*crc16)(const uint8_t *, size_t),
+                      const uint8_t *buffer, size_t length, uint16_t *crc)
+{
+    /* About 64 MiB per measure */
+    long nb_loops = (64L * 1024 * 1024) / length;
+    uint64_t start;
+    long i;
+
+    *crc = crc16(buffer, length);
+    start = ticks();
+    for (i = 0; i < nb_loops; i++) {
+        *crc ^= crc16(buffer, length);
+    }
+
+    return (double)length * nb_loops / (ticks() - start);
+}
+
+int main(void)
+{
+    static const size_t lengths[] = { 8, 64, 256, 4096, MAX_LENGTH };
+    uint8_t *buffer;
+    unsigned int i;
+    int rc = 0;
+
+    table_init();
+    buffer = malloc(MAX_LENGTH);
+    srand(1);
+    for (i = 0; i < MAX_LENGTH; i++) {
+        buffer[i] = rand();
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    printf("  Length  Bytewise (B/cycle)  Library (B/cycle)\n");
+#else
+    printf("  Length  Bytewise (B/ns)  Library (B/ns)\n");
+#endif
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        uint16_t crc_bytewise;
+        uint16_t crc;
+        double bytewise = measure(crc16_bytewise, buffer, lengths[i],
+                                  &crc_bytewise);
+        double library = measure(_modbus_crc16, buffer, lengths[i], &crc);
+
+        printf("%8lu %19.2f %18.2f%s\n", (unsigned long)lengths[i], bytewise,
+               library, (crc == crc_bytewise) ? "" : "  CRC MISMATCH");
+        if (crc != crc_bytewise) {
+            rc = -1;
+        }
+    }
+
+    free(buffer);
+
+    return rc;
+}
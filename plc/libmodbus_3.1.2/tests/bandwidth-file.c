@@ -0,0 +1,205 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Measures the transfer of files of 10000 registers from a server process
+   over TCP on 127.0.0.1: by reads of 125 holding registers then by the file
+   records of a mapped file, one request or a window of requests in flight. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <modbus.h>
+
+#define PORT 1508
+#define FILE_PATH "bandwidth-file.dat"
+#define NB_FILES 16
+#define NB_RECORDS (MODBUS_MAX_FILE_RECORD + 1)
+
+static uint16_t tab_reg[NB_RECORDS];
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The records are read in place in the mapped file */
+static int read_record(void *user_data, int file, int record, int nb,
+                       const uint8_t **data)
+{
+    const uint8_t *map = user_data;
+
+    if (file > NB_FILES || record + nb > NB_RECORDS) {
+        errno = EMBXILADD;
+        return -1;
+    }
+    *data = map + ((size_t)(file - 1) * NB_RECORDS + record) * 2;
+
+    return 0;
+}
+
+static void serve(modbus_t *ctx, int server_socket)
+{
+    modbus_mapping_t *mb_mapping = modbus_mapping_new(0, 0, NB_RECORDS, 0);
+    modbus_file_provider_t provider;
+    uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+    size_t size = (size_t)NB_FILES * NB_RECORDS * 2;
+    uint8_t *map;
+    int fd;
+
+    fd = open(FILE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        exit(1);
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        exit(1);
+    }
+    memset(map, 0x5A, size);
+
+    provider.read = read_record;
+    provider.write = NULL;
+    provider.user_data = map;
+    modbus_set_file_provider(ctx, &provider);
+
+    modbus_tcp_accept(ctx, &server_socket);
+    for (;;) {
+        int rc = modbus_receive(ctx, query);
+
+        if (rc > 0) {
+            modbus_reply(ctx, query, rc, mb_mapping);
+        } else if (rc == -1) {
+            break;
+        }
+    }
+
+    exit(0);
+}
+
+/* Reads the files by blocks of holding registers (window 0) or by file
+   records */
+static void run(const char *name, modbus_t *ctx, int window, int duration)
+{
+    modbus_file_record_t record;
+    long nb_files = 0;
+    long nb_requests = 0;
+    int64_t start = now_us();
+    int64_t elapsed;
+
+    do {
+        int file;
+
+        for (file = 1; file <= NB_FILES; file++) {
+            if (window == 0) {
+                int addr;
+
+                for (addr = 0; addr < NB_RECORDS;
+                     addr += MODBUS_MAX_READ_REGISTERS) {
+                    int nb = NB_RECORDS - addr;
+
+                    if (nb > MODBUS_MAX_READ_REGISTERS)
+                        nb = MODBUS_MAX_READ_REGISTERS;
+                    if (modbus_read_registers(ctx, addr, nb,
+                                              tab_reg + addr) == -1) {
+                        fprintf(stderr, "%s\n", modbus_strerror(errno));
+                        return;
+                    }
+                    nb_requests++;
+                }
+            } else {
+                record.file = file;
+                record.record = 0;
+                record.nb = NB_RECORDS;
+                record.data = tab_reg;
+                if (modbus_read_file_records(ctx, &record, 1) == -1) {
+                    fprintf(stderr, "%s\n", modbus_strerror(errno));
+                    return;
+                }
+                /* 121 registers by request */
+                nb_requests += (NB_RECORDS + 120) / 121;
+            }
+        }
+        nb_files += NB_FILES;
+        elapsed = now_us() - start;
+    } while (elapsed < (int64_t)duration * 1000000);
+
+    printf("%-24s %8.2f %10.0f %10.1f\n", name,
+           nb_files * NB_RECORDS * 2.0 / elapsed,
+           nb_requests * 1000000.0 / elapsed,
+           (double)elapsed / nb_files / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    modbus_t *ctx_server;
+    modbus_t *ctx;
+    modbus_tcp_profile_t profile;
+    int server_socket;
+    int duration = 1;
+    pid_t pid;
+
+    if (argc > 1) {
+        duration = atoi(argv[1]);
+    }
+    if (duration <= 0) {
+        printf("Usage:\n  %s [seconds] - Read files of %d registers from a"
+               " server process\n\n", argv[0], NB_RECORDS);
+        exit(1);
+    }
+
+    ctx_server = modbus_new_tcp("127.0.0.1", PORT);
+    ctx = modbus_new_tcp("127.0.0.1", PORT);
+    /* Without profile, the accepted socket keeps the Nagle algorithm and the
+       responses of a window wait for the delayed acknowledgements */
+    modbus_tcp_profile_init(&profile);
+    modbus_tcp_set_profile(ctx_server, &profile);
+    server_socket = modbus_tcp_listen(ctx_server, 1);
+    if (server_socket == -1) {
+        fprintf(stderr, "Listen failed: %s\n", modbus_strerror(errno));
+        exit(1);
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        modbus_free(ctx);
+        serve(ctx_server, server_socket);
+    }
+
+    if (modbus_connect(ctx) == -1) {
+        fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
+        kill(pid, SIGTERM);
+        exit(1);
+    }
+
+    printf("Transfer                     MB/s Requests/s  ms/file\n");
+    run("Read holding registers", ctx, 0, duration);
+    run("File records", ctx, 1, duration);
+    modbus_async_set_window(ctx, 8);
+    run("File records (window 8)", ctx, 8, duration);
+    modbus_async_set_window(ctx, 32);
+    run("File records (window 32)", ctx, 32, duration);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    modbus_close(ctx);
+    modbus_free(ctx);
+    close(server_socket);
+    modbus_free(ctx_server);
+    unlink(FILE_PATH);
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Reads the registers of a RTU server behind the TCP gateway from 1 to 16
+   clients. The line is a pseudo-terminal so an exchange only costs the
+   silence of 3.5 characters ending the response: with enough clients the
+   next request is waiting in the queue of the line when the response comes
+   and the rate is bounded by the silences. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <modbus.h>
+
+#define PORT 1504
+#define MAX_CLIENTS 16
+
+static volatile int running;
+static volatile int serving;
+
+typedef struct {
+    pthread_t thread;
+    long nb_requests;
+    long nb_errors;
+} client_t;
+
+static uint32_t gettime_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint32_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void *client(void *arg)
+{
+    client_t *c = arg;
+    uint16_t tab_reg[10];
+    modbus_t *ctx;
+
+    ctx = modbus_new_tcp("127.0.0.1", PORT);
+    modbus_set_slave(ctx, 1);
+    if (modbus_connect(ctx) == -1) {
+        modbus_free(ctx);
+        return NULL;
+    }
+
+    while (running) {
+        if (modbus_read_registers(ctx, 0, 10, tab_reg) == 10) {
+            c->nb_requests++;
+        } else {
+            c->nb_errors++;
+        }
+    }
+
+    modbus_close(ctx);
+    modbus_free(ctx);
+
+    return NULL;
+}
+
+/* RTU server of the slave 1 on the master side of the pseudo-terminal */
+static void *server(void *arg)
+{
+    modbus_t *ctx = arg;
+    modbus_mapping_t *mb_mapping = modbus_mapping_new(0, 0, 10, 0);
+    uint8_t query[MODBUS_RTU_MAX_ADU_LENGTH];
+    struct pollfd pfd;
+
+    pfd.fd = modbus_get_socket(ctx);
+    pfd.events = POLLIN;
+    while (serving) {
+        if (poll(&pfd, 1, 100) == 1) {
+            int rc = modbus_receive(ctx, query);
+
+            if (rc > 0) {
+                modbus_reply(ctx, query, rc, mb_mapping);
+            }
+        }
+    }
+    modbus_mapping_free(mb_mapping);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    client_t clients[MAX_CLIENTS];
+    pthread_t server_thread;
+    modbus_gateway_t *gateway;
+    modbus_t *ctx_listen;
+    modbus_t *ctx_rtu;
+    modbus_t *ctx_server;
+    int server_socket;
+    int duration = 1;
+    int nb_clients;
+    int master;
+    int i;
+
+    if (argc > 1) {
+        duration = atoi(argv[1]);
+    }
+    if (duration <= 0) {
+        printf("Usage:\n  %s [seconds] - Read a RTU server through the gateway"
+               " from 1 to %d clients\n\n", argv[0], MAX_CLIENTS);
+        exit(1);
+    }
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    grantpt(master);
+    unlockpt(master);
+    ctx_rtu = modbus_new_rtu(ptsname(master), 115200, 'N', 8, 1);
+    if (modbus_connect(ctx_rtu) == -1) {
+        fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
+        return -1;
+    }
+    ctx_server = modbus_new_rtu(ptsname(master), 115200, 'N', 8, 1);
+    modbus_set_slave(ctx_server, 1);
+    modbus_set_socket(ctx_server, master);
+
+    ctx_listen = modbus_new_tcp("127.0.0.1", PORT);
+    server_socket = modbus_tcp_listen(ctx_listen, MAX_CLIENTS);
+    gateway = modbus_gateway_new(server_socket);
+    if (gateway == NULL) {
+        fprintf(stderr, "Failed to create the gateway: %s\n",
+                modbus_strerror(errno));
+        return -1;
+    }
+    modbus_gateway_set_unit(gateway, 1,
+                            modbus_gateway_add_line(gateway, ctx_rtu));
+
+    serving = 1;
+    pthread_create(&server_thread, NULL, server, ctx_server);
+
+    printf("Clients  Requests/s  Latency (ms)  Errors\n");
+    for (nb_clients = 1; nb_clients <= MAX_CLIENTS; nb_clients *= 2) {
+        long nb_requests = 0;
+        long nb_errors = 0;
+        uint32_t start;
+        uint32_t elapsed;
+
+        memset(clients, 0, sizeof(clients));
+        running = 1;
+        for (i = 0; i < nb_clients; i++) {
+            pthread_create(&clients[i].thread, NULL, client, &clients[i]);
+        }
+
+        start = gettime_ms();
+        while (gettime_ms() - start < (uint32_t)duration * 1000) {
+            modbus_gateway_process(gateway, 10);
+        }
+        running = 0;
+
+        elapsed = gettime_ms() - start;
+
+        /* Serves the last requests of the clients */
+        start = gettime_ms();
+        while (gettime_ms() - start < 100) {
+            modbus_gateway_process(gateway, 10);
+        }
+        for (i = 0; i < nb_clients; i++) {
+            pthread_join(clients[i].thread, NULL);
+            nb_requests += clients[i].nb_requests;
+            nb_errors += clients[i].nb_errors;
+        }
+
+        printf("%7d %11.0f %13.2f %7ld\n", nb_clients,
+               nb_requests * 1000.0 / elapsed,
+               nb_requests ? (double)elapsed * nb_clients / nb_requests : 0.0,
+               nb_errors);
+    }
+
+    serving = 0;
+    pthread_join(server_thread, NULL);
+
+    modbus_gateway_free(gateway);
+    close(server_socket);
+    modbus_free(ctx_listen);
+    modbus_close(ctx_rtu);
+    modbus_free(ctx_rtu);
+    modbus_free(ctx_server);
+    close(master);
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Measures the library alone with the loopback pair, without system calls:
+   the server side (parsing of the request and modbus_reply(), alone or
+   through a router of units) then the round trip of a request, the messages
+   read at once or in fragments. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include <modbus.h>
+
+#define NB_REGISTERS 10
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *name, long nb_ops, int64_t elapsed)
+{
+    printf("%-22s %12.0f %9.0f\n", name, nb_ops * 1000000000.0 / elapsed,
+           (double)elapsed / nb_ops);
+}
+
+/* Only the server, the client doesn't read the responses */
+static void run_reply(const char *name, modbus_t *ctx_client,
+                      modbus_t *ctx_server, modbus_mapping_t *mb_mapping,
+                      int duration)
+{
+    /* Read of 10 registers */
+    const uint8_t req[] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x06,
+                            0xFF, 0x03, 0x00, 0x00, 0x00, NB_REGISTERS };
+    uint8_t query[MODBUS_LOOPBACK_MAX_ADU_LENGTH];
+    long nb_ops = 0;
+    int64_t start = now_ns();
+    int64_t elapsed;
+
+    do {
+        int i;
+
+        for (i = 0; i < 1000; i++) {
+            int rc;
+
+            modbus_loopback_inject(ctx_server, req, sizeof(req));
+            rc = modbus_receive(ctx_server, query);
+            if (rc > 0) {
+                modbus_reply(ctx_server, query, rc, mb_mapping);
+            }
+            modbus_flush(ctx_client);
+        }
+        nb_ops += i;
+        elapsed = now_ns() - start;
+    } while (elapsed < (int64_t)duration * 1000000000);
+
+    report(name, nb_ops, elapsed);
+}
+
+/* Replies through a router of all the units, locked or not */
+static void run_router(const char *name, modbus_t *ctx_client,
+                       modbus_t *ctx_server, modbus_mapping_t *mb_mapping,
+                       int flags, int duration)
+{
+    modbus_router_t *router = modbus_router_new();
+    int unit_id;
+
+    for (unit_id = 0; unit_id <= 247; unit_id++) {
+        modbus_router_add_unit(router, unit_id, mb_mapping, flags);
+    }
+    modbus_router_add_unit(router, MODBUS_TCP_SLAVE, mb_mapping, flags);
+    modbus_set_router(ctx_server, router);
+    run_reply(name, ctx_client, ctx_server, NULL, duration);
+    modbus_set_router(ctx_server, NULL);
+    modbus_router_free(router);
+}
+
+static void run_round_trip(const char *name, modbus_t *ctx_client,
+                           modbus_t *ctx_server, modbus_mapping_t *mb_mapping,
+                           int duration)
+{
+    uint8_t raw_req[] = { 0xFF, MODBUS_FC_READ_HOLDING_REGISTERS,
+                          0x00, 0x00, 0x00, NB_REGISTERS };
+    uint8_t query[MODBUS_LOOPBACK_MAX_ADU_LENGTH];
+    uint8_t rsp[MODBUS_LOOPBACK_MAX_ADU_LENGTH];
+    long nb_ops = 0;
+    long nb_errors = 0;
+    int64_t start = now_ns();
+    int64_t elapsed;
+
+    do {
+        int i;
+
+        for (i = 0; i < 1000; i++) {
+            int rc;
+
+            modbus_send_raw_request(ctx_client, raw_req, sizeof(raw_req));
+            rc = modbus_receive(ctx_server, query);
+            if (rc > 0) {
+                modbus_reply(ctx_server, query, rc, mb_mapping);
+            }
+            if (modbus_receive_confirmation(ctx_client, rsp) == -1)
+                nb_errors++;
+        }
+        nb_ops += i;
+        elapsed = now_ns() - start;
+    } while (elapsed < (int64_t)duration * 1000000000);
+
+    report(name, nb_ops, elapsed);
+    if (nb_errors > 0) {
+        printf("%ld errors\n", nb_errors);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    modbus_mapping_t *mb_mapping;
+    modbus_t *ctx_client;
+    modbus_t *ctx_server;
+    int duration = 1;
+
+    if (argc > 1) {
+        duration = atoi(argv[1]);
+    }
+    if (duration <= 0) {
+        printf("Usage:\n  %s [seconds] - Run the library through the loopback"
+               " pair\n\n", argv[0]);
+        exit(1);
+    }
+
+    if (modbus_new_loopback_pair(&ctx_client, &ctx_server) == -1) {
+        fprintf(stderr, "Failed to create the pair: %s\n",
+                modbus_strerror(errno));
+        return -1;
+    }
+    mb_mapping = modbus_mapping_new(0, 0, NB_REGISTERS, 0);
+
+    printf("Benchmark                   Ops/s  ns/op\n");
+    run_reply("modbus_reply", ctx_client, ctx_server, mb_mapping, duration);
+    run_router("modbus_reply (router)", ctx_client, ctx_server, mb_mapping, 0,
+               duration);
+    run_router("modbus_reply (locked)", ctx_client, ctx_server, mb_mapping,
+               MODBUS_ROUTER_LOCK, duration);
+    run_round_trip("Round trip", ctx_client, ctx_server, mb_mapping, duration);
+    modbus_loopback_set_fragment(ctx_client, 1, 0);
+    modbus_loopback_set_fragment(ctx_server, 1, 0);
+    run_round_trip("Round trip (1 byte)", ctx_client, ctx_server, mb_mapping,
+                   duration);
+    modbus_loopback_set_fragment(ctx_client, 8, 1);
+    modbus_loopback_set_fragment(ctx_server, 8, 2);
+    run_round_trip("Round trip (1-8 bytes)", ctx_client, ctx_server,
+                   mb_mapping, duration);
+
+    modbus_mapping_free(mb_mapping);
+    modbus_free(ctx_client);
+    modbus_free(ctx_server);
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Reads the registers of a thread-safe mapping from 1 to 32 threads while a
+   writer thread updates them, as the threads of a server replying to many
+   clients do. A read is torn if its registers don't have the same value. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <modbus.h>
+
+#define NB_REGISTERS 100
+#define MAX_THREADS 32
+
+static modbus_mapping_t *mb_mapping;
+static volatile int running;
+
+typedef struct {
+    pthread_t thread;
+    long nb_reads;
+    long nb_torn;
+} reader_t;
+
+static uint32_t gettime_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint32_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void *reader(void *arg)
+{
+    reader_t *r = arg;
+    uint16_t tab_reg[NB_REGISTERS];
+    int i;
+
+    while (running) {
+        modbus_mapping_read_registers(mb_mapping, MODBUS_TABLE_REGISTERS, 0,
+                                      NB_REGISTERS, tab_reg);
+        for (i = 1; i < NB_REGISTERS; i++) {
+            if (tab_reg[i] != tab_reg[0]) {
+                r->nb_torn++;
+                break;
+            }
+        }
+        r->nb_reads++;
+    }
+
+    return NULL;
+}
+
+static void *writer(void *arg)
+{
+    uint16_t tab_reg[NB_REGISTERS];
+    uint16_t value = 0;
+    long *nb_writes = arg;
+    int i;
+
+    while (running) {
+        value++;
+        for (i = 0; i < NB_REGISTERS; i++) {
+            tab_reg[i] = value;
+        }
+        modbus_mapping_write_registers(mb_mapping, MODBUS_TABLE_REGISTERS, 0,
+                                       NB_REGISTERS, tab_reg);
+        (*nb_writes)++;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    reader_t readers[MAX_THREADS];
+    pthread_t writer_thread;
+    int duration = 1;
+    int nb_threads;
+    int i;
+
+    if (argc > 1) {
+        duration = atoi(argv[1]);
+    }
+    if (duration <= 0) {
+        printf("Usage:\n  %s [seconds] - Read a mapping from 1 to %d threads\n\n",
+               argv[0], MAX_THREADS);
+        exit(1);
+    }
+
+    mb_mapping = modbus_mapping_new_ext(0, 0, NB_REGISTERS, 0,
+                                        MODBUS_MAPPING_THREAD_SAFE);
+    if (mb_mapping == NULL) {
+        fprintf(stderr, "Failed to allocate the mapping: %s\n",
+                modbus_strerror(errno));
+        return -1;
+    }
+
+    printf("Threads    Reads/s  Reads/s/thread  Writes/s  Torn\n");
+    for (nb_threads = 1; nb_threads <= MAX_THREADS; nb_threads *= 2) {
+        long nb_reads = 0;
+        long nb_torn = 0;
+        long nb_writes = 0;
+        uint32_t start;
+        uint32_t elapsed;
+
+        memset(readers, 0, sizeof(readers));
+        running = 1;
+        start = gettime_ms();
+        pthread_create(&writer_thread, NULL, writer, &nb_writes);
+        for (i = 0; i < nb_threads; i++) {
+            pthread_create(&readers[i].thread, NULL, reader, &readers[i]);
+        }
+
+        while (gettime_ms() - start < (uint32_t)duration * 1000) {
+            usleep(10000);
+        }
+        running = 0;
+
+        pthread_join(writer_thread, NULL);
+        for (i = 0; i < nb_threads; i++) {
+            pthread_join(readers[i].thread, NULL);
+            nb_reads += readers[i].nb_reads;
+            nb_torn += readers[i].nb_torn;
+        }
+        elapsed = gettime_ms() - start;
+
+        printf("%7d %10.0f %15.0f %9.0f %5ld\n", nb_threads,
+               nb_reads * 1000.0 / elapsed,
+               nb_reads * 1000.0 / elapsed / nb_threads,
+               nb_writes * 1000.0 / elapsed, nb_torn);
+    }
+
+    modbus_mapping_free(mb_mapping);
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Measures the TCP parser on a stream of requests (reads and writes of
+   registers) pushed in chunks of several sizes: the frames held by a chunk
+   are parsed in place, the other ones are gathered in the parser. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include <modbus.h>
+
+#define NB_FRAMES 1000
+
+static uint8_t stream[NB_FRAMES * MODBUS_TCP_MAX_ADU_LENGTH];
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void callback(modbus_tcp_parser_t *parser,
+                     const modbus_tcp_frame_t *frame, void *user_data)
+{
+    *(long *)user_data += frame->nb;
+}
+
+/* Builds alternated reads of 10 registers and writes of 10 registers */
+static int build_stream(void)
+{
+    int length = 0;
+    int i;
+
+    for (i = 0; i < NB_FRAMES; i++) {
+        uint8_t *adu = stream + length;
+
+        adu[0] = i >> 8;
+        adu[1] = i & 0xFF;
+        adu[2] = 0;
+        adu[3] = 0;
+        adu[6] = 0xFF;
+        adu[8] = 0;
+        adu[9] = i & 0x7F;
+        adu[10] = 0;
+        adu[11] = 10;
+        if (i & 1) {
+            adu[4] = 0;
+            adu[5] = 7 + 20;
+            adu[7] = MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+            adu[12] = 20;
+            memset(adu + 13, i & 0xFF, 20);
+            length += 6 + 7 + 20;
+        } else {
+            adu[4] = 0;
+            adu[5] = 6;
+            adu[7] = MODBUS_FC_READ_HOLDING_REGISTERS;
+            length += 6 + 6;
+        }
+    }
+
+    return length;
+}
+
+static void run(modbus_tcp_parser_t *parser, int length, int chunk_length,
+                int duration)
+{
+    long nb_frames = 0;
+    long nb_values = 0;
+    int64_t start = now_ns();
+    int64_t elapsed;
+
+    do {
+        int i;
+
+        for (i = 0; i < length; i += chunk_length) {
+            int n = (length - i < chunk_length) ? length - i : chunk_length;
+
+            nb_frames += modbus_tcp_parser_push(parser, stream + i, n,
+                                                callback, &nb_values);
+        }
+        elapsed = now_ns() - start;
+    } while (elapsed < (int64_t)duration * 1000000000);
+
+    printf("%10d %12.0f %10.0f %8.1f\n", chunk_length,
+           nb_frames * 1000000000.0 / elapsed,
+           (nb_frames / NB_FRAMES) * (double)length * 1000.0 / elapsed,
+           (double)elapsed / nb_frames);
+}
+
+int main(int argc, char *argv[])
+{
+    modbus_tcp_parser_t *parser;
+    int chunk_lengths[] = { 0, 1460, 64, 7, 1 };
+    int duration = 1;
+    int length;
+    int i;
+
+    if (argc > 1) {
+        duration = atoi(argv[1]);
+    }
+    if (duration <= 0) {
+        printf("Usage:\n  %s [seconds] - Parse a stream of %d requests in"
+               " chunks\n\n", argv[0], NB_FRAMES);
+        exit(1);
+    }
+
+    length = build_stream();
+    parser = modbus_tcp_parser_new(MODBUS_TCP_PARSER_REQUEST);
+    if (parser == NULL) {
+        fprintf(stderr, "Failed to create the parser: %s\n",
+                modbus_strerror(errno));
+        return -1;
+    }
+
+    /* The first chunk is the whole stream */
+    chunk_lengths[0] = length;
+    printf("Chunk (B)     Frames/s       MB/s  ns/frame\n");
+    for (i = 0; i < (int)(sizeof(chunk_lengths) / sizeof(int)); i++) {
+        run(parser, length, chunk_lengths[i], duration);
+    }
+
+    modbus_tcp_parser_free(parser);
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Polls many devices from a single thread with the poller. The devices are
+   simulated by bandwidth-server-many-up (one connection per device). */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+#include <modbus.h>
+
+#define NB_REGISTERS 10
+#define INTERVAL_MS 1000
+
+static int nb_ok = 0;
+static int nb_errors = 0;
+
+static uint32_t gettime_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint32_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void poll_callback(modbus_poller_t *poller, int id, modbus_t *ctx,
+                          int rc, void *user_data)
+{
+    if (rc == NB_REGISTERS) {
+        nb_ok++;
+    } else {
+        if (nb_errors == 0) {
+            fprintf(stderr, "Device %d: %s\n", id, modbus_strerror(errno));
+        }
+        nb_errors++;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    modbus_poller_t *poller;
+    uint16_t (*tab_reg)[NB_REGISTERS];
+    int nb_devices = 500;
+    int duration = 10;
+    uint32_t start;
+    uint32_t end;
+    clock_t cpu;
+    int i;
+
+    if (argc > 1) {
+        nb_devices = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        duration = atoi(argv[2]);
+    }
+    if (nb_devices <= 0 || duration <= 0) {
+        printf("Usage:\n  %s [nb_devices [seconds]] - Poll many devices at 1 Hz from one thread\n\n", argv[0]);
+        exit(1);
+    }
+
+    poller = modbus_poller_new();
+    if (poller == NULL) {
+        fprintf(stderr, "Unable to create the poller: %s\n",
+                modbus_strerror(errno));
+        return -1;
+    }
+
+    tab_reg = calloc(nb_devices, sizeof(*tab_reg));
+    for (i = 0; i < nb_devices; i++) {
+        modbus_t *ctx = modbus_new_tcp("127.0.0.1", 1502);
+
+        /* Long enough to survive the SYN retransmission when the small
+           listen backlog of the server overflows at startup */
+        modbus_set_response_timeout(ctx, 2, 0);
+
+        if (modbus_poller_add(poller, ctx, MODBUS_FC_READ_HOLDING_REGISTERS,
+                              0, NB_REGISTERS, tab_reg[i], INTERVAL_MS,
+                              poll_callback, NULL) == -1) {
+            fprintf(stderr, "%s\n", modbus_strerror(errno));
+            return -1;
+        }
+    }
+
+    printf("Polling %d devices every %d ms during %d s\n",
+           nb_devices, INTERVAL_MS, duration);
+
+    start = gettime_ms();
+    end = start;
+    cpu = clock();
+    do {
+        if (modbus_poller_process(poller, 100) == -1) {
+            fprintf(stderr, "%s\n", modbus_strerror(errno));
+            break;
+        }
+        end = gettime_ms();
+    } while (end - start < (uint32_t)duration * 1000);
+    cpu = clock() - cpu;
+
+    printf("* %d polls, %d errors\n", nb_ok, nb_errors);
+    printf("* %.1f polls/s (expected %.1f)\n",
+           nb_ok * 1000.0 / (end - start),
+           nb_devices * 1000.0 / INTERVAL_MS);
+    printf("* CPU usage %.1f %%\n",
+           100.0 * cpu / CLOCKS_PER_SEC * 1000 / (end - start));
+
+    modbus_poller_free(poller);
+    free(tab_reg);
+
+    return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Measures the round trip of the reads of 125 registers from a server
+   process over TCP on 127.0.0.1 then the connection and first request of a
+   client, with each option of the socket profile set on both sides. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include <modbus.h>
+
+#define PORT 1509
+#define NB_CONNECTIONS 200
+
+static uint16_t tab_reg[MODBUS_MAX_READ_REGISTERS];
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Serves the connections one by one until killed */
+static void serve(modbus_t *ctx, int server_socket)
+{
+    modbus_mapping_t *mb_mapping;
+    uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+
+    mb_mapping = modbus_mapping_new(0, 0, MODBUS_MAX_READ_REGISTERS, 0);
+    for (;;) {
+        if (modbus_tcp_accept(ctx, &server_socket) == -1) {
+            if (server_socket == -1)
+                exit(1);
+            continue;
+        }
+        for (;;) {
+            int rc = modbus_receive(ctx, query);
+
+            if (rc > 0) {
+                modbus_reply(ctx, query, rc, mb_mapping);
+            } else if (rc == -1) {
+                break;
+            }
+        }
+        modbus_close(ctx);
+    }
+}
+
+static void run(const char *name, const modbus_tcp_profile_t *profile,
+                int nb_loops)
+{
+    modbus_t *ctx_server;
+    modbus_t *ctx;
+    int64_t *samples;
+    int64_t connect_sum = 0;
+    int64_t sum = 0;
+    int server_socket;
+    pid_t pid;
+    int i;
+
+    ctx_server = modbus_new_tcp("127.0.0.1", PORT);
+    ctx = modbus_new_tcp("127.0.0.1", PORT);
+    if (modbus_tcp_set_profile(ctx_server, profile) == -1 ||
+        modbus_tcp_set_profile(ctx, profile) == -1) {
+        printf("%-24s %s\n", name, modbus_strerror(errno));
+        modbus_free(ctx);
+        modbus_free(ctx_server);
+        return;
+    }
+    server_socket = modbus_tcp_listen(ctx_server, NB_CONNECTIONS);
+    if (server_socket == -1) {
+        printf("%-24s %s\n", name, modbus_strerror(errno));
+        modbus_free(ctx);
+        modbus_free(ctx_server);
+        return;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        modbus_free(ctx);
+        serve(ctx_server, server_socket);
+    }
+
+    samples = malloc(nb_loops * sizeof(int64_t));
+    if (modbus_connect(ctx) == -1) {
+        printf("%-24s %s\n", name, modbus_strerror(errno));
+        goto close;
+    }
+    for (i = 0; i < nb_loops; i++) {
+        int64_t start = now_ns();
+
+        if (modbus_read_registers(ctx, 0, MODBUS_MAX_READ_REGISTERS,
+                                  tab_reg) == -1) {
+            printf("%-24s %s\n", name, modbus_strerror(errno));
+            modbus_close(ctx);
+            goto close;
+        }
+        samples[i] = now_ns() - start;
+        sum += samples[i];
+    }
+    modbus_close(ctx);
+
+    /* The connection is set up with the first request (fast open and
+       deferred accept) */
+    for (i = 0; i < NB_CONNECTIONS; i++) {
+        int64_t start = now_ns();
+
+        if (modbus_connect(ctx) == -1 ||
+            modbus_read_registers(ctx, 0, 1, tab_reg) == -1) {
+            printf("%-24s %s\n", name, modbus_strerror(errno));
+            modbus_close(ctx);
+            goto close;
+        }
+        connect_sum += now_ns() - start;
+        modbus_close(ctx);
+    }
+
+    qsort(samples, nb_loops, sizeof(int64_t), compare_int64);
+    printf("%-24s %10.2f %10.2f %12.2f\n", name,
+           sum / 1000.0 / nb_loops, samples[nb_loops * 99 / 100] / 1000.0,
+           connect_sum / 1000.0 / NB_CONNECTIONS);
+
+close:
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    free(samples);
+    modbus_free(ctx);
+    close(server_socket);
+    modbus_free(ctx_server);
+}
+
+int main(int argc, char *argv[])
+{
+    modbus_tcp_profile_t profile;
+    int nb_loops = 20000;
+
+    if (argc > 1) {
+        nb_loops = atoi(argv[1]);
+    }
+    if (nb_loops <= 0) {
+        printf("Usage:\n  %s [nb_loops] - Round trips to a server process"
+               " for each option of the socket profile\n\n", argv[0]);
+        exit(1);
+    }
+
+    printf("Profile                     mean us     p99 us   connect us\n");
+    run("Library options", NULL, nb_loops);
+
+    modbus_tcp_profile_init(&profile);
+    run("Default profile", &profile, nb_loops);
+
+    profile.nodelay = FALSE;
+    run("Nagle", &profile, nb_loops);
+
+    /* The quick ack mode is re-armed by a setsockopt() before each message
+       sent, the cost of the system call is in the round trip */
+    modbus_tcp_profile_init(&profile);
+    profile.quickack = TRUE;
+    run("Quick ack", &profile, nb_loops);
+
+    modbus_tcp_profile_init(&profile);
+    profile.busy_poll = 50;
+    run("Busy poll 50 us", &profile, nb_loops);
+
+    modbus_tcp_profile_init(&profile);
+    profile.priority = 6;
+    run("Priority 6", &profile, nb_loops);
+
+    modbus_tcp_profile_init(&profile);
+    profile.dscp = 46;
+    run("DSCP EF", &profile, nb_loops);
+
+    modbus_tcp_profile_init(&profile);
+    profile.user_timeout = 1000;
+    run("User timeout 1 s", &profile, nb_loops);
+
+    modbus_tcp_profile_init(&profile);
+    profile.send_buffer = 4096;
+    profile.recv_buffer = 4096;
+    run("Buffers of 4 KiB", &profile, nb_loops);
+
+    modbus_tcp_profile_init(&profile);
+    profile.fastopen = 16;
+    run("Fast open", &profile, nb_loops);
+
+    modbus_tcp_profile_init(&profile);
+    profile.defer_accept = 1;
+    run("Deferred accept", &profile, nb_loops);
+
+    return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Receives frames on many RTU lines with the framer and measures the delay
+   between the write of a frame and its delivery, the silence of 3.5
+   characters expected. The lines are pseudo-terminals so the bytes aren't
+   paced by the baud rate, only the silences are. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <modbus.h>
+
+#define NB_LINES 4
+
+typedef struct {
+    int master;
+    modbus_t *ctx;
+    /* Date of the last frame written */
+    volatile int64_t write_date;
+    long nb_frames;
+    long nb_errors;
+    int64_t sum_delay;
+    int64_t max_delay;
+} line_t;
+
+static line_t lines[NB_LINES];
+static volatile int running;
+static uint32_t t35_us;
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void callback(modbus_rtu_framer_t *framer, int id, modbus_t *ctx,
+                     const uint8_t *frame, int length, void *user_data)
+{
+    line_t *line = user_data;
+    int64_t delay = now_us() - line->write_date;
+
+    if (frame == NULL) {
+        line->nb_errors++;
+        return;
+    }
+
+    line->nb_frames++;
+    line->sum_delay += delay;
+    if (delay > line->max_delay)
+        line->max_delay = delay;
+}
+
+/* Writes a frame on each line then waits for the silence of the lines */
+static void *writer(void *arg)
+{
+    uint8_t frame[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x0A, 0xC5, 0xCD };
+    struct timespec gap;
+    int i;
+
+    gap.tv_sec = 0;
+    gap.tv_nsec = (t35_us * 2 + 500) * 1000L;
+
+    while (running) {
+        for (i = 0; i < NB_LINES; i++) {
+            lines[i].write_date = now_us();
+            if (write(lines[i].master, frame, sizeof(frame)) == -1)
+                return NULL;
+        }
+        nanosleep(&gap, NULL);
+    }
+
+    return NULL;
+}
+
+static void run(int baud, int spec, int duration)
+{
+    modbus_rtu_framer_t *framer;
+    pthread_t writer_thread;
+    /* 10 bits per character */
+    uint32_t char_us = 10000000 / baud;
+    long nb_frames = 0;
+    long nb_errors = 0;
+    int64_t sum_delay = 0;
+    int64_t max_delay = 0;
+    int64_t start;
+    int i;
+
+    framer = modbus_rtu_framer_new();
+    t35_us = (spec && baud > 19200) ? 1750 : char_us * 7 / 2;
+
+    for (i = 0; i < NB_LINES; i++) {
+        line_t *line = &lines[i];
+        int id;
+
+        memset(line, 0, sizeof(line_t));
+        line->master = posix_openpt(O_RDWR | O_NOCTTY);
+        grantpt(line->master);
+        unlockpt(line->master);
+        line->ctx = modbus_new_rtu(ptsname(line->master), baud, 'N', 8, 1);
+        modbus_set_slave(line->ctx, 1);
+        if (modbus_connect(line->ctx) == -1) {
+            fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
+            exit(1);
+        }
+        id = modbus_rtu_framer_add(framer, line->ctx, callback, line);
+        if (!spec)
+            modbus_rtu_framer_set_timing(framer, id, char_us * 3 / 2, t35_us);
+    }
+
+    running = 1;
+    start = now_us();
+    pthread_create(&writer_thread, NULL, writer, NULL);
+    while (now_us() - start < (int64_t)duration * 1000000) {
+        modbus_rtu_framer_process(framer, 10);
+    }
+    running = 0;
+    pthread_join(writer_thread, NULL);
+
+    for (i = 0; i < NB_LINES; i++) {
+        nb_frames += lines[i].nb_frames;
+        nb_errors += lines[i].nb_errors;
+        sum_delay += lines[i].sum_delay;
+        if (lines[i].max_delay > max_delay)
+            max_delay = lines[i].max_delay;
+        modbus_close(lines[i].ctx);
+        modbus_free(lines[i].ctx);
+        close(lines[i].master);
+    }
+    modbus_rtu_framer_free(framer);
+
+    printf("%7d %-5s %6u %10.0f %11.0f %10lld %7ld\n", baud,
+           spec ? "spec" : "char", t35_us,
+           nb_frames * 1000000.0 / (now_us() - start),
+           nb_frames ? (double)sum_delay / nb_frames - t35_us : 0.0,
+           (long long)(max_delay - t35_us), nb_errors);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int bauds[] = { 19200, 115200, 460800, 921600 };
+    int duration = 1;
+    unsigned int i;
+
+    if (argc > 1) {
+        duration = atoi(argv[1]);
+    }
+    if (duration <= 0) {
+        printf("Usage:\n  %s [seconds] - Receive frames on %d RTU lines\n\n",
+               argv[0], NB_LINES);
+        exit(1);
+    }
+
+    printf("   Baud Mode    t3.5   Frames/s  Error (us)   Max (us)  Errors\n");
+    for (i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+        run(bauds[i], 1, duration);
+        if (bauds[i] > 19200)
+            run(bauds[i], 0, duration);
+    }
+
+    return 0;
+}
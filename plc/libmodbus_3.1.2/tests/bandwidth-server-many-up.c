@@ -74,11 +74,23 @@ int main(void)
     fdmax = server_socket;
 
     for (;;) {
+        struct timeval tv;
+        uint32_t to_sec = 0;
+        uint32_t to_usec = 0;
+        int nb_deferred;
+
+        /* Wake up for the exception responses deferred by modbus_reply() */
+        nb_deferred = modbus_get_deferred_timeout(ctx, &to_sec, &to_usec);
+        tv.tv_sec = to_sec;
+        tv.tv_usec = to_usec;
+
         rdset = refset;
-        if (select(fdmax+1, &rdset, NULL, NULL, NULL) == -1) {
+        if (select(fdmax+1, &rdset, NULL, NULL,
+                   nb_deferred > 0 ? &tv : NULL) == -1) {
             perror("Server select() failure.");
             close_sigint(1);
         }
+        modbus_send_deferred(ctx);
 
         /* Run through the existing connections looking for data to be
          * read */
@@ -0,0 +1,186 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Measures the round trip of a request between two processes of the same
+   host over TCP on 127.0.0.1, a Unix socket and the shared memory rings,
+   the latter sleeping on futexes at once or busy polling first. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include <modbus.h>
+
+#define PORT 1507
+#define SOCKET_PATH "bandwidth-shm.sock"
+#define SHM_NAME "bandwidth-shm"
+/* Histogram of the latencies by microsecond */
+#define MAX_LATENCY_US 1000
+
+enum {
+    TCP,
+    UNIX_SOCKET,
+    SHM_SLEEP,
+    SHM_SPIN
+};
+
+static const char *transport_names[] = {
+    "TCP", "Unix socket", "Shm (sleep)", "Shm (spin)"
+};
+
+static long histogram[MAX_LATENCY_US + 1];
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void serve(modbus_t *ctx, int transport, int server_socket)
+{
+    modbus_mapping_t *mb_mapping = modbus_mapping_new(0, 0, 10, 0);
+    uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+
+    if (transport == TCP) {
+        modbus_tcp_accept(ctx, &server_socket);
+    } else if (transport == UNIX_SOCKET) {
+        modbus_unix_accept(ctx, &server_socket);
+    }
+
+    for (;;) {
+        int rc = modbus_receive(ctx, query);
+
+        if (rc > 0) {
+            modbus_reply(ctx, query, rc, mb_mapping);
+        } else if (rc == -1) {
+            break;
+        }
+    }
+
+    exit(0);
+}
+
+static void run(int transport, int duration)
+{
+    uint16_t tab_reg[10];
+    modbus_t *ctx_server;
+    modbus_t *ctx;
+    long nb_requests = 0;
+    long count = 0;
+    long p99 = MAX_LATENCY_US;
+    int64_t start;
+    int64_t elapsed;
+    int server_socket = -1;
+    pid_t pid;
+    int i;
+
+    if (transport == TCP) {
+        ctx_server = modbus_new_tcp("127.0.0.1", PORT);
+        ctx = modbus_new_tcp("127.0.0.1", PORT);
+        server_socket = modbus_tcp_listen(ctx_server, 1);
+    } else if (transport == UNIX_SOCKET) {
+        ctx_server = modbus_new_unix(SOCKET_PATH);
+        ctx = modbus_new_unix(SOCKET_PATH);
+        server_socket = modbus_unix_listen(ctx_server, 1);
+    } else {
+        ctx_server = modbus_new_shm(SHM_NAME);
+        ctx = modbus_new_shm(SHM_NAME);
+        if (transport == SHM_SLEEP) {
+            modbus_shm_set_spin(ctx_server, 0);
+            modbus_shm_set_spin(ctx, 0);
+        } else {
+            modbus_shm_set_spin(ctx_server, 50);
+            modbus_shm_set_spin(ctx, 50);
+        }
+        server_socket = modbus_shm_listen(ctx_server);
+    }
+    if (server_socket == -1) {
+        fprintf(stderr, "Listen failed: %s\n", modbus_strerror(errno));
+        exit(1);
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        modbus_free(ctx);
+        serve(ctx_server, transport, server_socket);
+    }
+
+    if (modbus_connect(ctx) == -1) {
+        fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
+        kill(pid, SIGTERM);
+        exit(1);
+    }
+
+    memset(histogram, 0, sizeof(histogram));
+    start = now_us();
+    do {
+        int64_t sent = now_us();
+        int64_t latency;
+
+        if (modbus_read_registers(ctx, 0, 10, tab_reg) != 10)
+            continue;
+
+        latency = now_us() - sent;
+        histogram[latency < MAX_LATENCY_US ? latency : MAX_LATENCY_US]++;
+        nb_requests++;
+    } while (now_us() - start < (int64_t)duration * 1000000);
+    elapsed = now_us() - start;
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    modbus_close(ctx);
+    modbus_free(ctx);
+    if (transport == TCP || transport == UNIX_SOCKET) {
+        close(server_socket);
+    } else {
+        /* Removes the shared memory object */
+        modbus_close(ctx_server);
+    }
+    modbus_free(ctx_server);
+
+    for (i = 0; i <= MAX_LATENCY_US; i++) {
+        count += histogram[i];
+        if (count * 100 >= nb_requests * 99) {
+            p99 = i;
+            break;
+        }
+    }
+
+    printf("%-12s %10.0f %13.1f %9ld\n", transport_names[transport],
+           nb_requests * 1000000.0 / elapsed,
+           nb_requests ? (double)elapsed / nb_requests : 0.0, p99);
+}
+
+int main(int argc, char *argv[])
+{
+    int duration = 1;
+    int transport;
+
+    if (argc > 1) {
+        duration = atoi(argv[1]);
+    }
+    if (duration <= 0) {
+        printf("Usage:\n  %s [seconds] - Compare the transports between two"
+               " processes\n\n", argv[0]);
+        exit(1);
+    }
+
+    printf("Transport    Requests/s  Latency (us)  p99 (us)\n");
+    for (transport = TCP; transport <= SHM_SPIN; transport++) {
+        run(transport, duration);
+    }
+    unlink(SOCKET_PATH);
+
+    return 0;
+}
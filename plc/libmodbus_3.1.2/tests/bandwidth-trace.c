@@ -0,0 +1,113 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Measures the cost of the pcapng trace on the round trips of a loopback
+   pair, without system calls to hide it: not traced, traced in the rings of
+   the contexts and printed by the debug mode. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include <modbus.h>
+
+#define NB_REGISTERS 10
+#define TRACE_FILE "bandwidth-trace.pcapng"
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run(const char *name, modbus_t *ctx_client, modbus_t *ctx_server,
+                modbus_mapping_t *mb_mapping, int duration)
+{
+    uint8_t raw_req[] = { 0xFF, MODBUS_FC_READ_HOLDING_REGISTERS,
+                          0x00, 0x00, 0x00, NB_REGISTERS };
+    uint8_t query[MODBUS_LOOPBACK_MAX_ADU_LENGTH];
+    uint8_t rsp[MODBUS_LOOPBACK_MAX_ADU_LENGTH];
+    long nb_ops = 0;
+    int64_t start = now_ns();
+    int64_t elapsed;
+
+    do {
+        int i;
+
+        for (i = 0; i < 100; i++) {
+            int rc;
+
+            modbus_send_raw_request(ctx_client, raw_req, sizeof(raw_req));
+            rc = modbus_receive(ctx_server, query);
+            if (rc > 0) {
+                modbus_reply(ctx_server, query, rc, mb_mapping);
+            }
+            modbus_receive_confirmation(ctx_client, rsp);
+        }
+        nb_ops += i;
+        elapsed = now_ns() - start;
+    } while (elapsed < (int64_t)duration * 1000000000);
+
+    fprintf(stderr, "%-10s %12.0f %9.0f\n", name,
+            nb_ops * 1000000000.0 / elapsed, (double)elapsed / nb_ops);
+}
+
+int main(int argc, char *argv[])
+{
+    modbus_mapping_t *mb_mapping;
+    modbus_trace_t *trace;
+    modbus_t *ctx_client;
+    modbus_t *ctx_server;
+    int duration = 1;
+
+    if (argc > 1) {
+        duration = atoi(argv[1]);
+    }
+    if (duration <= 0) {
+        printf("Usage:\n  %s [seconds] - Trace the round trips of a loopback"
+               " pair\n\n", argv[0]);
+        exit(1);
+    }
+
+    modbus_new_loopback_pair(&ctx_client, &ctx_server);
+    mb_mapping = modbus_mapping_new(0, 0, NB_REGISTERS, 0);
+
+    /* The results are printed on stderr, stdout is the output of the debug
+       mode */
+    fprintf(stderr, "Tracing     Round trips/s  ns/op\n");
+    run("None", ctx_client, ctx_server, mb_mapping, duration);
+
+    trace = modbus_trace_new(TRACE_FILE);
+    if (trace == NULL) {
+        fprintf(stderr, "Failed to create the trace: %s\n",
+                modbus_strerror(errno));
+        return -1;
+    }
+    modbus_set_trace(ctx_client, trace);
+    modbus_set_trace(ctx_server, trace);
+    run("pcapng", ctx_client, ctx_server, mb_mapping, duration);
+    modbus_set_trace(ctx_client, NULL);
+    modbus_set_trace(ctx_server, NULL);
+    modbus_trace_free(trace);
+
+    if (freopen("/dev/null", "w", stdout) != NULL) {
+        modbus_set_debug(ctx_client, TRUE);
+        modbus_set_debug(ctx_server, TRUE);
+        run("Debug", ctx_client, ctx_server, mb_mapping, duration);
+    }
+
+    modbus_mapping_free(mb_mapping);
+    modbus_free(ctx_client);
+    modbus_free(ctx_server);
+
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Polls a Modbus/UDP server from many sockets, each one keeping a window of
+   requests in flight, and compares the server replying to a datagram at a time
+   (modbus_receive() and modbus_reply()) with the batches of
+   modbus_udp_process() (recvmmsg() and sendmmsg()). */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <modbus.h>
+
+#define PORT 1505
+#define NB_SOCKETS 8
+#define WINDOW 16
+
+static volatile int running;
+static int batch_mode;
+
+static uint32_t gettime_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint32_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void *server(void *arg)
+{
+    modbus_t *ctx = arg;
+    modbus_mapping_t *mb_mapping = modbus_mapping_new(0, 0, 10, 0);
+    uint8_t query[MODBUS_UDP_MAX_ADU_LENGTH];
+    struct pollfd pfd;
+
+    pfd.fd = modbus_get_socket(ctx);
+    pfd.events = POLLIN;
+    while (running) {
+        if (batch_mode) {
+            modbus_udp_process(ctx, mb_mapping, 100);
+        } else if (poll(&pfd, 1, 100) == 1) {
+            int rc = modbus_receive(ctx, query);
+
+            if (rc > 0) {
+                modbus_reply(ctx, query, rc, mb_mapping);
+            }
+        }
+    }
+    modbus_mapping_free(mb_mapping);
+
+    return NULL;
+}
+
+static void run(int duration)
+{
+    /* Read of 10 registers */
+    uint8_t req[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x06,
+                      0xFF, 0x03, 0x00, 0x00, 0x00, 0x0A };
+    uint8_t rsp[MODBUS_UDP_MAX_ADU_LENGTH];
+    struct sockaddr_in addr;
+    pthread_t server_thread;
+    modbus_t *ctx;
+    int sockets[NB_SOCKETS];
+    long nb_polls = 0;
+    long nb_lost = 0;
+    uint32_t start;
+    uint32_t elapsed;
+    int i, j;
+
+    ctx = modbus_new_udp("127.0.0.1", PORT);
+    if (modbus_udp_bind(ctx) == -1) {
+        fprintf(stderr, "Bind failed: %s\n", modbus_strerror(errno));
+        exit(1);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    for (i = 0; i < NB_SOCKETS; i++) {
+        sockets[i] = socket(PF_INET, SOCK_DGRAM, 0);
+        connect(sockets[i], (struct sockaddr *)&addr, sizeof(addr));
+    }
+
+    running = 1;
+    pthread_create(&server_thread, NULL, server, ctx);
+
+    start = gettime_ms();
+    while (gettime_ms() - start < (uint32_t)duration * 1000) {
+        for (i = 0; i < NB_SOCKETS; i++) {
+            for (j = 0; j < WINDOW; j++) {
+                req[1] = j;
+                send(sockets[i], req, sizeof(req), 0);
+            }
+        }
+        for (i = 0; i < NB_SOCKETS; i++) {
+            struct pollfd pfd;
+
+            pfd.fd = sockets[i];
+            pfd.events = POLLIN;
+            for (j = 0; j < WINDOW; j++) {
+                if (poll(&pfd, 1, 100) != 1 ||
+                    recv(sockets[i], rsp, sizeof(rsp), 0) != 29) {
+                    nb_lost += WINDOW - j;
+                    break;
+                }
+                nb_polls++;
+            }
+        }
+    }
+    elapsed = gettime_ms() - start;
+
+    running = 0;
+    pthread_join(server_thread, NULL);
+    for (i = 0; i < NB_SOCKETS; i++) {
+        close(sockets[i]);
+    }
+    modbus_close(ctx);
+    modbus_free(ctx);
+
+    printf("%-10s %10.0f %7ld\n", batch_mode ? "Batch" : "Datagram",
+           nb_polls * 1000.0 / elapsed, nb_lost);
+}
+
+int main(int argc, char *argv[])
+{
+    int duration = 1;
+
+    if (argc > 1) {
+        duration = atoi(argv[1]);
+    }
+    if (duration <= 0) {
+        printf("Usage:\n  %s [seconds] - Poll a UDP server from %d sockets\n\n",
+               argv[0], NB_SOCKETS);
+        exit(1);
+    }
+
+    printf("Server        Polls/s    Lost\n");
+    batch_mode = 0;
+    run(duration);
+    batch_mode = 1;
+    run(duration);
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Compares a client and a server of the same host over TCP on 127.0.0.1 and
+   over a Unix socket: rate and latency of the requests on a connection, then
+   rate of the connections (connect, one request and close). */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <modbus.h>
+
+#define PORT 1506
+#define SOCKET_PATH "bandwidth-unix.sock"
+
+enum {
+    TCP,
+    UNIX_SOCKET
+};
+
+static int transport;
+static volatile int running;
+static int server_socket;
+
+static uint32_t gettime_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint32_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static modbus_t *new_ctx(void)
+{
+    return (transport == TCP) ? modbus_new_tcp("127.0.0.1", PORT) :
+        modbus_new_unix(SOCKET_PATH);
+}
+
+/* Serves the connections one after the other */
+static void *server(void *arg)
+{
+    modbus_mapping_t *mb_mapping = modbus_mapping_new(0, 0, 10, 0);
+    uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+    modbus_t *ctx = new_ctx();
+
+    while (running) {
+        int rc = (transport == TCP) ?
+            modbus_tcp_accept(ctx, &server_socket) :
+            modbus_unix_accept(ctx, &server_socket);
+
+        if (rc == -1)
+            break;
+
+        for (;;) {
+            rc = modbus_receive(ctx, query);
+            if (rc > 0) {
+                modbus_reply(ctx, query, rc, mb_mapping);
+            } else if (rc == -1) {
+                break;
+            }
+        }
+        modbus_close(ctx);
+    }
+
+    modbus_free(ctx);
+    modbus_mapping_free(mb_mapping);
+
+    return NULL;
+}
+
+static void run(int duration)
+{
+    pthread_t server_thread;
+    uint16_t tab_reg[10];
+    modbus_t *ctx;
+    long nb_requests = 0;
+    long nb_connections = 0;
+    uint32_t start;
+    uint32_t elapsed_requests;
+    uint32_t elapsed_connections;
+
+    ctx = new_ctx();
+    server_socket = (transport == TCP) ? modbus_tcp_listen(ctx, 1) :
+        modbus_unix_listen(ctx, 1);
+    if (server_socket == -1) {
+        fprintf(stderr, "Listen failed: %s\n", modbus_strerror(errno));
+        exit(1);
+    }
+    modbus_free(ctx);
+
+    running = 1;
+    pthread_create(&server_thread, NULL, server, NULL);
+
+    ctx = new_ctx();
+    modbus_connect(ctx);
+    start = gettime_ms();
+    while (gettime_ms() - start < (uint32_t)duration * 1000) {
+        if (modbus_read_registers(ctx, 0, 10, tab_reg) == 10)
+            nb_requests++;
+    }
+    elapsed_requests = gettime_ms() - start;
+    modbus_close(ctx);
+
+    start = gettime_ms();
+    while (gettime_ms() - start < (uint32_t)duration * 1000) {
+        if (modbus_connect(ctx) == 0 &&
+            modbus_read_registers(ctx, 0, 10, tab_reg) == 10)
+            nb_connections++;
+        modbus_close(ctx);
+    }
+    elapsed_connections = gettime_ms() - start;
+    modbus_free(ctx);
+
+    /* Wakes up the server blocked in accept() */
+    running = 0;
+    ctx = new_ctx();
+    modbus_connect(ctx);
+    modbus_close(ctx);
+    modbus_free(ctx);
+    pthread_join(server_thread, NULL);
+    close(server_socket);
+
+    printf("%-12s %10.0f %12.1f %13.0f\n",
+           (transport == TCP) ? "TCP" : "Unix socket",
+           nb_requests * 1000.0 / elapsed_requests,
+           nb_requests ? elapsed_requests * 1000.0 / nb_requests : 0.0,
+           nb_connections * 1000.0 / elapsed_connections);
+}
+
+int main(int argc, char *argv[])
+{
+    int duration = 1;
+
+    if (argc > 1) {
+        duration = atoi(argv[1]);
+    }
+    if (duration <= 0) {
+        printf("Usage:\n  %s [seconds] - Compare TCP on 127.0.0.1 with a Unix"
+               " socket\n\n", argv[0]);
+        exit(1);
+    }
+
+    printf("Transport    Requests/s  Latency (us)  Connections/s\n");
+    transport = TCP;
+    run(duration);
+    transport = UNIX_SOCKET;
+    run(duration);
+    unlink(SOCKET_PATH);
+
+    return 0;
+}
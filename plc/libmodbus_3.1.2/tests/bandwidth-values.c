@@ -0,0 +1,103 @@
+/*
+ * Copyright © 2008-2014 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+/* Measures the decoding of a block of 125 registers to floats and doubles:
+   one value at a time with modbus_get_float() and modbus_get_float_dcba()
+   then by the array functions in the four orders. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include <modbus.h>
+
+#define NB_LOOPS 100000
+
+static uint16_t tab_reg[MODBUS_MAX_READ_REGISTERS];
+static float tab_real[MODBUS_MAX_READ_REGISTERS / 2];
+static double tab_double[MODBUS_MAX_READ_REGISTERS / 4];
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *name, int64_t elapsed)
+{
+    printf("%-28s %8.1f\n", name, (double)elapsed / NB_LOOPS);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *names[] = { "ABCD", "DCBA", "BADC", "CDAB" };
+    char name[32];
+    int64_t start;
+    float sum = 0;
+    int order;
+    int i;
+    int n;
+
+    if (argc > 1) {
+        printf("Usage:\n  %s - Decode blocks of %d registers\n\n", argv[0],
+               MODBUS_MAX_READ_REGISTERS);
+        exit(1);
+    }
+
+    for (i = 0; i < MODBUS_MAX_READ_REGISTERS; i++) {
+        tab_reg[i] = i * 0x0101 + 0x4000;
+    }
+
+    printf("Function (125 registers)      ns/block\n");
+    start = now_ns();
+    for (n = 0; n < NB_LOOPS; n++) {
+        for (i = 0; i < MODBUS_MAX_READ_REGISTERS / 2; i++) {
+            tab_real[i] = modbus_get_float(tab_reg + 2 * i);
+        }
+        sum += tab_real[n % (MODBUS_MAX_READ_REGISTERS / 2)];
+    }
+    report("modbus_get_float", now_ns() - start);
+
+    start = now_ns();
+    for (n = 0; n < NB_LOOPS; n++) {
+        for (i = 0; i < MODBUS_MAX_READ_REGISTERS / 2; i++) {
+            tab_real[i] = modbus_get_float_dcba(tab_reg + 2 * i);
+        }
+        sum += tab_real[n % (MODBUS_MAX_READ_REGISTERS / 2)];
+    }
+    report("modbus_get_float_dcba", now_ns() - start);
+
+    for (order = MODBUS_ORDER_ABCD; order <= MODBUS_ORDER_CDAB; order++) {
+        start = now_ns();
+        for (n = 0; n < NB_LOOPS; n++) {
+            modbus_get_float_array(tab_real, tab_reg,
+                                   MODBUS_MAX_READ_REGISTERS / 2, order);
+            sum += tab_real[n % (MODBUS_MAX_READ_REGISTERS / 2)];
+        }
+        sprintf(name, "modbus_get_float_array %s", names[order]);
+        report(name, now_ns() - start);
+    }
+
+    for (order = MODBUS_ORDER_ABCD; order <= MODBUS_ORDER_CDAB; order++) {
+        start = now_ns();
+        for (n = 0; n < NB_LOOPS; n++) {
+            modbus_get_double_array(tab_double, tab_reg,
+                                    MODBUS_MAX_READ_REGISTERS / 4, order);
+            sum += tab_double[n % (MODBUS_MAX_READ_REGISTERS / 4)];
+        }
+        sprintf(name, "modbus_get_double_array %s", names[order]);
+        report(name, now_ns() - start);
+    }
+
+    /* Keeps the results alive */
+    return sum == 0 ? 1 : 0;
+}
@@ -10,6 +10,20 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <sys/time.h>
+#ifndef _WIN32
+# include <fcntl.h>
+# include <pthread.h>
+# include <signal.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/wait.h>
+#endif
+#ifdef __linux__
+# include <poll.h>
+# include <sys/resource.h>
+# include <netinet/in.h>
+#endif
 #include <modbus.h>
 
 #include "unit-test.h"
@@ -25,6 +39,69 @@ int send_crafted_request(modbus_t *ctx, int function,
                          uint8_t *req, int req_size,
                          uint16_t max_value, uint16_t bytes,
                          int backend_length, int backend_offset);
+void async_callback(modbus_t *ctx, int rc, void *user_data);
+void async_resubmit_callback(modbus_t *ctx, int rc, void *user_data);
+int local_request(modbus_t *ctx, modbus_t *ctx_server,
+                  modbus_mapping_t *mb_mapping,
+                  uint8_t *raw_req, int raw_req_length, uint8_t *rsp);
+int local_write(modbus_t *ctx, modbus_t *ctx_server, const char *label);
+int reply_unit(modbus_t *ctx, const uint8_t *req, int req_length,
+               uint8_t *rsp, modbus_mapping_t *mb_mapping, void *user_data);
+void framer_callback(modbus_rtu_framer_t *framer, int id, modbus_t *ctx,
+                     const uint8_t *frame, int length, void *user_data);
+void framer_run(modbus_rtu_framer_t *framer, int duration_ms);
+void gateway_run(modbus_gateway_t *gateway, modbus_t *ctx_server,
+                 modbus_mapping_t *mb_mapping, int duration_ms);
+void parser_callback(modbus_tcp_parser_t *parser,
+                     const modbus_tcp_frame_t *frame, void *user_data);
+void poller_callback(modbus_poller_t *poller, int id, modbus_t *ctx, int rc,
+                     void *user_data);
+void *mapping_writer(void *arg);
+void *mapping_reader(void *arg);
+
+/* Registers of the thread-safe mapping written and read by two threads, across
+   three stripes of 64 registers */
+#define MAPPING_THREADS_ADDRESS 30
+#define MAPPING_THREADS_NB 100
+
+/* Shared by the writer and the reader of a thread-safe mapping */
+typedef struct {
+    modbus_mapping_t *mb_mapping;
+    volatile int running;
+    int nb_writes;
+    int nb_reads;
+    int nb_changes;
+    int nb_torn;
+} mapping_threads_t;
+
+/* Requests submitted by the callback of a cancelled request */
+typedef struct {
+    int nb_cancelled;
+    int nb_completed;
+    uint16_t tab[MODBUS_MAX_READ_REGISTERS];
+} async_resubmit_t;
+
+/* Results of the callback of the RTU framer */
+typedef struct {
+    int nb_frames;
+    int nb_errors;
+    int length;
+    int error;
+} framer_result_t;
+
+/* Results of the callback of the poller */
+typedef struct {
+    int nb_polls;
+    int nb_timeouts;
+    int rc;
+} poller_result_t;
+
+/* Results of the callback of the TCP parser */
+typedef struct {
+    int nb_frames;
+    /* Last frame, its ADU isn't kept */
+    modbus_tcp_frame_t frame;
+} parser_result_t;
 
 #define BUG_REPORT(_cond, _format, _args ...) \
     printf("\nLine %d: assertion error for '%s': " _format "\n", __LINE__, # _cond, ## _args)
@@ -38,6 +115,245 @@ int send_crafted_request(modbus_t *ctx, int function,
     }                                             \
 };
 
+static int64_t now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Sends a request to a server of the same process, replies with the mapping
+   and returns the result of the confirmation */
+int local_request(modbus_t *ctx, modbus_t *ctx_server,
+                  modbus_mapping_t *mb_mapping,
+                  uint8_t *raw_req, int raw_req_length, uint8_t *rsp)
+{
+    uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+    int rc;
+
+    modbus_send_raw_request(ctx, raw_req, raw_req_length);
+    rc = modbus_receive(ctx_server, query);
+    if (rc > 0) {
+        modbus_reply(ctx_server, query, rc, mb_mapping);
+    }
+
+    return modbus_receive_confirmation(ctx, rsp);
+}
+
+/* Prints the label then writes 0x1234 in the second register of a new mapping
+   through a server of the same process, the request checked on each backend.
+   Returns TRUE when the register is written and confirmed. */
+int local_write(modbus_t *ctx, modbus_t *ctx_server, const char *label)
+{
+    modbus_mapping_t *mb_mapping;
+    uint8_t raw_write[] = { 0xFF, MODBUS_FC_WRITE_SINGLE_REGISTER,
+                            0x00, 0x01, 0x12, 0x34 };
+    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+    int rc;
+
+    printf("%s: ", label);
+    mb_mapping = modbus_mapping_new(0, 0, 2, 0);
+    if (mb_mapping == NULL) {
+        return FALSE;
+    }
+
+    rc = local_request(ctx, ctx_server, mb_mapping,
+                       raw_write, sizeof(raw_write), rsp);
+    rc = (rc == 12 && mb_mapping->tab_registers[1] == 0x1234);
+    modbus_mapping_free(mb_mapping);
+
+    return rc;
+}
+
+/* Writes a new value in all the registers with FC16 requests replied by a
+   server of the thread until the reader is done */
+void *mapping_writer(void *arg)
+{
+    mapping_threads_t *threads = arg;
+    uint8_t raw_write[7 + 2 * MAPPING_THREADS_NB] = {
+        0xFF, MODBUS_FC_WRITE_MULTIPLE_REGISTERS,
+        0x00, MAPPING_THREADS_ADDRESS, 0x00, MAPPING_THREADS_NB,
+        2 * MAPPING_THREADS_NB };
+    uint8_t rsp[MODBUS_LOOPBACK_MAX_ADU_LENGTH];
+    modbus_t *ctx_client;
+    modbus_t *ctx_server;
+    uint16_t value = 0;
+    int i;
+
+    if (modbus_new_loopback_pair(&ctx_client, &ctx_server) == -1)
+        return NULL;
+
+    while (threads->running) {
+        value++;
+        for (i = 0; i < MAPPING_THREADS_NB; i++) {
+            raw_write[7 + 2 * i] = value >> 8;
+            raw_write[8 + 2 * i] = value & 0xFF;
+        }
+        if (local_request(ctx_client, ctx_server, threads->mb_mapping,
+                          raw_write, sizeof(raw_write), rsp) == 12) {
+            threads->nb_writes++;
+        }
+    }
+
+    modbus_free(ctx_client);
+    modbus_free(ctx_server);
+    return NULL;
+}
+
+/* Reads the registers with FC03 requests for 300 ms and counts the reads
+   whose registers don't have the same value */
+void *mapping_reader(void *arg)
+{
+    mapping_threads_t *threads = arg;
+    uint8_t raw_read[] = { 0xFF, MODBUS_FC_READ_HOLDING_REGISTERS,
+                           0x00, MAPPING_THREADS_ADDRESS,
+                           0x00, MAPPING_THREADS_NB };
+    uint8_t rsp[MODBUS_LOOPBACK_MAX_ADU_LENGTH];
+    modbus_t *ctx_client;
+    modbus_t *ctx_server;
+    uint16_t last = 0;
+    int64_t start = now_ms();
+    int i;
+
+    if (modbus_new_loopback_pair(&ctx_client, &ctx_server) == -1) {
+        threads->running = FALSE;
+        return NULL;
+    }
+
+    while (now_ms() - start < 300) {
+        const uint8_t *values = rsp + 9;
+
+        if (local_request(ctx_client, ctx_server, threads->mb_mapping,
+                          raw_read, sizeof(raw_read), rsp) !=
+            9 + 2 * MAPPING_THREADS_NB) {
+            threads->nb_torn++;
+            continue;
+        }
+        for (i = 1; i < MAPPING_THREADS_NB; i++) {
+            if (values[2 * i] != values[0] || values[2 * i + 1] != values[1]) {
+                threads->nb_torn++;
+                break;
+            }
+        }
+        if (((values[0] << 8) | values[1]) != last) {
+            last = (values[0] << 8) | values[1];
+            threads->nb_changes++;
+        }
+        threads->nb_reads++;
+    }
+    threads->running = FALSE;
+
+    modbus_free(ctx_client);
+    modbus_free(ctx_server);
+    return NULL;
+}
+
+/* Handler of a unit of the router, replies the low byte of the first
+   register of the mapping of the unit */
+int reply_unit(modbus_t *ctx, const uint8_t *req, int req_length,
+               uint8_t *rsp, modbus_mapping_t *mb_mapping, void *user_data)
+{
+    rsp[0] = mb_mapping->tab_registers[0] & 0xFF;
+
+    return 1;
+}
+
+/* Counts the frames and keeps the first error */
+void framer_callback(modbus_rtu_framer_t *framer, int id, modbus_t *ctx,
+                     const uint8_t *frame, int length, void *user_data)
+{
+    framer_result_t *result = user_data;
+
+    if (frame != NULL) {
+        result->nb_frames++;
+        result->length = length;
+    } else if (result->nb_errors++ == 0) {
+        result->error = errno;
+    }
+}
+
+/* Counts the polls and the timeouts and keeps the last result */
+void poller_callback(modbus_poller_t *poller, int id, modbus_t *ctx, int rc,
+                     void *user_data)
+{
+    poller_result_t *result = user_data;
+
+    result->nb_polls++;
+    if (rc == -1 && errno == ETIMEDOUT)
+        result->nb_timeouts++;
+    result->rc = rc;
+}
+
+/* Counts the frames and keeps the last one */
+void parser_callback(modbus_tcp_parser_t *parser,
+                     const modbus_tcp_frame_t *frame, void *user_data)
+{
+    parser_result_t *result = user_data;
+
+    result->nb_frames++;
+    result->frame = *frame;
+}
+
+/* Processes the lines of the framer during the duration */
+void framer_run(modbus_rtu_framer_t *framer, int duration_ms)
+{
+    int i;
+
+    for (i = 0; i < duration_ms; i++) {
+        modbus_rtu_framer_process(framer, 1);
+    }
+}
+
+/* Processes the gateway and replies to the requests received by the server
+   of its line during the duration */
+void gateway_run(modbus_gateway_t *gateway, modbus_t *ctx_server,
+                 modbus_mapping_t *mb_mapping, int duration_ms)
+{
+    uint8_t query[MODBUS_RTU_MAX_ADU_LENGTH];
+    struct pollfd pfd;
+    int i;
+
+    pfd.fd = modbus_get_socket(ctx_server);
+    pfd.events = POLLIN;
+    for (i = 0; i < duration_ms; i++) {
+        modbus_gateway_process(gateway, 1);
+        if (poll(&pfd, 1, 0) == 1) {
+            int rc = modbus_receive(ctx_server, query);
+
+            if (rc > 0) {
+                modbus_reply(ctx_server, query, rc, mb_mapping);
+            }
+        }
+    }
+}
+
+/* Stores the result of an asynchronous request */
+void async_callback(modbus_t *ctx, int rc, void *user_data)
+{
+    *(int *)user_data = rc;
+}
+
+/* Submits two requests on the first cancel and counts the completions, the
+   second request takes a slot after the one of the cancelled request */
+void async_resubmit_callback(modbus_t *ctx, int rc, void *user_data)
+{
+    async_resubmit_t *resubmit = user_data;
+    int i;
+
+    if (rc == -1 && errno == ECANCELED) {
+        if (resubmit->nb_cancelled++ == 0) {
+            for (i = 0; i < 2; i++) {
+                modbus_async_read_registers(ctx, UT_REGISTERS_ADDRESS,
+                                            UT_REGISTERS_NB, resubmit->tab,
+                                            async_resubmit_callback, resubmit);
+            }
+        }
+    } else if (rc == UT_REGISTERS_NB) {
+        resubmit->nb_completed++;
+    }
+}
+
 int main(int argc, char *argv[])
 {
     const int NB_REPORT_SLAVE_ID = 10;
@@ -253,6 +569,21 @@ int main(int argc, char *argv[])
 
     /* End of many registers */
 
+    /* Full requests (bulk conversion of the registers) */
+    {
+        uint16_t tab_src[MODBUS_MAX_WRITE_REGISTERS];
+        uint16_t tab_dest[MODBUS_MAX_READ_REGISTERS];
+
+        for (i = 0; i < MODBUS_MAX_WRITE_REGISTERS; i++) {
+            tab_src[i] = (i << 8) | (0xFF - i);
+        }
+        modbus_write_registers(ctx, 0, MODBUS_MAX_WRITE_REGISTERS, tab_src);
+        rc = modbus_read_registers(ctx, 0, MODBUS_MAX_READ_REGISTERS, tab_dest);
+        printf("5/5 Full write then read of registers: ");
+        ASSERT_TRUE(rc == MODBUS_MAX_READ_REGISTERS &&
+                    memcmp(tab_src, tab_dest, sizeof(tab_src)) == 0, "");
+    }
+
 
     /** INPUT REGISTERS **/
     rc = modbus_read_input_registers(ctx, UT_INPUT_REGISTERS_ADDRESS,
@@ -299,6 +630,74 @@ int main(int argc, char *argv[])
     real = modbus_get_float_dcba(tab_rp_registers);
     ASSERT_TRUE(real == UT_REAL, "FAILED (%f != %f)\n", real, UT_REAL);
 
+    /** ARRAYS OF VALUES **/
+    printf("\nTEST ARRAYS OF VALUES:\n");
+    {
+        /* Registers of UT_IREAL in the orders ABCD, DCBA, BADC and CDAB */
+        const uint16_t tab_orders[4][2] = {
+            { 0x4465, 0x229A }, { 0x9A22, 0x6544 },
+            { 0x6544, 0x9A22 }, { 0x229A, 0x4465 }
+        };
+        const uint16_t tab_orders64[4][4] = {
+            { 0x0102, 0x0304, 0x0506, 0x0708 },
+            { 0x0807, 0x0605, 0x0403, 0x0201 },
+            { 0x0201, 0x0403, 0x0605, 0x0807 },
+            { 0x0708, 0x0506, 0x0304, 0x0102 }
+        };
+        uint16_t tab_reg[MODBUS_MAX_READ_REGISTERS];
+        float tab_real[MODBUS_MAX_READ_REGISTERS / 2];
+        uint64_t tab_u64[9];
+        int order;
+        int ok = TRUE;
+
+        for (order = MODBUS_ORDER_ABCD; order <= MODBUS_ORDER_CDAB; order++) {
+            for (i = 0; i < 3; i++)
+                tab_real[i] = UT_REAL;
+            modbus_set_float_array(tab_reg, tab_real, 3, order);
+            for (i = 0; i < 6; i++) {
+                if (tab_reg[i] != tab_orders[order][i & 1])
+                    ok = FALSE;
+            }
+            modbus_get_float_array(tab_real, tab_reg, 3, order);
+            if (tab_real[2] != UT_REAL)
+                ok = FALSE;
+        }
+        printf("1/4 Floats in the four orders: ");
+        ASSERT_TRUE(ok, "");
+
+        /* Block of 125 registers, as modbus_get_float() one by one */
+        for (i = 0; i < MODBUS_MAX_READ_REGISTERS; i++)
+            tab_reg[i] = i * 0x0101 + 0x4000;
+        modbus_get_float_array(tab_real, tab_reg, MODBUS_MAX_READ_REGISTERS / 2,
+                               MODBUS_ORDER_CDAB);
+        for (i = 0; i < MODBUS_MAX_READ_REGISTERS / 2; i++) {
+            if (tab_real[i] != modbus_get_float(tab_reg + 2 * i))
+                ok = FALSE;
+        }
+        printf("2/4 Block of floats like modbus_get_float: ");
+        ASSERT_TRUE(ok, "");
+
+        for (order = MODBUS_ORDER_ABCD; order <= MODBUS_ORDER_CDAB; order++) {
+            for (i = 0; i < 9; i++)
+                tab_u64[i] = 0x0102030405060708ULL;
+            modbus_set_uint64_array(tab_reg, tab_u64, 9, order);
+            for (i = 0; i < 36; i++) {
+                if (tab_reg[i] != tab_orders64[order][i & 3])
+                    ok = FALSE;
+            }
+            memset(tab_u64, 0, sizeof(tab_u64));
+            modbus_get_uint64_array(tab_u64, tab_reg, 9, order);
+            if (tab_u64[8] != 0x0102030405060708ULL)
+                ok = FALSE;
+        }
+        printf("3/4 64-bit values in the four orders: ");
+        ASSERT_TRUE(ok, "");
+
+        rc = modbus_get_int32_array((int32_t *)tab_u64, tab_reg, 1, 4);
+        printf("4/4 Invalid order: ");
+        ASSERT_TRUE(rc == -1 && errno == EINVAL, "");
+    }
+
     printf("\nAt this point, error messages doesn't mean the test has failed\n");
 
     /** ILLEGAL DATA ADDRESS **/
@@ -563,6 +962,1487 @@ int main(int argc, char *argv[])
     /* Restore original byte timeout */
     modbus_set_byte_timeout(ctx, old_byte_to_sec, old_byte_to_usec);
 
+    /** WAIT MODE **/
+    printf("\nTEST WAIT MODE:\n");
+
+    rc = modbus_set_wait_mode(ctx, 42);
+    printf("1/3 Invalid wait mode: ");
+    ASSERT_TRUE(rc == -1 && errno == EINVAL, "");
+
+    {
+        uint8_t raw_req[] = { (use_backend == RTU) ? SERVER_ID : 0xFF,
+                              MODBUS_FC_READ_HOLDING_REGISTERS,
+                              UT_REGISTERS_ADDRESS >> 8,
+                              UT_REGISTERS_ADDRESS & 0xFF,
+                              0x00, 0x01 };
+        uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+
+        modbus_set_wait_mode(ctx, MODBUS_WAIT_NONE);
+        rc = modbus_receive_confirmation(ctx, rsp);
+        printf("2/3 Nothing pending in no wait mode: ");
+        ASSERT_TRUE(rc == -1 && errno == EAGAIN, "");
+
+        modbus_send_raw_request(ctx, raw_req, sizeof(raw_req));
+        do {
+            rc = modbus_receive_confirmation(ctx, rsp);
+        } while (rc == -1 && errno == EAGAIN);
+    }
+    printf("3/3 Confirmation polled in no wait mode: ");
+    ASSERT_TRUE(rc == modbus_get_header_length(ctx) + 4 +
+                ((use_backend == RTU) ? 2 : 0), "");
+    modbus_set_wait_mode(ctx, MODBUS_WAIT_BLOCK);
+
+    /** EXCEPTION PENALTY **/
+    printf("\nTEST EXCEPTION PENALTY:\n");
+    printf("1/6 Deferred by default: ");
+    ASSERT_TRUE(modbus_get_exception_penalty(ctx) == MODBUS_PENALTY_DEFER, "");
+
+    rc = modbus_set_exception_penalty(ctx, 42);
+    printf("2/6 Invalid penalty mode: ");
+    ASSERT_TRUE(rc == -1 && errno == EINVAL, "");
+
+    {
+        /* Read of 0 registers, an illegal number of values */
+        uint8_t raw_req[] = { (use_backend == RTU) ? SERVER_ID : 0xFF,
+                              MODBUS_FC_READ_HOLDING_REGISTERS,
+                              UT_REGISTERS_ADDRESS >> 8,
+                              UT_REGISTERS_ADDRESS & 0xFF, 0x00, 0x00 };
+        uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+        int header_length = modbus_get_header_length(ctx);
+        int64_t start;
+        int64_t elapsed;
+
+        /* The server penalty is its response timeout (0.5 s) */
+        modbus_get_response_timeout(ctx, &old_response_to_sec,
+                                    &old_response_to_usec);
+        modbus_set_response_timeout(ctx, 0, 600000);
+
+        start = now_ms();
+        modbus_send_raw_request(ctx, raw_req, sizeof(raw_req));
+        rc = modbus_receive_confirmation(ctx, rsp);
+        elapsed = now_ms() - start;
+        printf("3/6 Exception after the penalty (%d ms): ", (int)elapsed);
+        ASSERT_TRUE(rc > header_length + 1 && elapsed >= 400 &&
+                    rsp[header_length] ==
+                    (MODBUS_FC_READ_HOLDING_REGISTERS | 0x80) &&
+                    rsp[header_length + 1] == MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE,
+                    "");
+
+        if (use_backend != RTU) {
+            /* A valid request pipelined behind the illegal one in the same
+               segment, the server must not flush it */
+            uint8_t pipelined[] = {
+                0x10, 0x01, 0x00, 0x00, 0x00, 0x06, 0xFF,
+                MODBUS_FC_READ_HOLDING_REGISTERS,
+                UT_REGISTERS_ADDRESS >> 8, UT_REGISTERS_ADDRESS & 0xFF,
+                0x00, 0x00,
+                0x10, 0x02, 0x00, 0x00, 0x00, 0x06, 0xFF,
+                MODBUS_FC_READ_HOLDING_REGISTERS,
+                UT_REGISTERS_ADDRESS >> 8, UT_REGISTERS_ADDRESS & 0xFF,
+                0x00, UT_REGISTERS_NB };
+            uint8_t flood[9 * 12];
+            uint8_t rsp_read[MODBUS_TCP_MAX_ADU_LENGTH];
+            int64_t elapsed_read = 0;
+            int rc_read = -1;
+
+            start = now_ms();
+            rc = send(modbus_get_socket(ctx), (const char *)pipelined,
+                      sizeof(pipelined), 0);
+            if (rc == sizeof(pipelined)) {
+                rc_read = modbus_receive_confirmation(ctx, rsp_read);
+                elapsed_read = now_ms() - start;
+                rc = modbus_receive_confirmation(ctx, rsp);
+            }
+            elapsed = now_ms() - start;
+            printf("4/6 Request served during the penalty (%d ms): ",
+                   (int)elapsed_read);
+            ASSERT_TRUE(rc_read == header_length + 2 + UT_REGISTERS_NB * 2 &&
+                        rsp_read[1] == 0x02 && elapsed_read < 300 &&
+                        rc > header_length + 1 && rsp[1] == 0x01 &&
+                        elapsed >= 400 &&
+                        rsp[header_length] ==
+                        (MODBUS_FC_READ_HOLDING_REGISTERS | 0x80), "");
+
+            /* Beyond 8 deferred responses, the server sleeps and the last
+               response overtakes the deferred ones */
+            for (i = 0; i < 9; i++) {
+                memcpy(flood + i * 12, pipelined, 12);
+                flood[i * 12 + 1] = 0x20 + i;
+            }
+            rc = send(modbus_get_socket(ctx), (const char *)flood,
+                      sizeof(flood), 0);
+            if (rc == sizeof(flood)) {
+                rc = modbus_receive_confirmation(ctx, rsp_read);
+                for (i = 1; i < 9 && rc != -1; i++) {
+                    rc = modbus_receive_confirmation(ctx, rsp);
+                }
+            }
+            printf("5/6 Penalty slept beyond 8 deferred responses: ");
+            ASSERT_TRUE(rc > header_length + 1 && rsp_read[1] == 0x28 &&
+                        rsp_read[header_length] ==
+                        (MODBUS_FC_READ_HOLDING_REGISTERS | 0x80),
+                        "FAILED (%02X)\n", rsp_read[1]);
+        }
+
+        rc = modbus_write_register(ctx, UT_REGISTERS_ADDRESS_PENALTY,
+                                   MODBUS_PENALTY_NONE);
+        start = now_ms();
+        modbus_send_raw_request(ctx, raw_req, sizeof(raw_req));
+        rc += modbus_receive_confirmation(ctx, rsp);
+        elapsed = now_ms() - start;
+        modbus_write_register(ctx, UT_REGISTERS_ADDRESS_PENALTY,
+                              MODBUS_PENALTY_DEFER);
+        modbus_set_response_timeout(ctx, old_response_to_sec,
+                                    old_response_to_usec);
+        printf("6/6 Exception at once without penalty (%d ms): ",
+               (int)elapsed);
+        ASSERT_TRUE(rc == 1 + header_length + 2 +
+                    ((use_backend == RTU) ? 2 : 0) && elapsed < 300 &&
+                    rsp[header_length + 1] == MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE,
+                    "");
+    }
+
+    /** ASYNCHRONOUS REQUESTS **/
+    printf("\nTEST ASYNCHRONOUS REQUESTS:\n");
+    {
+        const int window = (use_backend == RTU) ? 1 : 3;
+        uint16_t tab_async[3][MODBUS_MAX_READ_REGISTERS];
+        int results[3] = { 0, 0, 0 };
+        int nb_completed = 0;
+        async_resubmit_t resubmit;
+        int nb_pending;
+
+        /* Expected values */
+        modbus_read_registers(ctx, UT_REGISTERS_ADDRESS, UT_REGISTERS_NB,
+                              tab_rp_registers);
+
+        rc = modbus_async_set_window(ctx, window);
+        printf("1/5 modbus_async_set_window: ");
+        ASSERT_TRUE(rc == 0 && modbus_async_get_window(ctx) == window, "");
+
+        rc = 0;
+        for (i = 0; i < window && rc == 0; i++) {
+            rc = modbus_async_read_registers(ctx, UT_REGISTERS_ADDRESS,
+                                             UT_REGISTERS_NB, tab_async[i],
+                                             async_callback, &results[i]);
+        }
+        printf("2/5 %d requests in flight: ", window);
+        ASSERT_TRUE(rc == 0 && modbus_async_get_pending(ctx) == window, "");
+
+        rc = modbus_async_read_registers(ctx, UT_REGISTERS_ADDRESS,
+                                         UT_REGISTERS_NB, tab_async[0],
+                                         async_callback, &results[0]);
+        printf("3/5 Window full: ");
+        ASSERT_TRUE(rc == -1 && errno == EBUSY, "");
+
+        while (nb_completed < window) {
+            rc = modbus_async_process(ctx, TRUE);
+            if (rc == -1)
+                break;
+            nb_completed += rc;
+        }
+        printf("4/5 Responses of the requests in flight: ");
+        for (i = 0; i < window && rc != -1; i++) {
+            if (results[i] != UT_REGISTERS_NB ||
+                memcmp(tab_async[i], tab_rp_registers,
+                       UT_REGISTERS_NB * sizeof(uint16_t)) != 0) {
+                rc = -1;
+            }
+        }
+        ASSERT_TRUE(rc != -1 && modbus_async_get_pending(ctx) == 0, "");
+
+        /* The response of the cancelled request is dropped, without
+           transaction ID in RTU it would be taken for the new one */
+        if (use_backend != RTU) {
+            memset(&resubmit, 0, sizeof(resubmit));
+            rc = modbus_async_read_registers(ctx, UT_REGISTERS_ADDRESS,
+                                             UT_REGISTERS_NB, resubmit.tab,
+                                             async_resubmit_callback,
+                                             &resubmit);
+            if (rc == 0) {
+                rc = modbus_async_cancel(ctx);
+            }
+            nb_pending = modbus_async_get_pending(ctx);
+            while (modbus_async_get_pending(ctx) > 0 &&
+                   modbus_async_process(ctx, TRUE) != -1) {
+            }
+            printf("5/5 Requests submitted by the cancel callback: ");
+            ASSERT_TRUE(rc == 1 && nb_pending == 2 &&
+                        resubmit.nb_cancelled == 1 &&
+                        resubmit.nb_completed == 2 &&
+                        memcmp(resubmit.tab, tab_rp_registers,
+                               UT_REGISTERS_NB * sizeof(uint16_t)) == 0, "");
+        }
+    }
+
+    /** REQUEST PLANNER **/
+    printf("\nTEST REQUEST PLANNER:\n");
+    {
+        modbus_plan_t *plan = modbus_plan_new(MODBUS_FC_READ_HOLDING_REGISTERS);
+        uint16_t tab_large[300];
+        uint16_t tab_tag[2][2];
+
+        modbus_plan_add(plan, UT_REGISTERS_ADDRESS + 2, 1, tab_tag[0]);
+        modbus_plan_add(plan, UT_REGISTERS_ADDRESS, 2, tab_tag[1]);
+        modbus_plan_add(plan, 0, 300, tab_large);
+        rc = modbus_plan_get_nb_requests(plan);
+        printf("1/5 Large tag split in blocks: ");
+        ASSERT_TRUE(rc == 4, "FAILED (%d)", rc);
+
+        modbus_plan_set_max_gap(plan, 100);
+        rc = modbus_plan_get_nb_requests(plan);
+        printf("2/5 Gap read to save a request: ");
+        ASSERT_TRUE(rc == 3, "FAILED (%d)", rc);
+
+        /* Pipelined when the async window of the context is larger than 1 */
+        rc = modbus_plan_execute(plan, ctx);
+        printf("3/5 modbus_plan_execute: ");
+        ASSERT_TRUE(rc == 3 && modbus_plan_get_error(plan, 0) == 0, "");
+
+        printf("4/5 Values scattered in the tags: ");
+        ASSERT_TRUE(tab_tag[1][0] == tab_rp_registers[0] &&
+                    tab_tag[1][1] == tab_rp_registers[1] &&
+                    tab_tag[0][0] == tab_rp_registers[2], "");
+
+        rc = modbus_plan_set_max_gap(plan, MODBUS_MAX_READ_REGISTERS + 1);
+        printf("5/5 Gap larger than a block: ");
+        ASSERT_TRUE(rc == -1 && errno == EINVAL &&
+                    modbus_plan_get_max_gap(plan) == 100, "");
+        modbus_plan_free(plan);
+    }
+
+#ifdef __linux__
+    /** POLLER **/
+    printf("\nTEST POLLER:\n");
+    if (use_backend != RTU) {
+        modbus_poller_t *poller = modbus_poller_new();
+        poller_result_t result = { 0, 0, 0 };
+        poller_result_t result_silent = { 0, 0, 0 };
+        uint16_t tab_poll[UT_REGISTERS_NB];
+        uint16_t tab_silent[1];
+        modbus_t *ctx_poll;
+        modbus_t *ctx_silent;
+        modbus_t *ctx_listen;
+        int server_socket;
+        int nb_connections = 0;
+        int id;
+
+        /* The device shares the connection to the unit test server */
+        ctx_poll = (use_backend == TCP) ?
+            modbus_new_tcp("127.0.0.1", 1502) : modbus_new_tcp_pi("::1", "1502");
+        modbus_set_socket(ctx_poll, dup(modbus_get_socket(ctx)));
+        id = modbus_poller_add(poller, ctx_poll,
+                               MODBUS_FC_READ_HOLDING_REGISTERS,
+                               UT_REGISTERS_ADDRESS, UT_REGISTERS_NB, tab_poll,
+                               100, poller_callback, &result);
+        for (i = 0; i < 100 && result.nb_polls == 0; i++) {
+            modbus_poller_process(poller, 10);
+        }
+        /* The shared connection mustn't be shut down by the removal */
+        close(modbus_get_socket(ctx_poll));
+        modbus_set_socket(ctx_poll, -1);
+        modbus_poller_remove(poller, id);
+        printf("1/2 Poll of the server: ");
+        ASSERT_TRUE(result.nb_polls == 1 && result.rc == UT_REGISTERS_NB &&
+                    memcmp(tab_poll, tab_rp_registers,
+                           sizeof(tab_poll)) == 0, "");
+
+        /* Server which never accepts its connections */
+        ctx_listen = modbus_new_tcp("127.0.0.1", 1506);
+        server_socket = modbus_tcp_listen(ctx_listen, 4);
+        ctx_silent = modbus_new_tcp("127.0.0.1", 1506);
+        modbus_set_response_timeout(ctx_silent, 0, 100000);
+        modbus_poller_add(poller, ctx_silent, MODBUS_FC_READ_HOLDING_REGISTERS,
+                          0, 1, tab_silent, 50, poller_callback,
+                          &result_silent);
+        for (i = 0; i < 100 && result_silent.nb_polls < 2; i++) {
+            modbus_poller_process(poller, 10);
+        }
+        modbus_poller_free(poller);
+        /* A connection by poll */
+        fcntl(server_socket, F_SETFL, O_NONBLOCK);
+        for (;;) {
+            int s = accept(server_socket, NULL, NULL);
+
+            if (s == -1)
+                break;
+            close(s);
+            nb_connections++;
+        }
+        close(server_socket);
+        modbus_free(ctx_listen);
+        printf("2/2 Timeout and reconnection of a silent device: ");
+        ASSERT_TRUE(result_silent.nb_polls == 2 &&
+                    result_silent.nb_timeouts == 2 && nb_connections == 2,
+                    "FAILED (%d polls, %d timeouts, %d connections)\n",
+                    result_silent.nb_polls, result_silent.nb_timeouts,
+                    nb_connections);
+    }
+#endif
+
+    /** CUSTOM FUNCTION CODE **/
+    printf("\nTEST CUSTOM FUNCTION CODE:\n");
+    {
+        modbus_handler_t handler = { 0, 1, NULL, NULL, NULL };
+        uint8_t raw_req[] = { (use_backend == RTU) ? SERVER_ID : 0xFF,
+                              UT_FC_CUSTOM, 0x03, 0x01, 0x02, 0x03 };
+        uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+
+        rc = modbus_set_handler(ctx, MODBUS_FC_READ_COILS, &handler);
+        printf("1/3 Invalid handler: ");
+        ASSERT_TRUE(rc == -1 && errno == EINVAL, "");
+
+        rc = modbus_set_handler(ctx, 0x80, NULL);
+        printf("2/3 Invalid function code: ");
+        ASSERT_TRUE(rc == -1 && errno == EINVAL, "");
+
+        modbus_send_raw_request(ctx, raw_req, sizeof(raw_req));
+        rc = modbus_receive_confirmation(ctx, rsp);
+        printf("3/3 Reply of the handler registered by the server: ");
+        ASSERT_TRUE(rc == modbus_get_header_length(ctx) + 2 +
+                    ((use_backend == RTU) ? 2 : 0) &&
+                    rsp[modbus_get_header_length(ctx) + 1] == 6, "");
+    }
+
+    /** FILE RECORDS **/
+    printf("\nTEST FILE RECORDS:\n");
+    {
+        uint16_t src[UT_FILE_NB_RECORDS];
+        uint16_t dest[UT_FILE_NB_RECORDS];
+        modbus_file_record_t records[3];
+        /* Write of a record of length 0 */
+        uint8_t raw_req[] = { (use_backend == RTU) ? SERVER_ID : 0xFF,
+                              MODBUS_FC_WRITE_FILE_RECORD, 0x09,
+                              0x06, 0x00, UT_FILE_NUMBER, 0x00, 0x00,
+                              0x00, 0x00, 0x12, 0x34 };
+        uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+        int header_length = modbus_get_header_length(ctx);
+
+        for (i = 0; i < UT_FILE_NB_RECORDS; i++) {
+            src[i] = i * 3 + 1;
+        }
+        /* The first record is longer than a request */
+        for (i = 0; i < 3; i++) {
+            records[i].file = UT_FILE_NUMBER;
+        }
+        records[0].record = 0;
+        records[0].nb = 300;
+        records[1].record = 350;
+        records[1].nb = 20;
+        records[2].record = 300;
+        records[2].nb = 2;
+        for (i = 0; i < 3; i++) {
+            records[i].data = src + records[i].record;
+        }
+        rc = modbus_write_file_records(ctx, records, 3);
+        printf("1/5 modbus_write_file_records: ");
+        ASSERT_TRUE(rc == 322, "FAILED (nb records %d)", rc);
+
+        memset(dest, 0, sizeof(dest));
+        for (i = 0; i < 3; i++) {
+            records[i].data = dest + records[i].record;
+        }
+        rc = modbus_read_file_records(ctx, records, 3);
+        printf("2/5 modbus_read_file_records: ");
+        ASSERT_TRUE(rc == 322 && memcmp(dest, src, 302 * 2) == 0 &&
+                    memcmp(dest + 350, src + 350, 20 * 2) == 0,
+                    "FAILED (nb records %d)", rc);
+
+        /* The requests are pipelined in TCP */
+        memset(dest, 0, sizeof(dest));
+        if (use_backend != RTU) {
+            modbus_async_set_window(ctx, 4);
+        }
+        rc = modbus_read_file_records(ctx, records, 3);
+        modbus_async_set_window(ctx, 1);
+        printf("3/5 Records read in a window of requests: ");
+        ASSERT_TRUE(rc == 322 && memcmp(dest, src, 302 * 2) == 0,
+                    "FAILED (nb records %d)", rc);
+
+        records[0].record = UT_FILE_NB_RECORDS - 10;
+        records[0].nb = 20;
+        records[0].data = dest;
+        rc = modbus_read_file_records(ctx, records, 1);
+        printf("4/5 Records out of the file: ");
+        ASSERT_TRUE(rc == -1 && errno == EMBXILADD, "");
+
+        /* The exception is delayed by the penalty of the server */
+        modbus_get_response_timeout(ctx, &old_response_to_sec,
+                                    &old_response_to_usec);
+        modbus_set_response_timeout(ctx, 0, 600000);
+        modbus_send_raw_request(ctx, raw_req, sizeof(raw_req));
+        rc = modbus_receive_confirmation(ctx, rsp);
+        modbus_set_response_timeout(ctx, old_response_to_sec,
+                                    old_response_to_usec);
+        printf("5/5 Record of length 0: ");
+        ASSERT_TRUE(rc > header_length + 1 &&
+                    rsp[header_length] == (MODBUS_FC_WRITE_FILE_RECORD | 0x80) &&
+                    rsp[header_length + 1] == MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE,
+                    "");
+    }
+
+    /** MAPPING ARENA **/
+    printf("\nTEST MAPPING ARENA:\n");
+    {
+        modbus_mapping_t *mb_mapping;
+        size_t size;
+        uint8_t *mem;
+        uint8_t *aligned;
+        uint16_t values[150];
+        modbus_mapping_t mb_mapping_app;
+        uint16_t tab_app[4];
+
+        mb_mapping = modbus_mapping_new_ext(100, 0, 1000, 10,
+                                            MODBUS_MAPPING_HUGE_PAGES);
+        printf("1/6 modbus_mapping_new_ext: ");
+        ASSERT_TRUE(mb_mapping != NULL && mb_mapping->tab_input_bits == NULL &&
+                    ((uintptr_t)mb_mapping->tab_registers & 63) == 0 &&
+                    mb_mapping->tab_registers[999] == 0 &&
+                    mb_mapping->tab_input_registers[9] == 0, "");
+        modbus_mapping_free(mb_mapping);
+
+        size = modbus_mapping_get_size(100, 100, 100, 100,
+                                       MODBUS_MAPPING_PACKED_BITS);
+        mem = malloc(size + 64);
+        /* Aligned on a cache line */
+        aligned = mem + ((64 - (uintptr_t)mem % 64) % 64);
+        mb_mapping = modbus_mapping_init(aligned, size - 64, 100, 100, 100, 100,
+                                         MODBUS_MAPPING_PACKED_BITS);
+        printf("2/6 Too small memory of the caller: ");
+        ASSERT_TRUE(mb_mapping == NULL && errno == EINVAL, "");
+
+        /* Worst alignment */
+        mb_mapping = modbus_mapping_init(aligned + 1, size, 100, 100, 100, 100,
+                                         MODBUS_MAPPING_PACKED_BITS);
+        printf("3/6 modbus_mapping_init in the memory of the caller: ");
+        ASSERT_TRUE(mb_mapping != NULL &&
+                    ((uintptr_t)mb_mapping->tab_bits & 63) == 0 &&
+                    (uint8_t *)(mb_mapping->tab_input_registers + 100) <=
+                    aligned + 1 + size, "");
+        modbus_mapping_free(mb_mapping);
+        free(mem);
+
+        mb_mapping = modbus_mapping_new_ext(0, 0, 200, 0,
+                                            MODBUS_MAPPING_THREAD_SAFE);
+        for (i = 0; i < 150; i++) {
+            values[i] = i;
+        }
+        /* Across three stripes */
+        rc = modbus_mapping_write_registers(mb_mapping, MODBUS_TABLE_REGISTERS,
+                                            10, 150, values);
+        memset(values, 0, sizeof(values));
+        printf("4/6 modbus_mapping_write_registers of a thread-safe mapping: ");
+        ASSERT_TRUE(rc == 150 &&
+                    modbus_mapping_read_registers(mb_mapping,
+                                                  MODBUS_TABLE_REGISTERS,
+                                                  10, 150, values) == 150 &&
+                    mb_mapping->tab_registers[10 + 149] == 149 &&
+                    values[149] == 149, "");
+
+        rc = modbus_mapping_read_registers(mb_mapping, MODBUS_TABLE_REGISTERS,
+                                           100, 101, values);
+        printf("5/6 modbus_mapping_read_registers out of the table: ");
+        ASSERT_TRUE(rc == -1 && errno == EINVAL, "");
+        modbus_mapping_free(mb_mapping);
+
+        /* Filled by the application as with libmodbus 3.1.2, flags isn't
+           set by modbus_mapping_new*() */
+        memset(&mb_mapping_app, 0, sizeof(mb_mapping_app));
+        mb_mapping_app.nb_registers = 4;
+        mb_mapping_app.tab_registers = tab_app;
+        mb_mapping_app.flags = -1;
+        for (i = 0; i < 4; i++) {
+            values[i] = 0x100 + i;
+        }
+        rc = modbus_mapping_write_registers(&mb_mapping_app,
+                                            MODBUS_TABLE_REGISTERS, 0, 4,
+                                            values);
+        printf("6/6 Flags of a mapping filled by the application ignored: ");
+        ASSERT_TRUE(rc == 4 && tab_app[3] == 0x103, "");
+    }
+
+#ifndef _WIN32
+    /** THREAD-SAFE MAPPING **/
+    printf("\nTEST THREAD-SAFE MAPPING:\n");
+    {
+        mapping_threads_t threads;
+        pthread_t writer_thread;
+        pthread_t reader_thread;
+
+        memset(&threads, 0, sizeof(threads));
+        threads.mb_mapping = modbus_mapping_new_ext(
+            0, 0, MAPPING_THREADS_ADDRESS + MAPPING_THREADS_NB, 0,
+            MODBUS_MAPPING_THREAD_SAFE);
+        threads.running = TRUE;
+        rc = (threads.mb_mapping == NULL) ? -1 :
+            pthread_create(&writer_thread, NULL, mapping_writer, &threads);
+        if (rc == 0) {
+            rc = pthread_create(&reader_thread, NULL, mapping_reader, &threads);
+            if (rc == 0) {
+                pthread_join(reader_thread, NULL);
+            }
+            threads.running = FALSE;
+            pthread_join(writer_thread, NULL);
+        }
+        modbus_mapping_free(threads.mb_mapping);
+        printf("1/2 FC16 writes and FC03 reads from two threads: ");
+        ASSERT_TRUE(rc == 0 && threads.nb_writes > 0 && threads.nb_changes > 1,
+                    "%d writes, %d changes seen", threads.nb_writes,
+                    threads.nb_changes);
+
+        printf("2/2 Reads of the registers never torn: ");
+        ASSERT_TRUE(threads.nb_torn == 0, "%d torn in %d reads",
+                    threads.nb_torn, threads.nb_reads);
+    }
+#endif
+
+#ifndef _WIN32
+    /** SPARSE MAPPING **/
+    printf("\nTEST SPARSE MAPPING:\n");
+    {
+        modbus_mapping_t *mb_mapping;
+        modbus_t *ctx_client;
+        modbus_t *ctx_server;
+        uint16_t *reg;
+        int fds[2];
+        /* 16 registers across the pages 0x10 and 0x11 */
+        uint8_t raw_write[] = { 0xFF, MODBUS_FC_WRITE_MULTIPLE_REGISTERS,
+                                0x10, 0xF8, 0x00, 0x10, 0x20,
+                                0x00, 0x00, 0x00, 0x01, 0x00, 0x02, 0x00, 0x03,
+                                0x00, 0x04, 0x00, 0x05, 0x00, 0x06, 0x00, 0x07,
+                                0x00, 0x08, 0x00, 0x09, 0x00, 0x0A, 0x00, 0x0B,
+                                0x00, 0x0C, 0x00, 0x0D, 0x00, 0x0E, 0x12, 0x34 };
+        uint8_t raw_read[] = { 0xFF, MODBUS_FC_READ_HOLDING_REGISTERS,
+                               0x10, 0xF8, 0x00, 0x10 };
+        /* One register after the range */
+        uint8_t raw_gap[] = { 0xFF, MODBUS_FC_READ_HOLDING_REGISTERS,
+                              0x10, 0x00, 0x00, 0x0B };
+        /* 16 coils at the end of the address space */
+        uint8_t raw_write_bits[] = { 0xFF, MODBUS_FC_WRITE_MULTIPLE_COILS,
+                                     0xFF, 0xF0, 0x00, 0x10, 0x02, 0xA5, 0x0F };
+        uint8_t raw_read_bits[] = { 0xFF, MODBUS_FC_READ_COILS,
+                                    0xFF, 0xF0, 0x00, 0x10 };
+        uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+
+        mb_mapping = modbus_mapping_new_sparse();
+        rc = modbus_mapping_add_range(mb_mapping, MODBUS_TABLE_REGISTERS,
+                                      0x1000, 10);
+        rc += modbus_mapping_add_range(mb_mapping, MODBUS_TABLE_REGISTERS,
+                                       0x10F8, 16);
+        rc += modbus_mapping_add_range(mb_mapping, MODBUS_TABLE_BITS,
+                                       0xFFF0, 16);
+        printf("1/6 modbus_mapping_add_range: ");
+        ASSERT_TRUE(mb_mapping != NULL && rc == 0 &&
+                    modbus_mapping_add_range(mb_mapping, MODBUS_TABLE_BITS,
+                                             0xFFF8, 16) == -1 &&
+                    errno == EINVAL, "");
+
+        reg = modbus_mapping_get_register_ptr(mb_mapping,
+                                              MODBUS_TABLE_REGISTERS, 0x1009);
+        printf("2/6 modbus_mapping_get_register_ptr: ");
+        ASSERT_TRUE(reg != NULL && *reg == 0 &&
+                    modbus_mapping_get_register_ptr(mb_mapping,
+                                                    MODBUS_TABLE_REGISTERS,
+                                                    0x100A) == NULL &&
+                    errno == EINVAL, "");
+        *reg = 0x5678;
+
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        ctx_client = modbus_new_tcp("127.0.0.1", 1502);
+        ctx_server = modbus_new_tcp("127.0.0.1", 1502);
+        modbus_set_socket(ctx_client, fds[0]);
+        modbus_set_socket(ctx_server, fds[1]);
+
+        rc = local_request(ctx_client, ctx_server, mb_mapping,
+                           raw_write, sizeof(raw_write), rsp);
+        reg = modbus_mapping_get_register_ptr(mb_mapping,
+                                              MODBUS_TABLE_REGISTERS, 0x1107);
+        printf("3/6 Write registers across two pages: ");
+        ASSERT_TRUE(rc == 12 && reg != NULL && *reg == 0x1234, "");
+
+        rc = local_request(ctx_client, ctx_server, mb_mapping,
+                           raw_read, sizeof(raw_read), rsp);
+        printf("4/6 Read registers across two pages: ");
+        ASSERT_TRUE(rc == 9 + 32 && rsp[9 + 2 * 7] == 0x00 &&
+                    rsp[9 + 2 * 7 + 1] == 0x07 && rsp[9 + 30] == 0x12 &&
+                    rsp[9 + 31] == 0x34, "");
+
+        rc = local_request(ctx_client, ctx_server, mb_mapping,
+                           raw_gap, sizeof(raw_gap), rsp);
+        printf("5/6 Read out of the ranges: ");
+        ASSERT_TRUE(rc == 9 && rsp[7] == (0x80 | MODBUS_FC_READ_HOLDING_REGISTERS) &&
+                    rsp[8] == MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, "");
+
+        local_request(ctx_client, ctx_server, mb_mapping,
+                      raw_write_bits, sizeof(raw_write_bits), rsp);
+        rc = local_request(ctx_client, ctx_server, mb_mapping,
+                           raw_read_bits, sizeof(raw_read_bits), rsp);
+        printf("6/6 Write and read coils at the end of the address space: ");
+        ASSERT_TRUE(rc == 9 + 2 && rsp[9] == 0xA5 && rsp[10] == 0x0F &&
+                    *modbus_mapping_get_bit_ptr(mb_mapping, MODBUS_TABLE_BITS,
+                                                0xFFFF) == 0, "");
+
+        modbus_close(ctx_client);
+        modbus_free(ctx_client);
+        modbus_close(ctx_server);
+        modbus_free(ctx_server);
+        modbus_mapping_free(mb_mapping);
+    }
+#endif
+
+#ifndef _WIN32
+    /** UDP **/
+    printf("\nTEST UDP:\n");
+    {
+        modbus_mapping_t *mb_mapping;
+        modbus_t *ctx_client;
+        modbus_t *ctx_server;
+        uint8_t raw_read[] = { 0xFF, MODBUS_FC_READ_HOLDING_REGISTERS,
+                               0x00, 0x00, 0x00, 0x02 };
+        /* MBAP length of 7 in a datagram of 12 bytes */
+        uint8_t bad_req[] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x07,
+                              0xFF, 0x03, 0x00, 0x00, 0x00, 0x01 };
+        uint8_t query[MODBUS_UDP_MAX_ADU_LENGTH];
+        uint8_t rsp[MODBUS_UDP_MAX_ADU_LENGTH];
+        uint16_t reg;
+        int ok;
+
+        mb_mapping = modbus_mapping_new(0, 0, 2, 0);
+        mb_mapping->tab_registers[1] = 0x1234;
+        ctx_server = modbus_new_udp("127.0.0.1", 1505);
+        ctx_client = modbus_new_udp("127.0.0.1", 1505);
+        rc = modbus_udp_bind(ctx_server);
+        modbus_connect(ctx_client);
+        modbus_set_response_timeout(ctx_client, 0, 50000);
+
+        ASSERT_TRUE(local_write(ctx_client, ctx_server,
+                                "1/4 modbus_receive and modbus_reply") &&
+                    rc != -1, "");
+
+        /* One recvmmsg() call for the three requests */
+        for (i = 0; i < 3; i++) {
+            modbus_send_raw_request(ctx_client, raw_read, sizeof(raw_read));
+        }
+        rc = modbus_udp_process(ctx_server, mb_mapping, 100);
+        ok = (rc == 3);
+        for (i = 0; i < 3; i++) {
+            ok = ok && modbus_receive_confirmation(ctx_client, rsp) == 13 &&
+                rsp[11] == 0x12 && rsp[12] == 0x34;
+        }
+        printf("2/4 modbus_udp_process with a batch of requests: ");
+        ASSERT_TRUE(ok, "rc %d", rc);
+
+        send(modbus_get_socket(ctx_client), (const char *)bad_req,
+             sizeof(bad_req), 0);
+        rc = modbus_udp_process(ctx_server, mb_mapping, 100);
+        printf("3/4 Datagram with a bad length ignored: ");
+        ASSERT_TRUE(rc == 0 && modbus_receive_confirmation(ctx_client, rsp) == -1 &&
+                    errno == ETIMEDOUT, "");
+
+        /* The server drops the request as a lost datagram, nothing is left
+           to desynchronize the next transaction */
+        rc = modbus_read_registers(ctx_client, 0, 1, &reg);
+        ok = (rc == -1 && errno == ETIMEDOUT &&
+              modbus_receive(ctx_server, query) == 12);
+        ASSERT_TRUE(local_write(ctx_client, ctx_server,
+                                "4/4 Lost datagram timed out then retried") &&
+                    ok, "");
+
+        modbus_close(ctx_client);
+        modbus_free(ctx_client);
+        modbus_close(ctx_server);
+        modbus_free(ctx_server);
+        modbus_mapping_free(mb_mapping);
+    }
+#endif
+
+#ifndef _WIN32
+    /** UNIX SOCKET **/
+    printf("\nTEST UNIX SOCKET:\n");
+    {
+        const char *paths[] = { "unit-test.sock", "@unit-test" };
+        char long_path[200];
+        modbus_t *ctx_client;
+        modbus_t *ctx_server;
+        int s;
+        int fd;
+
+        /* The second listen on the path replaces the socket file left by the
+           first one */
+        for (i = 0; i < 3; i++) {
+            char label[64];
+
+            ctx_client = modbus_new_unix(paths[i % 2]);
+            ctx_server = modbus_new_unix(paths[i % 2]);
+            s = modbus_unix_listen(ctx_server, 1);
+            rc = modbus_connect(ctx_client);
+            if (s != -1 && rc != -1) {
+                rc = modbus_unix_accept(ctx_server, &s);
+            }
+            sprintf(label, "%d/6 Request over %s", i + 1,
+                    (i == 1) ? "the abstract namespace" : "a socket file");
+            ASSERT_TRUE(rc != -1 && local_write(ctx_client, ctx_server, label),
+                        "");
+
+            close(s);
+            modbus_close(ctx_client);
+            modbus_free(ctx_client);
+            modbus_close(ctx_server);
+            modbus_free(ctx_server);
+        }
+
+        /* The path doesn't fit in sun_path */
+        memset(long_path, 'a', sizeof(long_path) - 1);
+        long_path[sizeof(long_path) - 1] = '\0';
+        ctx_client = modbus_new_unix(long_path);
+        printf("4/6 Path too long: ");
+        ASSERT_TRUE(ctx_client == NULL && errno == EINVAL, "");
+
+        /* A regular file at the path is kept and not listened on */
+        unlink(paths[0]);
+        fd = open(paths[0], O_WRONLY | O_CREAT, 0600);
+        ctx_server = modbus_new_unix(paths[0]);
+        s = modbus_unix_listen(ctx_server, 1);
+        rc = (s == -1 && errno == EADDRINUSE && access(paths[0], F_OK) == 0);
+        if (fd != -1)
+            close(fd);
+        unlink(paths[0]);
+        printf("5/6 Regular file at the path not replaced: ");
+        ASSERT_TRUE(rc, "");
+
+        /* The permissions of the socket file are checked on connect, the
+           super user bypasses them */
+        s = modbus_unix_listen(ctx_server, 1);
+        ctx_client = modbus_new_unix(paths[0]);
+        rc = (s == -1) ? -1 : chmod(paths[0], 0);
+        if (rc != -1) {
+            rc = modbus_connect(ctx_client);
+            rc = (geteuid() == 0) ? (rc != -1) : (rc == -1 && errno == EACCES);
+        } else {
+            rc = FALSE;
+        }
+        printf("6/6 Socket file without permissions: ");
+        ASSERT_TRUE(rc, "");
+
+        close(s);
+        unlink(paths[0]);
+        modbus_close(ctx_client);
+        modbus_free(ctx_client);
+        modbus_free(ctx_server);
+    }
+#endif
+
+#ifndef _WIN32
+    /** SHARED MEMORY **/
+    printf("\nTEST SHARED MEMORY:\n");
+    {
+        modbus_mapping_t *mb_mapping;
+        modbus_t *ctx_client;
+        modbus_t *ctx_client_2;
+        modbus_t *ctx_server;
+        /* 213 bytes with the MBAP header, the ring of 4096 bytes wraps in
+           the middle of a request */
+        uint8_t raw_block[7 + 2 * 100] = { 0xFF,
+                                           MODBUS_FC_WRITE_MULTIPLE_REGISTERS,
+                                           0x00, 0x00, 0x00, 100, 200 };
+        uint8_t rsp[MODBUS_SHM_MAX_ADU_LENGTH];
+        uint16_t reg;
+        int64_t start;
+        pid_t pid;
+        int j;
+
+        mb_mapping = modbus_mapping_new(0, 0, 100, 0);
+        ctx_server = modbus_new_shm("unit-test");
+        ctx_client = modbus_new_shm("unit-test");
+        ctx_client_2 = modbus_new_shm("unit-test");
+
+        rc = modbus_shm_listen(ctx_server);
+        if (rc != -1) {
+            rc = modbus_connect(ctx_client);
+        }
+        ASSERT_TRUE(rc != -1 && local_write(ctx_client, ctx_server,
+                                            "1/5 Request over the rings"), "");
+
+        rc = 12;
+        for (i = 0; i < 40 && rc == 12; i++) {
+            for (j = 0; j < 100; j++) {
+                raw_block[7 + 2 * j] = i;
+                raw_block[8 + 2 * j] = j;
+            }
+            rc = local_request(ctx_client, ctx_server, mb_mapping,
+                               raw_block, sizeof(raw_block), rsp);
+            for (j = 0; j < 100 && rc == 12; j++) {
+                if (mb_mapping->tab_registers[j] != ((i << 8) | j))
+                    rc = -1;
+            }
+        }
+        printf("2/5 Requests across the end of the ring: ");
+        ASSERT_TRUE(rc == 12 && i == 40, "request %d", i);
+
+        /* Without spin, the server process sleeps on the futex before the
+           request is written */
+        pid = fork();
+        if (pid == 0) {
+            uint8_t query[MODBUS_SHM_MAX_ADU_LENGTH];
+
+            modbus_shm_set_spin(ctx_server, 0);
+            rc = modbus_receive(ctx_server, query);
+            if (rc > 0) {
+                modbus_reply(ctx_server, query, rc, mb_mapping);
+            }
+            _exit(0);
+        }
+        usleep(100000);
+        modbus_shm_set_spin(ctx_client, 0);
+        modbus_set_response_timeout(ctx_client, 1, 0);
+        start = now_ms();
+        rc = (pid == -1) ? -1 : modbus_read_registers(ctx_client, 99, 1, &reg);
+        printf("3/5 Server woken up from the futex: ");
+        if (pid != -1) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        ASSERT_TRUE(rc == 1 && reg == ((39 << 8) | 99) &&
+                    now_ms() - start < 500, "");
+
+        rc = modbus_connect(ctx_client_2);
+        printf("4/5 Single client of the rings: ");
+        ASSERT_TRUE(rc == -1 && errno == EBUSY, "");
+
+        modbus_close(ctx_server);
+        rc = modbus_read_registers(ctx_client, 0, 1, &reg);
+        printf("5/5 Server closed: ");
+        ASSERT_TRUE(rc == -1 && errno == ECONNRESET, "");
+
+        modbus_close(ctx_client);
+        modbus_free(ctx_client);
+        modbus_free(ctx_client_2);
+        modbus_free(ctx_server);
+        modbus_mapping_free(mb_mapping);
+    }
+#endif
+
+    /** LOOPBACK **/
+    printf("\nTEST LOOPBACK:\n");
+    {
+        modbus_mapping_t *mb_mapping;
+        modbus_t *ctx_client;
+        modbus_t *ctx_server;
+        uint8_t raw_write[] = { 0xFF, MODBUS_FC_WRITE_MULTIPLE_REGISTERS,
+                                0x00, 0x00, 0x00, 0x02, 0x04,
+                                0x12, 0x34, 0x56, 0x78 };
+        uint8_t rsp[MODBUS_LOOPBACK_MAX_ADU_LENGTH];
+        uint16_t reg;
+
+        mb_mapping = modbus_mapping_new(0, 0, 2, 0);
+        rc = modbus_new_loopback_pair(&ctx_client, &ctx_server);
+        if (rc == -1) {
+            printf("Unable to create the loopback pair\n");
+            goto close;
+        }
+
+        ASSERT_TRUE(local_write(ctx_client, ctx_server,
+                                "1/3 Request through the buffers"), "");
+
+        /* Reads of 1 to 3 bytes on both sides */
+        modbus_loopback_set_fragment(ctx_client, 3, 1);
+        modbus_loopback_set_fragment(ctx_server, 3, 2);
+        rc = local_request(ctx_client, ctx_server, mb_mapping,
+                           raw_write, sizeof(raw_write), rsp);
+        printf("2/3 Request reassembled from fragments: ");
+        ASSERT_TRUE(rc == 12 && mb_mapping->tab_registers[0] == 0x1234 &&
+                    mb_mapping->tab_registers[1] == 0x5678, "");
+
+        /* No server to answer in the thread, the timeout is immediate */
+        rc = modbus_read_registers(ctx_client, 0, 1, &reg);
+        printf("3/3 No response: ");
+        ASSERT_TRUE(rc == -1 && errno == ETIMEDOUT, "");
+
+        modbus_free(ctx_client);
+        modbus_free(ctx_server);
+        modbus_mapping_free(mb_mapping);
+    }
+
+    /** UNIT ROUTER **/
+    printf("\nTEST UNIT ROUTER:\n");
+    {
+        modbus_handler_t handler = { 0, 0, NULL, reply_unit, NULL };
+        modbus_mapping_t *mb_mapping_units[2];
+        modbus_router_t *router;
+        modbus_t *ctx_client;
+        modbus_t *ctx_server;
+        uint8_t raw_write[] = { 0x01, MODBUS_FC_WRITE_SINGLE_REGISTER,
+                                0x00, 0x00, 0x12, 0x34 };
+        uint8_t raw_custom[] = { 0x02, 0x41 };
+        uint8_t rsp[MODBUS_LOOPBACK_MAX_ADU_LENGTH];
+
+        mb_mapping_units[0] = modbus_mapping_new(0, 0, 1, 0);
+        mb_mapping_units[1] = modbus_mapping_new(0, 0, 1, 0);
+        modbus_new_loopback_pair(&ctx_client, &ctx_server);
+        router = modbus_router_new();
+        modbus_router_add_unit(router, 1, mb_mapping_units[0], 0);
+        modbus_router_add_unit(router, 2, mb_mapping_units[1], 0);
+        modbus_router_set_handler(router, 2, 0x41, &handler);
+        modbus_set_router(ctx_server, router);
+
+        /* The mapping given to modbus_reply() is ignored */
+        rc = local_request(ctx_client, ctx_server, NULL,
+                           raw_write, sizeof(raw_write), rsp);
+        raw_write[0] = 2;
+        raw_write[5] = 0x56;
+        if (rc == 12) {
+            rc = local_request(ctx_client, ctx_server, NULL,
+                               raw_write, sizeof(raw_write), rsp);
+        }
+        printf("1/4 Requests written in the mapping of their unit: ");
+        ASSERT_TRUE(rc == 12 &&
+                    mb_mapping_units[0]->tab_registers[0] == 0x1234 &&
+                    mb_mapping_units[1]->tab_registers[0] == 0x1256, "");
+
+        rc = local_request(ctx_client, ctx_server, NULL,
+                           raw_custom, sizeof(raw_custom), rsp);
+        raw_custom[0] = 1;
+        if (rc == 9 && rsp[8] == 0x56) {
+            rc = local_request(ctx_client, ctx_server, NULL,
+                               raw_custom, sizeof(raw_custom), rsp);
+        }
+        /* The raw confirmation isn't checked, the exception is returned */
+        printf("2/4 Handler registered for one unit only: ");
+        ASSERT_TRUE(rc == 9 && rsp[7] == (0x41 | 0x80) &&
+                    rsp[8] == MODBUS_EXCEPTION_ILLEGAL_FUNCTION, "");
+
+        raw_write[0] = 3;
+        rc = local_request(ctx_client, ctx_server, NULL,
+                           raw_write, sizeof(raw_write), rsp);
+        printf("3/4 Unknown unit: ");
+        ASSERT_TRUE(rc == 9 &&
+                    rsp[7] == (MODBUS_FC_WRITE_SINGLE_REGISTER | 0x80) &&
+                    rsp[8] == MODBUS_EXCEPTION_GATEWAY_PATH, "");
+
+        rc = modbus_router_add_unit(router, 250, mb_mapping_units[0], 0);
+        if (rc == -1 && errno == EINVAL) {
+            modbus_router_remove_unit(router, 1);
+            rc = modbus_router_add_unit(router, 3, mb_mapping_units[0],
+                                        MODBUS_ROUTER_LOCK);
+        }
+        if (rc == 0) {
+            rc = local_request(ctx_client, ctx_server, NULL,
+                               raw_write, sizeof(raw_write), rsp);
+        }
+        printf("4/4 Unit replied under its lock: ");
+        ASSERT_TRUE(rc == 12 &&
+                    mb_mapping_units[0]->tab_registers[0] == 0x1256, "");
+
+        modbus_free(ctx_client);
+        modbus_free(ctx_server);
+        modbus_router_free(router);
+        modbus_mapping_free(mb_mapping_units[0]);
+        modbus_mapping_free(mb_mapping_units[1]);
+    }
+
+#ifndef _WIN32
+    /** CONTEXT STORAGE **/
+    printf("\nTEST CONTEXT STORAGE:\n");
+    {
+        uint64_t storage_client[MODBUS_TCP_CONTEXT_SIZE / 8];
+        uint64_t storage_server[MODBUS_TCP_SERVER_CONTEXT_SIZE / 8];
+        modbus_t *ctx_client;
+        modbus_t *ctx_server;
+        int sv[2];
+
+        ctx_client = modbus_init_tcp(storage_client, 16, "127.0.0.1", 1502);
+        printf("1/3 Storage too small: ");
+        ASSERT_TRUE(ctx_client == NULL && errno == EINVAL, "");
+
+        /* The two ends of a stream socket pair stand for a connection
+           accepted by the server */
+        rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        ctx_client = modbus_init_tcp(storage_client, sizeof(storage_client),
+                                     "127.0.0.1", 1502);
+        ctx_server = (rc == -1) ? NULL :
+            modbus_init_tcp_server(storage_server, sizeof(storage_server),
+                                   sv[1]);
+        if (ctx_client != NULL && ctx_server != NULL) {
+            modbus_set_socket(ctx_client, sv[0]);
+        }
+        ASSERT_TRUE(ctx_client != NULL && ctx_server != NULL &&
+                    local_write(ctx_client, ctx_server,
+                                "2/3 Request between contexts in storage"), "");
+
+        /* modbus_free() leaves the storage to the caller */
+        modbus_close(ctx_client);
+        modbus_free(ctx_client);
+        ctx_client = modbus_init_tcp(storage_client, sizeof(storage_client),
+                                     "127.0.0.1", 1503);
+        printf("3/3 Storage reused after modbus_free: ");
+        ASSERT_TRUE(ctx_client != NULL && modbus_get_socket(ctx_client) == -1,
+                    "");
+        modbus_free(ctx_client);
+
+        modbus_close(ctx_server);
+        modbus_free(ctx_server);
+    }
+
+    /** PCAPNG TRACE **/
+    printf("\nTEST PCAPNG TRACE:\n");
+    {
+        modbus_trace_t *trace;
+        modbus_t *ctx_client;
+        modbus_t *ctx_server;
+        uint8_t block[512];
+        uint32_t header[2];
+        int nb_packets = 0;
+        int first_ok = FALSE;
+        FILE *file;
+
+        modbus_new_loopback_pair(&ctx_client, &ctx_server);
+        trace = modbus_trace_new("unit-test.pcapng");
+        printf("1/4 modbus_trace_new: ");
+        ASSERT_TRUE(trace != NULL, "");
+
+        modbus_set_trace(ctx_client, trace);
+        modbus_set_trace(ctx_server, trace);
+        rc = local_write(ctx_client, ctx_server, "2/4 Traced request");
+        modbus_free(ctx_client);
+        modbus_free(ctx_server);
+        modbus_trace_free(trace);
+        ASSERT_TRUE(rc, "");
+
+        /* Enhanced Packet Blocks of the request and the response, sent
+           and received */
+        file = fopen("unit-test.pcapng", "rb");
+        while (file != NULL && fread(header, 4, 2, file) == 2 &&
+               header[1] >= 12 && header[1] - 8 <= sizeof(block) &&
+               fread(block, 1, header[1] - 8, file) == header[1] - 8) {
+            if (header[0] != 6)
+                continue;
+            if (nb_packets++ == 0) {
+                /* The client sends the request to the port 502 */
+                const uint8_t *ip = block + 20;
+                const uint8_t *tcp = ip + 20;
+
+                first_ok = ip[0] == 0x45 && ip[9] == 6 &&
+                    ((tcp[2] << 8) | tcp[3]) == MODBUS_TCP_DEFAULT_PORT &&
+                    tcp[20 + 6] == 0xFF && tcp[20 + 7] == 0x06 &&
+                    tcp[20 + 10] == 0x12 && tcp[20 + 11] == 0x34;
+            }
+        }
+        if (file != NULL)
+            fclose(file);
+        unlink("unit-test.pcapng");
+
+        printf("3/4 Packets written: ");
+        ASSERT_TRUE(nb_packets == 4, "%d", nb_packets);
+        printf("4/4 Request in a TCP segment to the port 502: ");
+        ASSERT_TRUE(first_ok, "");
+    }
+#endif
+
+    /** TCP PARSER **/
+    printf("\nTEST TCP PARSER:\n");
+    {
+        modbus_tcp_parser_t *parser;
+        parser_result_t result;
+        /* Read of 10 registers then write of 2 registers at 0x0102 */
+        uint8_t stream[] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x06, 0xFF,
+                             0x03, 0x00, 0x00, 0x00, 0x0A,
+                             0x00, 0x02, 0x00, 0x00, 0x00, 0x0B, 0xFF,
+                             0x10, 0x01, 0x02, 0x00, 0x02, 0x04,
+                             0x12, 0x34, 0x56, 0x78 };
+        /* Byte count of 2 for 2 registers, the MBAP length is the one of
+           the bytes sent */
+        uint8_t bad_count[] = { 0x00, 0x03, 0x00, 0x00, 0x00, 0x09, 0xFF,
+                                0x10, 0x00, 0x00, 0x00, 0x02, 0x02,
+                                0x12, 0x34 };
+        uint8_t bad_protocol[] = { 0x00, 0x04, 0x00, 0x01, 0x00, 0x06, 0xFF,
+                                   0x03, 0x00, 0x00, 0x00, 0x01 };
+        int nb_valid = 0;
+
+        parser = modbus_tcp_parser_new(MODBUS_TCP_PARSER_REQUEST);
+        memset(&result, 0, sizeof(result));
+        for (i = 0; i < (int)sizeof(stream); i++) {
+            nb_valid += modbus_tcp_parser_push(parser, stream + i, 1,
+                                               parser_callback, &result);
+        }
+        printf("1/4 Frames pushed byte per byte: ");
+        ASSERT_TRUE(nb_valid == 2 && result.nb_frames == 2 &&
+                    result.frame.transaction_id == 2 &&
+                    result.frame.function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS &&
+                    result.frame.addr == 0x0102 && result.frame.nb == 2 &&
+                    result.frame.byte_count == 4 &&
+                    result.frame.error == MODBUS_TCP_FRAME_OK, "");
+
+        memset(&result, 0, sizeof(result));
+        rc = modbus_tcp_parser_push(parser, stream, sizeof(stream),
+                                    parser_callback, &result);
+        printf("2/4 Frames parsed in place: ");
+        ASSERT_TRUE(rc == 2 && result.frame.adu == stream + 12 &&
+                    result.frame.adu_length == 17, "");
+
+        rc = modbus_tcp_parser_push(parser, bad_count, sizeof(bad_count),
+                                    parser_callback, &result);
+        printf("3/4 Byte count not matching the quantity: ");
+        ASSERT_TRUE(rc == 0 &&
+                    result.frame.error == MODBUS_TCP_FRAME_BAD_BYTE_COUNT, "");
+
+        rc = modbus_tcp_parser_push(parser, bad_protocol, sizeof(bad_protocol),
+                                    parser_callback, &result);
+        if (rc == -1 && errno == EMBBADDATA &&
+            result.frame.error == MODBUS_TCP_FRAME_BAD_PROTOCOL) {
+            /* Stopped until the reset */
+            rc = modbus_tcp_parser_push(parser, stream, sizeof(stream),
+                                        parser_callback, &result);
+            if (rc == -1) {
+                modbus_tcp_parser_reset(parser);
+                rc = modbus_tcp_parser_push(parser, stream, sizeof(stream),
+                                            parser_callback, &result);
+            } else {
+                rc = -1;
+            }
+        }
+        printf("4/4 Stream stopped by a bad protocol ID: ");
+        ASSERT_TRUE(rc == 2, "");
+        modbus_tcp_parser_free(parser);
+    }
+
+#ifdef __linux__
+    /** RTU FRAMER **/
+    printf("\nTEST RTU FRAMER:\n");
+    {
+        modbus_rtu_framer_t *framer;
+        modbus_t *ctx_rtu;
+        framer_result_t result;
+        uint8_t frame[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x0A, 0xC5, 0xCD };
+        uint8_t frames[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x0A, 0xC5, 0xCD,
+                             0x01, 0x03, 0x00, 0x00, 0x00, 0x0A, 0xC5, 0xCD };
+        uint8_t frame_other[] = { 0x02, 0x03, 0x00, 0x00, 0x00, 0x0A,
+                                  0xC5, 0xFE };
+        uint8_t raw_rsp[] = { 0x01, 0x03, 0x02, 0x12, 0x34 };
+        uint8_t rsp[MODBUS_RTU_MAX_ADU_LENGTH];
+        int master;
+        int id;
+
+        /* The slave side of a pseudo-terminal is the serial port */
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        grantpt(master);
+        unlockpt(master);
+        fcntl(master, F_SETFL, O_NONBLOCK);
+        ctx_rtu = modbus_new_rtu(ptsname(master), 115200, 'N', 8, 1);
+        modbus_set_slave(ctx_rtu, 1);
+        modbus_connect(ctx_rtu);
+        framer = modbus_rtu_framer_new();
+        id = modbus_rtu_framer_add(framer, ctx_rtu, framer_callback, &result);
+
+        memset(&result, 0, sizeof(result));
+        rc = write(master, frame, sizeof(frame));
+        framer_run(framer, 20);
+        printf("1/6 Frame after a silence of 3.5 characters: ");
+        ASSERT_TRUE(id == 0 && rc == sizeof(frame) && result.nb_frames == 1 &&
+                    result.length == sizeof(frame) && result.nb_errors == 0, "");
+
+        /* Silence of 1.5 character at least in the frame (750 us) */
+        memset(&result, 0, sizeof(result));
+        rc = write(master, frame, 3);
+        modbus_rtu_framer_process(framer, 10);
+        modbus_rtu_framer_process(framer, 10);
+        rc += write(master, frame + 3, sizeof(frame) - 3);
+        framer_run(framer, 20);
+        printf("2/6 Silence of 1.5 character in the frame: ");
+        ASSERT_TRUE(rc == sizeof(frame) && result.nb_frames == 0 &&
+                    result.nb_errors >= 1 && result.error == EMBBADDATA, "");
+
+        memset(&result, 0, sizeof(result));
+        rc = write(master, frame_other, sizeof(frame_other));
+        framer_run(framer, 20);
+        printf("3/6 Frame of another slave ignored: ");
+        ASSERT_TRUE(rc == sizeof(frame_other) && result.nb_frames == 0 &&
+                    result.nb_errors == 0, "");
+
+        /* Two frames without silence are a single frame */
+        memset(&result, 0, sizeof(result));
+        rc = write(master, frames, sizeof(frames));
+        framer_run(framer, 20);
+        printf("4/6 Frames without silence: ");
+        ASSERT_TRUE(rc == sizeof(frames) && result.nb_frames == 0 &&
+                    result.nb_errors == 1 && result.error == EMBBADCRC, "");
+
+        rc = modbus_rtu_framer_send(framer, id, raw_rsp, sizeof(raw_rsp));
+        framer_run(framer, 20);
+        printf("5/6 modbus_rtu_framer_send: ");
+        ASSERT_TRUE(rc == 0 && read(master, rsp, sizeof(rsp)) == 7 &&
+                    memcmp(rsp, raw_rsp, sizeof(raw_rsp)) == 0 &&
+                    rsp[5] == 0xB5 && rsp[6] == 0x33, "");
+
+        /* The slave side of a pseudo-terminal without master fails the
+           writes, the frame isn't left waiting on the closed line */
+        close(master);
+        master = -1;
+        rc = modbus_rtu_framer_send(framer, id, raw_rsp, sizeof(raw_rsp));
+        if (rc == -1 && errno == EIO) {
+            rc = modbus_rtu_framer_send(framer, id, raw_rsp, sizeof(raw_rsp));
+            framer_run(framer, 5);
+            rc = (rc == 0) ? modbus_rtu_framer_send(framer, id, raw_rsp,
+                                                    sizeof(raw_rsp)) : 0;
+        } else {
+            rc = 0;
+        }
+        printf("6/6 Frame not written: ");
+        ASSERT_TRUE(rc == -1 && errno == EIO, "");
+
+        modbus_rtu_framer_free(framer);
+        modbus_close(ctx_rtu);
+        modbus_free(ctx_rtu);
+        close(master);
+    }
+
+    /** TCP GATEWAY **/
+    printf("\nTEST TCP GATEWAY:\n");
+    {
+        modbus_gateway_t *gateway;
+        modbus_mapping_t *mb_mapping;
+        modbus_t *ctx_listen;
+        modbus_t *ctx_rtu;
+        modbus_t *ctx_server;
+        modbus_t *ctx_clients[2];
+        uint8_t req_read[] = { 0x12, 0x34, 0x00, 0x00, 0x00, 0x06,
+                               0x01, 0x03, 0x00, 0x00, 0x00, 0x02 };
+        uint8_t rsp_read[] = { 0x12, 0x34, 0x00, 0x00, 0x00, 0x07,
+                               0x01, 0x03, 0x04, 0x01, 0x02, 0x03, 0x04 };
+        /* Unit without line */
+        uint8_t req_path[] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x06,
+                               0x05, 0x03, 0x00, 0x00, 0x00, 0x02 };
+        uint8_t rsp_path[] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x03,
+                               0x05, 0x83, MODBUS_EXCEPTION_GATEWAY_PATH };
+        /* Unit of the line without server */
+        uint8_t req_target[] = { 0x00, 0x02, 0x00, 0x00, 0x00, 0x06,
+                                 0x02, 0x03, 0x00, 0x00, 0x00, 0x02 };
+        uint8_t rsp_target[] = { 0x00, 0x02, 0x00, 0x00, 0x00, 0x03,
+                                 0x02, 0x83, MODBUS_EXCEPTION_GATEWAY_TARGET };
+        uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+        int server_socket;
+        int master;
+        int s0, s1;
+        int line;
+
+        mb_mapping = modbus_mapping_new(0, 0, 2, 0);
+        mb_mapping->tab_registers[0] = 0x0102;
+        mb_mapping->tab_registers[1] = 0x0304;
+
+        /* Server of the slave 1 on the master side of the pseudo-terminal */
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        grantpt(master);
+        unlockpt(master);
+        ctx_rtu = modbus_new_rtu(ptsname(master), 115200, 'N', 8, 1);
+        modbus_set_response_timeout(ctx_rtu, 0, 50000);
+        modbus_connect(ctx_rtu);
+        ctx_server = modbus_new_rtu(ptsname(master), 115200, 'N', 8, 1);
+        modbus_set_slave(ctx_server, 1);
+        modbus_set_socket(ctx_server, master);
+
+        ctx_listen = modbus_new_tcp("127.0.0.1", 1503);
+        server_socket = modbus_tcp_listen(ctx_listen, 2);
+        gateway = modbus_gateway_new(server_socket);
+        line = modbus_gateway_add_line(gateway, ctx_rtu);
+        rc = modbus_gateway_set_unit(gateway, 1, line);
+        rc += modbus_gateway_set_unit(gateway, 2, line);
+
+        ctx_clients[0] = modbus_new_tcp("127.0.0.1", 1503);
+        ctx_clients[1] = modbus_new_tcp("127.0.0.1", 1503);
+        modbus_connect(ctx_clients[0]);
+        modbus_connect(ctx_clients[1]);
+        s0 = modbus_get_socket(ctx_clients[0]);
+        s1 = modbus_get_socket(ctx_clients[1]);
+
+        send(s0, req_read, sizeof(req_read), 0);
+        gateway_run(gateway, ctx_server, mb_mapping, 20);
+        printf("1/5 Request routed to the RTU line: ");
+        ASSERT_TRUE(line == 0 && rc == 0 &&
+                    recv(s0, rsp, sizeof(rsp), MSG_DONTWAIT) == sizeof(rsp_read) &&
+                    memcmp(rsp, rsp_read, sizeof(rsp_read)) == 0, "");
+
+        send(s0, req_path, sizeof(req_path), 0);
+        gateway_run(gateway, ctx_server, mb_mapping, 5);
+        printf("2/5 Unit without line: ");
+        ASSERT_TRUE(recv(s0, rsp, sizeof(rsp), MSG_DONTWAIT) == sizeof(rsp_path) &&
+                    memcmp(rsp, rsp_path, sizeof(rsp_path)) == 0, "");
+
+        /* The second request waits for the response to the first one */
+        send(s0, req_read, sizeof(req_read), 0);
+        req_read[1] = 0x35;
+        send(s1, req_read, sizeof(req_read), 0);
+        gateway_run(gateway, ctx_server, mb_mapping, 30);
+        rc = recv(s0, rsp, sizeof(rsp), MSG_DONTWAIT);
+        printf("3/5 Requests of two clients serialized on the line: ");
+        ASSERT_TRUE(rc == sizeof(rsp_read) &&
+                    memcmp(rsp, rsp_read, sizeof(rsp_read)) == 0 &&
+                    recv(s1, rsp, sizeof(rsp), MSG_DONTWAIT) == sizeof(rsp_read) &&
+                    rsp[1] == 0x35 && memcmp(rsp + 2, rsp_read + 2,
+                                             sizeof(rsp_read) - 2) == 0, "");
+
+        /* The server of the line ignores the slave 2 */
+        send(s1, req_target, sizeof(req_target), 0);
+        gateway_run(gateway, ctx_server, mb_mapping, 100);
+        printf("4/5 Response timeout of the line: ");
+        ASSERT_TRUE(recv(s1, rsp, sizeof(rsp), MSG_DONTWAIT) == sizeof(rsp_target) &&
+                    memcmp(rsp, rsp_target, sizeof(rsp_target)) == 0, "");
+
+        /* Answered before the response timeout of the line */
+        close(master);
+        master = -1;
+        modbus_set_socket(ctx_server, -1);
+        send(s1, req_read, sizeof(req_read), 0);
+        gateway_run(gateway, ctx_server, mb_mapping, 10);
+        rc = recv(s1, rsp, sizeof(rsp), MSG_DONTWAIT);
+        printf("5/5 Request not written on the line: ");
+        ASSERT_TRUE(rc == 9 && rsp[1] == 0x35 && rsp[6] == 0x01 &&
+                    rsp[7] == (MODBUS_FC_READ_HOLDING_REGISTERS | 0x80) &&
+                    rsp[8] == MODBUS_EXCEPTION_GATEWAY_TARGET, "");
+
+        modbus_gateway_free(gateway);
+        modbus_close(ctx_clients[0]);
+        modbus_free(ctx_clients[0]);
+        modbus_close(ctx_clients[1]);
+        modbus_free(ctx_clients[1]);
+        close(server_socket);
+        modbus_free(ctx_listen);
+        modbus_close(ctx_rtu);
+        modbus_free(ctx_rtu);
+        /* The server doesn't own the terminal settings of the master side */
+        modbus_free(ctx_server);
+        close(master);
+        modbus_mapping_free(mb_mapping);
+    }
+#endif
+
+#ifdef __linux__
+    /** TCP PROFILE **/
+    printf("\nTEST TCP PROFILE:\n");
+    {
+        modbus_tcp_profile_t profile;
+        modbus_t *ctx_listen;
+        modbus_t *ctx_client;
+        modbus_t *ctx_unix;
+        int server_socket;
+        int tos_client = 0;
+        int tos_server = 0;
+        socklen_t tos_length = sizeof(int);
+        modbus_mapping_t *mb_mapping_fastopen = modbus_mapping_new(0, 0, 2, 0);
+        uint8_t raw_fastopen[] = { 0xFF, MODBUS_FC_WRITE_SINGLE_REGISTER,
+                                   0x00, 0x01, 0x12, 0x34 };
+        uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+        uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+        modbus_t *ctx_fill[2];
+        struct rlimit limit;
+
+        ctx_client = modbus_new_tcp("127.0.0.1", 1504);
+        rc = modbus_tcp_get_profile(ctx_client, &profile);
+        printf("1/5 Default profile: ");
+        ASSERT_TRUE(rc == 0 && profile.nodelay && !profile.quickack &&
+                    profile.priority == -1 && profile.dscp == -1, "");
+
+        profile.dscp = 64;
+        rc = modbus_tcp_set_profile(ctx_client, &profile);
+        printf("2/5 Invalid DSCP: ");
+        ASSERT_TRUE(rc == -1 && errno == EINVAL, "");
+
+        /* The Unix backend shares the ADU of TCP but not its options */
+        ctx_unix = modbus_new_unix("/tmp/unit-test-profile.sock");
+        modbus_tcp_profile_init(&profile);
+        rc = modbus_tcp_set_profile(ctx_unix, &profile);
+        modbus_free(ctx_unix);
+        printf("3/5 Profile of a context without TCP: ");
+        ASSERT_TRUE(rc == -1 && errno == EINVAL, "");
+
+        /* Expedited forwarding on both ends of the connection */
+        profile.dscp = 46;
+        profile.quickack = TRUE;
+        ctx_listen = modbus_new_tcp("127.0.0.1", 1504);
+        rc = modbus_tcp_set_profile(ctx_listen, &profile);
+        rc += modbus_tcp_set_profile(ctx_client, &profile);
+        server_socket = modbus_tcp_listen(ctx_listen, 1);
+        if (rc == 0 && server_socket != -1 && modbus_connect(ctx_client) == 0 &&
+            modbus_tcp_accept(ctx_listen, &server_socket) != -1) {
+            getsockopt(modbus_get_socket(ctx_client), IPPROTO_IP, IP_TOS,
+                       &tos_client, &tos_length);
+            tos_length = sizeof(int);
+            getsockopt(modbus_get_socket(ctx_listen), IPPROTO_IP, IP_TOS,
+                       &tos_server, &tos_length);
+        }
+        printf("4/5 DSCP of the connected and accepted sockets: ");
+        ASSERT_TRUE(tos_client == 46 << 2 && tos_server == 46 << 2,
+                    "FAILED (%02X, %02X)\n", tos_client, tos_server);
+
+        modbus_close(ctx_client);
+        modbus_free(ctx_client);
+        modbus_close(ctx_listen);
+        modbus_free(ctx_listen);
+        if (server_socket != -1)
+            close(server_socket);
+
+        /* The request waits for the handshake of fast open on a socket
+           number out of the range of select(). The backlog of the listening
+           socket is filled so the first SYN of the client is dropped and the
+           connection is still in progress when the request is sent. */
+        modbus_tcp_profile_init(&profile);
+        profile.fastopen = 16;
+        ctx_listen = modbus_new_tcp("127.0.0.1", 1504);
+        ctx_client = modbus_new_tcp("127.0.0.1", 1504);
+        ctx_fill[0] = modbus_new_tcp("127.0.0.1", 1504);
+        ctx_fill[1] = modbus_new_tcp("127.0.0.1", 1504);
+        rc = modbus_tcp_set_profile(ctx_listen, &profile);
+        rc += modbus_tcp_set_profile(ctx_client, &profile);
+        server_socket = (rc == 0) ? modbus_tcp_listen(ctx_listen, 1) : -1;
+        rc = -1;
+        if (server_socket != -1 && getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+            limit.rlim_max > FD_SETSIZE + 1) {
+            limit.rlim_cur = FD_SETSIZE + 2;
+            modbus_set_wait_mode(ctx_client, MODBUS_WAIT_NONE);
+            if (setrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+                modbus_connect(ctx_fill[0]) == 0 &&
+                modbus_connect(ctx_fill[1]) == 0 &&
+                modbus_connect(ctx_client) == -1 && errno == EINPROGRESS) {
+                rc = dup2(modbus_get_socket(ctx_client), FD_SETSIZE + 1);
+            }
+        }
+        if (rc != -1) {
+            close(modbus_get_socket(ctx_client));
+            modbus_set_socket(ctx_client, rc);
+            modbus_set_wait_mode(ctx_client, MODBUS_WAIT_BLOCK);
+            modbus_set_response_timeout(ctx_client, 3, 0);
+            /* Room for the retransmitted SYN of the client */
+            close(accept(server_socket, NULL, NULL));
+            rc = modbus_send_raw_request(ctx_client, raw_fastopen,
+                                         sizeof(raw_fastopen));
+        }
+        if (rc != -1) {
+            close(accept(server_socket, NULL, NULL));
+            rc = modbus_tcp_accept(ctx_listen, &server_socket);
+        }
+        if (rc != -1) {
+            rc = modbus_receive(ctx_listen, query);
+            if (rc > 0) {
+                modbus_reply(ctx_listen, query, rc, mb_mapping_fastopen);
+            }
+            rc = modbus_receive_confirmation(ctx_client, rsp);
+        }
+        printf("5/5 Fast open on the socket %d: ", FD_SETSIZE + 1);
+        ASSERT_TRUE(rc == 12 && mb_mapping_fastopen->tab_registers[1] == 0x1234,
+                    "");
+
+        for (i = 0; i < 2; i++) {
+            modbus_close(ctx_fill[i]);
+            modbus_free(ctx_fill[i]);
+        }
+        modbus_close(ctx_client);
+        modbus_free(ctx_client);
+        modbus_close(ctx_listen);
+        modbus_free(ctx_listen);
+        if (server_socket != -1)
+            close(server_socket);
+        modbus_mapping_free(mb_mapping_fastopen);
+    }
+#endif
+
     /** BAD RESPONSE **/
     printf("\nTEST BAD RESPONSE ERROR:\n");
 
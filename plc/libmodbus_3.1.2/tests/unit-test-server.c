@@ -30,8 +30,61 @@ enum {
     RTU
 };
 
+int reply_custom(modbus_t *ctx, const uint8_t *req, int req_length,
+                 uint8_t *rsp, modbus_mapping_t *mb_mapping, void *user_data);
+int read_file_record(void *user_data, int file, int record, int nb,
+                     const uint8_t **data);
+int write_file_record(void *user_data, int file, int record, int nb,
+                      const uint8_t *data);
+
+/* Records of the file, big-endian */
+static uint8_t ut_file[UT_FILE_NB_RECORDS * 2];
+
+/* Handler of the user defined function code (byte count then bytes) */
+int reply_custom(modbus_t *ctx, const uint8_t *req, int req_length,
+                 uint8_t *rsp, modbus_mapping_t *mb_mapping, void *user_data)
+{
+    uint8_t sum = 0;
+    int i;
+
+    for (i = 1; i < req_length; i++) {
+        sum += req[i];
+    }
+    rsp[0] = sum;
+
+    return 1;
+}
+
+/* Provider of the file, the records are read in place */
+int read_file_record(void *user_data, int file, int record, int nb,
+                     const uint8_t **data)
+{
+    if (file != UT_FILE_NUMBER || record + nb > UT_FILE_NB_RECORDS) {
+        errno = EMBXILADD;
+        return -1;
+    }
+    *data = ut_file + 2 * record;
+
+    return 0;
+}
+
+int write_file_record(void *user_data, int file, int record, int nb,
+                      const uint8_t *data)
+{
+    if (file != UT_FILE_NUMBER || record + nb > UT_FILE_NB_RECORDS) {
+        errno = EMBXILADD;
+        return -1;
+    }
+    memcpy(ut_file + 2 * record, data, 2 * nb);
+
+    return 0;
+}
+
 int main(int argc, char*argv[])
 {
+    modbus_handler_t handler = { 1, 1, NULL, reply_custom, NULL };
+    modbus_file_provider_t provider = { read_file_record, write_file_record,
+                                        NULL };
     int s = -1;
     modbus_t *ctx;
     modbus_mapping_t *mb_mapping;
@@ -69,14 +122,25 @@ int main(int argc, char*argv[])
         query = malloc(MODBUS_RTU_MAX_ADU_LENGTH);
     }
     header_length = modbus_get_header_length(ctx);
+    modbus_set_handler(ctx, UT_FC_CUSTOM, &handler);
+    modbus_set_file_provider(ctx, &provider);
 
     modbus_set_debug(ctx, TRUE);
 
-    mb_mapping = modbus_mapping_new(
-        UT_BITS_ADDRESS + UT_BITS_NB,
-        UT_INPUT_BITS_ADDRESS + UT_INPUT_BITS_NB,
-        UT_REGISTERS_ADDRESS + UT_REGISTERS_NB,
-        UT_INPUT_REGISTERS_ADDRESS + UT_INPUT_REGISTERS_NB);
+    if (use_backend == TCP_PI) {
+        /* Same tests with the bits packed in bitsets */
+        mb_mapping = modbus_mapping_new_packed(
+            UT_BITS_ADDRESS + UT_BITS_NB,
+            UT_INPUT_BITS_ADDRESS + UT_INPUT_BITS_NB,
+            UT_REGISTERS_ADDRESS + UT_REGISTERS_NB,
+            UT_INPUT_REGISTERS_ADDRESS + UT_INPUT_REGISTERS_NB);
+    } else {
+        mb_mapping = modbus_mapping_new(
+            UT_BITS_ADDRESS + UT_BITS_NB,
+            UT_INPUT_BITS_ADDRESS + UT_INPUT_BITS_NB,
+            UT_REGISTERS_ADDRESS + UT_REGISTERS_NB,
+            UT_INPUT_REGISTERS_ADDRESS + UT_INPUT_REGISTERS_NB);
+    }
     if (mb_mapping == NULL) {
         fprintf(stderr, "Failed to allocate the mapping: %s\n",
                 modbus_strerror(errno));
@@ -114,9 +178,18 @@ int main(int argc, char*argv[])
        Only the read-only input values are assigned. */
 
     /** INPUT STATUS **/
-    modbus_set_bits_from_bytes(mb_mapping->tab_input_bits,
-                               UT_INPUT_BITS_ADDRESS, UT_INPUT_BITS_NB,
-                               UT_INPUT_BITS_TAB);
+    if (mb_mapping->flags & MODBUS_MAPPING_PACKED_BITS) {
+        for (i=0; i < UT_INPUT_BITS_NB; i++) {
+            if (UT_INPUT_BITS_TAB[i / 8] & (1 << (i % 8))) {
+                MODBUS_SET_BIT(mb_mapping->tab_input_bits,
+                               UT_INPUT_BITS_ADDRESS + i);
+            }
+        }
+    } else {
+        modbus_set_bits_from_bytes(mb_mapping->tab_input_bits,
+                                   UT_INPUT_BITS_ADDRESS, UT_INPUT_BITS_NB,
+                                   UT_INPUT_BITS_TAB);
+    }
 
     /** INPUT REGISTERS **/
     for (i=0; i < UT_INPUT_REGISTERS_NB; i++) {
@@ -153,7 +226,13 @@ int main(int argc, char*argv[])
         }
 
         /* Special server behavior to test client */
-        if (query[header_length] == 0x03) {
+        if (query[header_length] == MODBUS_FC_WRITE_SINGLE_REGISTER &&
+            MODBUS_GET_INT16_FROM_INT8(query, header_length + 1)
+            == UT_REGISTERS_ADDRESS_PENALTY) {
+            printf("Set the exception penalty\n");
+            modbus_set_exception_penalty(
+                ctx, MODBUS_GET_INT16_FROM_INT8(query, header_length + 3));
+        } else if (query[header_length] == 0x03) {
             /* Read holding registers */
 
             if (MODBUS_GET_INT16_FROM_INT8(query, header_length + 3)